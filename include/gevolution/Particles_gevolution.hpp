@@ -20,10 +20,10 @@
 #include "LATfield2.hpp"
 #include "gevolution/real_type.hpp"
 #include "gevolution/metadata.hpp"
+#include "gevolution/id_backlog.hpp"
 #include <cstdlib>
 #include <iostream>
 #include <mpi.h>
-#include <set>
 #include <string>
 
 
@@ -34,30 +34,49 @@ using LATfield2::Field;
 using LATfield2::parallel;
 using LATfield2::Site;
 
+/*
+    The part_simple of LATfield2 follows its precision: in the
+    mixed-precision build (SINGLE) the particles have their own base, with
+    the positions in particle_real, as a float position only resolves
+    about 1e-7 of the box.
+*/
+#ifdef SINGLE
+struct particle_base
+{
+    long ID;
+    particle_real pos[3];
+    Real vel[3];
+};
+#else
+using particle_base = LATfield2::part_simple;
+#endif
+
 /*
     The indivual particle data structure in gevolution is 'particle',
     defined below.
 */
 // TODO: template particle variables
-struct particle : LATfield2::part_simple
+struct particle : particle_base
 {
-    using base_particle = LATfield2::part_simple;
+    using base_particle = particle_base;
     using base_particle::ID;
     using base_particle::pos;
     using base_particle::vel;
     
-    // inherited from LATfield2::part_simple we have
+    // inherited from LATfield2::part_simple (or particle_base) we have
     // pos[]; // that's position (x)
     // vel[]; // that's velocity (dx/dt)
     // id;
-    Real mass;
-    std::array<Real,3> momentum{0,0,0}; // that's momentum (p)
-    std::array<Real,3> force{0,0,0};    // that's force (dp/dt)
+    particle_real mass;
+    std::array<particle_real,3> momentum{0,0,0}; // that's momentum (p)
+    std::array<particle_real,3> force{0,0,0};    // that's force (dp/dt)
     
     // Metric components at the particle position
     Real Phi{0};
     std::array<Real,3> B{0,0,0};
     
+    int bin{0}; // time bin, see time_bins.hpp
+    
     template<class Archive>
     void serialize(Archive & ar, const unsigned int /*version*/)
     {
@@ -80,11 +99,60 @@ struct particle : LATfield2::part_simple
         
         ar & Phi;
         ar & B;
+        ar & bin;
     }
 };
 
 typedef LATfield2::part_simple_info particle_info;
+#ifdef SINGLE
+/*
+    The HDF5 records of LATfield2 with the ID, position and velocity of a
+    particle, its own compound types replacing those of part_simple, such
+    that the hibernation points keep the positions in double.
+*/
+struct particle_dataType : LATfield2::part_simple_dataType
+{
+    particle_dataType()
+    {
+#ifdef HDF5
+        H5Tclose(part_memType);
+        H5Tclose(part_fileType);
+        static_assert(sizeof(particle_real)==sizeof(double)
+                      && sizeof(Real)==sizeof(float),"HDF5 types");
+        const char* names[6] = {"positionX","positionY","positionZ",
+            "velocityX","velocityY","velocityZ"};
+        // particle is not standard-layout, no offsetof
+        const particle p{};
+        auto offset = [&p](const void* member)
+        {
+            return (std::size_t)((const char*)member - (const char*)&p);
+        };
+        part_memType = H5Tcreate(H5T_COMPOUND,sizeof(particle));
+        part_fileType = H5Tcreate(H5T_COMPOUND,
+            sizeof(long) + 3*sizeof(particle_real) + 3*sizeof(Real));
+        H5Tinsert(part_memType,"ID",offset(&p.ID),H5T_NATIVE_LONG);
+        H5Tinsert(part_fileType,"ID",0,H5T_NATIVE_LONG);
+        std::size_t at = sizeof(long);
+        for(int i=0;i<3;++i)
+        {
+            H5Tinsert(part_memType,names[i],offset(&p.pos[i]),
+                H5T_NATIVE_DOUBLE);
+            H5Tinsert(part_fileType,names[i],at,H5T_NATIVE_DOUBLE);
+            at += sizeof(particle_real);
+        }
+        for(int i=0;i<3;++i)
+        {
+            H5Tinsert(part_memType,names[3+i],offset(&p.vel[i]),
+                H5T_NATIVE_FLOAT);
+            H5Tinsert(part_fileType,names[3+i],at,H5T_NATIVE_FLOAT);
+            at += sizeof(Real);
+        }
+#endif
+    }
+};
+#else
 typedef LATfield2::part_simple_dataType particle_dataType;
+#endif
 
 class Particles_gevolution : 
     public 
@@ -102,9 +170,41 @@ class Particles_gevolution :
                       lightcone_geometry &lightcone, double dist, double dtau,
                       double dtau_old, double dadtau,
                       double vertex[MAX_INTERSECTS][3], const int vertexcount,
-                      std::set<long> &IDbacklog, std::set<long> &IDprelog,
+                      const id_backlog &IDbacklog, id_backlog &IDprelog,
                       Field<Real> *phi, const int tracer_factor = 1);
-    void loadGadget2 (std::string filename, gadget2_header &hdr);
+    /*
+        Read a Gadget2 file, or all the files of a multi-file input named
+        as the first one with the extension replaced by their number, and
+        return the total number of particles; hdr receives the header of
+        the first file. A subset of aggregator ranks (by default as many as
+        there are processes in dim-0) reads contiguous parts of the particle
+        blocks, the shares of the files being spread over them, and sends
+        the particles to their owners with one all-to-all per buffer of
+        PCLBUFFER particles. This is a collective call.
+    */
+    long loadGadget2 (std::string filename, gadget2_header &hdr,
+                      int aggregators = 0);
+    
+    using LATfield2::Particles<particle, particle_info,
+                               particle_dataType>::moveParticles;
+    /*
+        Apply the periodic boundary conditions and move the particles to the
+        cell of their position: within the local domain the list nodes are
+        spliced, the particles that left it are sent to the neighbouring
+        processes by particle_exchange. As for LATfield2, a particle may
+        move at most to the neighbouring domain. This is a collective call.
+    */
+    void moveParticles ();
+    /*
+        Allocate the list nodes of all the particles anew, site after site
+        in the order of the loops over the lattice. moveParticles splices
+        the nodes of the particles that change cells, so that after many
+        cycles the particles of neighbouring cells are scattered over the
+        heap and the loops of the projections and of the forces miss the
+        cache; this gathers them again. A copy of the local particles is
+        held during the call.
+    */
+    void reorder ();
     
     void update_mass()
     {
@@ -114,6 +214,27 @@ class Particles_gevolution :
                 part.mass = this->parts_info()->mass;
             });
     }
+    
+    /*
+        Exchange the velocity and the momentum of every particle. The HDF5
+        files of the hibernation points carry the momentum in the place of
+        the velocity, as the Gadget-2 files do, since the velocity depends
+        on the metric and is recomputed from the momentum in every drift:
+        hibernate swaps them around the writes, readIC after the reads.
+    */
+    void swap_velocity_momentum()
+    {
+        this->for_each(
+            [](particle& part,const LATfield2::Site&)
+            {
+                for(int i=0;i<3;++i)
+                {
+                    const auto v = part.vel[i];
+                    part.vel[i] = part.momentum[i];
+                    part.momentum[i] = v;
+                }
+            });
+    }
 };
 
 }
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "gevolution/h5_snapshot.hpp"
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <mpi.h>
+
+/*
+    Output stage that drains to disk on a thread of its own while the next
+    cycles compute.
+
+    A job owns a copy of its data (a staged h5_snapshot, a power spectrum
+    table...) and the bytes it holds count against a budget: push waits
+    until the pending jobs leave room for the new one, a single job larger
+    than the budget waiting for the queue to be empty. The jobs run in the
+    order they were pushed, with a duplicate of the communicator, so that
+    every process runs the same collective writes in the same order.
+
+    The thread needs MPI_THREAD_MULTIPLE; without it, or with a budget of
+    0, the jobs run in push. flush, and the destructor, wait until all the
+    jobs are written.
+
+        async_output output(com,budget);
+        output.push(std::move(snapshot));
+        ...
+        output.flush();
+*/
+
+namespace gevolution
+{
+
+class async_output
+{
+    struct job
+    {
+        std::size_t bytes;
+        std::function<void(MPI_Comm)> run;
+    };
+
+    std::size_t budget;
+    std::size_t pending{0}; // bytes of the queued and running jobs
+    MPI_Comm io_com;
+    bool threaded;
+
+    std::deque<job> queue;
+    bool busy{false}, done{false};
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread worker;
+
+    void drain()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            changed.wait(lock,[this]{ return done or !queue.empty(); });
+            if(queue.empty())
+                return;
+            job j = std::move(queue.front());
+            queue.pop_front();
+            busy = true;
+            lock.unlock();
+            j.run(io_com);
+            lock.lock();
+            busy = false;
+            pending -= j.bytes;
+            changed.notify_all();
+        }
+    }
+
+    public:
+
+    async_output(MPI_Comm com, std::size_t budget_bytes):
+        budget{budget_bytes}
+    {
+        int level;
+        MPI_Query_thread(&level);
+        MPI_Allreduce(MPI_IN_PLACE,&level,1,MPI_INT,MPI_MIN,com);
+        threaded = budget > 0 && level == MPI_THREAD_MULTIPLE;
+        MPI_Comm_dup(com,&io_com);
+        if(threaded)
+            worker = std::thread([this]{ drain(); });
+    }
+    async_output(const async_output&) = delete;
+    async_output& operator = (const async_output&) = delete;
+    ~async_output()
+    {
+        if(threaded)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+            }
+            changed.notify_all();
+            worker.join();
+        }
+        MPI_Comm_free(&io_com);
+    }
+
+    // whether the jobs run on the output thread
+    bool asynchronous() const { return threaded; }
+
+    // bytes held by the jobs not yet written
+    std::size_t bytes_pending()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending;
+    }
+
+    // run(io_com) writes data of the given size owned by the job
+    void push(std::size_t bytes, std::function<void(MPI_Comm)> run)
+    {
+        if(not threaded)
+        {
+            run(io_com);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock,[&]
+            { return pending == 0 or pending + bytes <= budget; });
+        pending += bytes;
+        queue.push_back({bytes,std::move(run)});
+        changed.notify_all();
+    }
+
+    // write a staged snapshot, collective
+    void push(h5_snapshot&& snapshot)
+    {
+        auto file = std::make_shared<h5_snapshot>(std::move(snapshot));
+        const std::size_t bytes = file->bytes();
+        push(bytes,[file](MPI_Comm com){ file->write(com); });
+    }
+
+    // wait until every job pushed so far is written
+    void flush()
+    {
+        if(not threaded)
+            return;
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock,[this]{ return queue.empty() and not busy; });
+    }
+};
+
+} // namespace gevolution
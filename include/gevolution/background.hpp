@@ -139,5 +139,67 @@ void rungekutta4bg (double &a, const cosmology cosmo,
 //////////////////////////
 
 double particleHorizon (const double a, const cosmology cosmo);
+
+//////////////////////////
+// growthFactor
+//////////////////////////
+// Description:
+//   computes the linear growth factor D1 of a flat LCDM model with the
+//   matter density of the cosmology, normalized to D1 = a at early times
+//
+// Arguments:
+//   a          scale factor
+//   cosmo      structure containing the cosmological parameters
+//
+// Returns: linear growth factor
+//
+//////////////////////////
+
+double growthFactor (const double a, const cosmology cosmo);
+
+//////////////////////////
+// growthFactorDerivative
+//////////////////////////
+// Description:
+//   computes dD1/da analytically from the growth integral, see growthFactor
+//
+// Arguments:
+//   a          scale factor
+//   cosmo      structure containing the cosmological parameters
+//
+// Returns: derivative of the linear growth factor with respect to a
+//
+//////////////////////////
+
+double growthFactorDerivative (const double a, const cosmology cosmo);
+
+//////////////////////////
+// tabulateBackground
+//////////////////////////
+// Description:
+//   tabulates the ncdm background densities, the particle horizon and the
+//   growth integral as cubic splines in log a, such that bg_ncdm, Hconf,
+//   rungekutta4bg, particleHorizon and the growth factor interpolate
+//   instead of integrating; the grid is refined
+//   until the splines agree with the integrals to the given tolerance at
+//   the midpoints of the grid. The tables hold the logs of the densities,
+//   of tau and of the growth integral, so the tolerance bounds their
+//   relative error, and that of the growth factor and its derivative;
+//   a table that does not reach it with 65537 nodes is reported with a
+//   warning. Outside [a_min, a_max], or for another cosmology, the
+//   integrals are computed as before.
+//
+// Arguments:
+//   cosmo      structure containing the cosmological parameters
+//   a_min      smallest scale factor of the tables
+//   a_max      largest scale factor of the tables
+//   tolerance  relative error of the interpolation (default 1e-6)
+//
+// Returns: total number of nodes of the tables
+//
+//////////////////////////
+
+int tabulateBackground (const cosmology cosmo, const double a_min,
+                        const double a_max, const double tolerance = 1e-6);
 }
 #endif
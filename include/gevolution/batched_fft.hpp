@@ -0,0 +1,663 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "LATfield2.hpp"
+#include "gevolution/halo.hpp"
+#include "gevolution/threading.hpp"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <fftw3.h>
+#include <mpi.h>
+#include <boost/mpi/datatype.hpp>
+
+/*
+    Real to complex FFT of multi-component fields with all the components
+    sent through the same all-to-all transposes.
+
+    batched_fft is a drop-in replacement of LATfield2::PlanFFT for a real
+    field and its Fourier image. The transform is a pencil decomposition on
+    the processor grid of the lattice: r2c in the local direction 0, a
+    transpose along one processor line, c2c in that direction, a transpose
+    along the other line and c2c in the last direction. Each transpose is a
+    single MPI_Alltoallv carrying every component, where PlanFFT transposes
+    the components one by one.
+
+    The result is written to the Fourier field in the distribution LATfield2
+    chose for it. The construction checks that this distribution is one the
+    pencils can produce without an extra transpose, and that both directions
+    of the batched transform reproduce PlanFFT on test data; if not, execute
+    falls back to PlanFFT and batched() returns false.
+
+    The constructor is collective and overwrites both fields.
+*/
+
+namespace gevolution
+{
+
+namespace detail
+{
+    // the FFTW interface of one precision
+    template<class real_type>
+    struct fftw_api;
+
+    template<>
+    struct fftw_api<double>
+    {
+        using complex = fftw_complex;
+        using plan = fftw_plan;
+        static void* malloc(std::size_t n) { return fftw_malloc(n); }
+        static void free(void* p) { fftw_free(p); }
+        static plan r2c(int n, int howmany, double* in, complex* out)
+        {
+            return fftw_plan_many_dft_r2c(1,&n,howmany,
+                in,nullptr,1,n,out,nullptr,1,n/2+1,FFTW_ESTIMATE);
+        }
+        static plan c2r(int n, int howmany, complex* in, double* out)
+        {
+            return fftw_plan_many_dft_c2r(1,&n,howmany,
+                in,nullptr,1,n/2+1,out,nullptr,1,n,FFTW_ESTIMATE);
+        }
+        static plan c2c(int n, int howmany, complex* data, int sign)
+        {
+            return fftw_plan_many_dft(1,&n,howmany,
+                data,nullptr,1,n,data,nullptr,1,n,sign,FFTW_ESTIMATE);
+        }
+        static void execute(plan p) { fftw_execute(p); }
+        static void destroy(plan p) { fftw_destroy_plan(p); }
+    };
+
+    template<>
+    struct fftw_api<float>
+    {
+        using complex = fftwf_complex;
+        using plan = fftwf_plan;
+        static void* malloc(std::size_t n) { return fftwf_malloc(n); }
+        static void free(void* p) { fftwf_free(p); }
+        static plan r2c(int n, int howmany, float* in, complex* out)
+        {
+            return fftwf_plan_many_dft_r2c(1,&n,howmany,
+                in,nullptr,1,n,out,nullptr,1,n/2+1,FFTW_ESTIMATE);
+        }
+        static plan c2r(int n, int howmany, complex* in, float* out)
+        {
+            return fftwf_plan_many_dft_c2r(1,&n,howmany,
+                in,nullptr,1,n/2+1,out,nullptr,1,n,FFTW_ESTIMATE);
+        }
+        static plan c2c(int n, int howmany, complex* data, int sign)
+        {
+            return fftwf_plan_many_dft(1,&n,howmany,
+                data,nullptr,1,n,data,nullptr,1,n,sign,FFTW_ESTIMATE);
+        }
+        static void execute(plan p) { fftwf_execute(p); }
+        static void destroy(plan p) { fftwf_destroy_plan(p); }
+    };
+
+    /*
+        The pencil transform on raw buffers, independent of LATfield2.
+
+        Direction 0 (x) is local. d1 and d2 are the two distributed
+        directions, d1 being transformed first. line1 is the processor line
+        along d1: its A blocks are the real-space blocks of d1, its T blocks
+        the blocks of kx. line2 is the line along d2: A blocks are the
+        real-space blocks of d2, T blocks the blocks of k_d1.
+
+        real layout    [c][d2][d1][x]
+        Fourier layout [c][k_d1][kx][k_d2], k_d2 being complete
+    */
+    template<class real_type>
+    class pencil_transform
+    {
+        public:
+        struct blocks
+        {
+            std::vector<int> lo, len;
+        };
+        struct line
+        {
+            MPI_Comm comm;
+            int rank;
+            blocks a, t;
+        };
+
+        private:
+        using api = fftw_api<real_type>;
+        using complex = std::complex<real_type>;
+
+        int N, Nk, C;
+        line l1, l2;
+        int la1, la2, lkx, lk1;
+
+        real_type* real_buff{nullptr};
+        complex* data{nullptr};
+        std::vector<complex> send, recv;
+
+        typename api::plan p_r2c{}, p_c2r{};
+        typename api::plan p1[2]{}, p2[2]{}; // [0] forward, [1] backward
+
+        typename api::complex* fftw_data()
+        {
+            return reinterpret_cast<typename api::complex*>(data);
+        }
+        static void run(typename api::plan p)
+        {
+            if(p)
+                api::execute(p);
+        }
+
+        /*
+            forward: [C][P][A_me][T_full] -> [C][T_me][P][A_full]
+            backward: the reverse
+        */
+        void transpose(const line& l, int P, int T_full, int A_full,
+            bool backward)
+        {
+            const int n = l.a.len.size();
+            const int A_me = l.a.len[l.rank], T_me = l.t.len[l.rank];
+
+            // counts of the forward direction, in complex numbers
+            std::vector<long> out_count(n), in_count(n), out_displ(n+1,0),
+                              in_displ(n+1,0);
+            for(int r=0;r<n;++r)
+            {
+                out_count[r] = (long)C*P*A_me*l.t.len[r];
+                in_count[r] = (long)C*P*l.a.len[r]*T_me;
+                out_displ[r+1] = out_displ[r] + out_count[r];
+                in_displ[r+1] = in_displ[r] + in_count[r];
+            }
+            const auto& send_displ = backward ? in_displ : out_displ;
+            const auto& recv_displ = backward ? out_displ : in_displ;
+            send.resize(send_displ[n]);
+            recv.resize(recv_displ[n]);
+
+            // the pieces exchanged with rank r, "split" and "joined" layouts
+            auto split = [&](int r, auto op)
+            {
+                const int T_r = l.t.len[r], t0 = l.t.lo[r];
+                const long base = out_displ[r];
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2) schedule(static)
+#endif
+                for(int c=0;c<C;++c)
+                for(int p=0;p<P;++p)
+                for(int a=0;a<A_me;++a)
+                {
+                    const long row = ((long)(c*P+p)*A_me+a);
+                    for(int t=0;t<T_r;++t)
+                        op(base + row*T_r + t, row*T_full + t0 + t);
+                }
+            };
+            auto joined = [&](int r, auto op)
+            {
+                const int A_r = l.a.len[r], a0 = l.a.lo[r];
+                const long base = in_displ[r];
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2) schedule(static)
+#endif
+                for(int c=0;c<C;++c)
+                for(int p=0;p<P;++p)
+                for(int a=0;a<A_r;++a)
+                for(int t=0;t<T_me;++t)
+                    op(base + (((long)(c*P+p)*A_r+a)*T_me+t),
+                       (((long)c*T_me+t)*P+p)*A_full + a0 + a);
+            };
+
+            for(int r=0;r<n;++r)
+            {
+                if(backward)
+                    joined(r,[&](long m, long d){ send[m] = data[d]; });
+                else
+                    split(r,[&](long m, long d){ send[m] = data[d]; });
+            }
+
+            std::vector<int> sc(n), sd(n), rc(n), rd(n);
+            for(int r=0;r<n;++r)
+            {
+                sc[r] = 2*(send_displ[r+1]-send_displ[r]);
+                sd[r] = 2*send_displ[r];
+                rc[r] = 2*(recv_displ[r+1]-recv_displ[r]);
+                rd[r] = 2*recv_displ[r];
+            }
+            MPI_Datatype dtype = ::boost::mpi::get_mpi_datatype<real_type>();
+            MPI_Alltoallv(send.data(),sc.data(),sd.data(),dtype,
+                          recv.data(),rc.data(),rd.data(),dtype,l.comm);
+
+            for(int r=0;r<n;++r)
+            {
+                if(backward)
+                    split(r,[&](long m, long d){ data[d] = recv[m]; });
+                else
+                    joined(r,[&](long m, long d){ data[d] = recv[m]; });
+            }
+        }
+
+        public:
+        pencil_transform(int N_, int components, const line& line1,
+            const line& line2):
+            N{N_}, Nk{N_/2+1}, C{components}, l1{line1}, l2{line2},
+            la1{l1.a.len[l1.rank]}, la2{l2.a.len[l2.rank]},
+            lkx{l1.t.len[l1.rank]}, lk1{l2.t.len[l2.rank]}
+        {
+            const long n_real = (long)C*la2*la1*N;
+            const long n_data = std::max({(long)C*la2*la1*Nk,
+                (long)C*lkx*la2*N, (long)C*lk1*lkx*N, 1L});
+            real_buff = static_cast<real_type*>(
+                api::malloc(std::max(n_real,1L)*sizeof(real_type)));
+            data = static_cast<complex*>(api::malloc(n_data*sizeof(complex)));
+
+            if(C*la2*la1 > 0)
+            {
+                p_r2c = api::r2c(N,C*la2*la1,real_buff,fftw_data());
+                p_c2r = api::c2r(N,C*la2*la1,fftw_data(),real_buff);
+            }
+            for(int way=0;way<2;++way)
+            {
+                const int sign = way==0 ? FFTW_FORWARD : FFTW_BACKWARD;
+                if(C*lkx*la2 > 0)
+                    p1[way] = api::c2c(N,C*lkx*la2,fftw_data(),sign);
+                if(C*lk1*lkx > 0)
+                    p2[way] = api::c2c(N,C*lk1*lkx,fftw_data(),sign);
+            }
+        }
+        pencil_transform(const pencil_transform&) = delete;
+        pencil_transform& operator = (const pencil_transform&) = delete;
+        ~pencil_transform()
+        {
+            for(auto p : {p_r2c,p_c2r,p1[0],p1[1],p2[0],p2[1]})
+                if(p)
+                    api::destroy(p);
+            api::free(real_buff);
+            api::free(data);
+        }
+
+        // real input / output, [c][d2][d1][x]
+        real_type* real_data() { return real_buff; }
+        // Fourier input / output, [c][k_d1][kx][k_d2]
+        complex* fourier_data() { return data; }
+
+        void forward()
+        {
+            run(p_r2c);
+            transpose(l1,la2,Nk,N,false);
+            run(p1[0]);
+            transpose(l2,lkx,N,N,false);
+            run(p2[0]);
+        }
+        void backward()
+        {
+            run(p2[1]);
+            transpose(l2,lkx,N,N,true);
+            run(p1[1]);
+            transpose(l1,la2,Nk,N,true);
+            run(p_c2r);
+        }
+    };
+} // namespace detail
+
+template<class complex_type>
+class batched_fft
+{
+    public:
+    using real_type = typename complex_type::value_type;
+    using real_field_type = LATfield2::Field<real_type>;
+    using complex_field_type = LATfield2::Field<complex_type>;
+    using fft_plan_type = LATfield2::PlanFFT<complex_type>;
+
+    private:
+    using pencil_type = detail::pencil_transform<real_type>;
+
+    real_field_type* rF;
+    complex_field_type* kF;
+    fft_plan_type plan;
+    std::unique_ptr<pencil_type> pencil;
+
+    int N{0}, C{0};
+    int d1{1}, d2{2};
+    // local box of the Fourier field, in global coordinates
+    int k_lo[3]{}, k_len[3]{};
+
+    static MPI_Comm line_comm(int dir)
+    {
+        using LATfield2::parallel;
+        return dir==1 ? parallel.dim1_comm()[parallel.grid_rank()[0]]
+                      : parallel.dim0_comm()[parallel.grid_rank()[1]];
+    }
+
+    // collective over comm: (lo,len) of every rank of comm
+    static typename pencil_type::blocks gather(MPI_Comm comm, int lo, int len)
+    {
+        int n;
+        MPI_Comm_size(comm,&n);
+        typename pencil_type::blocks b;
+        b.lo.resize(n);
+        b.len.resize(n);
+        MPI_Allgather(&lo,1,MPI_INT,b.lo.data(),1,MPI_INT,comm);
+        MPI_Allgather(&len,1,MPI_INT,b.len.data(),1,MPI_INT,comm);
+        return b;
+    }
+    // the blocks cover [0,total) in rank order
+    static bool partition(const typename pencil_type::blocks& b, int total)
+    {
+        int next = 0;
+        for(std::size_t r=0;r<b.lo.size();++r)
+        {
+            if(b.lo[r]!=next)
+                return false;
+            next += b.len[r];
+        }
+        return next==total;
+    }
+    static bool all_equal(const typename pencil_type::blocks& b)
+    {
+        for(std::size_t r=1;r<b.lo.size();++r)
+            if(b.lo[r]!=b.lo[0] || b.len[r]!=b.len[0])
+                return false;
+        return true;
+    }
+    // logical and over the processor grid
+    static bool all(bool ok)
+    {
+        int v = ok;
+        MPI_Allreduce(MPI_IN_PLACE,&v,1,MPI_INT,MPI_LAND,line_comm(1));
+        MPI_Allreduce(MPI_IN_PLACE,&v,1,MPI_INT,MPI_LAND,line_comm(2));
+        return v;
+    }
+
+    // local coordinates of real-space site (x, y, z) in the pencil layout
+    long real_index(int c, int x, int y, int z) const
+    {
+        const LATfield2::Lattice& L = rF->lattice();
+        const int ly = L.sizeLocal(1), lz = L.sizeLocal(2);
+        return d1==1 ? (((long)c*lz+z)*ly+y)*N + x
+                     : (((long)c*ly+y)*lz+z)*N + x;
+    }
+    long fourier_index(int c, const LATfield2::rKSite& k) const
+    {
+        const int kx = k.coord(0)-k_lo[0];
+        const int k1 = k.coord(d1)-k_lo[d1];
+        const int k2 = k.coord(d2)-k_lo[d2];
+        return (((long)c*k_len[d1]+k1)*k_len[0]+kx)*N + k2;
+    }
+
+    void copy_in()
+    {
+        const LATfield2::Lattice& L = rF->lattice();
+        const int nx = L.sizeLocal(0), ny = L.sizeLocal(1),
+                  nz = L.sizeLocal(2);
+        real_type* buff = pencil->real_data();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for(int z=0;z<nz;++z)
+        {
+            LATfield2::Site s(L);
+            for(int y=0;y<ny;++y)
+            for(int x=0;x<nx;++x)
+            {
+                s.setIndex(local_site_index(L,x,y,z));
+                for(int c=0;c<C;++c)
+                    buff[real_index(c,x,y,z)] = (*rF)(s,c);
+            }
+        }
+    }
+    void copy_out()
+    {
+        const LATfield2::Lattice& L = rF->lattice();
+        const int nx = L.sizeLocal(0), ny = L.sizeLocal(1),
+                  nz = L.sizeLocal(2);
+        const real_type* buff = pencil->real_data();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for(int z=0;z<nz;++z)
+        {
+            LATfield2::Site s(L);
+            for(int y=0;y<ny;++y)
+            for(int x=0;x<nx;++x)
+            {
+                s.setIndex(local_site_index(L,x,y,z));
+                for(int c=0;c<C;++c)
+                    (*rF)(s,c) = buff[real_index(c,x,y,z)];
+            }
+        }
+    }
+    void fourier_in()
+    {
+        const auto* buff = pencil->fourier_data();
+        for_each_site<LATfield2::rKSite>(kF->lattice(),
+            [&](const LATfield2::rKSite& k)
+            {
+                for(int c=0;c<C;++c)
+                {
+                    const auto v = buff[fourier_index(c,k)];
+                    (*kF)(k,c) = complex_type(v.real(),v.imag());
+                }
+            });
+    }
+    void fourier_out()
+    {
+        auto* buff = pencil->fourier_data();
+        for_each_site<LATfield2::rKSite>(kF->lattice(),
+            [&](const LATfield2::rKSite& k)
+            {
+                for(int c=0;c<C;++c)
+                {
+                    const complex_type v = (*kF)(k,c);
+                    buff[fourier_index(c,k)] = {v.real(),v.imag()};
+                }
+            });
+    }
+
+    /*
+        Set up the pencils if the Fourier distribution allows it, collective.
+    */
+    bool setup()
+    {
+        const LATfield2::Lattice& L = rF->lattice();
+        const LATfield2::Lattice& K = kF->lattice();
+        N = L.size(0);
+        C = rF->components();
+        const int Nk = N/2+1;
+
+        // local box of the Fourier field
+        int k_hi[3];
+        long count = 0;
+        for(int i=0;i<3;++i)
+        {
+            k_lo[i] = std::numeric_limits<int>::max();
+            k_hi[i] = -1;
+        }
+        LATfield2::rKSite k(K);
+        for(k.first();k.test();k.next())
+        {
+            for(int i=0;i<3;++i)
+            {
+                k_lo[i] = std::min(k_lo[i],k.coord(i));
+                k_hi[i] = std::max(k_hi[i],k.coord(i));
+            }
+            ++count;
+        }
+        for(int i=0;i<3;++i)
+            k_len[i] = count ? k_hi[i]-k_lo[i]+1 : 0;
+
+        bool ok = kF->components()==C && L.sizeLocal(0)==N
+               && count==(long)k_len[0]*k_len[1]*k_len[2];
+
+        // the direction transformed last is complete
+        d2 = (k_lo[2]==0 && k_len[2]==N) ? 2 : 1;
+        d1 = 3-d2;
+        ok = ok && k_lo[d2]==0 && k_len[d2]==N;
+
+        // the same choice everywhere
+        int d2_min = d2, d2_max = d2;
+        for(int dir=1;dir<3;++dir)
+        {
+            MPI_Allreduce(MPI_IN_PLACE,&d2_min,1,MPI_INT,MPI_MIN,line_comm(dir));
+            MPI_Allreduce(MPI_IN_PLACE,&d2_max,1,MPI_INT,MPI_MAX,line_comm(dir));
+        }
+        ok = ok && d2_min==d2_max;
+
+        // real-space blocks: lattice direction 1 is at coordSkip()[1],
+        // direction 2 at coordSkip()[0]
+        const int r_lo[3] = {0,L.coordSkip()[1],L.coordSkip()[0]};
+        typename pencil_type::line l1, l2;
+        l1.comm = line_comm(d1);
+        l2.comm = line_comm(d2);
+        MPI_Comm_rank(l1.comm,&l1.rank);
+        MPI_Comm_rank(l2.comm,&l2.rank);
+        l1.a = gather(l1.comm,r_lo[d1],L.sizeLocal(d1));
+        l1.t = gather(l1.comm,k_lo[0],k_len[0]);
+        l2.a = gather(l2.comm,r_lo[d2],L.sizeLocal(d2));
+        l2.t = gather(l2.comm,k_lo[d1],k_len[d1]);
+
+        // the other direction is shared along each line
+        const auto l1_other = gather(l1.comm,r_lo[d2],L.sizeLocal(d2));
+        const auto l2_kx = gather(l2.comm,k_lo[0],k_len[0]);
+
+        ok = ok && partition(l1.a,N) && partition(l1.t,Nk)
+                && partition(l2.a,N) && partition(l2.t,N)
+                && all_equal(l1_other) && all_equal(l2_kx);
+        if(not all(ok))
+            return false;
+
+        pencil.reset(new pencil_type(N,C,l1,l2));
+        return true;
+    }
+
+    static double distance(real_type a, real_type b)
+    {
+        return std::abs(a-b);
+    }
+    static double distance(const complex_type& a, const complex_type& b)
+    {
+        return std::hypot(a.real()-b.real(),a.imag()-b.imag());
+    }
+
+    // PlanFFT and the pencils agree on test data, collective
+    bool verify()
+    {
+        const LATfield2::Lattice& L = rF->lattice();
+        const int nx = L.sizeLocal(0), ny = L.sizeLocal(1),
+                  nz = L.sizeLocal(2);
+        const int y0 = L.coordSkip()[1], z0 = L.coordSkip()[0];
+        auto fill = [&]()
+        {
+            LATfield2::Site s(L);
+            for(int z=0;z<nz;++z)
+            for(int y=0;y<ny;++y)
+            for(int x=0;x<nx;++x)
+            {
+                s.setIndex(local_site_index(L,x,y,z));
+                for(int c=0;c<C;++c)
+                    (*rF)(s,c) = std::sin(1.+0.37*x+1.91*(y+y0)+2.53*(z+z0)
+                                          +0.71*c*(x+1));
+            }
+        };
+        auto save_fourier = [&]()
+        {
+            std::vector<complex_type> v;
+            LATfield2::rKSite k(kF->lattice());
+            for(k.first();k.test();k.next())
+                for(int c=0;c<C;++c)
+                    v.push_back((*kF)(k,c));
+            return v;
+        };
+        auto restore_fourier = [&](const std::vector<complex_type>& v)
+        {
+            long i=0;
+            LATfield2::rKSite k(kF->lattice());
+            for(k.first();k.test();k.next())
+                for(int c=0;c<C;++c)
+                    (*kF)(k,c) = v[i++];
+        };
+        auto save_real = [&]()
+        {
+            std::vector<real_type> v;
+            LATfield2::Site s(L);
+            for(int z=0;z<nz;++z)
+            for(int y=0;y<ny;++y)
+            for(int x=0;x<nx;++x)
+            {
+                s.setIndex(local_site_index(L,x,y,z));
+                for(int c=0;c<C;++c)
+                    v.push_back((*rF)(s,c));
+            }
+            return v;
+        };
+
+        // max |a-b| <= tol max |a|, over the processor grid
+        auto close = [&](const auto& a, const auto& b)
+        {
+            double d[2] = {0,0};
+            for(std::size_t i=0;i<a.size();++i)
+            {
+                d[0] = std::max(d[0],distance(a[i],b[i]));
+                d[1] = std::max(d[1],distance(a[i],decltype(a[i])(0)));
+            }
+            for(int dir=1;dir<3;++dir)
+                MPI_Allreduce(MPI_IN_PLACE,d,2,MPI_DOUBLE,MPI_MAX,
+                    line_comm(dir));
+            const double tol =
+                std::sqrt(std::numeric_limits<real_type>::epsilon());
+            return d[0] <= tol*d[1];
+        };
+
+        fill();
+        plan.execute(LATfield2::FFT_FORWARD);
+        const auto ref_FT = save_fourier();
+        fill();
+        forward_pencils();
+        const bool forward_ok = close(ref_FT,save_fourier());
+
+        restore_fourier(ref_FT);
+        plan.execute(LATfield2::FFT_BACKWARD);
+        const auto ref = save_real();
+        restore_fourier(ref_FT);
+        backward_pencils();
+        const bool backward_ok = close(ref,save_real());
+
+        return forward_ok && backward_ok;
+    }
+
+    void forward_pencils()
+    {
+        copy_in();
+        pencil->forward();
+        fourier_in();
+    }
+    void backward_pencils()
+    {
+        fourier_out();
+        pencil->backward();
+        copy_out();
+    }
+
+    public:
+    batched_fft(real_field_type* real, complex_field_type* fourier):
+        rF{real}, kF{fourier}, plan(real,fourier)
+    {
+        if(setup() && not verify())
+            pencil.reset();
+    }
+    batched_fft(const batched_fft&) = delete;
+    batched_fft& operator = (const batched_fft&) = delete;
+
+    bool batched() const { return pencil!=nullptr; }
+
+    // LATfield2::FFT_FORWARD or LATfield2::FFT_BACKWARD, as PlanFFT
+    template<class direction_type>
+    void execute(direction_type direction)
+    {
+        if(not pencil)
+            plan.execute(direction);
+        else if(direction==LATfield2::FFT_FORWARD)
+            forward_pencils();
+        else
+            backward_pencils();
+    }
+};
+
+} // namespace gevolution
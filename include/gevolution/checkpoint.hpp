@@ -0,0 +1,568 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "LATfield2.hpp"
+#include "gevolution/particle_exchange.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <mpi.h>
+
+/*
+    Incremental checkpoints.
+
+    A checkpoint is one file written collectively with MPI-IO. Every few
+    checkpoints it is a base image: the ID, position and momentum of every
+    particle and the values of the fields that carry over from one cycle to
+    the next (see particle_mesh::restart_fields). In between it is a delta
+    from the previous checkpoint: the changes quantized to 16 bits, with a
+    scale per block of 64 particles or sites, separate for the positions
+    and the momenta. Position changes go to the nearest periodic image, so
+    that a particle crossing the boundary of the box does not coarsen the
+    scale of its block. The deltas are taken from the state a restart
+    decodes, not from the exact one, so that the quantization error does
+    not accumulate along a chain: it stays below 1/65534 of the largest
+    change in a block. Particles that arrived on a process since the
+    previous checkpoint are stored in full.
+
+    A base image and its deltas make a set; the two newest sets are kept.
+    A file is written under a temporary name and renamed once complete, so
+    that restore_latest finds the newest consistent chain from a base.
+    A restart needs the same processor grid; the decoded positions are
+    kept within the domain of the process that wrote them, and the number
+    of particles restored is checked against the number written.
+
+        file:    header | segment size of each process | segments
+        segment: counts | full particles | delta particles | fields
+*/
+
+namespace gevolution
+{
+
+// the loop variables of the run at the top of a cycle
+struct checkpoint_clock
+{
+    double a, tau, dtau, dtau_old;
+    int cycle, snapcount, pkcount, restartcount;
+};
+
+class incremental_checkpoint
+{
+    static constexpr char magic[8] = {'G','E','V','C','K','P','T','2'};
+    static constexpr int block = 64;      // values per quantization scale
+    static constexpr int qmax = 32767;
+    static constexpr long io_chunk = 1l<<30; // bytes per MPI-IO call
+
+    struct header
+    {
+        char magic[8];
+        int kind;      // 0 base image, 1 delta
+        int seq, base_seq;
+        int nproc, grid[2];
+        int nfields;
+        long long particles; // over all processes
+        checkpoint_clock clock;
+    };
+
+    using state = std::array<double,6>; // position, momentum
+
+    std::string base;    // files base + "_ckpt" + seq + ".bin"
+    MPI_Comm com;
+    int rank, nproc;
+    int base_interval;
+    int seq{-1}, base_seq{-1};
+    std::deque<int> bases; // of the sets on disk, rank 0
+
+    // decoded state of the last checkpoint, reference of the next delta
+    std::unordered_map<long,state> reference;
+    std::vector< std::vector<double> > field_reference;
+
+    static void fail(const std::string& what)
+    {
+        std::cerr << " proc#" << LATfield2::parallel.rank()
+                  << ": error in incremental_checkpoint, " << what
+                  << std::endl;
+        LATfield2::parallel.abortForce();
+    }
+
+    std::string filename(int s) const
+    {
+        char buffer[16];
+        std::snprintf(buffer,sizeof(buffer),"%06d",s);
+        return base + "_ckpt" + buffer + ".bin";
+    }
+
+    template<class T>
+    static void append(std::vector<char>& buf, const T* v, std::size_t n)
+    {
+        const std::size_t at = buf.size();
+        buf.resize(at + n*sizeof(T));
+        std::memcpy(buf.data()+at,v,n*sizeof(T));
+    }
+    template<class T>
+    static const char* extract(const char* p, T* v, std::size_t n)
+    {
+        std::memcpy(v,p,n*sizeof(T));
+        return p + n*sizeof(T);
+    }
+
+    /*
+        Quantize the changes d (stride values per record) by blocks of
+        records; ref += the decoded changes.
+    */
+    static void encode(std::vector<char>& buf, const std::vector<double>& d,
+        std::vector<double*>& ref, int stride)
+    {
+        const std::size_t n = ref.size();
+        std::vector<double> steps;
+        std::vector<int16_t> q(d.size());
+        for(std::size_t b=0;b<n;b+=block)
+        {
+            const std::size_t e = std::min(n,b+block);
+            double m = 0;
+            for(std::size_t i=b*stride;i<e*stride;++i)
+                m = std::max(m,std::abs(d[i]));
+            const double step = m > 0 ? m/qmax : 1;
+            steps.push_back(step);
+            for(std::size_t i=b;i<e;++i)
+            for(int c=0;c<stride;++c)
+            {
+                q[i*stride+c] = (int16_t)std::lround(d[i*stride+c]/step);
+                ref[i][c] += q[i*stride+c]*step;
+            }
+        }
+        append(buf,steps.data(),steps.size());
+        append(buf,q.data(),q.size());
+    }
+    static const char* decode(const char* p, std::vector<double*>& ref,
+        int stride)
+    {
+        const std::size_t n = ref.size();
+        std::vector<double> steps((n+block-1)/block);
+        std::vector<int16_t> q(n*stride);
+        p = extract(p,steps.data(),steps.size());
+        p = extract(p,q.data(),q.size());
+        for(std::size_t i=0;i<n;++i)
+        for(int c=0;c<stride;++c)
+            ref[i][c] += q[i*stride+c]*steps[i/block];
+        return p;
+    }
+
+    /*
+        The changes d of the states of the particles of ref, positions and
+        momenta with their own scales; the positions of ref stay in the box.
+    */
+    static void encode_states(std::vector<char>& buf,
+        const std::vector<double>& d, const std::vector<double*>& ref)
+    {
+        for(int part=0;part<2;++part)
+        {
+            std::vector<double> dp;
+            std::vector<double*> r;
+            for(std::size_t i=0;i<ref.size();++i)
+            {
+                dp.insert(dp.end(),&d[6*i+3*part],&d[6*i+3*part+3]);
+                r.push_back(ref[i]+3*part);
+            }
+            encode(buf,dp,r,3);
+        }
+        wrap_positions(ref);
+    }
+    static const char* decode_states(const char* p,
+        const std::vector<double*>& ref)
+    {
+        for(int part=0;part<2;++part)
+        {
+            std::vector<double*> r;
+            for(double* s : ref)
+                r.push_back(s+3*part);
+            p = decode(p,r,3);
+        }
+        wrap_positions(ref);
+        return p;
+    }
+    static void wrap_positions(const std::vector<double*>& ref)
+    {
+        for(double* s : ref)
+            for(int i=0;i<3;++i)
+                s[i] -= std::floor(s[i]);
+    }
+
+    // collective read or write of a segment of any size
+    template<class io_type>
+    void segment_io(io_type io, MPI_File fh, MPI_Offset at, char* data,
+        long size) const
+    {
+        long calls = (size + io_chunk - 1)/io_chunk;
+        MPI_Allreduce(MPI_IN_PLACE,&calls,1,MPI_LONG,MPI_MAX,com);
+        for(long c=0;c<calls;++c)
+        {
+            const long lo = std::min(size,c*io_chunk);
+            const int len = std::min(size,lo+io_chunk) - lo;
+            io(fh,at+lo,data+lo,len,MPI_BYTE,MPI_STATUS_IGNORE);
+        }
+    }
+
+    bool read_header(const std::string& name, header& h) const
+    {
+        FILE* f = std::fopen(name.c_str(),"rb");
+        if(!f)
+            return false;
+        const bool ok = std::fread(&h,sizeof(h),1,f)==1
+                        && std::memcmp(h.magic,magic,8)==0;
+        std::fclose(f);
+        return ok;
+    }
+
+    public:
+
+    incremental_checkpoint(const std::string& file_base, MPI_Comm that_com,
+        int that_base_interval):
+        base{file_base}, com{that_com},
+        base_interval{std::max(1,that_base_interval)}
+    {
+        MPI_Comm_rank(com,&rank);
+        MPI_Comm_size(com,&nproc);
+    }
+
+    /*
+        Write the next checkpoint, collective. fields are those of
+        particle_mesh::restart_fields, the same ones at every call.
+    */
+    template<class particle_container, class T>
+    void write(const checkpoint_clock& clock, const particle_container& pcls,
+        const std::vector<LATfield2::Field<T>*>& fields)
+    {
+        ++seq;
+        const bool is_base = base_seq < 0 || seq - base_seq >= base_interval;
+        if(is_base)
+        {
+            base_seq = seq;
+            reference.clear();
+            field_reference.assign(fields.size(),{});
+        }
+
+        // particles, known ones as deltas
+        std::vector<long> full_ID, delta_ID;
+        std::vector<double> full, delta;
+        std::unordered_map<long,state> current;
+        std::vector<double*> delta_ref;
+        LATfield2::Site x(pcls.lattice());
+        for(x.first();x.test();x.next())
+            for(const auto& p : pcls.field()(x).parts)
+            {
+                const state s{p.pos[0],p.pos[1],p.pos[2],
+                    p.momentum[0],p.momentum[1],p.momentum[2]};
+                auto known = reference.find(p.ID);
+                if(known == reference.end())
+                {
+                    full_ID.push_back(p.ID);
+                    full.insert(full.end(),s.begin(),s.end());
+                    current[p.ID] = s;
+                }
+                else
+                {
+                    delta_ID.push_back(p.ID);
+                    for(int c=0;c<6;++c)
+                    {
+                        const double d = s[c] - known->second[c];
+                        delta.push_back(c < 3 ? d - std::round(d) : d);
+                    }
+                    current[p.ID] = known->second;
+                }
+            }
+        for(long ID : delta_ID)
+            delta_ref.push_back(current[ID].data());
+
+        std::vector<char> buf;
+        const uint64_t counts[3] = {full_ID.size(),delta_ID.size(),
+            fields.empty() ? 0 : (uint64_t)fields[0]->lattice().sitesLocal()};
+        append(buf,counts,3);
+        append(buf,full_ID.data(),full_ID.size());
+        append(buf,full.data(),full.size());
+        append(buf,delta_ID.data(),delta_ID.size());
+        encode_states(buf,delta,delta_ref);
+
+        // fields, local sites only
+        for(std::size_t f=0;f<fields.size();++f)
+        {
+            const LATfield2::Lattice& L = fields[f]->lattice();
+            std::vector<double> values;
+            values.reserve(counts[2]);
+            LATfield2::Site y(L);
+            for(y.first();y.test();y.next())
+                values.push_back((*fields[f])(y));
+            auto& ref = field_reference[f];
+            if(is_base)
+            {
+                append(buf,values.data(),values.size());
+                ref = std::move(values);
+            }
+            else
+            {
+                std::vector<double*> r;
+                for(std::size_t i=0;i<ref.size();++i)
+                {
+                    values[i] -= ref[i];
+                    r.push_back(&ref[i]);
+                }
+                encode(buf,values,r,1);
+            }
+        }
+        reference = std::move(current);
+
+        long long particles = reference.size();
+        MPI_Allreduce(MPI_IN_PLACE,&particles,1,MPI_LONG_LONG,MPI_SUM,com);
+
+        // sizes and offsets of the segments
+        const uint64_t size = buf.size();
+        std::vector<uint64_t> sizes(nproc);
+        MPI_Allgather(&size,1,MPI_UINT64_T,sizes.data(),1,MPI_UINT64_T,com);
+        MPI_Offset at = sizeof(header) + nproc*sizeof(uint64_t);
+        for(int r=0;r<rank;++r)
+            at += sizes[r];
+
+        const std::string name = filename(seq), temporary = name + ".tmp";
+        MPI_File fh;
+        if(MPI_File_open(com,temporary.c_str(),
+               MPI_MODE_CREATE|MPI_MODE_WRONLY,MPI_INFO_NULL,&fh)
+           != MPI_SUCCESS)
+            fail("cannot open " + temporary);
+        if(rank==0)
+        {
+            header h;
+            std::memcpy(h.magic,magic,8);
+            h.kind = is_base ? 0 : 1;
+            h.seq = seq;
+            h.base_seq = base_seq;
+            h.nproc = nproc;
+            h.grid[0] = LATfield2::parallel.grid_size()[0];
+            h.grid[1] = LATfield2::parallel.grid_size()[1];
+            h.nfields = fields.size();
+            h.particles = particles;
+            h.clock = clock;
+            MPI_File_write_at(fh,0,&h,sizeof(h),MPI_BYTE,MPI_STATUS_IGNORE);
+            MPI_File_write_at(fh,sizeof(h),sizes.data(),
+                nproc*sizeof(uint64_t),MPI_BYTE,MPI_STATUS_IGNORE);
+        }
+        segment_io(MPI_File_write_at_all,fh,at,buf.data(),buf.size());
+        MPI_File_sync(fh);
+        MPI_File_close(&fh);
+
+        // publish, then rotate
+        if(rank==0)
+        {
+            std::filesystem::rename(temporary,name);
+            if(is_base)
+            {
+                bases.push_back(seq);
+                while(bases.size() > 2)
+                {
+                    for(int s=bases[0];s<bases[1];++s)
+                        std::filesystem::remove(filename(s));
+                    bases.pop_front();
+                }
+            }
+        }
+        MPI_Barrier(com);
+    }
+
+    /*
+        Load the newest consistent checkpoint into pcls and fields,
+        collective; pcls gets the particles of the checkpoint only. Returns
+        false if there is none for this processor grid, leaving everything
+        untouched. Checkpoints newer than the one loaded are removed.
+    */
+    template<class particle_container, class T>
+    bool restore_latest(checkpoint_clock& clock, particle_container& pcls,
+        const std::vector<LATfield2::Field<T>*>& fields)
+    {
+        // rank 0 finds the chain: base_seq, ..., seq
+        int chain[2] = {-1,-1};
+        if(rank==0)
+        {
+            namespace fs = std::filesystem;
+            const fs::path b(base);
+            const fs::path dir = b.has_parent_path() ? b.parent_path()
+                                                     : fs::path(".");
+            const std::string prefix = b.filename().string() + "_ckpt";
+            std::vector<std::pair<int,header> > found;
+            if(fs::is_directory(dir))
+                for(const auto& entry : fs::directory_iterator(dir))
+                {
+                    const std::string f = entry.path().filename().string();
+                    header h;
+                    if(f.rfind(prefix,0)==0 && entry.path().extension()==".bin"
+                       && read_header(entry.path().string(),h)
+                       && h.nproc==nproc
+                       && h.grid[0]==LATfield2::parallel.grid_size()[0]
+                       && h.grid[1]==LATfield2::parallel.grid_size()[1]
+                       && h.nfields==(int)fields.size())
+                        found.emplace_back(h.seq,h);
+                }
+            std::sort(found.begin(),found.end(),
+                [](const auto& l, const auto& r){ return l.first < r.first; });
+
+            auto at = [&](int s) -> const header*
+            {
+                for(const auto& [fs_seq,h] : found)
+                    if(fs_seq==s)
+                        return &h;
+                return nullptr;
+            };
+            for(auto it=found.rbegin();it!=found.rend();++it)
+            {
+                const header& last = it->second;
+                bool complete = true;
+                for(int s=last.base_seq;s<=last.seq && complete;++s)
+                {
+                    const header* h = at(s);
+                    complete = h && h->base_seq==last.base_seq
+                               && h->kind==(s==last.base_seq ? 0 : 1);
+                }
+                if(complete)
+                {
+                    chain[0] = last.base_seq;
+                    chain[1] = last.seq;
+                    break;
+                }
+            }
+            for(const auto& [s,h] : found)
+            {
+                if(s > chain[1])
+                    fs::remove(filename(s));
+                else if(h.kind==0)
+                    bases.push_back(s);
+            }
+        }
+        MPI_Bcast(chain,2,MPI_INT,0,com);
+        if(chain[1] < 0)
+            return false;
+
+        reference.clear();
+        field_reference.assign(fields.size(),{});
+        header h;
+        for(int s=chain[0];s<=chain[1];++s)
+        {
+            const std::string name = filename(s);
+            MPI_File fh;
+            if(MPI_File_open(com,name.c_str(),MPI_MODE_RDONLY,MPI_INFO_NULL,
+                   &fh) != MPI_SUCCESS)
+                fail("cannot open " + name);
+            std::vector<uint64_t> sizes(nproc);
+            MPI_File_read_at_all(fh,0,&h,sizeof(h),MPI_BYTE,
+                MPI_STATUS_IGNORE);
+            MPI_File_read_at_all(fh,sizeof(h),sizes.data(),
+                nproc*sizeof(uint64_t),MPI_BYTE,MPI_STATUS_IGNORE);
+            MPI_Offset at = sizeof(header) + nproc*sizeof(uint64_t);
+            for(int r=0;r<rank;++r)
+                at += sizes[r];
+            std::vector<char> buf(sizes[rank]);
+            segment_io(MPI_File_read_at_all,fh,at,buf.data(),buf.size());
+            MPI_File_close(&fh);
+
+            const char* p = buf.data();
+            uint64_t counts[3];
+            p = extract(p,counts,3);
+            std::vector<long> full_ID(counts[0]), delta_ID(counts[1]);
+            std::vector<double> full(6*counts[0]);
+            p = extract(p,full_ID.data(),full_ID.size());
+            p = extract(p,full.data(),full.size());
+            p = extract(p,delta_ID.data(),delta_ID.size());
+
+            std::unordered_map<long,state> current;
+            for(std::size_t i=0;i<full_ID.size();++i)
+                std::copy(&full[6*i],&full[6*i+6],current[full_ID[i]].begin());
+            std::vector<double*> delta_ref;
+            for(long ID : delta_ID)
+            {
+                auto known = reference.find(ID);
+                if(known == reference.end())
+                    fail("particle missing from the chain in " + name);
+                current[ID] = known->second;
+            }
+            for(long ID : delta_ID)
+                delta_ref.push_back(current[ID].data());
+            p = decode_states(p,delta_ref);
+            reference = std::move(current);
+
+            for(std::size_t f=0;f<fields.size();++f)
+            {
+                auto& ref = field_reference[f];
+                if(h.kind==0)
+                {
+                    ref.resize(counts[2]);
+                    p = extract(p,ref.data(),ref.size());
+                }
+                else
+                {
+                    std::vector<double*> r;
+                    for(auto& v : ref)
+                        r.push_back(&v);
+                    p = decode(p,r,1);
+                }
+            }
+        }
+        seq = chain[1];
+        base_seq = chain[0];
+        clock = h.clock;
+
+        // the decoded state replaces the particles and fields
+        LATfield2::Site x(pcls.lattice());
+        for(x.first();x.test();x.next())
+        {
+            pcls.field()(x).parts.clear();
+            pcls.field()(x).size = 0;
+        }
+        // the quantization error must not move a particle off this domain;
+        // the reference of the next delta stays the decoded state
+        const LATfield2::Lattice& lat = pcls.lattice();
+        const double dx = pcls.res(), margin = 1e-6;
+        double lo[3], hi[3];
+        for(int i=0;i<3;++i)
+        {
+            lo[i] = (local_offset(lat,i) + margin)*dx;
+            hi[i] = (local_offset(lat,i) + lat.sizeLocal(i) - margin)*dx;
+        }
+        for(const auto& [ID,s] : reference)
+        {
+            typename particle_container::value_type part;
+            part.ID = ID;
+            for(int i=0;i<3;++i)
+            {
+                part.pos[i] = std::min(hi[i],std::max(lo[i],s[i]));
+                part.vel[i] = 0;
+                part.momentum[i] = s[3+i];
+            }
+            part.mass = pcls.parts_info()->mass;
+            pcls.addParticle_global(part);
+        }
+        long long restored = 0;
+        for(x.first();x.test();x.next())
+            restored += pcls.field()(x).parts.size();
+        MPI_Allreduce(MPI_IN_PLACE,&restored,1,MPI_LONG_LONG,MPI_SUM,com);
+        if(restored != h.particles)
+            fail("restored " + std::to_string(restored) + " particles of "
+                 + std::to_string(h.particles) + " from " + filename(seq));
+        for(std::size_t f=0;f<fields.size();++f)
+        {
+            LATfield2::Site y(fields[f]->lattice());
+            std::size_t i = 0;
+            for(y.first();y.test();y.next())
+                (*fields[f])(y) = field_reference[f][i++];
+            fields[f]->updateHalo();
+        }
+        return true;
+    }
+};
+
+} // namespace gevolution
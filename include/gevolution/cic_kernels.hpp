@@ -0,0 +1,279 @@
+#pragma once
+
+#include "gevolution/config.h"
+#if defined(SIMD_AVX2) || defined(SIMD_AVX512)
+#include <immintrin.h>
+#endif
+
+/*
+    CIC kernels working on batches of particles that share a cell.
+
+    The particles are given by their offsets u from the lower corner of the
+    cell, in units of the lattice spacing, one array per direction. The eight
+    corners of the cell are ordered as XYZ = 000 | 001 | 010 | 011 | 100 | 101
+    | 110 | 111, as in the projection functions of gevolution.hpp.
+
+    Double precision kernels use AVX2 or AVX-512 when the meson option SIMD
+    asks for it; the portable version is left to the auto-vectorizer and
+    handles the remainder of the batch.
+*/
+
+namespace gevolution
+{
+namespace cic
+{
+
+// particles are copied into batches of this size before calling the kernels
+constexpr int batch_size = 64;
+
+namespace detail
+{
+    // weights of the eight corners
+    template<class T>
+    inline void weights(T ux, T uy, T uz, T w[8])
+    {
+        const T xy00 = (1-ux)*(1-uy), xy01 = (1-ux)*uy,
+                xy10 = ux*(1-uy),     xy11 = ux*uy;
+        w[0] = xy00*(1-uz); w[1] = xy00*uz;
+        w[2] = xy01*(1-uz); w[3] = xy01*uz;
+        w[4] = xy10*(1-uz); w[5] = xy10*uz;
+        w[6] = xy11*(1-uz); w[7] = xy11*uz;
+    }
+
+    template<class T>
+    void deposit_portable(
+        int k0, int n, const T* ux, const T* uy, const T* uz, const T* q,
+        T cube[8])
+    {
+        T c0=0, c1=0, c2=0, c3=0, c4=0, c5=0, c6=0, c7=0;
+#ifdef _OPENMP
+        #pragma omp simd reduction(+:c0,c1,c2,c3,c4,c5,c6,c7)
+#endif
+        for(int k=k0;k<n;++k)
+        {
+            T w[8];
+            weights(ux[k],uy[k],uz[k],w);
+            c0 += w[0]*q[k]; c1 += w[1]*q[k];
+            c2 += w[2]*q[k]; c3 += w[3]*q[k];
+            c4 += w[4]*q[k]; c5 += w[5]*q[k];
+            c6 += w[6]*q[k]; c7 += w[7]*q[k];
+        }
+        cube[0] += c0; cube[1] += c1; cube[2] += c2; cube[3] += c3;
+        cube[4] += c4; cube[5] += c5; cube[6] += c6; cube[7] += c7;
+    }
+
+    template<class T>
+    void gather_portable(
+        int k0, int n, const T* ux, const T* uy, const T* uz,
+        int ncomp, const T* cube, T* out)
+    {
+        for(int c=0;c<ncomp;++c)
+        {
+            const T* f = cube + 8*c;
+#ifdef _OPENMP
+            #pragma omp simd
+#endif
+            for(int k=k0;k<n;++k)
+            {
+                T w[8];
+                weights(ux[k],uy[k],uz[k],w);
+                out[c*n+k] = w[0]*f[0] + w[1]*f[1] + w[2]*f[2] + w[3]*f[3]
+                           + w[4]*f[4] + w[5]*f[5] + w[6]*f[6] + w[7]*f[7];
+            }
+        }
+    }
+
+#if defined(SIMD_AVX512)
+    struct simd_double
+    {
+        using reg = __m512d;
+        static constexpr int width = 8;
+        static reg load(const double* p) { return _mm512_loadu_pd(p); }
+        static void store(double* p, reg a) { _mm512_storeu_pd(p,a); }
+        static reg set1(double a) { return _mm512_set1_pd(a); }
+        static reg zero() { return _mm512_setzero_pd(); }
+        static reg sub(reg a, reg b) { return _mm512_sub_pd(a,b); }
+        static reg mul(reg a, reg b) { return _mm512_mul_pd(a,b); }
+        static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_pd(a,b,c); }
+        static double sum(reg a) { return _mm512_reduce_add_pd(a); }
+    };
+#elif defined(SIMD_AVX2)
+    struct simd_double
+    {
+        using reg = __m256d;
+        static constexpr int width = 4;
+        static reg load(const double* p) { return _mm256_loadu_pd(p); }
+        static void store(double* p, reg a) { _mm256_storeu_pd(p,a); }
+        static reg set1(double a) { return _mm256_set1_pd(a); }
+        static reg zero() { return _mm256_setzero_pd(); }
+        static reg sub(reg a, reg b) { return _mm256_sub_pd(a,b); }
+        static reg mul(reg a, reg b) { return _mm256_mul_pd(a,b); }
+        static reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_pd(a,b,c); }
+        static double sum(reg a)
+        {
+            const __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a),
+                                         _mm256_extractf128_pd(a,1));
+            return _mm_cvtsd_f64(_mm_add_sd(s,_mm_unpackhi_pd(s,s)));
+        }
+    };
+#endif
+
+#if defined(SIMD_AVX2) || defined(SIMD_AVX512)
+    template<class V>
+    inline void simd_weights(
+        typename V::reg ux, typename V::reg uy, typename V::reg uz,
+        typename V::reg w[8])
+    {
+        const auto one = V::set1(1.0);
+        const auto vx = V::sub(one,ux), vy = V::sub(one,uy),
+                   vz = V::sub(one,uz);
+        const auto xy00 = V::mul(vx,vy), xy01 = V::mul(vx,uy),
+                   xy10 = V::mul(ux,vy), xy11 = V::mul(ux,uy);
+        w[0] = V::mul(xy00,vz); w[1] = V::mul(xy00,uz);
+        w[2] = V::mul(xy01,vz); w[3] = V::mul(xy01,uz);
+        w[4] = V::mul(xy10,vz); w[5] = V::mul(xy10,uz);
+        w[6] = V::mul(xy11,vz); w[7] = V::mul(xy11,uz);
+    }
+
+    // returns the number of particles done, the rest is left to the
+    // portable kernel
+    template<class V>
+    int deposit_simd(
+        int n, const double* ux, const double* uy, const double* uz,
+        const double* q, double cube[8])
+    {
+        typename V::reg acc[8], w[8];
+        for(int c=0;c<8;++c)
+            acc[c] = V::zero();
+        int k=0;
+        for(;k+V::width<=n;k+=V::width)
+        {
+            simd_weights<V>(V::load(ux+k),V::load(uy+k),V::load(uz+k),w);
+            const auto qk = V::load(q+k);
+            for(int c=0;c<8;++c)
+                acc[c] = V::fmadd(w[c],qk,acc[c]);
+        }
+        for(int c=0;c<8;++c)
+            cube[c] += V::sum(acc[c]);
+        return k;
+    }
+
+    template<class V>
+    int gather_simd(
+        int n, const double* ux, const double* uy, const double* uz,
+        int ncomp, const double* cube, double* out)
+    {
+        typename V::reg w[8];
+        int k=0;
+        for(;k+V::width<=n;k+=V::width)
+        {
+            simd_weights<V>(V::load(ux+k),V::load(uy+k),V::load(uz+k),w);
+            for(int c=0;c<ncomp;++c)
+            {
+                auto acc = V::mul(w[0],V::set1(cube[8*c]));
+                for(int j=1;j<8;++j)
+                    acc = V::fmadd(w[j],V::set1(cube[8*c+j]),acc);
+                V::store(out+c*n+k,acc);
+            }
+        }
+        return k;
+    }
+#endif
+} // namespace detail
+
+/*
+    cube[corner] += sum_k w_corner(u_k) q[k], for k < n
+*/
+template<class T>
+void deposit(int n, const T* ux, const T* uy, const T* uz, const T* q,
+    T cube[8])
+{
+    detail::deposit_portable(0,n,ux,uy,uz,q,cube);
+}
+inline void deposit(int n, const double* ux, const double* uy,
+    const double* uz, const double* q, double cube[8])
+{
+    int k0 = 0;
+#if defined(SIMD_AVX2) || defined(SIMD_AVX512)
+    k0 = detail::deposit_simd<detail::simd_double>(n,ux,uy,uz,q,cube);
+#endif
+    detail::deposit_portable(k0,n,ux,uy,uz,q,cube);
+}
+
+/*
+    out[c*n+k] = sum_corner w_corner(u_k) cube[8*c+corner], for c < ncomp
+    and k < n
+*/
+template<class T>
+void gather(int n, const T* ux, const T* uy, const T* uz, int ncomp,
+    const T* cube, T* out)
+{
+    detail::gather_portable(0,n,ux,uy,uz,ncomp,cube,out);
+}
+inline void gather(int n, const double* ux, const double* uy,
+    const double* uz, int ncomp, const double* cube, double* out)
+{
+    int k0 = 0;
+#if defined(SIMD_AVX2) || defined(SIMD_AVX512)
+    k0 = detail::gather_simd<detail::simd_double>(n,ux,uy,uz,ncomp,cube,out);
+#endif
+    detail::gather_portable(k0,n,ux,uy,uz,ncomp,cube,out);
+}
+
+/*
+    Visit the particles of a cell in batches: load(part,k) is called for the
+    k-th particle of a batch, then flush(n) with the size of the batch, then
+    store(part,k) for the same particles.
+*/
+template<class range_type, class load_type, class flush_type, class store_type>
+void in_batches(range_type&& parts, load_type load, flush_type flush,
+    store_type store)
+{
+    auto it = parts.begin();
+    const auto end = parts.end();
+    while(it!=end)
+    {
+        auto batch_begin = it;
+        int n = 0;
+        for(;it!=end && n<batch_size;++it,++n)
+            load(*it,n);
+        flush(n);
+        n = 0;
+        for(auto jt=batch_begin;jt!=it;++jt,++n)
+            store(*jt,n);
+    }
+}
+/*
+    The same, for the particles of the cell for which select(part) is true.
+*/
+template<class range_type, class select_type, class load_type,
+    class flush_type, class store_type>
+void in_batches_if(range_type&& parts, select_type select, load_type load,
+    flush_type flush, store_type store)
+{
+    auto it = parts.begin();
+    const auto end = parts.end();
+    while(it!=end)
+    {
+        auto batch_begin = it;
+        int n = 0;
+        for(;it!=end && n<batch_size;++it)
+            if(select(*it))
+                load(*it,n++);
+        if(n==0)
+            continue;
+        flush(n);
+        n = 0;
+        for(auto jt=batch_begin;jt!=it;++jt)
+            if(select(*jt))
+                store(*jt,n++);
+    }
+}
+template<class range_type, class load_type, class flush_type>
+void in_batches(range_type&& parts, load_type load, flush_type flush)
+{
+    in_batches(parts,load,flush,[](const auto&,int){});
+}
+
+} // namespace cic
+} // namespace gevolution
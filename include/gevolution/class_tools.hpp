@@ -19,12 +19,286 @@
 #include "gevolution/config.h"
 #include "LATfield2.hpp"
 #include "gevolution/parser.hpp"
+#include <cstdint>
+#include <cstdio>
 #include <gsl/gsl_spline.h>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace gevolution
 {
 using LATfield2::parallel;
 
+//////////////////////////
+// CLASS cache
+//////////////////////////
+// Description:
+//   the transfer functions computed by CLASS (the tables of
+//   perturb_output_data, by redshift) can be kept in a file of the
+//   directory given by "CLASS cache" in the settings, named after a hash of
+//   the CLASS input. A later run with the same input reads that file on
+//   rank 0, broadcasts it and does not call CLASS at all, unless it needs a
+//   redshift that is not in the file; the tables computed by a run are
+//   added to the file when the CLASS structures are freed.
+//
+//////////////////////////
+
+struct CLASS_cache
+{
+    std::string file; // empty if there is no cache
+    std::string key;  // CLASS input, without the verbosity and the root
+    std::string titles;
+    int k_size = 0;
+    std::map<double, std::vector<double> > tables; // by redshift
+    std::vector<double> scratch;                   // without a cache
+    bool modified = false;
+
+    // deferred CLASS computation, see initializeCLASSstructures
+    bool computed = true;
+    file_content filecontent;
+    background *class_background = NULL;
+    thermo *class_thermo = NULL;
+    perturbs *class_perturbs = NULL;
+};
+
+CLASS_cache &CLASScache ()
+{
+    static CLASS_cache cache;
+    return cache;
+}
+
+static const char CLASS_CACHE_MAGIC[8]
+    = { 'g', 'e', 'v', 'C', 'L', 'S', 'T', '1' };
+
+// reads the cache file on rank 0 and broadcasts it; false if there is none
+bool readCLASScache (CLASS_cache &cache)
+{
+    std::vector<char> buffer;
+    long size = 0;
+
+    if (parallel.isRoot ())
+    {
+        FILE *f = fopen (cache.file.c_str (), "rb");
+        if (f != NULL)
+        {
+            fseek (f, 0, SEEK_END);
+            size = ftell (f);
+            fseek (f, 0, SEEK_SET);
+            buffer.resize (size);
+            if (size <= 0 || fread (buffer.data (), 1, size, f) != (size_t)size)
+                size = 0;
+            fclose (f);
+        }
+    }
+
+    parallel.broadcast<long> (size, 0);
+    if (size == 0)
+        return false;
+    buffer.resize (size);
+    parallel.broadcast<char> (buffer.data (), size, 0);
+
+    const char *ptr = buffer.data (), *end = ptr + size;
+    auto get = [&] (void *to, const size_t bytes) {
+        if (ptr + bytes > end)
+            return false;
+        memcpy (to, ptr, bytes);
+        ptr += bytes;
+        return true;
+    };
+    char magic[8];
+    int length, k_size, cols;
+    long count;
+    if (!get (magic, 8) || memcmp (magic, CLASS_CACHE_MAGIC, 8) != 0
+        || !get (&length, sizeof (int)) || ptr + length > end
+        || std::string (ptr, length) != cache.key)
+        return false;
+    ptr += length;
+    if (!get (&length, sizeof (int)) || ptr + length > end)
+        return false;
+    std::string titles (ptr, length);
+    ptr += length;
+    if (!get (&k_size, sizeof (int)) || !get (&cols, sizeof (int))
+        || !get (&count, sizeof (long)))
+        return false;
+
+    std::map<double, std::vector<double> > tables;
+    for (long n = 0; n < count; n++)
+    {
+        double z;
+        std::vector<double> data ((size_t)k_size * cols);
+        if (!get (&z, sizeof (double))
+            || !get (data.data (), sizeof (double) * data.size ()))
+            return false;
+        tables[z].swap (data);
+    }
+
+    cache.titles = titles;
+    cache.k_size = k_size;
+    cache.tables.swap (tables);
+    return true;
+}
+
+// writes all the tables of the cache to its file, on rank 0
+void writeCLASScache (CLASS_cache &cache)
+{
+    cache.modified = false;
+    if (!parallel.isRoot () || cache.tables.empty ())
+        return;
+
+    const std::string tmpname = cache.file + ".tmp";
+    FILE *f = fopen (tmpname.c_str (), "wb");
+    if (f == NULL)
+    {
+        COUT << COLORTEXT_YELLOW << " /!\\ warning" << COLORTEXT_RESET
+             << ": unable to write the CLASS cache " << cache.file << endl;
+        return;
+    }
+
+    const int keylength = cache.key.size (),
+              titlelength = cache.titles.size (),
+              cols = cache.tables.begin ()->second.size () / cache.k_size;
+    const long count = cache.tables.size ();
+    bool ok = fwrite (CLASS_CACHE_MAGIC, 1, 8, f) == 8;
+    ok = ok && fwrite (&keylength, sizeof (int), 1, f) == 1;
+    ok = ok && fwrite (cache.key.data (), 1, keylength, f) == (size_t)keylength;
+    ok = ok && fwrite (&titlelength, sizeof (int), 1, f) == 1;
+    ok = ok
+         && fwrite (cache.titles.data (), 1, titlelength, f)
+                == (size_t)titlelength;
+    ok = ok && fwrite (&cache.k_size, sizeof (int), 1, f) == 1;
+    ok = ok && fwrite (&cols, sizeof (int), 1, f) == 1;
+    ok = ok && fwrite (&count, sizeof (long), 1, f) == 1;
+    for (const auto &table : cache.tables)
+    {
+        ok = ok && fwrite (&table.first, sizeof (double), 1, f) == 1;
+        ok = ok
+             && fwrite (table.second.data (), sizeof (double),
+                        table.second.size (), f)
+                    == table.second.size ();
+    }
+    ok = (fclose (f) == 0) && ok;
+
+    // concurrent jobs of the same input write the same content
+    if (!ok || rename (tmpname.c_str (), cache.file.c_str ()) != 0)
+    {
+        COUT << COLORTEXT_YELLOW << " /!\\ warning" << COLORTEXT_RESET
+             << ": unable to write the CLASS cache " << cache.file << endl;
+        remove (tmpname.c_str ());
+    }
+}
+
+// key and file of the CLASS input in directory dir
+void openCLASScache (CLASS_cache &cache, const char *dir,
+                     const file_content &class_filecontent)
+{
+    std::string key = _VERSION_;
+    for (int i = 0; i < class_filecontent.size; i++)
+    {
+        const std::string name = class_filecontent.name[i];
+        if (name == "root"
+            || (name.size () > 8
+                && name.compare (name.size () - 8, 8, "_verbose") == 0))
+            continue;
+        key += "\n" + name + " = " + class_filecontent.value[i];
+    }
+
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (const char c : key)
+    {
+        hash ^= (unsigned char)c;
+        hash *= 1099511628211ull;
+    }
+    char name[32];
+    sprintf (name, "class_%016llx.dat", (unsigned long long)hash);
+
+    if (cache.key != key)
+    {
+        cache.tables.clear ();
+        cache.key = key;
+        cache.file = std::string (dir) + "/" + name;
+        readCLASScache (cache);
+    }
+}
+
+//////////////////////////
+// runCLASS
+//////////////////////////
+// Description:
+//   calls CLASS with the given input, which is freed, and initializes the
+//   CLASS structures
+//
+// Arguments:
+//   class_filecontent CLASS input
+//   class_background  CLASS structure that will contain the background
+//   class_thermo      CLASS structure that will contain thermodynamics
+//   class_perturbs    CLASS structure that will contain perturbations
+//
+// Returns:
+//
+//////////////////////////
+
+void runCLASS (file_content &class_filecontent, background &class_background,
+               thermo &class_thermo, perturbs &class_perturbs)
+{
+    precision class_precision;
+    transfers class_transfers;
+    primordial class_primordial;
+    nonlinear class_nonlinear;
+    spectra class_spectra;
+    lensing class_lensing;
+    output class_output;
+    ErrorMsg class_errmsg;
+
+    COUT << " gevolution is calling CLASS..." << endl << endl;
+
+    if (input_init (&class_filecontent, &class_precision, &class_background,
+                    &class_thermo, &class_perturbs, &class_transfers,
+                    &class_primordial, &class_spectra, &class_nonlinear,
+                    &class_lensing, &class_output, class_errmsg)
+        == _FAILURE_)
+    {
+        COUT << " error: calling input_init from CLASS library failed!" << endl
+             << " following error message was passed: " << class_errmsg << endl;
+        parallel.abortForce ();
+    }
+
+    parser_free (&class_filecontent);
+
+    if (background_init (&class_precision, &class_background) == _FAILURE_)
+    {
+        COUT << " error: calling background_init from CLASS library failed!"
+             << endl
+             << " following error message was passed: "
+             << class_background.error_message << endl;
+        parallel.abortForce ();
+    }
+
+    if (thermodynamics_init (&class_precision, &class_background, &class_thermo)
+        == _FAILURE_)
+    {
+        COUT << " error: calling thermodynamics_init from CLASS library "
+                "failed!"
+             << endl
+             << " following error message was passed: "
+             << class_thermo.error_message << endl;
+        parallel.abortForce ();
+    }
+
+    if (perturb_init (&class_precision, &class_background, &class_thermo,
+                      &class_perturbs)
+        == _FAILURE_)
+    {
+        COUT << " error: calling perturb_init from CLASS library failed!"
+             << endl
+             << " following error message was passed: "
+             << class_perturbs.error_message << endl;
+        parallel.abortForce ();
+    }
+
+    COUT << endl << " CLASS structures initialized successfully." << endl;
+}
+
 //////////////////////////
 // initializeCLASSstructures
 //////////////////////////
@@ -53,13 +327,6 @@ void initializeCLASSstructures (metadata &sim, icsettings &ic, cosmology &cosmo,
                                 parameter *params = NULL, int numparam = 0,
                                 const char *output_value = "dTk, vTk")
 {
-    precision class_precision;
-    transfers class_transfers;
-    primordial class_primordial;
-    nonlinear class_nonlinear;
-    spectra class_spectra;
-    lensing class_lensing;
-    output class_output;
     file_content class_filecontent;
     ErrorMsg class_errmsg;
     char filename[] = "initializeCLASSstructures";
@@ -265,53 +532,34 @@ void initializeCLASSstructures (metadata &sim, icsettings &ic, cosmology &cosmo,
         }
     }
 
-    COUT << " gevolution is calling CLASS..." << endl << endl;
-
-    if (input_init (&class_filecontent, &class_precision, &class_background,
-                    &class_thermo, &class_perturbs, &class_transfers,
-                    &class_primordial, &class_spectra, &class_nonlinear,
-                    &class_lensing, &class_output, class_errmsg)
-        == _FAILURE_)
-    {
-        COUT << " error: calling input_init from CLASS library failed!" << endl
-             << " following error message was passed: " << class_errmsg << endl;
-        parallel.abortForce ();
-    }
-
-    parser_free (&class_filecontent);
-
-    if (background_init (&class_precision, &class_background) == _FAILURE_)
-    {
-        COUT << " error: calling background_init from CLASS library failed!"
-             << endl
-             << " following error message was passed: "
-             << class_background.error_message << endl;
-        parallel.abortForce ();
-    }
+    CLASS_cache &cache = CLASScache ();
+    cache.class_background = &class_background;
+    cache.class_thermo = &class_thermo;
+    cache.class_perturbs = &class_perturbs;
+    cache.computed = true;
 
-    if (thermodynamics_init (&class_precision, &class_background, &class_thermo)
-        == _FAILURE_)
+    if (ic.class_cache[0] != '\0')
     {
-        COUT << " error: calling thermodynamics_init from CLASS library "
-                "failed!"
-             << endl
-             << " following error message was passed: "
-             << class_thermo.error_message << endl;
-        parallel.abortForce ();
+        openCLASScache (cache, ic.class_cache, class_filecontent);
+        if (!cache.tables.empty ())
+        {
+            // CLASS is called if a redshift is missing, see CLASSoutputData
+            cache.filecontent = class_filecontent;
+            cache.computed = false;
+            COUT << " CLASS transfer functions read from cache " << cache.file
+                 << " (" << cache.tables.size () << " redshifts)" << endl;
+            return;
+        }
     }
-
-    if (perturb_init (&class_precision, &class_background, &class_thermo,
-                      &class_perturbs)
-        == _FAILURE_)
+    else
     {
-        COUT << " error: calling perturb_init from CLASS library failed!"
-             << endl
-             << " following error message was passed: "
-             << class_perturbs.error_message << endl;
-        parallel.abortForce ();
+        cache.file.clear ();
+        cache.key.clear ();
+        cache.tables.clear ();
     }
 
-    COUT << endl << " CLASS structures initialized successfully." << endl;
+    runCLASS (class_filecontent, class_background, class_thermo,
+              class_perturbs);
 }
 
 //////////////////////////
@@ -333,6 +581,16 @@ void initializeCLASSstructures (metadata &sim, icsettings &ic, cosmology &cosmo,
 void freeCLASSstructures (background &class_background, thermo &class_thermo,
                           perturbs &class_perturbs)
 {
+    CLASS_cache &cache = CLASScache ();
+    if (cache.modified)
+        writeCLASScache (cache);
+    if (!cache.computed)
+    {
+        parser_free (&cache.filecontent);
+        cache.computed = true;
+        return;
+    }
+
     if (perturb_free (&class_perturbs) == _FAILURE_)
     {
         COUT << " error: calling perturb_free from CLASS library failed!"
@@ -362,6 +620,72 @@ void freeCLASSstructures (background &class_background, thermo &class_thermo,
     }
 }
 
+//////////////////////////
+// CLASSoutputData
+//////////////////////////
+// Description:
+//   the table of perturb_output_data at some redshift, from the CLASS cache
+//   if it is there, otherwise computed (and added to the cache if there is
+//   one); calls CLASS first if initializeCLASSstructures did not
+//
+// Arguments:
+//   class_background  CLASS structure that contains the background
+//   class_perturbs    CLASS structure that contains the perturbations
+//   z                 redshift
+//   coltitles         will contain the titles of the columns
+//   k_size            will contain the number of rows
+//
+// Returns: the table, valid until the next call
+//
+//////////////////////////
+
+const std::vector<double> &CLASSoutputData (background &class_background,
+                                            perturbs &class_perturbs,
+                                            const double z, char *coltitles,
+                                            int &k_size)
+{
+    CLASS_cache &cache = CLASScache ();
+
+    auto it = cache.tables.find (z);
+    if (it != cache.tables.end ())
+    {
+        sprintf (coltitles, "%s", cache.titles.c_str ());
+        k_size = cache.k_size;
+        return it->second;
+    }
+
+    if (!cache.computed)
+    {
+        COUT << " redshift " << z << " is not in the CLASS cache" << endl;
+        runCLASS (cache.filecontent, *cache.class_background,
+                  *cache.class_thermo, *cache.class_perturbs);
+        cache.computed = true;
+    }
+
+    perturb_output_titles (&class_background, &class_perturbs, class_format,
+                           coltitles);
+    int cols = 0;
+    std::string titles = coltitles;
+    for (char *ptr = strtok (&titles[0], _DELIMITER_); ptr != NULL;
+         ptr = strtok (NULL, _DELIMITER_))
+        cols++;
+    k_size = class_perturbs.k_size[class_perturbs.index_md_scalars];
+
+    std::vector<double> &data
+        = cache.file.empty () ? cache.scratch : cache.tables[z];
+    data.resize ((size_t)cols * k_size);
+    perturb_output_data (&class_background, &class_perturbs, class_format, z,
+                         cols, data.data ());
+
+    if (!cache.file.empty ())
+    {
+        cache.titles = coltitles;
+        cache.k_size = k_size;
+        cache.modified = true;
+    }
+    return data;
+}
+
 //////////////////////////
 // loadTransferFunctions (2)
 //////////////////////////
@@ -394,19 +718,18 @@ void loadTransferFunctions (background &class_background,
                             gsl_spline *&tk_theta, const char *qname,
                             const double boxsize, const double z, double h)
 {
-    int cols = 0, dcol = -1, tcol = -1, kcol = -1;
+    int cols = 0, dcol = -1, tcol = -1, kcol = -1, k_size;
     double *k;
     double *tk_d;
     double *tk_t;
-    double *data;
     char coltitles[_MAXTITLESTRINGLENGTH_] = { 0 };
     char dname[16];
     char tname[16];
     char kname[8];
     char *ptr;
 
-    perturb_output_titles (&class_background, &class_perturbs, class_format,
-                           coltitles);
+    const std::vector<double> &data = CLASSoutputData (
+        class_background, class_perturbs, z, coltitles, k_size);
 
     if (qname != NULL)
     {
@@ -443,24 +766,11 @@ void loadTransferFunctions (background &class_background,
         parallel.abortForce ();
     }
 
-    data = (double *)malloc (
-        sizeof (double) * cols
-        * class_perturbs.k_size[class_perturbs.index_md_scalars]);
-    k = (double *)malloc (
-        sizeof (double)
-        * class_perturbs.k_size[class_perturbs.index_md_scalars]);
-    tk_d = (double *)malloc (
-        sizeof (double)
-        * class_perturbs.k_size[class_perturbs.index_md_scalars]);
-    tk_t = (double *)malloc (
-        sizeof (double)
-        * class_perturbs.k_size[class_perturbs.index_md_scalars]);
+    k = (double *)malloc (sizeof (double) * k_size);
+    tk_d = (double *)malloc (sizeof (double) * k_size);
+    tk_t = (double *)malloc (sizeof (double) * k_size);
 
-    perturb_output_data (&class_background, &class_perturbs, class_format, z,
-                         cols, data);
-
-    for (int i = 0; i < class_perturbs.k_size[class_perturbs.index_md_scalars];
-         i++)
+    for (int i = 0; i < k_size; i++)
     {
         k[i] = data[i * cols + kcol] * boxsize;
         tk_d[i] = data[i * cols + dcol];
@@ -478,19 +788,11 @@ void loadTransferFunctions (background &class_background,
         }
     }
 
-    free (data);
-
-    tk_delta = gsl_spline_alloc (
-        gsl_interp_cspline,
-        class_perturbs.k_size[class_perturbs.index_md_scalars]);
-    tk_theta = gsl_spline_alloc (
-        gsl_interp_cspline,
-        class_perturbs.k_size[class_perturbs.index_md_scalars]);
+    tk_delta = gsl_spline_alloc (gsl_interp_cspline, k_size);
+    tk_theta = gsl_spline_alloc (gsl_interp_cspline, k_size);
 
-    gsl_spline_init (tk_delta, k, tk_d,
-                     class_perturbs.k_size[class_perturbs.index_md_scalars]);
-    gsl_spline_init (tk_theta, k, tk_t,
-                     class_perturbs.k_size[class_perturbs.index_md_scalars]);
+    gsl_spline_init (tk_delta, k, tk_d, k_size);
+    gsl_spline_init (tk_theta, k, tk_t, k_size);
 
     free (k);
     free (tk_d);
@@ -3,15 +3,20 @@
 #include "gevolution/config.h"
 #include <boost/mpi/collectives.hpp>
 #include <boost/mpi/communicator.hpp>
-#include <boost/serialization/vector.hpp>
 #include <boost/serialization/array.hpp>
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/binary_oarchive.hpp>
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
+#include <utility>
 #include <filesystem>
+#include <mpi.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace gevolution
 {
@@ -31,6 +36,15 @@ struct part_data
     }
 };
 
+/*
+    Debug trace of the particles, written with MPI-IO.
+
+    Each flush appends a frame to the file: the total number of records of
+    the frame (a 64 bit integer, written by the root) followed by the
+    part_data of all the processes, in rank order, at offsets given by a
+    prefix sum of the local counts. The records are raw part_data, so that
+    analizer_t reads the file by mapping it in memory.
+*/
 class debugger_t 
 {
     std::vector< part_data > data;
@@ -40,30 +54,65 @@ class debugger_t
     const int root{ 0 };
     const double Pos_physical{1},Acc_physical{1};
     
+    MPI_File file{MPI_FILE_NULL};
+    MPI_Offset end{0}; // of the last frame, the same on all processes
+    static constexpr unsigned long long chunk = 1ull << 24; // records
+    
   public:
     debugger_t (boost::mpi::communicator _com, std::string _fname,
         double Pos_fac,double Acc_fac)
         : com{ _com }, fname{ _fname },
         Pos_physical{Pos_fac}, Acc_physical{Acc_fac}
     {
+        #ifndef NDEBUG
         if (com.rank()==root)
             std::filesystem::remove(fname);
+        com.barrier ();
+        MPI_File_open (com, fname.c_str (), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                       MPI_INFO_NULL, &file);
+        #endif
     }
+    debugger_t (const debugger_t&) = delete;
+    debugger_t& operator = (const debugger_t&) = delete;
 
+    // collective
     void flush ()
     {
         #ifndef NDEBUG
-        for (int p = 0; p < com.size (); ++p)
+        static_assert (sizeof (part_data) == 56, "part_data is not packed");
+        unsigned long long count = data.size (), first = 0, total = 0;
+        MPI_Exscan (&count, &first, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, com);
+        MPI_Allreduce (&count, &total, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
+                       com);
+        if (total == 0)
+            return;
+        if (com.rank () == root)
         {
-            if (p == com.rank ())
-            {
-                std::ofstream os (fname, std::ios::binary | std::ios::app);
-                boost::archive::binary_oarchive oa(os);
-                oa << data;
-                data.clear();
-            }
-            com.barrier ();
+            first = 0;
+            MPI_File_write_at (file, end, &total, 1, MPI_UNSIGNED_LONG_LONG,
+                               MPI_STATUS_IGNORE);
         }
+        
+        MPI_Datatype record;
+        MPI_Type_contiguous (sizeof (part_data), MPI_BYTE, &record);
+        MPI_Type_commit (&record);
+        // the count of MPI-IO is an int: collective writes of at most
+        // chunk records, as many on every process
+        unsigned long long calls = (count + chunk - 1) / chunk;
+        MPI_Allreduce (MPI_IN_PLACE, &calls, 1, MPI_UNSIGNED_LONG_LONG,
+                       MPI_MAX, com);
+        for (unsigned long long c = 0; c < calls; ++c)
+        {
+            const unsigned long long lo = std::min (count, c * chunk);
+            const int len = std::min (count, lo + chunk) - lo;
+            MPI_File_write_at_all (
+                file, end + sizeof (total) + (first + lo) * sizeof (part_data),
+                data.data () + lo, len, record, MPI_STATUS_IGNORE);
+        }
+        MPI_Type_free (&record);
+        
+        end += sizeof (total) + total * sizeof (part_data);
+        data.clear ();
         #endif
     }
     void append (unsigned long long id, std::array<double, 3> Pos, std::array<double, 3> Acc)
@@ -72,27 +121,75 @@ class debugger_t
         for(auto &a: Acc) a *= Acc_physical;
         data.push_back({id,Pos,Acc});
     }
-    ~debugger_t () { flush (); }
+    ~debugger_t ()
+    {
+        #ifndef NDEBUG
+        flush ();
+        MPI_File_close (&file);
+        #endif
+    }
 };
 
+/*
+    Reader of a debug trace: the file is mapped in memory and frame(i) is
+    the part_data of the i-th flush, without a copy.
+*/
 class analizer_t
 {
-    std::vector<part_data> data;
     std::string fname;
+    const char* map{nullptr};
+    std::size_t length{0};
+    std::vector< std::pair<const part_data*,std::size_t> > frames;
     
     public:
     analizer_t(std::string _fname):
         fname{_fname}
     {
-        std::ifstream is (fname, std::ios::binary);
-        boost::archive::binary_iarchive ia(is);
-        std::vector<part_data> buff;
-        while(is)
+        const int fd = open (fname.c_str (), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << " cannot open the debug trace " << fname << "\n";
+            return;
+        }
+        struct stat st;
+        fstat (fd, &st);
+        length = st.st_size;
+        if (length > 0)
+        {
+            void* p = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+                map = static_cast<const char*> (p);
+        }
+        close (fd);
+        
+        for (std::size_t at = 0; map && at + sizeof (unsigned long long) <= length;)
         {
-            ia >> buff;
-            std::copy(buff.begin(),buff.end(),std::back_inserter(data));
+            unsigned long long count;
+            std::memcpy (&count, map + at, sizeof (count));
+            at += sizeof (count);
+            if (at + count * sizeof (part_data) > length)
+            {
+                std::cerr << " truncated frame in the debug trace " << fname
+                          << "\n";
+                break;
+            }
+            frames.emplace_back (
+                reinterpret_cast<const part_data*> (map + at), count);
+            at += count * sizeof (part_data);
         }
     }
+    analizer_t (const analizer_t&) = delete;
+    analizer_t& operator = (const analizer_t&) = delete;
+    ~analizer_t ()
+    {
+        if (map)
+            munmap (const_cast<char*> (map), length);
+    }
+    
+    std::size_t size () const { return frames.size (); }
+    // records of frame i and their number
+    const part_data* frame (std::size_t i) const { return frames[i].first; }
+    std::size_t frame_size (std::size_t i) const { return frames[i].second; }
 };
 
 extern debugger_t *Debugger;
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+/*
+    Scalars of a cycle (moments of the particles, statistics of the fields,
+    maximum velocity...) accumulated locally and reduced over the processes
+    in a single MPI_Allreduce.
+
+    Every entry is a sum or a maximum; adding to an existing name
+    accumulates into it. All the processes must add the same names in the
+    same order. After reduce, operator [] gives the global values.
+
+        diagnostics d;
+        d.sum("mass",local_mass);
+        d.max("max|v|",local_vmax);
+        d.reduce(com);
+        COUT << d["mass"] << std::endl;
+*/
+
+namespace gevolution
+{
+
+class diagnostics
+{
+    std::vector<std::string> sum_names, max_names;
+    std::vector<double> sums, maxima;
+
+    static int find(const std::vector<std::string>& names,
+        const std::string& name)
+    {
+        auto it = std::find(names.begin(),names.end(),name);
+        return it==names.end() ? -1 : int(it - names.begin());
+    }
+
+    /*
+        The buffer is a single element of a contiguous type, so that MPI
+        does not split it: [number of sums, sums..., maxima...].
+    */
+    static void combine(void* in, void* inout, int* len, MPI_Datatype* type)
+    {
+        int size;
+        MPI_Type_size(*type,&size);
+        const long n = long(size/sizeof(double));
+        for(int e=0;e<*len;++e)
+        {
+            const double* a = static_cast<const double*>(in) + e*n;
+            double* b = static_cast<double*>(inout) + e*n;
+            const long nsum = long(b[0]);
+            for(long i=1;i<=nsum;++i)
+                b[i] += a[i];
+            for(long i=nsum+1;i<n;++i)
+                b[i] = std::max(a[i],b[i]);
+        }
+    }
+
+    public:
+
+    void sum(const std::string& name, double value)
+    {
+        const int i = find(sum_names,name);
+        if(i < 0)
+        {
+            sum_names.push_back(name);
+            sums.push_back(value);
+        }
+        else
+            sums[i] += value;
+    }
+
+    void max(const std::string& name, double value)
+    {
+        const int i = find(max_names,name);
+        if(i < 0)
+        {
+            max_names.push_back(name);
+            maxima.push_back(value);
+        }
+        else
+            maxima[i] = std::max(maxima[i],value);
+    }
+
+    // reduce all the entries over com, collective
+    void reduce(MPI_Comm com)
+    {
+        std::vector<double> buf;
+        buf.reserve(1 + sums.size() + maxima.size());
+        buf.push_back(double(sums.size()));
+        buf.insert(buf.end(),sums.begin(),sums.end());
+        buf.insert(buf.end(),maxima.begin(),maxima.end());
+
+        MPI_Datatype block;
+        MPI_Type_contiguous(int(buf.size()),MPI_DOUBLE,&block);
+        MPI_Type_commit(&block);
+        MPI_Op op;
+        MPI_Op_create(&diagnostics::combine,1,&op);
+        MPI_Allreduce(MPI_IN_PLACE,buf.data(),1,block,op,com);
+        MPI_Op_free(&op);
+        MPI_Type_free(&block);
+
+        std::copy(buf.begin()+1,buf.begin()+1+sums.size(),sums.begin());
+        std::copy(buf.begin()+1+sums.size(),buf.end(),maxima.begin());
+    }
+
+    bool contains(const std::string& name) const
+    {
+        return find(sum_names,name) >= 0 or find(max_names,name) >= 0;
+    }
+
+    // value of an entry, NaN if there is none of that name
+    double operator [] (const std::string& name) const
+    {
+        int i = find(sum_names,name);
+        if(i >= 0)
+            return sums[i];
+        i = find(max_names,name);
+        return i >= 0 ? maxima[i] : std::nan("");
+    }
+
+    void clear()
+    {
+        sum_names.clear();
+        max_names.clear();
+        sums.clear();
+        maxima.clear();
+    }
+};
+
+/*
+    Local sums and maxima over the particles of a container, for
+    particle_mesh::diagnose_particles. Containers can provide their own
+    sum_particles, found by argument-dependent lookup: particles_soa does
+    with GPU_OFFLOAD, where its particles are on the device.
+*/
+struct particle_sums
+{
+    long count{};
+    double mass{}, masspos{}, massmom{}, massacc{}, max_pos{}, max_mom{};
+};
+
+template<class particle_container>
+particle_sums sum_particles(const particle_container& pcls)
+{
+    particle_sums s;
+    pcls.for_each([&s](const auto& part, const auto& /*xpart*/)
+        {
+            using std::abs;
+            using std::max;
+            double v2 = 0,p2=0,a2=0;
+            for(int i=0;i<3;++i)
+            {
+                v2 += part.momentum[i]*part.momentum[i];
+                p2 += part.pos[i]*part.pos[i];
+                a2 += part.force[i]*part.force[i];
+                s.max_pos = max<double>(s.max_pos,abs(part.pos[i]));
+                s.max_mom = max<double>(s.max_mom,abs(part.momentum[i]));
+            }
+            s.masspos += p2*part.mass;
+            s.massmom += v2*part.mass;
+            s.massacc += a2*part.mass;
+            s.mass += part.mass;
+            s.count++;
+        });
+    return s;
+}
+
+} // namespace gevolution
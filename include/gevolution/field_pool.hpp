@@ -0,0 +1,254 @@
+#pragma once
+
+#include "LATfield2.hpp"
+#include <cstddef>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace gevolution
+{
+
+/*
+    Pool of scratch fields living on the lattices of a particle_mesh engine.
+
+    Fields are requested by shape (rows x cols, symmetry) and handed out as
+    leases; when a lease goes out of scope the field goes back to the pool
+    and is reused by the next request with the same shape. Memory is thus
+    allocated (and first touched) once per shape instead of once per cycle.
+
+    The pool keeps track of the memory held and of the high-water mark of the
+    memory in use, both per process.
+*/
+template<typename complex_type>
+class field_pool
+{
+    public:
+    using real_type = typename complex_type::value_type;
+    using real_field_type = LATfield2::Field<real_type>;
+    using complex_field_type = LATfield2::Field<complex_type>;
+    using fft_plan_type = LATfield2::PlanFFT<complex_type>;
+
+    struct shape
+    {
+        int rows{1}, cols{1};
+        int symmetry{LATfield2::matrix_symmetry::unsymmetric};
+
+        int components() const
+        {
+            if(cols==1)
+                return rows;
+            return symmetry == LATfield2::matrix_symmetry::symmetric ?
+                rows*(rows+1)/2 : rows*cols;
+        }
+        bool operator == (const shape& that) const
+        {
+            return rows==that.rows && cols==that.cols
+                && symmetry==that.symmetry;
+        }
+    };
+
+    // a real field, its Fourier image and the plan connecting them
+    struct fft_set
+    {
+        real_field_type real;
+        complex_field_type fourier;
+        fft_plan_type plan;
+    };
+
+    private:
+
+    template<class T>
+    struct slot
+    {
+        std::unique_ptr<T> item;
+        shape s;
+        std::size_t bytes{0};
+        bool in_use{false};
+    };
+
+    const LATfield2::Lattice &lat, &latFT;
+
+    std::vector< std::unique_ptr< slot<real_field_type> > > real_slots;
+    std::vector< std::unique_ptr< slot<complex_field_type> > > complex_slots;
+    std::vector< std::unique_ptr< slot<fft_set> > > fft_slots;
+
+    std::size_t bytes_held{0}, bytes_in_use{0}, bytes_peak{0};
+
+    template<class F>
+    static void initialize_field(
+        F& field, const LATfield2::Lattice& L, const shape& s)
+    {
+        if(s.cols==1)
+            field.initialize(L,s.rows);
+        else
+            field.initialize(L,s.rows,s.cols,s.symmetry);
+    }
+
+    std::size_t real_bytes(const shape& s) const
+    {
+        return lat.sitesLocalGross() * s.components() * sizeof(real_type);
+    }
+    std::size_t complex_bytes(const shape& s) const
+    {
+        return latFT.sitesLocalGross() * s.components() * sizeof(complex_type);
+    }
+
+    template<class T>
+    void take(slot<T>& sl)
+    {
+        sl.in_use = true;
+        bytes_in_use += sl.bytes;
+        using std::max;
+        bytes_peak = max(bytes_peak,bytes_in_use);
+    }
+
+    template<class T, class maker_type>
+    slot<T>& find_or_make(
+        std::vector< std::unique_ptr< slot<T> > >& slots,
+        const shape& s,
+        std::size_t bytes,
+        maker_type make)
+    {
+        for(auto& sl : slots)
+            if(not sl->in_use and sl->s == s)
+            {
+                take(*sl);
+                return *sl;
+            }
+
+        auto sl = std::make_unique< slot<T> >();
+        sl->s = s;
+        sl->bytes = bytes;
+        sl->item = make();
+        bytes_held += bytes;
+        take(*sl);
+        slots.push_back(std::move(sl));
+        return *slots.back();
+    }
+
+    public:
+
+    /*
+        Handle to a field (or fft_set) borrowed from the pool.
+    */
+    template<class T>
+    class lease
+    {
+        field_pool* pool{nullptr};
+        slot<T>* sl{nullptr};
+
+        public:
+        lease(field_pool* p, slot<T>* s): pool{p}, sl{s} {}
+        lease(const lease&) = delete;
+        lease& operator = (const lease&) = delete;
+        lease(lease&& that): pool{that.pool}, sl{that.sl}
+        {
+            that.sl = nullptr;
+        }
+        ~lease()
+        {
+            if(sl)
+            {
+                sl->in_use = false;
+                pool->bytes_in_use -= sl->bytes;
+            }
+        }
+
+        T& operator * () const { return *sl->item; }
+        T* operator -> () const { return sl->item.get(); }
+        T* get() const { return sl->item.get(); }
+    };
+
+    field_pool(const LATfield2::Lattice& l, const LATfield2::Lattice& lFT):
+        lat{l}, latFT{lFT}
+    {}
+    field_pool(const field_pool&) = delete;
+    field_pool& operator = (const field_pool&) = delete;
+
+    /*
+        Scratch fields on the real space lattice, with ghost cells.
+        The content is whatever the previous user left in it.
+    */
+    lease<real_field_type> real_field(shape s)
+    {
+        auto& sl = find_or_make(real_slots,s,real_bytes(s),
+            [this,&s]()
+            {
+                auto F = std::make_unique<real_field_type>();
+                initialize_field(*F,lat,s);
+                return F;
+            });
+        return {this,&sl};
+    }
+    lease<real_field_type> real_field(int components=1)
+    {
+        return real_field(shape{components,1});
+    }
+
+    /*
+        Scratch fields on the Fourier lattice.
+    */
+    lease<complex_field_type> complex_field(shape s)
+    {
+        auto& sl = find_or_make(complex_slots,s,complex_bytes(s),
+            [this,&s]()
+            {
+                auto F = std::make_unique<complex_field_type>();
+                initialize_field(*F,latFT,s);
+                return F;
+            });
+        return {this,&sl};
+    }
+    lease<complex_field_type> complex_field(int components=1)
+    {
+        return complex_field(shape{components,1});
+    }
+
+    /*
+        A real field together with its Fourier image and the FFT plan.
+        Planning is done only the first time a shape is requested.
+    */
+    lease<fft_set> fft(shape s)
+    {
+        auto& sl = find_or_make(fft_slots,s,real_bytes(s)+complex_bytes(s),
+            [this,&s]()
+            {
+                auto F = std::make_unique<fft_set>();
+                initialize_field(F->real,lat,s);
+                initialize_field(F->fourier,latFT,s);
+                F->plan.initialize(&F->real,&F->fourier);
+                return F;
+            });
+        return {this,&sl};
+    }
+    lease<fft_set> fft(int components=1)
+    {
+        return fft(shape{components,1});
+    }
+
+    // memory accounting, local process
+    std::size_t held() const { return bytes_held; }
+    std::size_t in_use() const { return bytes_in_use; }
+    std::size_t peak() const { return bytes_peak; }
+
+    /*
+        Human readable summary, maximum over all processes.
+        This is a collective call.
+    */
+    std::string report() const
+    {
+        double held_MB = bytes_held/1048576.0,
+               peak_MB = bytes_peak/1048576.0;
+        LATfield2::parallel.max(held_MB);
+        LATfield2::parallel.max(peak_MB);
+
+        std::stringstream ss;
+        ss << "scratch fields: " << held_MB << " MB held, "
+           << peak_MB << " MB peak in use (max per process)";
+        return ss.str();
+    }
+};
+
+} // namespace gevolution
@@ -0,0 +1,443 @@
+#pragma once
+
+#include "LATfield2.hpp"
+#include "gevolution/h5_snapshot.hpp"
+#include "gevolution/particle_layer.hpp"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+/*
+    Friends-of-friends halo finder, run in situ on the particles of one
+    species, such that the snapshots need not contain the particles.
+
+    Two particles are friends if they are closer than the linking length,
+    given in units of the mean particle separation (0.2 is customary), and
+    a halo is a class of friends of friends with at least min_members
+    particles.
+
+    Each process gathers the particles of its cells, and receives copies of
+    the particles of the neighbouring domains within one linking length of
+    its boundaries (the halo layer, exchanged first along direction 1, then
+    along direction 2 with the copies, which covers the corners). The
+    lattice cells are several linking lengths wide, so the friends are
+    looked up in a sorted grid of cells of one linking length, and the
+    classes of friends merged with a union-find.
+
+    A group crossing the boundaries of the domains is labelled by the
+    smallest ID of its members: the labels are exchanged through the halo
+    layer until no label changes, then the partial sums of the group on
+    each process go to the process chosen by the label, which completes
+    the catalog entry. The groups that do not touch the halo layer never
+    leave their process.
+
+        fof_halos halos(pcls_cdm,0.2,20,true,com);
+        halos.write(file,"halos");   // h5_snapshot
+
+    Positions and velocities have the units of the particles, the
+    positions being in units of the box, as in h5_snapshot.
+*/
+
+namespace gevolution
+{
+
+class fof_halos
+{
+    public:
+
+    struct halo
+    {
+        long long ID;   // smallest particle ID of the members
+        long long N;    // number of members
+        double pos[3];  // centre of mass
+        double vel[3];  // mean velocity
+        double sigma_v; // velocity dispersion, three-dimensional
+        double radius;  // rms distance of the members to the centre
+    };
+
+    private:
+
+    // sums over the members of a group on one process, relative to ref
+    struct group_sums
+    {
+        long long ID, N;
+        double ref[3], x[3], xx, v[3], vv;
+    };
+
+    std::vector<halo> catalog;
+    std::vector<long long> first;   // offsets of the halos in members
+    std::vector<long long> members; // IDs of the members, halo by halo
+    bool with_members;
+    double b;                      // in units of the mean separation
+    double linking_length;         // in units of the box
+    long long min_members;
+
+    std::vector<long long> ID;
+    std::vector<double> pos, vel;  // 3 per particle
+    long nlocal{0};                // the copies of the halo layer follow
+    particle_layer layer;
+
+    std::vector<long> parent;      // union-find
+
+    // nearest periodic image of a difference of positions
+    static double wrap(double d) { return d - std::round(d); }
+
+    long root(long k)
+    {
+        while(parent[k] != k)
+            k = parent[k] = parent[parent[k]];
+        return k;
+    }
+
+    void link(long i, long j)
+    {
+        i = root(i);
+        j = root(j);
+        if(i < j)
+            parent[j] = i;
+        else if(j < i)
+            parent[i] = j;
+    }
+
+    // union-find of the friends, in cells of one linking length
+    void link_friends()
+    {
+        const long n = ID.size();
+        const double ll2 = linking_length*linking_length;
+        const cell_grid grid(pos,linking_length);
+
+        parent.resize(n);
+        for(long k=0;k<n;++k)
+            parent[k] = k;
+
+        auto friends = [&](long i, long j)
+        {
+            double d2 = 0;
+            for(int c=0;c<3;++c)
+            {
+                const double d = wrap(pos[3*i+c]-pos[3*j+c]);
+                d2 += d*d;
+            }
+            return d2 < ll2;
+        };
+
+        std::vector<long> neighbours;
+        for(long begin=0,end;begin<n;begin=end)
+        {
+            const long own = grid.cell(begin);
+            end = grid.range(own).second;
+            grid.neighbours(own,neighbours);
+
+            for(long s=begin;s<end;++s)
+                for(long t=s+1;t<end;++t)
+                    if(friends(grid.particle(s),grid.particle(t)))
+                        link(grid.particle(s),grid.particle(t));
+
+            for(long m : neighbours)
+            {
+                if(m <= own)
+                    continue;
+                const auto range = grid.range(m);
+                for(long s=begin;s<end;++s)
+                    for(long t=range.first;t<range.second;++t)
+                    {
+                        const long i = grid.particle(s), j = grid.particle(t);
+                        if(root(i) != root(j) && friends(i,j))
+                            link(i,j);
+                    }
+            }
+        }
+    }
+
+    // the smallest ID of each group, on all its members and copies
+    std::vector<long long> labels(MPI_Comm com)
+    {
+        const long n = ID.size();
+        std::vector<long long> label(ID), smallest(n);
+        int changed;
+        do
+        {
+            changed = 0;
+            std::fill(smallest.begin(),smallest.end(),LLONG_MAX);
+            for(long k=0;k<n;++k)
+                smallest[root(k)] = std::min(smallest[root(k)],label[k]);
+            for(long k=0;k<n;++k)
+                if(label[k] != smallest[root(k)])
+                {
+                    label[k] = smallest[root(k)];
+                    changed = 1;
+                }
+
+            if(layer.update(label))
+                changed = 1;
+            MPI_Allreduce(MPI_IN_PLACE,&changed,1,MPI_INT,MPI_LOR,com);
+        }
+        while(changed);
+
+        return label;
+    }
+
+    void add(group_sums& g, long k) const
+    {
+        double d2 = 0, v2 = 0;
+        for(int i=0;i<3;++i)
+        {
+            const double d = wrap(pos[3*k+i] - g.ref[i]);
+            g.x[i] += d;
+            d2 += d*d;
+            g.v[i] += vel[3*k+i];
+            v2 += vel[3*k+i]*vel[3*k+i];
+        }
+        g.xx += d2;
+        g.vv += v2;
+        g.N++;
+    }
+
+    // b += a, moving the reference of a to that of b
+    static void merge(group_sums& b, const group_sums& a)
+    {
+        double s[3], s2 = 0, sx = 0;
+        for(int i=0;i<3;++i)
+        {
+            s[i] = wrap(a.ref[i] - b.ref[i]);
+            s2 += s[i]*s[i];
+            sx += s[i]*a.x[i];
+        }
+        for(int i=0;i<3;++i)
+        {
+            b.x[i] += a.x[i] + a.N*s[i];
+            b.v[i] += a.v[i];
+        }
+        b.xx += a.xx + 2.*sx + a.N*s2;
+        b.vv += a.vv;
+        b.N += a.N;
+    }
+
+    static halo entry(const group_sums& g)
+    {
+        halo h;
+        h.ID = g.ID;
+        h.N = g.N;
+        double x2 = 0, v2 = 0;
+        for(int i=0;i<3;++i)
+        {
+            const double x = g.x[i]/g.N, v = g.v[i]/g.N;
+            h.pos[i] = g.ref[i] + x - std::floor(g.ref[i] + x);
+            h.vel[i] = v;
+            x2 += x*x;
+            v2 += v*v;
+        }
+        h.radius = std::sqrt(std::max(0.,g.xx/g.N - x2));
+        h.sigma_v = std::sqrt(std::max(0.,g.vv/g.N - v2));
+        return h;
+    }
+
+    // send[p] to process p, returns what arrives, collective over com
+    template<class T>
+    static std::vector<T> all_to_all(std::vector< std::vector<T> >& send,
+        MPI_Comm com)
+    {
+        const int nproc = send.size();
+        std::vector<int> n_out(nproc), n_in(nproc), d_out(nproc),
+                         d_in(nproc);
+        for(int p=0;p<nproc;++p)
+            n_out[p] = send[p].size()*sizeof(T);
+        MPI_Alltoall(n_out.data(),1,MPI_INT,n_in.data(),1,MPI_INT,com);
+
+        std::vector<T> out, in;
+        for(int p=0;p<nproc;++p)
+        {
+            d_out[p] = out.size()*sizeof(T);
+            out.insert(out.end(),send[p].begin(),send[p].end());
+            d_in[p] = p ? d_in[p-1] + n_in[p-1] : 0;
+        }
+        in.resize((d_in[nproc-1] + n_in[nproc-1])/sizeof(T));
+        MPI_Alltoallv(out.data(),n_out.data(),d_out.data(),MPI_BYTE,
+            in.data(),n_in.data(),d_in.data(),MPI_BYTE,com);
+        return in;
+    }
+
+    public:
+
+    /*
+        Find the halos of pcls, a Particles_gevolution or particles_soa;
+        with members, the IDs of the members are kept for write.
+        Collective over com, the processes of the lattice.
+    */
+    template<class particle_container>
+    fof_halos(const particle_container& pcls, double that_b,
+        long long that_min_members, bool that_with_members, MPI_Comm com):
+        with_members{that_with_members}, b{that_b},
+        min_members{that_min_members}
+    {
+        const LATfield2::Lattice& lat = pcls.lattice();
+        LATfield2::Site x(lat);
+        for(x.first();x.test();x.next())
+            for(const auto& p : pcls.field()(x).parts)
+            {
+                ID.push_back(p.ID);
+                for(int i=0;i<3;++i)
+                {
+                    pos.push_back(p.pos[i]);
+                    vel.push_back(p.vel[i]);
+                }
+            }
+        nlocal = ID.size();
+
+        long long total = nlocal;
+        MPI_Allreduce(MPI_IN_PLACE,&total,1,MPI_LONG_LONG,MPI_SUM,com);
+        linking_length = b/std::cbrt((double)std::max(1ll,total));
+
+        layer.exchange(lat,pcls.res(),linking_length,ID,pos);
+        link_friends();
+        const std::vector<long long> label = labels(com);
+
+        // sums of the groups, by root, over the local members
+        std::vector<long> group(ID.size(),-1);
+        std::vector<group_sums> sums;
+        std::vector<char> crossing;     // touches the halo layer
+        for(long k=0;k<(long)ID.size();++k)
+        {
+            const long r = root(k);
+            if(group[r] < 0)
+            {
+                group[r] = sums.size();
+                group_sums g{label[k],0,{pos[3*k],pos[3*k+1],pos[3*k+2]},
+                             {0,0,0},0,{0,0,0},0};
+                sums.push_back(g);
+                crossing.push_back(0);
+            }
+            if(k < nlocal)
+            {
+                add(sums[group[r]],k);
+                crossing[group[r]] |= layer.sent(k);
+            }
+            else
+                crossing[group[r]] = 1;
+        }
+
+        int nproc, rank;
+        MPI_Comm_size(com,&nproc);
+        MPI_Comm_rank(com,&rank);
+        std::vector< std::vector<group_sums> > send(nproc);
+        std::vector< std::vector<long long> > send_members(nproc);
+        std::vector< std::pair<long long,long long> > local_members;
+
+        for(long g=0;g<(long)sums.size();++g)
+            if(sums[g].N > 0 and crossing[g])
+                send[sums[g].ID % nproc].push_back(sums[g]);
+            else if(sums[g].N >= min_members)
+                catalog.push_back(entry(sums[g]));
+
+        if(with_members)
+            for(long k=0;k<nlocal;++k)
+            {
+                const long g = group[root(k)];
+                if(crossing[g])
+                {
+                    send_members[sums[g].ID % nproc].push_back(sums[g].ID);
+                    send_members[sums[g].ID % nproc].push_back(ID[k]);
+                }
+                else if(sums[g].N >= min_members)
+                    local_members.emplace_back(sums[g].ID,ID[k]);
+            }
+
+        // the partial sums of the crossing groups of this process' labels
+        std::vector<group_sums> parts = all_to_all(send,com);
+        std::sort(parts.begin(),parts.end(),
+            [](const group_sums& a, const group_sums& b)
+            { return a.ID < b.ID; });
+        for(long i=0,j;i<(long)parts.size();i=j)
+        {
+            group_sums g = parts[i];
+            for(j=i+1;j<(long)parts.size() && parts[j].ID==g.ID;++j)
+                merge(g,parts[j]);
+            if(g.N >= min_members)
+                catalog.push_back(entry(g));
+        }
+
+        std::sort(catalog.begin(),catalog.end(),
+            [](const halo& a, const halo& b){ return a.ID < b.ID; });
+
+        if(with_members)
+        {
+            const std::vector<long long> pairs = all_to_all(send_members,com);
+            for(long i=0;i+1<(long)pairs.size();i+=2)
+                local_members.emplace_back(pairs[i],pairs[i+1]);
+            std::sort(local_members.begin(),local_members.end());
+
+            // the members of the groups below min_members are dropped
+            long i = 0;
+            for(const halo& h : catalog)
+            {
+                while(i<(long)local_members.size()
+                      && local_members[i].first < h.ID)
+                    ++i;
+                first.push_back(members.size());
+                for(;i<(long)local_members.size()
+                     && local_members[i].first==h.ID;++i)
+                    members.push_back(local_members[i].second);
+            }
+        }
+
+        // the particles are not needed any more
+        std::vector<long long>().swap(ID);
+        std::vector<double>().swap(pos);
+        std::vector<double>().swap(vel);
+        std::vector<long>().swap(parent);
+    }
+
+    // halos of this process, sorted by ID
+    const std::vector<halo>& halos() const { return catalog; }
+
+    /*
+        The catalog in group name of file, with the datasets ID, N, pos,
+        vel, sigma_v and radius, and, with members, the IDs of the members
+        of all halos in members and the offset of each halo in first.
+        Collective.
+    */
+    void write(h5_snapshot& file, const std::string& name) const
+    {
+        std::vector<long long> haloID, N;
+        std::vector<double> hpos, hvel, sigma_v, radius;
+        for(const halo& h : catalog)
+        {
+            haloID.push_back(h.ID);
+            N.push_back(h.N);
+            hpos.insert(hpos.end(),h.pos,h.pos+3);
+            hvel.insert(hvel.end(),h.vel,h.vel+3);
+            sigma_v.push_back(h.sigma_v);
+            radius.push_back(h.radius);
+        }
+
+        file.attribute(name + "_linking_length",b);
+        file.attribute(name + "_min_members",(double)min_members);
+        file.group(name);
+        file.write_rows(name + "/ID",haloID);
+        file.write_rows(name + "/N",N);
+        file.write_rows(name + "/pos",hpos,3);
+        file.write_rows(name + "/vel",hvel,3);
+        file.write_rows(name + "/sigma_v",sigma_v);
+        file.write_rows(name + "/radius",radius);
+
+        if(with_members)
+        {
+            long long n = members.size(), offset = 0;
+            MPI_Exscan(&n,&offset,1,MPI_LONG_LONG,MPI_SUM,file.communicator());
+            int rank;
+            MPI_Comm_rank(file.communicator(),&rank);
+            if(rank==0)
+                offset = 0;
+            std::vector<long long> global(first);
+            for(auto& f : global)
+                f += offset;
+            file.write_rows(name + "/first",global);
+            file.write_rows(name + "/members",members);
+        }
+    }
+};
+
+} // namespace gevolution
@@ -34,6 +34,10 @@
 #include "gevolution/real_type.hpp"
 #include "gevolution/debugger.hpp"
 #include "gevolution/Particles_gevolution.hpp"
+#include "gevolution/halo.hpp"
+#include "gevolution/kspace_tables.hpp"
+#include "gevolution/cic_kernels.hpp"
+#include "gevolution/threading.hpp"
 #include <cstdlib>
 #include <iostream>
 
@@ -67,10 +71,8 @@ template <class FieldType>
 void prepareFTsource (const Field<FieldType> &phi, const Field<FieldType> &Tij,
                       Field<FieldType> &Sij, const double coeff)
 {
-    Site x (phi.lattice ());
-
-    for (x.first (); x.test (); x.next ())
-    {
+    // sites are independent, the loop is shared among threads
+    for_each_site (phi.lattice (), [&] (const Site &x) {
         // 0-0-component:
         Sij (x, 0, 0) = coeff * Tij (x, 0, 0);
 #ifdef PHINONLINEAR
@@ -163,7 +165,7 @@ void prepareFTsource (const Field<FieldType> &phi, const Field<FieldType> &Tij,
         Sij (x, 1, 2) += 0.5 * phi (x + 1 + 2) * phi (x + 1 + 2);
 #endif
 #endif
-    }
+    });
 }
 
 //////////////////////////
@@ -195,10 +197,8 @@ void prepareFTsource (const Field<FieldType> &phi, const Field<FieldType> &chi,
                       const double coeff2, 
                       const double coeff3)
 {
-    Site x (phi.lattice ());
-
-    for (x.first (); x.test (); x.next ())
-    {
+    // sites are independent, the loop is shared among threads
+    for_each_site (phi.lattice (), [&] (const Site &x) {
         result (x) = coeff2 * (T00 (x) - bgmodel);
 #ifdef PHINONLINEAR
 #ifdef ORIGINALMETRIC
@@ -221,7 +221,7 @@ void prepareFTsource (const Field<FieldType> &phi, const Field<FieldType> &chi,
 #endif
         result (x) += (coeff3) * phi (x) - coeff3 * chi (x);
         // result (x) += (coeff3 - coeff) * phi (x) - coeff3 * chi (x);
-    }
+    });
 }
 
 #ifdef FFT3D
@@ -324,21 +324,11 @@ void solveModifiedPoissonFT (const Field<Complex> &sourceFT, Field<Complex> &pot
     
     #ifdef GEVOLUTION_OLD_VERSION
     const int linesize = potFT.lattice().size(1);
-    int i;
-    Real * gridk2;
-    // Real * sinc;
+    const Real * gridk2 = kspace_axes::of(linesize).grid_k2.data();
     rKSite k(potFT.lattice());
     
-    gridk2 = (Real *) malloc(linesize * sizeof(Real));
-    
     coeff /= -((long) linesize * (long) linesize * (long) linesize);
     
-    for (i = 0; i < linesize; i++)
-    {
-        gridk2[i] = 2. * (Real) linesize * sin(M_PI * (Real) i / (Real) linesize);
-        gridk2[i] *= gridk2[i];
-    }
-    
     k.first();
     if (k.coord(0) == 0 && k.coord(1) == 0 && k.coord(2) == 0)
     {
@@ -353,38 +343,24 @@ void solveModifiedPoissonFT (const Field<Complex> &sourceFT, Field<Complex> &pot
     {
         potFT(k) = sourceFT(k) * coeff / (gridk2[k.coord(0)] + gridk2[k.coord(1)] + gridk2[k.coord(2)] + modif);
     }
-    
-    free(gridk2);
     #else
     const int linesize = potFT.lattice ().size (1);
-    rKSite k (potFT.lattice ());
     coeff /= -((long)linesize * (long)linesize * (long)linesize);
+    const Real * k2 = kspace_axes::of(linesize).linear_k2.data();
 
-    auto signed_mode = [linesize](int n)
-    {
-        return n>= linesize/2 ? n-linesize : n;
-    };
-
-    k.first ();
-    if (k.coord (0) == 0 && k.coord (1) == 0 && k.coord (2) == 0)
-    {
-        if (modif == 0.)
-            potFT (k) = Complex (0., 0.);
-        else
-            potFT (k) = sourceFT (k) * coeff / modif;
-        k.next ();
-    }
-
-    for (; k.test (); k.next ())
-    {   
-        Real k2 {0.0};
-        for(int i=0;i<3;++i)
+    for_each_site<rKSite> (potFT.lattice (), [&] (const rKSite &k) {
+        if (k.coord (0) == 0 && k.coord (1) == 0 && k.coord (2) == 0)
         {
-            Real ki = 2*M_PI*signed_mode(k.coord(i));
-            k2 += ki*ki;
+            if (modif == 0.)
+                potFT (k) = Complex (0., 0.);
+            else
+                potFT (k) = sourceFT (k) * coeff / modif;
+            return;
         }
-        potFT (k) = sourceFT (k) * coeff / (k2 + modif);
-    }
+        potFT (k) = sourceFT (k) * coeff
+                    / (k2[k.coord (0)] + k2[k.coord (1)] + k2[k.coord (2)]
+                       + modif);
+    });
     #endif
 }
 #endif
@@ -577,18 +553,20 @@ void projection_T00_project (const Particles<part, part_info, part_dataType> *pc
     Site xPart (pcls->lattice ());
     Site xField (T00->lattice ());
 
-    Real referPos[3];
-    Real weightScalarGridUp[3];
-    Real weightScalarGridDown[3];
     Real dx = pcls->res ();
 
     coeff *= 1.0/(dx*dx*dx*a);
 
     Real e = a, f = 0.;
 
-    Real localCube[8]; // XYZ = 000 | 001 | 010 | 011 | 100 | 101 | 110 | 111
+    // the deposit of a particle on corner c is w_c (e + f phi_c) m, hence it
+    // is split in two CIC deposits, of e m and of f m
+    Real localCubeE[8]; // XYZ = 000 | 001 | 010 | 011 | 100 | 101 | 110 | 111
+    Real localCubeF[8];
     Real localCubePhi[8];
 
+    Real u[3][cic::batch_size], qe[cic::batch_size], qf[cic::batch_size];
+
     for (int i = 0; i < 8; i++)
         localCubePhi[i] = 0.0;
 
@@ -597,10 +575,11 @@ void projection_T00_project (const Particles<part, part_info, part_dataType> *pc
     {
         if (pcls->field () (xPart).size != 0)
         {
-            for (int i = 0; i < 3; i++)
-                referPos[i] = xPart.coord (i) * dx;
             for (int i = 0; i < 8; i++)
-                localCube[i] = 0.0;
+            {
+                localCubeE[i] = 0.0;
+                localCubeF[i] = 0.0;
+            }
 
             if (phi != NULL)
             {
@@ -614,73 +593,41 @@ void projection_T00_project (const Particles<part, part_info, part_dataType> *pc
                 localCubePhi[7] = (*phi) (xField + 0 + 1 + 2);
             }
 
-            for (const auto& p : pcls->field ()(xPart).parts)
-            {
-                double mass = p.mass;
-                for (int i = 0; i < 3; i++)
-                {
-                    weightScalarGridUp[i] = (p.pos[i] - referPos[i]) / dx;
-                    weightScalarGridDown[i] = 1.0l - weightScalarGridUp[i];
-                }
-
-                if (phi != NULL)
-                {
-                    const auto &q = p.momentum;
-                    f = q[0] * q[0] + q[1] * q[1] + q[2] * q[2];
-                    e = sqrt (f + a * a);
-                    f = 3. * e + f / e;
-                }
-
-                // 000
-                localCube[0]
-                    += weightScalarGridDown[0] * weightScalarGridDown[1]
-                       * weightScalarGridDown[2] * (e + f * localCubePhi[0])
-                       * mass;
-                // 001
-                localCube[1]
-                    += weightScalarGridDown[0] * weightScalarGridDown[1]
-                       * weightScalarGridUp[2] * (e + f * localCubePhi[1])
-                       * mass;
-                // 010
-                localCube[2] += weightScalarGridDown[0] * weightScalarGridUp[1]
-                                * weightScalarGridDown[2]
-                                * (e + f * localCubePhi[2])
-                                * mass;
-                // 011
-                localCube[3] += weightScalarGridDown[0] * weightScalarGridUp[1]
-                                * weightScalarGridUp[2]
-                                * (e + f * localCubePhi[3])
-                                * mass;
-                // 100
-                localCube[4] += weightScalarGridUp[0] * weightScalarGridDown[1]
-                                * weightScalarGridDown[2]
-                                * (e + f * localCubePhi[4])
-                                * mass;
-                // 101
-                localCube[5] += weightScalarGridUp[0] * weightScalarGridDown[1]
-                                * weightScalarGridUp[2]
-                                * (e + f * localCubePhi[5])
-                                * mass;
-                // 110
-                localCube[6] += weightScalarGridUp[0] * weightScalarGridUp[1]
-                                * weightScalarGridDown[2]
-                                * (e + f * localCubePhi[6])
-                                * mass;
-                // 111
-                localCube[7] += weightScalarGridUp[0] * weightScalarGridUp[1]
-                                * weightScalarGridUp[2]
-                                * (e + f * localCubePhi[7])
-                                * mass;
-            }
-
-            (*T00) (xField) += localCube[0] * coeff;
-            (*T00) (xField + 2) += localCube[1] * coeff;
-            (*T00) (xField + 1) += localCube[2] * coeff;
-            (*T00) (xField + 1 + 2) += localCube[3] * coeff;
-            (*T00) (xField + 0) += localCube[4] * coeff;
-            (*T00) (xField + 0 + 2) += localCube[5] * coeff;
-            (*T00) (xField + 0 + 1) += localCube[6] * coeff;
-            (*T00) (xField + 0 + 1 + 2) += localCube[7] * coeff;
+            cic::in_batches (
+                pcls->field () (xPart).parts,
+                [&] (const auto &p, int k) {
+                    for (int i = 0; i < 3; i++)
+                        u[i][k] = p.pos[i] / dx - xPart.coord (i);
+
+                    if (phi != NULL)
+                    {
+                        const auto &q = p.momentum;
+                        f = q[0] * q[0] + q[1] * q[1] + q[2] * q[2];
+                        e = sqrt (f + a * a);
+                        f = 3. * e + f / e;
+                    }
+                    qe[k] = e * p.mass;
+                    qf[k] = f * p.mass;
+                },
+                [&] (int n) {
+                    cic::deposit (n, u[0], u[1], u[2], qe, localCubeE);
+                    if (phi != NULL)
+                        cic::deposit (n, u[0], u[1], u[2], qf, localCubeF);
+                });
+
+            Real localCube[8];
+            for (int i = 0; i < 8; i++)
+                localCube[i] = (localCubeE[i] + localCubeF[i] * localCubePhi[i])
+                               * coeff;
+
+            (*T00) (xField) += localCube[0];
+            (*T00) (xField + 2) += localCube[1];
+            (*T00) (xField + 1) += localCube[2];
+            (*T00) (xField + 1 + 2) += localCube[3];
+            (*T00) (xField + 0) += localCube[4];
+            (*T00) (xField + 0 + 2) += localCube[5];
+            (*T00) (xField + 0 + 1) += localCube[6];
+            (*T00) (xField + 0 + 1 + 2) += localCube[7];
         }
     }
 }
@@ -1027,6 +974,292 @@ void projection_Tij_project (const Particles<part, part_info, part_dataType> *pc
 #define projection_Tij_comm symtensorProjectionCICNGP_comm
 #endif
 
+//////////////////////////
+// projection_Tmunu_project
+//////////////////////////
+// Description:
+//   Particle-mesh projection for T00, T0i and Tij in a single sweep over the
+//   particles; equivalent to calling projection_T00_project,
+//   projection_T0i_project and projection_Tij_project one after the other,
+//   but the particle cells are visited once, the potential is gathered once
+//   per cell and the CIC weights are computed once per particle
+//
+// Arguments:
+//   pcls       pointer to particle handler (LATfield2 particles or
+//              particles_soa)
+//   T00        pointer to target field (scalar)
+//   T0i        pointer to target field (vector)
+//   Tij        pointer to target field (symmetric tensor)
+//   a          scale factor at projection (needed in order to convert
+//              canonical momenta to energies)
+//   phi        pointer to Bardeen potential which characterizes the
+//              geometric corrections (volume distortion); can be set to
+//              NULL which will result in no corrections applied
+//   coeff      coefficient applied to the projection operation (default 1)
+//
+// Returns:
+//
+//////////////////////////
+
+template <class particle_container>
+void projection_Tmunu_project (
+    const particle_container *pcls, Field<Real> *T00,
+    Field<Real> *T0i, Field<Real> *Tij, double a = 1., Field<Real> *phi = NULL,
+    double coeff = 1.)
+{
+    if (T00->lattice ().halo () == 0)
+    {
+        std::cout << "projection_Tmunu_project: target field needs halo > 0"
+                  << std::endl;
+        std::exit (-1);
+    }
+
+    const Real dx = pcls->res ();
+
+    const Real coeff00 = coeff / (dx * dx * dx * a);
+    const Real coeff0i = coeff / (dx * dx * dx);
+    const Real coeffij = coeff / (dx * dx * dx * a);
+
+    // neighbouring planes are never projected at the same time, hence
+    // threads do not write to the same sites
+    for_each_site_colored (pcls->lattice (), [&] (const Site &xPart) {
+        if (pcls->field () (xPart).size == 0)
+            return;
+
+        Site xField (T00->lattice ());
+        xField.setIndex (xPart.index ());
+
+        Real referPos[3];
+        Real weightScalarGridUp[3];
+        Real weightScalarGridDown[3];
+
+        Real e00, f00, eij, fij, q2, w, m;
+
+        Real localCube[8]; // XYZ = 000 | 001 | 010 | 011 | 100 | 101 | 110 | 111
+        Real qi[12];
+        Real tij[6];
+        Real tii[24];
+        Real cw[8]; // CIC weights, same ordering as localCube
+        Real localCubePhi[8];
+
+        for (int i = 0; i < 8; i++)
+            localCubePhi[i] = 0.0;
+
+        for (int i = 0; i < 3; i++)
+            referPos[i] = xPart.coord (i) * dx;
+        for (int i = 0; i < 8; i++)
+            localCube[i] = 0.0;
+        for (int i = 0; i < 12; i++)
+            qi[i] = 0.0;
+        for (int i = 0; i < 6; i++)
+            tij[i] = 0.0;
+        for (int i = 0; i < 24; i++)
+            tii[i] = 0.0;
+
+        if (phi != NULL)
+        {
+            localCubePhi[0] = (*phi) (xField);
+            localCubePhi[1] = (*phi) (xField + 2);
+            localCubePhi[2] = (*phi) (xField + 1);
+            localCubePhi[3] = (*phi) (xField + 1 + 2);
+            localCubePhi[4] = (*phi) (xField + 0);
+            localCubePhi[5] = (*phi) (xField + 0 + 2);
+            localCubePhi[6] = (*phi) (xField + 0 + 1);
+            localCubePhi[7] = (*phi) (xField + 0 + 1 + 2);
+        }
+
+        for (const auto &p : pcls->field () (xPart).parts)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                weightScalarGridUp[i] = (p.pos[i] - referPos[i]) / dx;
+                weightScalarGridDown[i] = 1.0l - weightScalarGridUp[i];
+            }
+            for (int c = 0; c < 8; c++)
+                cw[c] = ((c & 4) ? weightScalarGridUp[0]
+                                 : weightScalarGridDown[0])
+                        * ((c & 2) ? weightScalarGridUp[1]
+                                   : weightScalarGridDown[1])
+                        * ((c & 1) ? weightScalarGridUp[2]
+                                   : weightScalarGridDown[2]);
+
+            m = p.mass;
+            const auto &q = p.momentum;
+            q2 = q[0] * q[0] + q[1] * q[1] + q[2] * q[2];
+            eij = sqrt (q2 + a * a);
+            fij = 4. + a * a / (q2 + a * a);
+
+            if (phi != NULL)
+            {
+                e00 = eij;
+                f00 = 3. * e00 + q2 / e00;
+            }
+            else
+            {
+                e00 = a;
+                f00 = 0.;
+            }
+
+            // T00
+            for (int c = 0; c < 8; c++)
+                localCube[c] += cw[c] * (e00 + f00 * localCubePhi[c]) * m;
+
+            // T0i
+            w = coeff0i * m * q[0];
+            qi[0] += w * weightScalarGridDown[1] * weightScalarGridDown[2];
+            qi[1] += w * weightScalarGridUp[1] * weightScalarGridDown[2];
+            qi[2] += w * weightScalarGridDown[1] * weightScalarGridUp[2];
+            qi[3] += w * weightScalarGridUp[1] * weightScalarGridUp[2];
+
+            w = coeff0i * m * q[1];
+            qi[4] += w * weightScalarGridDown[0] * weightScalarGridDown[2];
+            qi[5] += w * weightScalarGridUp[0] * weightScalarGridDown[2];
+            qi[6] += w * weightScalarGridDown[0] * weightScalarGridUp[2];
+            qi[7] += w * weightScalarGridUp[0] * weightScalarGridUp[2];
+
+            w = coeff0i * m * q[2];
+            qi[8] += w * weightScalarGridDown[0] * weightScalarGridDown[1];
+            qi[9] += w * weightScalarGridUp[0] * weightScalarGridDown[1];
+            qi[10] += w * weightScalarGridDown[0] * weightScalarGridUp[1];
+            qi[11] += w * weightScalarGridUp[0] * weightScalarGridUp[1];
+
+            // Tij, diagonal components
+            for (int i = 0; i < 3; i++)
+            {
+                w = coeffij * m * q[i] * q[i] / eij;
+                for (int c = 0; c < 8; c++)
+                    tii[c + i * 8]
+                        += w * cw[c] * (1. + fij * localCubePhi[c]);
+            }
+
+            // Tij, off-diagonal components
+            w = coeffij * m * q[0] * q[1] / eij;
+            tij[0] += w * weightScalarGridDown[2]
+                      * (1.
+                         + fij * 0.25
+                               * (localCubePhi[0] + localCubePhi[2]
+                                  + localCubePhi[4] + localCubePhi[6]));
+            tij[1] += w * weightScalarGridUp[2]
+                      * (1.
+                         + fij * 0.25
+                               * (localCubePhi[1] + localCubePhi[3]
+                                  + localCubePhi[5] + localCubePhi[7]));
+
+            w = coeffij * m * q[0] * q[2] / eij;
+            tij[2] += w * weightScalarGridDown[1]
+                      * (1.
+                         + fij * 0.25
+                               * (localCubePhi[0] + localCubePhi[1]
+                                  + localCubePhi[4] + localCubePhi[5]));
+            tij[3] += w * weightScalarGridUp[1]
+                      * (1.
+                         + fij * 0.25
+                               * (localCubePhi[2] + localCubePhi[3]
+                                  + localCubePhi[6] + localCubePhi[7]));
+
+            w = coeffij * m * q[1] * q[2] / eij;
+            tij[4] += w * weightScalarGridDown[0]
+                      * (1.
+                         + fij * 0.25
+                               * (localCubePhi[0] + localCubePhi[1]
+                                  + localCubePhi[2] + localCubePhi[3]));
+            tij[5] += w * weightScalarGridUp[0]
+                      * (1.
+                         + fij * 0.25
+                               * (localCubePhi[4] + localCubePhi[5]
+                                  + localCubePhi[6] + localCubePhi[7]));
+        }
+
+        // T00
+        (*T00) (xField) += localCube[0] * coeff00;
+        (*T00) (xField + 2) += localCube[1] * coeff00;
+        (*T00) (xField + 1) += localCube[2] * coeff00;
+        (*T00) (xField + 1 + 2) += localCube[3] * coeff00;
+        (*T00) (xField + 0) += localCube[4] * coeff00;
+        (*T00) (xField + 0 + 2) += localCube[5] * coeff00;
+        (*T00) (xField + 0 + 1) += localCube[6] * coeff00;
+        (*T00) (xField + 0 + 1 + 2) += localCube[7] * coeff00;
+
+        // T0i
+        (*T0i) (xField, 0) += qi[0] * (1. + localCubePhi[0] + localCubePhi[4]);
+        (*T0i) (xField, 1) += qi[4] * (1. + localCubePhi[0] + localCubePhi[2]);
+        (*T0i) (xField, 2) += qi[8] * (1. + localCubePhi[0] + localCubePhi[1]);
+
+        (*T0i) (xField + 0, 1)
+            += qi[5] * (1. + localCubePhi[4] + localCubePhi[6]);
+        (*T0i) (xField + 0, 2)
+            += qi[9] * (1. + localCubePhi[4] + localCubePhi[5]);
+
+        (*T0i) (xField + 1, 0)
+            += qi[1] * (1. + localCubePhi[2] + localCubePhi[6]);
+        (*T0i) (xField + 1, 2)
+            += qi[10] * (1. + localCubePhi[2] + localCubePhi[3]);
+
+        (*T0i) (xField + 2, 0)
+            += qi[2] * (1. + localCubePhi[1] + localCubePhi[5]);
+        (*T0i) (xField + 2, 1)
+            += qi[6] * (1. + localCubePhi[1] + localCubePhi[3]);
+
+        (*T0i) (xField + 1 + 2, 0)
+            += qi[3] * (1. + localCubePhi[3] + localCubePhi[7]);
+        (*T0i) (xField + 0 + 2, 1)
+            += qi[7] * (1. + localCubePhi[5] + localCubePhi[7]);
+        (*T0i) (xField + 0 + 1, 2)
+            += qi[11] * (1. + localCubePhi[6] + localCubePhi[7]);
+
+        // Tij
+        for (int i = 0; i < 3; i++)
+            (*Tij) (xField, i, i) += tii[8 * i];
+        (*Tij) (xField, 0, 1) += tij[0];
+        (*Tij) (xField, 0, 2) += tij[2];
+        (*Tij) (xField, 1, 2) += tij[4];
+
+        for (int i = 0; i < 3; i++)
+            (*Tij) (xField + 0, i, i) += tii[4 + 8 * i];
+        (*Tij) (xField + 0, 1, 2) += tij[5];
+
+        for (int i = 0; i < 3; i++)
+            (*Tij) (xField + 1, i, i) += tii[2 + 8 * i];
+        (*Tij) (xField + 1, 0, 2) += tij[3];
+
+        for (int i = 0; i < 3; i++)
+            (*Tij) (xField + 2, i, i) += tii[1 + 8 * i];
+        (*Tij) (xField + 2, 0, 1) += tij[1];
+
+        for (int i = 0; i < 3; i++)
+            (*Tij) (xField + 0 + 1, i, i) += tii[6 + 8 * i];
+        for (int i = 0; i < 3; i++)
+            (*Tij) (xField + 0 + 2, i, i) += tii[5 + 8 * i];
+        for (int i = 0; i < 3; i++)
+            (*Tij) (xField + 1 + 2, i, i) += tii[3 + 8 * i];
+        for (int i = 0; i < 3; i++)
+            (*Tij) (xField + 0 + 1 + 2, i, i) += tii[7 + 8 * i];
+    });
+}
+
+//////////////////////////
+// projection_Tmunu_comm
+//////////////////////////
+// Description:
+//   Communication step matching projection_Tmunu_project: the ghost cells of
+//   the three fields are added to the neighbouring domains using a single
+//   message per direction
+//
+// Arguments:
+//   T00        pointer to projected scalar field
+//   T0i        pointer to projected vector field
+//   Tij        pointer to projected symmetric tensor field
+//
+// Returns:
+//
+//////////////////////////
+
+inline void projection_Tmunu_comm (Field<Real> *T00, Field<Real> *T0i,
+                                   Field<Real> *Tij)
+{
+    add_upper_halo<Real> ({ T00, T0i, Tij });
+}
+
 //////////////////////////
 // projection_Ti0_project
 //////////////////////////
@@ -13,11 +13,20 @@
 
 namespace gevolution
 {
-template<typename complex_type, typename particle_container>
-class relativistic_pm : public particle_mesh<complex_type,particle_container>
+template<
+    typename complex_type,
+    typename particle_container,
+    typename assignment_type = assignment::cic>
+class relativistic_pm :
+    public particle_mesh<complex_type,particle_container,assignment_type>
 { 
+    // T0i, Tij and the gradient of B are written for CIC
+    static_assert(std::is_same<assignment_type,assignment::cic>::value,
+        "relativistic_pm only supports CIC mass assignment");
+
     public:
-    using base_type = particle_mesh<complex_type,particle_container>;
+    using base_type =
+        particle_mesh<complex_type,particle_container,assignment_type>;
     using typename base_type::real_type;
     using typename base_type::real_field_type;
     using typename base_type::complex_field_type;
@@ -26,8 +35,11 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
     using base_type::scalar_to_zero;
     using base_type::gradient;
     using typename base_type::fft_plan_type;
+    using typename base_type::batched_fft_type;
     
     using typename base_type::force_reduction;
+    using typename base_type::halo_exchange_type;
+    using typename base_type::particle_type;
     using base_type::com;
     
     // metric perturbations
@@ -39,7 +51,9 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
     
     // Energy-Momentum tensor
     real_field_type T00,T0i,Tij;
-    complex_field_type T00_FT; //, T0i_FT, Tij_FT;
+    // transformed on demand by T00_kspace, only the outputs need it
+    mutable complex_field_type T00_FT; //, T0i_FT, Tij_FT;
+    mutable bool T00_FT_valid{false};
     
     // Sources
     mutable real_field_type S00, S0i, Sij; // source fields
@@ -47,36 +61,39 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
     
     
     // FT plans
-    fft_plan_type plan_phi, plan_chi, plan_Bi;
-    fft_plan_type plan_T00; // , plan_T0i, plan_Tij;
-    fft_plan_type plan_S00, plan_S0i, plan_Sij;
+    // the vector and tensor fields send all their components through the
+    // same transposes
+    fft_plan_type plan_phi, plan_chi;
+    batched_fft_type plan_Bi;
+    mutable fft_plan_type plan_T00; // , plan_T0i, plan_Tij;
+    fft_plan_type plan_S00;
+    batched_fft_type plan_S0i, plan_Sij;
+    
+    // ghost cells of chi and Bi are exchanged while the forces are computed
+    mutable halo_exchange_type chi_halo, Bi_halo;
     
     void scalar_to_zero(real_field_type& F)
     {
-        site_type x(base_type::lat);
-        for(x.first();x.test();x.next())
-            F(x) = 0.0;
+        for_each_site(base_type::lat,[&F](const site_type& x){ F(x) = 0.0; });
         F.updateHalo();
     }
     void vector_to_zero(real_field_type& F)
     {
-        site_type x(base_type::lat);
-        for(x.first();x.test();x.next())
-        {
-            for(int i=0;i<3;++i)
-                F(x,i) = 0.0;
-        }
+        for_each_site(base_type::lat,[&F](const site_type& x)
+            {
+                for(int i=0;i<3;++i)
+                    F(x,i) = 0.0;
+            });
         F.updateHalo();
     }
     void tensor_to_zero(real_field_type& F)
     {
-        site_type x(base_type::lat);
-        for(x.first();x.test();x.next())
-        {
-            for(int i=0;i<3;++i)
-                for(int j=0;j<3;++j)
-                    F(x,i,j) = 0.0;
-        }
+        for_each_site(base_type::lat,[&F](const site_type& x)
+            {
+                for(int i=0;i<3;++i)
+                    for(int j=0;j<3;++j)
+                        F(x,i,j) = 0.0;
+            });
         F.updateHalo();
     }
     
@@ -127,7 +144,10 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
         
         plan_S00(&S00,&S00_FT),
         plan_S0i(&S0i,&S0i_FT),
-        plan_Sij(&Sij,&Sij_FT)
+        plan_Sij(&Sij,&Sij_FT),
+        
+        chi_halo(chi),
+        Bi_halo(Bi)
     {
         scalar_to_zero(phi);
         scalar_to_zero(chi);
@@ -147,6 +167,7 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
         scalar_to_zero(T00);
         vector_to_zero(T0i);
         tensor_to_zero(Tij);
+        T00_FT_valid = false;
     }
     
     /*
@@ -157,15 +178,24 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
     // canonical momentum normalized q = p/mca.
     {
         // WARNING: has phi been initialized? 
-        projection_T00_project(&pcls, &T00, a, &phi); // samples
-        projection_T00_comm (&T00); // communicates the ghost cells
-        plan_T00.execute(LATfield2::FFT_FORWARD);
-        
-        projection_T0i_project(&pcls,&T0i,&phi);
-        projection_T0i_comm(&T0i);
-        
-        projection_Tij_project(&pcls,&Tij,a,&phi);
-        projection_Tij_comm(&Tij);
+        // T00, T0i and Tij are sampled in a single sweep over the particles
+        projection_Tmunu_project(&pcls, &T00, &T0i, &Tij, a, &phi);
+        projection_Tmunu_comm(&T00, &T0i, &Tij); // communicates the ghost cells
+        T00_FT_valid = false;
+    }
+    
+    /*
+        Fourier image of the sampled T00; the forward FFT is done on the first
+        call after each sample and only then. Collective.
+    */
+    const complex_field_type& T00_kspace() const
+    {
+        if(not T00_FT_valid)
+        {
+            plan_T00.execute(LATfield2::FFT_FORWARD);
+            T00_FT_valid = true;
+        }
+        return T00_FT;
     }
     
     void compute_phi(
@@ -200,26 +230,27 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
         plan_Sij.execute (LATfield2::FFT_FORWARD);
         Sij_FT.updateHalo ();
         projectFTscalar (Sij_FT,chi_FT);
+        chi_halo.end();
         plan_chi.execute(LATfield2::FFT_BACKWARD);
-        chi.updateHalo();
+        chi_halo.begin(); // completed by the first consumer of the ghosts
     }
     void compute_Bi(double f = 1.0)
     {
         // prepare source S0i from T0i
-        Site x(base_type::lat);
-        for(x.first();x.test();x.next())
-        {
-            for(int i=0;i<3;++i)
-                S0i(x,i) = T0i(x,i);
-        }
+        for_each_site(base_type::lat,[this](const site_type& x)
+            {
+                for(int i=0;i<3;++i)
+                    S0i(x,i) = T0i(x,i);
+            });
         
         plan_S0i.execute(LATfield2::FFT_FORWARD);
         S0i_FT.updateHalo();
         
         projectFTvector (S0i_FT, Bi_FT, f);
         
+        Bi_halo.end();
         plan_Bi.execute(LATfield2::FFT_BACKWARD);
-        Bi.updateHalo();
+        Bi_halo.begin(); // completed by the first consumer of the ghosts
     }
     void compute_potential(
         double fourpiG, 
@@ -325,11 +356,16 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
         // const int N = size();
         // const real_type dx = 1.0 / N;
         
-        site_type xpart(pcls.lattice());
-        for(xpart.first();xpart.test();xpart.next())
+        // the stencils below reach 1 site away, particles in the interior of
+        // the local domain are processed while the ghost cells are exchanged
+        base_type::for_each_site_overlapped(pcls.lattice(),
+            {&chi_halo,&Bi_halo},1,
+            [&](const site_type& xpart)
         {
             for(auto& part : pcls.field()(xpart).parts )
             {
+                if(not base_type::is_active(part))
+                    continue;
                 std::array<real_type,3> pos{part.pos[0],part.pos[1],part.pos[2]};
                 std::array<real_type,3> 
                     gradphi = gradient(phi,xpart,pos), 
@@ -453,7 +489,7 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
                         part.force = force;
                 }
             }
-        }
+        });
     }
    
     std::array<real_type,3> vector_at(
@@ -513,17 +549,14 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
     
     void project_metric(particle_container& pcls) const
     {
-        site_type xpart(pcls.lattice());
-        for(xpart.first();xpart.test();xpart.next())
-        {
-            for(auto& part : pcls.field()(xpart).parts )
+        Bi_halo.end();
+        for_each_particle(pcls,
+            [this](particle_type& part, const site_type& xpart)
             {
                 std::array<real_type,3> pos{part.pos[0],part.pos[1],part.pos[2]};
                 part.Phi = scalar_at(phi,xpart,pos);
                 part.B   = vector_at(Bi ,xpart,pos);
-                
-            }
-        }
+            });
     }
    
     std::array<real_type,3> momentum_to_velocity(
@@ -532,6 +565,8 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
                           const site_type& xpart,
                           const real_type a) const override
     {
+        chi_halo.end();
+        Bi_halo.end();
         const int N = size();
         std::array<real_type,3> velocity{0,0,0};
         real_type xchi{0},xphi{0};
@@ -563,6 +598,8 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
                           const site_type& xpart,
                           const real_type a) const override
     {
+        chi_halo.end();
+        Bi_halo.end();
         const int N = size();
         std::array<real_type,3> momentum{0,0,0};
         real_type xchi{0},xphi{0};
@@ -596,23 +633,36 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
     
     
     virtual ~relativistic_pm(){}
-    std::string report(const particle_container& pcls, double a) const override
+    
+    void complete_halos() const override
+    {
+        chi_halo.end();
+        Bi_halo.end();
+    }
+
+    void diagnose_sources(diagnostics& d) const override
+    {
+        diagnose_msq(d,"RMS(T00)",T00);
+        diagnose_msq(d,"RMS(T0i)",T0i,0);
+        diagnose_msq(d,"RMS(Tij)",Tij,0,0);
+        diagnose_mean(d,"T00hom",T00);
+    }
+    
+    void diagnose_potentials(diagnostics& d) const override
+    {
+        diagnose_msq(d,"RMS(Phi)",phi);
+        diagnose_msq(d,"RMS(Chi)",chi);
+        diagnose_msq(d,"RMS(Bi) ",Bi,0);
+        diagnose_mean(d,"Phihom",phi);
+    }
+    
+    std::string report(const diagnostics& d) const override
     {
         std::stringstream ss;
-        // sources
-        double std_t00 = show_msq(T00);
-        double std_t0i = show_msq(T0i,0);
-        double std_tij = show_msq(Tij,0,0);
-        // potentials
-        double std_phi = show_msq(phi);
-        double std_chi = show_msq(chi);
-        double std_Bi = show_msq(Bi,0);
-        ss << "RMS(T00) = " << std_t00 << '\n';
-        ss << "RMS(T0i) = " << std_t0i << '\n';
-        ss << "RMS(Tij) = " << std_tij << '\n';
-        ss << "RMS(Phi) = " << std_phi << '\n';
-        ss << "RMS(Chi) = " << std_chi << '\n';
-        ss << "RMS(Bi)  = " << std_Bi << '\n';
+        for(const char* name : {"RMS(T00)","RMS(T0i)","RMS(Tij)","RMS(Phi)",
+                "RMS(Chi)","RMS(Bi) "})
+            if(d.contains(name))
+                ss << name << " = " << d[name] << '\n';
         return ss.str();
     }
     double density() const override
@@ -637,23 +687,59 @@ class relativistic_pm : public particle_mesh<complex_type,particle_container>
         chi.saveHDF5 (prefix + "_chi.h5");
         Bi.saveHDF5 (prefix + "_B.h5");
     }
+    // phi and chi enter the sources of the next cycle, Bi is recomputed
+    void save_restart(std::string prefix) const override
+    {
+        phi.saveHDF5 (prefix + "_phi.h5");
+        chi.saveHDF5 (prefix + "_chi.h5");
+        Bi.saveHDF5 (prefix + "_B.h5");
+    }
+    void load_restart(const std::array<std::string,3>& files) override
+    {
+        if(!files[0].empty())
+        {
+            phi.loadHDF5 (files[0]);
+            phi.updateHalo ();
+        }
+        if(!files[1].empty())
+        {
+            chi_halo.end();
+            chi.loadHDF5 (files[1]);
+            chi_halo.begin();
+        }
+    }
+    std::vector<real_field_type*> restart_fields() override
+    {
+        return {&phi,&chi};
+    }
+    std::array<real_field_type*,4> lightcone_fields() override
+    {
+        return {&phi,&chi,&Bi,nullptr};
+    }
+    void save_to_snapshot(h5_snapshot& file) const override
+    {
+        file.write_field("T00",T00);
+        file.write_field("T0i",T0i);
+        file.write_field("Tij",Tij);
+        file.write_field("phi",phi);
+        file.write_field("chi",chi);
+        file.write_field("B",Bi);
+    }
     virtual void save_power_spectrum(std::string fname) const override
     {
-        real_type phi_mean=show_mean(phi),
-                  chi_mean = show_mean(chi),
-                  T00_mean = show_mean(T00);
-        
-        base_type::save_field_power_spectrum(fname,"_phi.txt",phi_FT);
-        base_type::save_field_power_spectrum(fname,"_chi.txt",chi_FT);
-        base_type::save_field_power_spectrum(fname,"_T00.txt",T00_FT,T00_mean);
-        base_type:: template save_field_power_spectrum <3>(fname,"_B0.txt",Bi_FT);
+        base_type::save_power_spectra(fname,
+            {{"_phi.txt",&phi_FT},{"_chi.txt",&chi_FT},
+             {"_T00.txt",&T00_kspace()},{"_B0.txt",&Bi_FT}});
     }
 };
-template<class functor_type, typename complex_type, typename particle_container>
+template<class functor_type, typename complex_type,
+    typename particle_container, typename assignment_type>
 void apply_filter_kspace(
-    relativistic_pm<complex_type,particle_container> &pm,
-    functor_type f)
+    relativistic_pm<complex_type,particle_container,assignment_type> &pm,
+    const functor_type& f)
 {
+    pm.chi_halo.end();
+    pm.Bi_halo.end();
     apply_filter_kspace_scalar(pm.phi,pm.phi_FT,pm.plan_phi,f);
     apply_filter_kspace_scalar(pm.chi,pm.chi_FT,pm.plan_chi,f);
     apply_filter_kspace_vector(pm.Bi,pm.Bi_FT,pm.plan_Bi,f);
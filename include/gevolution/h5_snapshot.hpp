@@ -0,0 +1,447 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "LATfield2.hpp"
+#include "gevolution/halo.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <hdf5.h>
+#include <mpi.h>
+
+/*
+    Snapshot in a single HDF5 file, written collectively with MPI-IO by all
+    the processes. With a serial HDF5 library (H5_HAVE_PARALLEL undefined)
+    the first process creates the file and the processes write their
+    blocks in turn, in the order of their ranks.
+
+    Fields are stored as datasets of shape [N][N][N] (direction 2 first),
+    with a trailing dimension for the components of vector and tensor
+    fields. Their chunks are the local domain of a process, so that each
+    process writes whole chunks. Particles go to a group per species with
+    the datasets ID, pos and vel, each process writing a contiguous range.
+
+    With deflate > 0 the datasets are compressed (shuffle + deflate): in
+    parallel, this needs HDF5 >= 1.10.2 built with parallel filter support.
+
+    The fields can be stored in a reduced form, set by name before the
+    write_field calls (see field_format): coarse-grained, in single
+    precision or with rounded mantissas, which the deflate filter then
+    compresses much better.
+
+        h5_snapshot file(name,com,deflate);
+        file.attribute("a",a);
+        file.write_particles("cdm",pcls);
+        file.write_field("phi",phi);
+        file.write();
+
+    Other tables, such as halo catalogs, are written as rows with group
+    and write_rows.
+*/
+
+namespace gevolution
+{
+
+class h5_snapshot
+{
+    // element types of the datasets
+    enum class element { real32, real64, int64 };
+
+    // a dataset staged for writing, with the local block of this process
+    struct dataset
+    {
+        std::string name; // path in the file
+        element type;
+        int rank;
+        hsize_t dims[4], chunk[4], offset[4], local[4];
+        std::vector<char> data;
+    };
+
+    std::string filename;
+    MPI_Comm com;
+    int deflate;
+    std::vector< std::pair<std::string,double> > attributes;
+    std::vector<std::string> groups;
+    std::vector<dataset> datasets;
+
+    public:
+
+    /*
+        Storage of a field: the average over blocks of downgrade^3 sites
+        (the local domains must be multiples of the blocks), in single
+        precision, and with the mantissas rounded to mantissa_bits
+        significant bits (0: exact), which bounds the relative error by
+        2^-mantissa_bits.
+    */
+    struct field_format
+    {
+        int downgrade = 1;
+        bool single = false;
+        int mantissa_bits = 0;
+    };
+
+    private:
+
+    std::map<std::string,field_format> formats;
+
+    template<class S>
+    static S round_mantissa(S v, int bits)
+    {
+        if(bits <= 0 || bits >= std::numeric_limits<S>::digits
+           || v == 0 || !std::isfinite(v))
+            return v;
+        int e;
+        const S m = std::frexp(v,&e);
+        return std::ldexp(std::round(std::ldexp(m,bits)),e-bits);
+    }
+
+    // the local sites of F in the format fmt, stored as S
+    template<class S, class T>
+    void write_field_as(const std::string& name,
+        const LATfield2::Field<T>& F, const field_format& fmt)
+    {
+        const LATfield2::Lattice& L = F.lattice();
+        const int C = F.components();
+        const int d = std::max(1,fmt.downgrade);
+        const int nx = L.sizeLocal(0)/d, ny = L.sizeLocal(1)/d,
+                  nz = L.sizeLocal(2)/d;
+        const int rank = C > 1 ? 4 : 3;
+        const double norm = 1./((double)d*d*d);
+
+        std::vector<S> buf((long)nx*ny*nz*C);
+        long count = 0;
+        LATfield2::Site x(L);
+        for(int z=0;z<nz;++z)
+        for(int y=0;y<ny;++y)
+        for(int i=0;i<nx;++i)
+        {
+            for(int c=0;c<C;++c)
+            {
+                double sum = 0;
+                for(int dz=0;dz<d;++dz)
+                for(int dy=0;dy<d;++dy)
+                for(int di=0;di<d;++di)
+                {
+                    x.setIndex(local_site_index(L,d*i+di,d*y+dy,d*z+dz));
+                    sum += F(x,c);
+                }
+                buf[count + c] = round_mantissa(
+                    (S)(d > 1 ? sum*norm : sum),fmt.mantissa_bits);
+            }
+            count += C;
+        }
+
+        // chunks are the largest local domain, smaller than 1 GB
+        int block[2] = {nz,ny};
+        MPI_Allreduce(MPI_IN_PLACE,block,2,MPI_INT,MPI_MAX,com);
+        hsize_t chunk[4] = {(hsize_t)block[0],(hsize_t)block[1],
+                            (hsize_t)nx,(hsize_t)C};
+        while(chunk[0] > 1
+              && chunk[0]*chunk[1]*chunk[2]*chunk[3]*sizeof(S) > (1ul<<30))
+            chunk[0] = (chunk[0]+1)/2;
+
+        const hsize_t dims[4] = {(hsize_t)(L.size(2)/d),
+                                 (hsize_t)(L.size(1)/d),
+                                 (hsize_t)(L.size(0)/d),(hsize_t)C};
+        const hsize_t offset[4] = {(hsize_t)(L.coordSkip()[0]/d),
+                                   (hsize_t)(L.coordSkip()[1]/d),0,0};
+        const hsize_t local[4] = {(hsize_t)nz,(hsize_t)ny,(hsize_t)nx,
+                                  (hsize_t)C};
+        stage(name,rank,dims,chunk,offset,local,buf);
+    }
+
+    static void check(herr_t status, const std::string& what)
+    {
+        if(status < 0)
+        {
+            std::cerr << " proc#" << LATfield2::parallel.rank()
+                      << ": error in h5_snapshot, " << what << std::endl;
+            LATfield2::parallel.abortForce();
+        }
+    }
+
+    template<class T>
+    static element element_of()
+    {
+        if constexpr (sizeof(T)==sizeof(float))
+            return element::real32;
+        else
+            return element::real64;
+    }
+
+    static hid_t native_type(element type)
+    {
+        switch(type)
+        {
+            case element::real32: return H5T_NATIVE_FLOAT;
+            case element::real64: return H5T_NATIVE_DOUBLE;
+            default:              return H5T_NATIVE_LLONG;
+        }
+    }
+
+    // property list of a chunked dataset, with the filters if requested
+    hid_t chunked(int rank, const hsize_t* chunk) const
+    {
+        hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+        check(H5Pset_chunk(dcpl,rank,chunk),"chunking");
+        if(deflate > 0)
+        {
+            check(H5Pset_shuffle(dcpl),"shuffle filter");
+            check(H5Pset_deflate(dcpl,deflate),"deflate filter");
+        }
+        return dcpl;
+    }
+
+    template<class T>
+    void stage(const std::string& name, int rank, const hsize_t* dims,
+        const hsize_t* chunk, const hsize_t* offset, const hsize_t* local,
+        const std::vector<T>& buf)
+    {
+        dataset d{name,element_of<T>(),rank,{},{},{},{},{}};
+        if constexpr (std::is_integral_v<T>)
+            d.type = element::int64;
+        std::copy(dims,dims+rank,d.dims);
+        std::copy(chunk,chunk+rank,d.chunk);
+        std::copy(offset,offset+rank,d.offset);
+        std::copy(local,local+rank,d.local);
+        d.data.resize(buf.size()*sizeof(T));
+        std::memcpy(d.data.data(),buf.data(),d.data.size());
+        datasets.push_back(std::move(d));
+    }
+
+    // the attributes, groups and datasets, collective with MPI-IO
+    void create(hid_t file) const
+    {
+        for(const auto& [name,value] : attributes)
+        {
+            hid_t space = H5Screate(H5S_SCALAR);
+            hid_t attr = H5Acreate2(file,name.c_str(),H5T_NATIVE_DOUBLE,
+                space,H5P_DEFAULT,H5P_DEFAULT);
+            check(attr,"creating attribute " + name);
+            check(H5Awrite(attr,H5T_NATIVE_DOUBLE,&value),
+                "writing attribute " + name);
+            H5Aclose(attr);
+            H5Sclose(space);
+        }
+        for(const auto& name : groups)
+        {
+            hid_t group = H5Gcreate2(file,name.c_str(),H5P_DEFAULT,
+                H5P_DEFAULT,H5P_DEFAULT);
+            check(group,"creating group " + name);
+            H5Gclose(group);
+        }
+        for(const auto& d : datasets)
+        {
+            hid_t filespace = H5Screate_simple(d.rank,d.dims,nullptr);
+            // chunks cannot be larger than an empty dataset
+            const bool empty =
+                std::find(d.dims,d.dims+d.rank,hsize_t(0)) != d.dims+d.rank;
+            hid_t dcpl = empty ? H5Pcreate(H5P_DATASET_CREATE)
+                               : chunked(d.rank,d.chunk);
+            hid_t dset = H5Dcreate2(file,d.name.c_str(),native_type(d.type),
+                filespace,H5P_DEFAULT,dcpl,H5P_DEFAULT);
+            check(dset,"creating dataset " + d.name);
+            H5Dclose(dset);
+            H5Pclose(dcpl);
+            H5Sclose(filespace);
+        }
+    }
+
+    /*
+        Write the local block of d at its offset in the global dims, with
+        the transfer properties xfer (collective with MPI-IO).
+    */
+    void write_block(hid_t file, hid_t xfer, const dataset& d) const
+    {
+        const hid_t type = native_type(d.type);
+        hid_t dset = H5Dopen2(file,d.name.c_str(),H5P_DEFAULT);
+        check(dset,"opening dataset " + d.name);
+        hid_t filespace = H5Dget_space(dset);
+
+        hid_t memspace = H5Screate_simple(d.rank,d.local,nullptr);
+        if(!d.data.empty())
+            check(H5Sselect_hyperslab(filespace,H5S_SELECT_SET,d.offset,
+                nullptr,d.local,nullptr),"selecting " + d.name);
+        else
+        {
+            H5Sselect_none(filespace);
+            H5Sselect_none(memspace);
+        }
+        check(H5Dwrite(dset,type,memspace,filespace,xfer,d.data.data()),
+            "writing dataset " + d.name);
+
+        H5Sclose(memspace);
+        H5Sclose(filespace);
+        H5Dclose(dset);
+    }
+
+    public:
+
+    /*
+        The data is staged in memory by attribute, write_field and
+        write_particles, and goes to disk with write. The staging calls
+        are collective over com but make no HDF5 call, so that write can
+        run on another thread (see async_output).
+    */
+    h5_snapshot(const std::string& that_filename, MPI_Comm that_com,
+        int deflate_level = 0):
+        filename{that_filename}, com{that_com},
+        deflate{std::max(0,std::min(9,deflate_level))}
+    {}
+
+    MPI_Comm communicator() const { return com; }
+
+    // bytes staged by this process
+    std::size_t bytes() const
+    {
+        std::size_t total = 0;
+        for(const auto& d : datasets)
+            total += d.data.size();
+        return total;
+    }
+
+    // attribute of the root group, same value on all processes
+    void attribute(const std::string& name, double value)
+    {
+        attributes.emplace_back(name,value);
+    }
+
+    // storage of the fields called name from now on, see field_format
+    void format(const std::string& name, const field_format& fmt)
+    {
+        formats[name] = fmt;
+    }
+
+    // the local sites of F (ghost cells excluded), collective
+    template<class T>
+    void write_field(const std::string& name, const LATfield2::Field<T>& F)
+    {
+        const auto found = formats.find(name);
+        const field_format fmt =
+            found != formats.end() ? found->second : field_format{};
+        if(fmt.single)
+            write_field_as<float>(name,F,fmt);
+        else
+            write_field_as<T>(name,F,fmt);
+    }
+
+    // group of the datasets name/..., same on all processes
+    void group(const std::string& name)
+    {
+        groups.push_back(name);
+    }
+
+    /*
+        Rows of width values (width 1: a one-dimensional dataset), the
+        processes writing contiguous ranges in the order of their ranks.
+        Collective.
+    */
+    template<class T>
+    void write_rows(const std::string& name, const std::vector<T>& buf,
+        int width = 1)
+    {
+        long long n = buf.size()/width, first = 0, total = 0;
+        MPI_Exscan(&n,&first,1,MPI_LONG_LONG,MPI_SUM,com);
+        MPI_Allreduce(&n,&total,1,MPI_LONG_LONG,MPI_SUM,com);
+        int nproc;
+        MPI_Comm_size(com,&nproc);
+        int rank;
+        MPI_Comm_rank(com,&rank);
+        if(rank==0)
+            first = 0;
+
+        // one chunk per process on average
+        const hsize_t rows = std::max<long long>(1,(total+nproc-1)/nproc);
+
+        const hsize_t dims[2] = {(hsize_t)total,(hsize_t)width};
+        const hsize_t chunk[2] = {std::min<hsize_t>(rows,1ul<<24),
+                                  (hsize_t)width};
+        const hsize_t offset[2] = {(hsize_t)first,0};
+        const hsize_t local[2] = {(hsize_t)n,(hsize_t)width};
+        stage(name,width > 1 ? 2 : 1,dims,chunk,offset,local,buf);
+    }
+
+    // ID, position and velocity of all particles in group name, collective
+    template<class particle_container>
+    void write_particles(const std::string& name,
+        const particle_container& pcls)
+    {
+        std::vector<long long> ID;
+        std::vector<double> pos, vel;
+        LATfield2::Site x(pcls.lattice());
+        for(x.first();x.test();x.next())
+            for(const auto& p : pcls.field()(x).parts)
+            {
+                ID.push_back(p.ID);
+                for(int i=0;i<3;++i)
+                {
+                    pos.push_back(p.pos[i]);
+                    vel.push_back(p.vel[i]);
+                }
+            }
+
+        group(name);
+        write_rows(name + "/ID",ID);
+        write_rows(name + "/pos",pos,3);
+        write_rows(name + "/vel",vel,3);
+    }
+
+    /*
+        Write the staged data to the file, collectively over io_com, which
+        has the processes of com in the same order.
+    */
+    void write(MPI_Comm io_com) const
+    {
+#ifdef H5_HAVE_PARALLEL
+        hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+        check(H5Pset_fapl_mpio(fapl,io_com,MPI_INFO_NULL),"MPI-IO driver");
+        hid_t file = H5Fcreate(filename.c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,
+            fapl);
+        H5Pclose(fapl);
+        check(file,"creating " + filename);
+
+        hid_t xfer = H5Pcreate(H5P_DATASET_XFER);
+        check(H5Pset_dxpl_mpio(xfer,H5FD_MPIO_COLLECTIVE),"collective I/O");
+
+        create(file);
+        for(const auto& d : datasets)
+            write_block(file,xfer,d);
+
+        H5Pclose(xfer);
+        H5Fclose(file);
+#else
+        // the processes open the file in turn, passing on a token
+        int rank, nproc, token = 0;
+        MPI_Comm_rank(io_com,&rank);
+        MPI_Comm_size(io_com,&nproc);
+        if(rank > 0)
+            MPI_Recv(&token,1,MPI_INT,rank-1,0,io_com,MPI_STATUS_IGNORE);
+
+        hid_t file = rank==0
+            ? H5Fcreate(filename.c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,
+                H5P_DEFAULT)
+            : H5Fopen(filename.c_str(),H5F_ACC_RDWR,H5P_DEFAULT);
+        check(file,"opening " + filename);
+        if(rank==0)
+            create(file);
+        for(const auto& d : datasets)
+            if(!d.data.empty())
+                write_block(file,H5P_DEFAULT,d);
+        H5Fclose(file);
+
+        if(rank+1 < nproc)
+            MPI_Send(&token,1,MPI_INT,rank+1,0,io_com);
+        MPI_Barrier(io_com);
+#endif
+    }
+    void write() const { write(com); }
+};
+
+} // namespace gevolution
@@ -0,0 +1,451 @@
+#pragma once
+
+#include "LATfield2.hpp"
+#include <initializer_list>
+#include <vector>
+#include <mpi.h>
+#include <boost/mpi/datatype.hpp>
+
+namespace gevolution
+{
+
+/*
+    Raw index of a site given its local coordinates, ghost cells included.
+    Coordinates run from -halo to sizeLocal+halo-1 in each direction.
+*/
+inline long local_site_index(
+    const LATfield2::Lattice& lat, int x, int y, int z)
+{
+    const int h = lat.halo();
+    return (x + h) + (long)lat.sizeLocalGross(0)
+                    * ((y + h) + (long)lat.sizeLocalGross(1) * (z + h));
+}
+
+/*
+    Add the upper ghost layer of a set of fields, living on the same lattice,
+    to the first local layer of the neighbouring domain. This is the
+    communication step that follows a CIC-like projection which deposits on
+    x, x+0, x+1, x+2 and their combinations.
+
+    All fields are packed into one buffer per direction, so that projecting
+    several fields costs the same number of messages as projecting one.
+
+    precondition: the ghost cells that received no deposit are zero.
+*/
+template<typename T>
+void add_upper_halo(std::initializer_list<LATfield2::Field<T>*> fields)
+{
+    if(fields.size()==0)
+        return;
+
+    const LATfield2::Lattice& lat = (*fields.begin())->lattice();
+
+    if (lat.halo () == 0)
+    {
+        std::cout << "add_upper_halo: target field needs halo > 0"
+                  << std::endl;
+        std::exit (-1);
+    }
+
+    const int nx = lat.sizeLocal(0),
+              ny = lat.sizeLocal(1),
+              nz = lat.sizeLocal(2);
+
+    int ncomp = 0;
+    for(auto F : fields)
+        ncomp += F->components();
+
+    LATfield2::Site g(lat), l(lat);
+
+    // direction 0 is never distributed
+    for(int z=0;z<=nz;++z)
+    for(int y=0;y<=ny;++y)
+    {
+        g.setIndex(local_site_index(lat,nx,y,z));
+        l.setIndex(local_site_index(lat,0,y,z));
+        for(auto F : fields)
+        for(int c=0;c<F->components();++c)
+            (*F)(l,c) += (*F)(g,c);
+    }
+
+    std::vector<T> send_buff, recv_buff;
+    MPI_Datatype dtype = ::boost::mpi::get_mpi_datatype<T>();
+
+    // exchange the ghost layer along one distributed direction:
+    // dir is the lattice direction, comm the corresponding processor line
+    auto exchange =
+        [&](int dir, MPI_Comm comm, int rank, int nproc, int nu, int nv)
+    {
+        send_buff.resize((long)nu*nv*ncomp);
+        recv_buff.resize(send_buff.size());
+
+        auto site_at = [&](int u, int v, int w)
+        {
+            return dir==1 ? local_site_index(lat,u,w,v)
+                          : local_site_index(lat,u,v,w);
+        };
+
+        const int n_dir = dir==1 ? ny : nz;
+        long count=0;
+        for(int v=0;v<nv;++v)
+        for(int u=0;u<nu;++u)
+        {
+            g.setIndex(site_at(u,v,n_dir));
+            for(auto F : fields)
+            for(int c=0;c<F->components();++c)
+                send_buff[count++] = (*F)(g,c);
+        }
+
+        MPI_Sendrecv(
+            send_buff.data(), send_buff.size(), dtype, (rank+1)%nproc, 0,
+            recv_buff.data(), recv_buff.size(), dtype, (rank+nproc-1)%nproc, 0,
+            comm, MPI_STATUS_IGNORE);
+
+        count=0;
+        for(int v=0;v<nv;++v)
+        for(int u=0;u<nu;++u)
+        {
+            l.setIndex(site_at(u,v,0));
+            for(auto F : fields)
+            for(int c=0;c<F->components();++c)
+                (*F)(l,c) += recv_buff[count++];
+        }
+    };
+
+    using LATfield2::parallel;
+
+    // direction 1 is distributed over the second dimension of the processor
+    // grid, the upper ghost layer in direction 2 travels along
+    exchange(1,
+        parallel.dim1_comm()[parallel.grid_rank()[0]],
+        parallel.grid_rank()[1], parallel.grid_size()[1],
+        nx, nz+1);
+
+    // direction 2 is distributed over the first dimension of the processor
+    // grid
+    exchange(2,
+        parallel.dim0_comm()[parallel.grid_rank()[1]],
+        parallel.grid_rank()[0], parallel.grid_size()[0],
+        nx, ny);
+}
+
+/*
+    Same as add_upper_halo, but all the ghost layers on both sides are added
+    to the neighbouring domain. This is the communication step that follows a
+    projection reaching below x, as TSC and PCS do.
+
+    precondition: the ghost cells that received no deposit are zero.
+*/
+template<typename T>
+void add_halo(std::initializer_list<LATfield2::Field<T>*> fields)
+{
+    if(fields.size()==0)
+        return;
+
+    const LATfield2::Lattice& lat = (*fields.begin())->lattice();
+    const int h = lat.halo();
+    const int n[3] = {lat.sizeLocal(0),lat.sizeLocal(1),lat.sizeLocal(2)};
+
+    int ncomp = 0;
+    for(auto F : fields)
+        ncomp += F->components();
+
+    LATfield2::Site g(lat), l(lat);
+    auto add = [&](long from, long to)
+    {
+        g.setIndex(from);
+        l.setIndex(to);
+        for(auto F : fields)
+        for(int c=0;c<F->components();++c)
+        {
+            (*F)(l,c) += (*F)(g,c);
+            (*F)(g,c) = 0;
+        }
+    };
+
+    // direction 0 is never distributed, the ghost rows of the other
+    // directions are folded as well, they travel further below
+    for(int z=-h;z<n[2]+h;++z)
+    for(int y=-h;y<n[1]+h;++y)
+    for(int i=0;i<h;++i)
+    {
+        add(local_site_index(lat,n[0]+i,y,z),local_site_index(lat,i,y,z));
+        add(local_site_index(lat,-1-i,y,z),local_site_index(lat,n[0]-1-i,y,z));
+    }
+
+    std::vector<T> send_buff, recv_buff;
+    MPI_Datatype dtype = ::boost::mpi::get_mpi_datatype<T>();
+    using LATfield2::parallel;
+
+    // dir = 1: the ghost layers in direction 2 travel along
+    for(int dir=1;dir<3;++dir)
+    {
+        MPI_Comm comm = dir==1 ? parallel.dim1_comm()[parallel.grid_rank()[0]]
+                               : parallel.dim0_comm()[parallel.grid_rank()[1]];
+        const int rank = parallel.grid_rank()[dir==1 ? 1 : 0],
+                  nproc = parallel.grid_size()[dir==1 ? 1 : 0];
+        const int up = (rank+1)%nproc, down = (rank+nproc-1)%nproc;
+        const int w_lo = dir==1 ? -h : 0, w_hi = dir==1 ? n[2]+h : n[1];
+
+        // site of layer v (in direction dir) at (u,w) in the other directions
+        auto site_at = [&](int u, int v, int w)
+        {
+            return dir==1 ? local_site_index(lat,u,v,w)
+                          : local_site_index(lat,u,w,v);
+        };
+
+        for(int way=0;way<2;++way)
+        {
+            // way 0: upper ghosts go up, way 1: lower ghosts go down
+            const int ghost0 = way==0 ? n[dir] : -h,
+                      local0 = way==0 ? 0 : n[dir]-h;
+
+            send_buff.resize((long)n[0]*h*(w_hi-w_lo)*ncomp);
+            recv_buff.resize(send_buff.size());
+            long count=0;
+            for(int w=w_lo;w<w_hi;++w)
+            for(int v=0;v<h;++v)
+            for(int u=0;u<n[0];++u)
+            {
+                g.setIndex(site_at(u,ghost0+v,w));
+                for(auto F : fields)
+                for(int c=0;c<F->components();++c)
+                {
+                    send_buff[count++] = (*F)(g,c);
+                    (*F)(g,c) = 0;
+                }
+            }
+
+            MPI_Sendrecv(
+                send_buff.data(), send_buff.size(), dtype,
+                way==0 ? up : down, way,
+                recv_buff.data(), recv_buff.size(), dtype,
+                way==0 ? down : up, way,
+                comm, MPI_STATUS_IGNORE);
+
+            count=0;
+            for(int w=w_lo;w<w_hi;++w)
+            for(int v=0;v<h;++v)
+            for(int u=0;u<n[0];++u)
+            {
+                l.setIndex(site_at(u,local0+v,w));
+                for(auto F : fields)
+                for(int c=0;c<F->components();++c)
+                    (*F)(l,c) += recv_buff[count++];
+            }
+        }
+    }
+}
+
+/*
+    Split-phase update of the ghost cells of a field, equivalent to
+    Field::updateHalo once end() has returned:
+    
+        halo_exchange<Real> h(phi);
+        h.begin();
+        // ... work that only reads local sites of phi ...
+        h.end();
+        // ... work that reads the ghost cells of phi ...
+    
+    begin() fills the ghost cells in the (local) direction 0 and posts
+    non-blocking messages for the faces in directions 1 and 2. end() waits for
+    them and completes the edges shared by directions 1 and 2 with a small
+    extra message. end() does nothing if no exchange is pending, so it can be
+    called by every consumer of the ghost cells.
+    
+    The field must not be written between begin() and end().
+*/
+template<typename T>
+class halo_exchange
+{
+    LATfield2::Field<T>* F;
+    
+    // a box of sites in local coordinates, [lo,hi) in every direction
+    struct box
+    {
+        int lo[3], hi[3];
+        long size() const
+        {
+            return (long)(hi[0]-lo[0])*(hi[1]-lo[1])*(hi[2]-lo[2]);
+        }
+    };
+    
+    // face buffers: [direction-1][0 = going down, 1 = going up]
+    std::vector<T> send_buff[2][2], recv_buff[2][2];
+    box send_box[2][2], recv_box[2][2];
+    MPI_Request requests[8];
+    bool is_pending{false};
+    
+    template<class op_type>
+    void for_each_in(const box& b, op_type op) const
+    {
+        const LATfield2::Lattice& lat = F->lattice();
+        LATfield2::Site s(lat);
+        for(int z=b.lo[2];z<b.hi[2];++z)
+        for(int y=b.lo[1];y<b.hi[1];++y)
+        for(int x=b.lo[0];x<b.hi[0];++x)
+        {
+            s.setIndex(local_site_index(lat,x,y,z));
+            for(int c=0;c<F->components();++c)
+                op(s,c);
+        }
+    }
+    void pack(std::vector<T>& buff, const box& b) const
+    {
+        buff.resize(b.size()*F->components());
+        long count=0;
+        for_each_in(b,[&](const LATfield2::Site& s, int c)
+            { buff[count++] = (*F)(s,c); });
+    }
+    void unpack(const std::vector<T>& buff, const box& b)
+    {
+        long count=0;
+        for_each_in(b,[&](const LATfield2::Site& s, int c)
+            { (*F)(s,c) = buff[count++]; });
+    }
+    
+    // processor line along lattice direction dir = 1, 2
+    static MPI_Comm line_comm(int dir)
+    {
+        using LATfield2::parallel;
+        return dir==1 ? parallel.dim1_comm()[parallel.grid_rank()[0]]
+                      : parallel.dim0_comm()[parallel.grid_rank()[1]];
+    }
+    static int line_rank(int dir)
+    {
+        return LATfield2::parallel.grid_rank()[dir==1 ? 1 : 0];
+    }
+    static int line_size(int dir)
+    {
+        return LATfield2::parallel.grid_size()[dir==1 ? 1 : 0];
+    }
+    
+    public:
+    
+    explicit halo_exchange(LATfield2::Field<T>& field): F{&field} {}
+    halo_exchange(const halo_exchange&) = delete;
+    halo_exchange& operator = (const halo_exchange&) = delete;
+    ~halo_exchange() { end(); }
+    
+    bool pending() const { return is_pending; }
+    
+    void begin()
+    {
+        end();
+        
+        const LATfield2::Lattice& lat = F->lattice();
+        const int h = lat.halo();
+        const int n[3] = {lat.sizeLocal(0),lat.sizeLocal(1),lat.sizeLocal(2)};
+        
+        // direction 0 is local
+        unpack_periodic_x(h,n);
+        
+        MPI_Datatype dtype = ::boost::mpi::get_mpi_datatype<T>();
+        int r=0;
+        for(int dir=1;dir<3;++dir)
+        {
+            const int d = dir-1;
+            const int rank = line_rank(dir), nproc = line_size(dir);
+            const int up = (rank+1)%nproc, down = (rank+nproc-1)%nproc;
+            
+            box b{{-h,0,0},{n[0]+h,n[1],n[2]}};
+            
+            // going down: first local layers to the lower ghost cells
+            send_box[d][0] = b;
+            send_box[d][0].hi[dir] = h;
+            recv_box[d][0] = b;
+            recv_box[d][0].lo[dir] = n[dir];
+            recv_box[d][0].hi[dir] = n[dir]+h;
+            
+            // going up: last local layers to the upper ghost cells
+            send_box[d][1] = b;
+            send_box[d][1].lo[dir] = n[dir]-h;
+            recv_box[d][1] = b;
+            recv_box[d][1].lo[dir] = -h;
+            recv_box[d][1].hi[dir] = 0;
+            
+            for(int way=0;way<2;++way)
+            {
+                pack(send_buff[d][way],send_box[d][way]);
+                recv_buff[d][way].resize(send_buff[d][way].size());
+                
+                // what goes down is received from above and vice versa
+                MPI_Irecv(recv_buff[d][way].data(),recv_buff[d][way].size(),
+                    dtype, way==0 ? up : down, way, line_comm(dir),
+                    &requests[r++]);
+                MPI_Isend(send_buff[d][way].data(),send_buff[d][way].size(),
+                    dtype, way==0 ? down : up, way, line_comm(dir),
+                    &requests[r++]);
+            }
+        }
+        is_pending = true;
+    }
+    
+    void end()
+    {
+        if(not is_pending)
+            return;
+        is_pending = false;
+        
+        MPI_Waitall(8,requests,MPI_STATUSES_IGNORE);
+        for(int d=0;d<2;++d)
+        for(int way=0;way<2;++way)
+            unpack(recv_buff[d][way],recv_box[d][way]);
+        
+        // edges: the ghost cells of direction 1 travel along direction 2
+        const LATfield2::Lattice& lat = F->lattice();
+        const int h = lat.halo();
+        const int n[3] = {lat.sizeLocal(0),lat.sizeLocal(1),lat.sizeLocal(2)};
+        const int dir = 2;
+        const int rank = line_rank(dir), nproc = line_size(dir);
+        const int up = (rank+1)%nproc, down = (rank+nproc-1)%nproc;
+        MPI_Datatype dtype = ::boost::mpi::get_mpi_datatype<T>();
+        
+        for(int way=0;way<2;++way)
+        for(int side=0;side<2;++side)
+        {
+            box s{{-h,side==0 ? -h : n[1],0},{n[0]+h,side==0 ? 0 : n[1]+h,0}};
+            box t = s;
+            s.lo[2] = way==0 ? 0 : n[2]-h;
+            s.hi[2] = s.lo[2] + h;
+            t.lo[2] = way==0 ? n[2] : -h;
+            t.hi[2] = t.lo[2] + h;
+            
+            pack(send_buff[1][way],s);
+            recv_buff[1][way].resize(send_buff[1][way].size());
+            MPI_Sendrecv(
+                send_buff[1][way].data(), send_buff[1][way].size(), dtype,
+                way==0 ? down : up, way,
+                recv_buff[1][way].data(), recv_buff[1][way].size(), dtype,
+                way==0 ? up : down, way,
+                line_comm(dir), MPI_STATUS_IGNORE);
+            unpack(recv_buff[1][way],t);
+        }
+    }
+    
+    private:
+    
+    void unpack_periodic_x(int h, const int n[3])
+    {
+        const LATfield2::Lattice& lat = F->lattice();
+        LATfield2::Site g(lat), l(lat);
+        for(int z=0;z<n[2];++z)
+        for(int y=0;y<n[1];++y)
+        for(int x=0;x<h;++x)
+        {
+            // lower ghost cells
+            g.setIndex(local_site_index(lat,x-h,y,z));
+            l.setIndex(local_site_index(lat,x-h+n[0],y,z));
+            for(int c=0;c<F->components();++c)
+                (*F)(g,c) = (*F)(l,c);
+            
+            // upper ghost cells
+            g.setIndex(local_site_index(lat,n[0]+x,y,z));
+            l.setIndex(local_site_index(lat,x,y,z));
+            for(int c=0;c<F->components();++c)
+                (*F)(g,c) = (*F)(l,c);
+        }
+    }
+};
+
+} // namespace gevolution
@@ -19,6 +19,8 @@
 #include "gevolution/real_type.hpp"
 #include "gevolution/metadata.hpp"
 #include "gevolution/Particles_gevolution.hpp"
+#include <functional>
+#include <string>
 
 namespace gevolution
 {
@@ -66,13 +68,14 @@ void writeRestartSettings (metadata &sim, icsettings &ic, cosmology &cosmo,
 //   pcls_cdm       pointer to particle handler for CDM
 //   pcls_b         pointer to particle handler for baryons
 //   pcls_ncdm      array of particle handlers for non-cold DM
-//   phi            reference to field containing first Bardeen potential
-//   chi            reference to field containing difference of Bardeen
-//   potentials Bi             reference to vector field containing
-//   frame-dragging potential a              scale factor tau conformal
-//   coordinate time dtau           time step cycle          current main
-//   control loop cycle count restartcount   restart counter aka number of
-//   hibernation point (default -1)
+//   save_fields    writes the fields of the particle_mesh engine, called
+//                  collectively with the file base of the hibernation point
+//   a              scale factor
+//   tau            conformal coordinate time
+//   dtau           time step
+//   cycle          current main control loop cycle count
+//   restartcount   restart counter aka number of hibernation point (default
+//   -1)
 //                  if < 0 no number is associated to the hibernation point
 //
 // Returns:
@@ -84,8 +87,8 @@ void hibernate (
     Particles_gevolution *pcls_cdm,
     Particles_gevolution *pcls_b,
     Particles_gevolution *pcls_ncdm,
-    Field<Real> &phi, Field<Real> &chi, Field<Real> &Bi, const double a,
-    const double tau, const double dtau, const int cycle,
+    const std::function<void (const std::string &)> &save_fields,
+    const double a, const double tau, const double dtau, const int cycle,
     const int restartcount = -1);
 }
 #endif
@@ -180,6 +180,24 @@ void loadTransferFunctions (const char *filename, gsl_spline *&tk_delta,
 void generateCICKernel (Field<Real> &ker, const long numpcl = 0,
                         float *pcldata = nullptr, const int numtile = 1);
 
+//////////////////////////
+// generateCICKernelFT
+//////////////////////////
+// Description:
+//   sets the Fourier image of the standard convolution kernel of
+//   generateCICKernel (a lattice Laplacian), which is known analytically,
+//   without a Fourier transform
+//
+// Arguments:
+//   kerFT      reference to allocated field that will contain the Fourier
+//              image of the kernel
+//
+// Returns:
+//
+//////////////////////////
+
+void generateCICKernelFT (Field<Cplx> &kerFT);
+
 #ifdef FFT3D
 
 //////////////////////////
@@ -668,20 +686,26 @@ double applyMomentumDistribution (
 //   maxvel         array that will contain the maximum q/m/a (max. velocity)
 //   phi            pointer to allocated field
 //   chi            pointer to allocated field
-//   Bi             pointer to allocated field
+//   Bi             pointer to allocated field (can be NULL)
 //   source         pointer to allocated field
-//   Sij            pointer to allocated field
+//   Sij            pointer to allocated field (can be NULL)
 //   scalarFT       pointer to allocated field
-//   BiFT           pointer to allocated field
-//   SijFT          pointer to allocated field
+//   BiFT           pointer to allocated field (can be NULL)
+//   SijFT          pointer to allocated field (can be NULL)
 //   plan_phi       pointer to FFT planner
 //   plan_chi       pointer to FFT planner
-//   plan_Bi        pointer to FFT planner
+//   plan_Bi        pointer to FFT planner (can be NULL)
 //   plan_source    pointer to FFT planner
-//   plan_Sij       pointer to FFT planner
+//   plan_Sij       pointer to FFT planner (can be NULL)
 //   params         pointer to array of precision settings for CLASS (can be
 //   NULL) numparam       number of precision settings for CLASS (can be 0)
 //
+// Note:
+//   If Bi, Sij and their partners are NULL, B and chi are not computed at
+//   the end (chi then does not contain the metric): this saves
+//   twelve field components and four Fourier transforms when the caller
+//   does not keep the metric of the initial conditions.
+//
 // Returns:
 //
 //////////////////////////
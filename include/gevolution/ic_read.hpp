@@ -87,6 +87,6 @@ void readIC (
     Field<Cplx> *BiFT, Field<Cplx> *SijFT, PlanFFT<Cplx> *plan_phi,
     PlanFFT<Cplx> *plan_chi, PlanFFT<Cplx> *plan_Bi, PlanFFT<Cplx> *plan_source,
     PlanFFT<Cplx> *plan_Sij, int &cycle, int &snapcount, int &pkcount,
-    int &restartcount, std::set<long> *IDbacklog);
+    int &restartcount, id_backlog *IDbacklog);
 }
 #endif
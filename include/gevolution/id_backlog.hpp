@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+/*
+    Set of particle IDs, for the lightcone backlog: the IDs of the
+    particles already written on a lightcone, which must not be written
+    again by the next cycles.
+
+    The IDs are kept as a sorted vector, that is 8 bytes per ID, against
+    ~40 for a std::set, and looked up by binary search. The insertions are
+    appended and take effect at the next commit(), which sorts the vector
+    and removes the duplicates:
+
+        id_backlog b;
+        b.insert(ID); ...
+        b.commit();
+        if(b.contains(ID)) ...
+
+    contains() must not be called between an insert() and the commit().
+*/
+
+namespace gevolution
+{
+
+class id_backlog
+{
+    std::vector<long> ids;
+
+    public:
+
+    void insert(long ID) { ids.push_back(ID); }
+
+    template<class iterator_type>
+    void insert(iterator_type first, iterator_type last)
+    {
+        ids.insert(ids.end(),first,last);
+    }
+
+    void commit()
+    {
+        std::sort(ids.begin(),ids.end());
+        ids.erase(std::unique(ids.begin(),ids.end()),ids.end());
+    }
+
+    bool contains(long ID) const
+    {
+        return std::binary_search(ids.begin(),ids.end(),ID);
+    }
+
+    long size() const { return ids.size(); }
+    const long* data() const { return ids.data(); }
+    void clear() { ids.clear(); }
+    void swap(id_backlog& other) { ids.swap(other.ids); }
+};
+
+} // namespace gevolution
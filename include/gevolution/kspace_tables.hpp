@@ -0,0 +1,122 @@
+#pragma once
+
+#include "LATfield2.hpp"
+#include "gevolution/real_type.hpp"
+#include "gevolution/threading.hpp"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <vector>
+
+/*
+    Tabulated k-space factors of the spectral loops (Poisson solvers,
+    projections, filters, deconvolution of the power spectra).
+
+    kspace_axes holds the separable factors of one direction of a lattice
+    of N sites, indexed by the Fourier coordinate n. The tables of each N
+    are computed once and cached:
+
+        const kspace_axes& t = kspace_axes::of(N);
+        k2 = t.grid_k2[k.coord(0)] + t.grid_k2[k.coord(1)] + ...
+
+    kspace_table holds one factor per site of a Fourier lattice, for the
+    kernels that do not separate (e.g. a filter). It is filled from a
+    functor of the integer wave vector once, and then applied as a plain
+    multiplication:
+
+        kspace_table W(latFT,[](int k0, int k1, int k2){ ... });
+        W.multiply(phi_FT);
+
+    of() must not be called from inside a parallel region.
+*/
+
+namespace gevolution
+{
+
+struct kspace_axes
+{
+    int N;
+    std::vector<Real> grid_k2;   // (2 N sin(pi n/N))^2, lattice Laplacian
+    std::vector<Cplx> kshift;    // 2 N sin(pi n/N) e^(-i pi n/N)
+    std::vector<Real> central_k; // N sin(2 pi n/N), centred difference
+    std::vector<Real> central_k2;
+    std::vector<Real> linear_k2; // (2 pi n)^2, n the signed mode
+    std::vector<Real> sinc;      // sin(pi n/N)/(pi n/N), n the signed mode
+
+    explicit kspace_axes(int that_N): N{that_N}
+    {
+        grid_k2.reserve(N);
+        kshift.reserve(N);
+        central_k.reserve(N);
+        central_k2.reserve(N);
+        linear_k2.reserve(N);
+        sinc.reserve(N);
+        for(int n=0;n<N;++n)
+        {
+            const double x = M_PI*n/N;
+            const double g = 2.*N*std::sin(x);
+            grid_k2.push_back(g*g);
+            kshift.push_back(Cplx(g*std::cos(x),-g*std::sin(x)));
+            const double c = N*std::sin(2.*x);
+            central_k.push_back(c);
+            central_k2.push_back(c*c);
+
+            const int m = std::min(n,N-n);
+            const double y = M_PI*m/N;
+            linear_k2.push_back(4.*M_PI*M_PI*m*m);
+            sinc.push_back(m==0 ? 1. : std::sin(y)/y);
+        }
+    }
+
+    static const kspace_axes& of(int N)
+    {
+        static std::map<int,std::unique_ptr<kspace_axes>> cache;
+        auto& t = cache[N];
+        if(not t)
+            t.reset(new kspace_axes(N));
+        return *t;
+    }
+};
+
+class kspace_table
+{
+    const LATfield2::Lattice* lat;
+    std::vector<Real> values; // by site index of lat
+
+    public:
+
+    template<class function_type>
+    kspace_table(const LATfield2::Lattice& latFT, function_type f):
+        lat{&latFT}, values(latFT.sitesLocalGross(),0.)
+    {
+        for_each_site<LATfield2::rKSite>(latFT,
+            [&](const LATfield2::rKSite& k)
+            {
+                values[k.index()] = f(k.coord(0),k.coord(1),k.coord(2));
+            });
+    }
+
+    const LATfield2::Lattice& lattice() const { return *lat; }
+
+    Real operator () (const LATfield2::rKSite& k) const
+    {
+        return values[k.index()];
+    }
+
+    // F *= factor * table, every component
+    template<class complex_field_type>
+    void multiply(complex_field_type& F, double factor = 1) const
+    {
+        const int C = F.components();
+        for_each_site<LATfield2::rKSite>(*lat,
+            [&](const LATfield2::rKSite& k)
+            {
+                const Real w = factor*values[k.index()];
+                for(int c=0;c<C;++c)
+                    F(k,c) *= w;
+            });
+    }
+};
+
+} // namespace gevolution
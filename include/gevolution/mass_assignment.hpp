@@ -0,0 +1,283 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "LATfield2.hpp"
+#include "gevolution/halo.hpp"
+#include "gevolution/threading.hpp"
+#include <array>
+#include <cmath>
+
+/*
+    Mass assignment schemes of the particle_mesh engines.
+
+    A scheme gives the one dimensional shape W(r) of a particle, r being the
+    distance between the particle and a grid point in units of the lattice
+    spacing, and its derivative. A particle in the cell x reaches the grid
+    points x+lo ... x+hi in every direction. In Fourier space the scheme
+    multiplies the field by sinc(pi k/N)^order in every direction.
+
+    The same scheme is used to sample the sources and to interpolate the
+    forces, so that the force of a particle on itself vanishes.
+*/
+
+namespace gevolution
+{
+namespace assignment
+{
+
+// cloud in cell, the default of gevolution
+struct cic
+{
+    static constexpr int lo = 0, hi = 1, order = 2;
+
+    template<class T>
+    static T shape(T r)
+    {
+        using std::abs;
+        r = abs(r);
+        return r<1 ? 1-r : 0;
+    }
+    template<class T>
+    static T derivative(T r)
+    {
+        if(r<-1 or r>=1)
+            return 0;
+        return r<0 ? 1 : -1;
+    }
+};
+
+// triangular shaped cloud
+struct tsc
+{
+    static constexpr int lo = -1, hi = 2, order = 3;
+
+    template<class T>
+    static T shape(T r)
+    {
+        using std::abs;
+        r = abs(r);
+        if(r<0.5)
+            return 0.75-r*r;
+        if(r<1.5)
+            return 0.5*(1.5-r)*(1.5-r);
+        return 0;
+    }
+    template<class T>
+    static T derivative(T r)
+    {
+        using std::abs;
+        const T s = r<0 ? -1 : 1;
+        r = abs(r);
+        if(r<0.5)
+            return -2*s*r;
+        if(r<1.5)
+            return -s*(1.5-r);
+        return 0;
+    }
+};
+
+// piecewise cubic spline
+struct pcs
+{
+    static constexpr int lo = -1, hi = 2, order = 4;
+
+    template<class T>
+    static T shape(T r)
+    {
+        using std::abs;
+        r = abs(r);
+        if(r<1)
+            return (4-6*r*r+3*r*r*r)/6;
+        if(r<2)
+            return (2-r)*(2-r)*(2-r)/6;
+        return 0;
+    }
+    template<class T>
+    static T derivative(T r)
+    {
+        using std::abs;
+        const T s = r<0 ? -1 : 1;
+        r = abs(r);
+        if(r<1)
+            return s*(-2*r+1.5*r*r);
+        if(r<2)
+            return -s*0.5*(2-r)*(2-r);
+        return 0;
+    }
+};
+
+// number of grid points reached in each direction
+template<class scheme>
+constexpr int width() { return scheme::hi - scheme::lo + 1; }
+
+// distance, in sites, of the farthest grid point reached from the cell
+template<class scheme>
+constexpr int reach() { return -scheme::lo > scheme::hi ? -scheme::lo : scheme::hi; }
+
+/*
+    Weights (and their derivatives) of the grid points x+lo ... x+hi in one
+    direction, u being the position of the particle in the cell x,
+    0 <= u < 1.
+*/
+template<class scheme, class T>
+void weights(T u, T w[width<scheme>()])
+{
+    for(int o=scheme::lo;o<=scheme::hi;++o)
+        w[o-scheme::lo] = scheme::shape(u-o);
+}
+template<class scheme, class T>
+void derivatives(T u, T dw[width<scheme>()])
+{
+    for(int o=scheme::lo;o<=scheme::hi;++o)
+        dw[o-scheme::lo] = scheme::derivative(u-o);
+}
+
+/*
+    Value of component c of F at the position u (in units of the lattice
+    spacing, relative to the site x) of a particle in cell x.
+    precondition: F has valid ghost cells
+*/
+template<class scheme, class T>
+T interpolate(
+    const LATfield2::Field<T>& F, const LATfield2::Site& x,
+    const std::array<T,3>& u, int c = 0)
+{
+    constexpr int n = width<scheme>();
+    T w[3][n];
+    for(int i=0;i<3;++i)
+        weights<scheme>(u[i],w[i]);
+
+    LATfield2::Site y(F.lattice());
+    T value = 0;
+    for(int a=0;a<n;++a)
+    for(int b=0;b<n;++b)
+    for(int d=0;d<n;++d)
+    {
+        const T wabd = w[0][a]*w[1][b]*w[2][d];
+        if(wabd==0)
+            continue;
+        y.setIndex(local_site_index(F.lattice(),
+            x.coord(0)+scheme::lo+a,
+            x.coord(1)-F.lattice().coordSkip()[1]+scheme::lo+b,
+            x.coord(2)-F.lattice().coordSkip()[0]+scheme::lo+d));
+        value += wabd*F(y,c);
+    }
+    return value;
+}
+
+/*
+    Gradient of the interpolated field, in units of 1/lattice spacing.
+    precondition: F has valid ghost cells
+*/
+template<class scheme, class T>
+std::array<T,3> gradient(
+    const LATfield2::Field<T>& F, const LATfield2::Site& x,
+    const std::array<T,3>& u)
+{
+    constexpr int n = width<scheme>();
+    T w[3][n], dw[3][n];
+    for(int i=0;i<3;++i)
+    {
+        weights<scheme>(u[i],w[i]);
+        derivatives<scheme>(u[i],dw[i]);
+    }
+
+    // the derivative of W(u-o) with respect to the particle position u
+    LATfield2::Site y(F.lattice());
+    std::array<T,3> grad{0,0,0};
+    for(int a=0;a<n;++a)
+    for(int b=0;b<n;++b)
+    for(int d=0;d<n;++d)
+    {
+        y.setIndex(local_site_index(F.lattice(),
+            x.coord(0)+scheme::lo+a,
+            x.coord(1)-F.lattice().coordSkip()[1]+scheme::lo+b,
+            x.coord(2)-F.lattice().coordSkip()[0]+scheme::lo+d));
+        const T f = F(y);
+        grad[0] += dw[0][a]*w[1][b]*w[2][d]*f;
+        grad[1] += w[0][a]*dw[1][b]*w[2][d]*f;
+        grad[2] += w[0][a]*w[1][b]*dw[2][d]*f;
+    }
+    return grad;
+}
+
+/*
+    Deposit the particle masses, as a density, on rho with the scheme; the
+    species mass comes from the particle info as for the LATfield2 CIC
+    projection. The ghost cells are folded back with add_halo.
+
+    shift moves all particles by that many lattice spacings in every
+    direction, -1/2 <= shift <= 0; -1/2 gives the second grid of interlacing.
+
+    precondition: rho and its ghost cells are zero where nothing has been
+    deposited yet
+*/
+template<class scheme, class particle_container, class T>
+void project_density(
+    const particle_container& pcls, LATfield2::Field<T>& rho,
+    double shift = 0)
+{
+    constexpr int n = width<scheme>();
+    const double dx = pcls.res();
+    const T m = pcls.parts_info()->mass/(dx*dx*dx);
+    const LATfield2::Lattice& L = rho.lattice();
+
+    // the deposits of one plane reach n planes, one more when shifted
+    for_each_site_colored(pcls.lattice(),[&](const LATfield2::Site& xPart)
+        {
+            LATfield2::Site y(L);
+            const int c0[3] = {xPart.coord(0)+scheme::lo,
+                               xPart.coord(1)-L.coordSkip()[1]+scheme::lo,
+                               xPart.coord(2)-L.coordSkip()[0]+scheme::lo};
+            for(const auto& p : pcls.field()(xPart).parts)
+            {
+                T w[3][n];
+                int x0[3];
+                for(int i=0;i<3;++i)
+                {
+                    const double u = p.pos[i]/dx - xPart.coord(i) + shift;
+                    const int cell = std::floor(u);
+                    x0[i] = c0[i] + cell;
+                    weights<scheme>(T(u-cell),w[i]);
+                }
+
+                for(int a=0;a<n;++a)
+                for(int b=0;b<n;++b)
+                for(int d=0;d<n;++d)
+                {
+                    y.setIndex(local_site_index(L,x0[0]+a,x0[1]+b,x0[2]+d));
+                    rho(y) += m*w[0][a]*w[1][b]*w[2][d];
+                }
+            }
+        },shift==0 ? n : n+1);
+
+    add_halo<T>({&rho});
+}
+
+/*
+    Interlacing: combine in place the Fourier images of the densities sampled
+    on the grid (F) and with the particles shifted by -1/2 lattice spacing
+    (F_shifted). The shifted image is brought back by a phase, after which
+    the leading aliases of the two images have opposite signs and cancel in
+    the mean.
+*/
+template<class complex_type>
+void interlace(
+    LATfield2::Field<complex_type>& F,
+    const LATfield2::Field<complex_type>& F_shifted,
+    int N)
+{
+    for_each_site<LATfield2::rKSite>(F.lattice(),
+        [&](const LATfield2::rKSite& k)
+        {
+            int ksum = 0;
+            for(int i=0;i<3;++i)
+                ksum += k.coord(i) > N/2 ? k.coord(i)-N : k.coord(i);
+            const double arg = -M_PI*ksum/N;
+            F(k) = (F(k) + F_shifted(k)*complex_type(std::cos(arg),std::sin(arg)))
+                   * 0.5;
+        });
+}
+
+} // namespace assignment
+} // namespace gevolution
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "gevolution/metadata.hpp"
+#include "gevolution/Particles_gevolution.hpp"
+#include "gevolution/real_type.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+    Memory of a run predicted from the settings, for the dry run of
+    gevolution -d, which sizes a job without running it.
+
+    predict_memory counts the memory of a process for the largest local
+    domain and the particles spread uniformly over the processes, in the
+    two stages of a run: the generation of the initial conditions, whose
+    fields are freed before the evolution, and the evolution.
+
+        const memory_estimate e = predict_memory(sim,ic,numpcl,species,n,m);
+        COUT << e.report();
+
+    Clustering makes the particles of the processes holding the halos
+    exceed the uniform share late in a run, see particle_load.
+*/
+
+namespace gevolution
+{
+
+struct memory_estimate
+{
+    struct item
+    {
+        std::string name;
+        double bytes;      // per process
+        bool initial;      // held while the initial conditions are generated
+        bool evolution;    // held during the evolution
+    };
+    std::vector<item> items;
+
+    double total(bool evolution) const
+    {
+        double t = 0;
+        for(const auto& i : items)
+            if(evolution ? i.evolution : i.initial)
+                t += i.bytes;
+        return t;
+    }
+
+    std::string report() const
+    {
+        const double MB = 1048576.;
+        std::ostringstream o;
+        o << std::fixed << std::setprecision(1);
+        for(const auto& i : items)
+            o << "   " << std::left << std::setw(40) << i.name << std::right
+              << std::setw(12) << i.bytes/MB << " MB"
+              << (i.initial ? (i.evolution ? "" : "  (initial conditions)")
+                            : "") << "\n";
+        o << "   " << std::left << std::setw(40)
+          << "total, initial conditions" << std::right << std::setw(12)
+          << total(false)/MB << " MB\n"
+          << "   " << std::left << std::setw(40) << "total, evolution"
+          << std::right << std::setw(12) << total(true)/MB << " MB\n";
+        return o.str();
+    }
+};
+
+/*
+    Memory of a process of an n x m processor grid, numpcl[i] particles of
+    each of the numspecies species. The fields and particles are counted
+    exactly up to the rounding of the domains and the allocator overhead;
+    the FFT buffers of LATfield2 and the temporaries of the generators are
+    estimates, the lightcones are not counted. The buffers of the forces
+    and of the snapshots are added to the total as if they were held at
+    the same time, which makes it an upper bound.
+*/
+inline memory_estimate predict_memory(const metadata& sim,
+    const icsettings& ic, const long* numpcl, int numspecies, int n, int m)
+{
+    const long N = sim.numpts, h = 2;
+    auto ceil_div = [](long a, long b) { return (a + b - 1)/b; };
+    const double sites = (double)(N + 2*h)*(ceil_div(N,m) + 2*h)
+                       * (ceil_div(N,n) + 2*h);
+    const double sitesFT = (double)(N/2 + 1)*ceil_div(N,n)*ceil_div(N,m);
+    const double real_field = sites*sizeof(Real),
+                 complex_field = sitesFT*sizeof(Cplx);
+    const double nproc = (double)n*m;
+
+    memory_estimate e;
+    auto add = [&e](const std::string& name, double bytes, bool initial,
+        bool evolution)
+    {
+        if(bytes > 0)
+            e.items.push_back({name,bytes,initial,evolution});
+    };
+
+    // the particles, list nodes of Particles_gevolution in the cells of
+    // each species
+    double local_pcls = 0;
+    for(int i=0;i<numspecies;++i)
+        local_pcls += numpcl[i]/nproc;
+    const double cdm = numpcl[0]/nproc;
+    add("particles",local_pcls*(sizeof(particle) + 2*sizeof(void*) + 16)
+        + numspecies*sites*(sizeof(std::list<particle>) + sizeof(long)),
+        true,true);
+#ifdef PARTICLES_SOA
+    // the columns, first and the buffers of sort_by_cell
+    add("particles_soa copy",cdm*(sizeof(particle) + 2*sizeof(long))
+        + 2*sites*sizeof(long),false,true);
+    // the box of the force field and the buffers of its exchange
+    if(sim.balance_interval > 0 && sim.gr_flag != gravity_theory::GR)
+        add("particle balance boxes",9.*N*(ceil_div(N,m) + 1)
+            *(ceil_div(N,n) + 1)*sizeof(Real),false,true);
+#endif
+
+    // the fields of main for the generator
+    const bool basic = ic.generator == ICGEN_BASIC;
+    add("initial condition fields",(basic ? 3 : 12)*real_field
+        + (basic ? 1 : 10)*complex_field,true,false);
+
+    if(sim.gr_flag == gravity_theory::GR)
+    {
+        // phi chi Bi T00 T0i Tij S00 S0i Sij, their images in Fourier space
+        add("relativistic_pm fields",25*real_field,false,true);
+        add("relativistic_pm Fourier fields",16*complex_field,false,true);
+    }
+    else
+    {
+        const int grids = sim.interlacing_flag ? 2 : 1;
+        // rho and phi, the force field of the scratch pool
+        add("newtonian_pm fields",(1 + grids + 3)*real_field,false,true);
+        add("newtonian_pm Fourier fields",(1 + grids)*complex_field,false,
+            true);
+        if(sim.short_range_flag)
+        {
+            // the long-range potential of the mesh forces
+            add("newtonian_pm long-range potential",
+                real_field + complex_field,false,true);
+
+            // IDs, positions and cell grid (order, sorted and keys) of the
+            // particles and their copies in the layer, and the forces and
+            // targets of the own particles
+            const double width = sim.short_range_cutoff
+                               * sim.short_range_split;
+            const double layer = 1 + 2*width/std::max(1.,N/(double)m)
+                               + 2*width/std::max(1.,N/(double)n);
+            const double copy = sizeof(long long) + 3*sizeof(double)
+                              + 3*sizeof(long);
+            add("short-range forces, in compute_forces",
+                cdm*(layer*copy + 3*sizeof(double) + sizeof(char)),
+                false,true);
+        }
+    }
+
+    // the transposition buffers of the FFTs of LATfield2
+    add("FFT buffers (estimate)",3*complex_field,true,true);
+
+    if(sim.out_snapshot & (MASK_HALOS | MASK_MEMBERS))
+        add("halo finder, at the snapshots",
+            cdm*(sizeof(long long) + 6*sizeof(double) + 2*sizeof(long)),
+            false,true);
+    if(sim.out_snapshot & ~(MASK_GADGET | MASK_PCLS | MASK_HALOS
+                            | MASK_MEMBERS))
+    {
+        // one tensor of the snapshots at once, reduced by the downgrade
+        const int d = std::max(1,sim.downgrade_factor);
+        const double local = (double)N*ceil_div(N,m)*ceil_div(N,n);
+        add("snapshot buffer, at the snapshots",
+            6.*local*sizeof(double)/(d*d*d),false,true);
+    }
+    add("output buffer",sim.output_buffer*1048576.,false,true);
+    return e;
+}
+
+} // namespace gevolution
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+/*
+    Memory of the processes, measured during a run; memory_estimate.hpp
+    predicts it from the settings.
+
+    resident_bytes and peak_resident_bytes read the resident set of the
+    process and its high-water mark from /proc/self/status (0 where there
+    is none); reset_peak_resident lowers the mark to the current resident
+    set (Linux 4.0 and later), such that the peak of a phase can be told
+    from the peak of the run.
+
+    memory_ledger records the memory of the subsystems of a run, as the
+    growth of the resident set over the scope in which they are built, or
+    given in bytes where the memory is not touched at once:
+
+        memory_ledger ledger;
+        {
+            memory_ledger::scope measured(ledger,"engine");
+            PM.reset(new newtonian_pm<Cplx,particles,cic>(N,com));
+        }
+        ledger.record("output buffer",sim.output_buffer*1048576);
+        const std::string report = ledger.report(com);   // collective
+        COUT << report;
+*/
+
+namespace gevolution
+{
+
+namespace detail
+{
+    // value of a "Vm...:  123 kB" line of /proc/self/status, in bytes
+    inline double proc_status_bytes(const char* key)
+    {
+        double bytes = 0;
+#ifdef __linux__
+        if(FILE* f = std::fopen("/proc/self/status","r"))
+        {
+            char line[256];
+            const std::size_t n = std::strlen(key);
+            while(std::fgets(line,sizeof(line),f))
+                if(std::strncmp(line,key,n)==0)
+                {
+                    bytes = 1024.*std::atof(line+n);
+                    break;
+                }
+            std::fclose(f);
+        }
+#else
+        (void)key;
+#endif
+        return bytes;
+    }
+} // namespace detail
+
+inline double resident_bytes()
+{
+    return detail::proc_status_bytes("VmRSS:");
+}
+
+inline double peak_resident_bytes()
+{
+    return detail::proc_status_bytes("VmHWM:");
+}
+
+// returns false if the high-water mark cannot be reset
+inline bool reset_peak_resident()
+{
+#ifdef __linux__
+    if(FILE* f = std::fopen("/proc/self/clear_refs","w"))
+    {
+        const bool ok = std::fputs("5",f) >= 0;
+        return std::fclose(f)==0 && ok;
+    }
+#endif
+    return false;
+}
+
+class memory_ledger
+{
+    struct item
+    {
+        std::string name;
+        double bytes;      // grown, or given
+        double peak{0};    // above the start of the scope, 0 if given
+    };
+    std::vector<item> items;
+
+    public:
+
+    // records the growth of the resident set and its peak over its scope
+    class scope
+    {
+        memory_ledger& ledger;
+        std::string name;
+        double start;
+
+        public:
+        scope(memory_ledger& that_ledger, const std::string& that_name):
+            ledger{that_ledger}, name{that_name}, start{resident_bytes()}
+        {
+            reset_peak_resident();
+        }
+        scope(const scope&) = delete;
+        scope& operator = (const scope&) = delete;
+        ~scope()
+        {
+            ledger.items.push_back({name,resident_bytes() - start,
+                std::max(0.,peak_resident_bytes() - start)});
+        }
+    };
+
+    void record(const std::string& name, double bytes)
+    {
+        items.push_back({name,bytes});
+    }
+
+    /*
+        One line per subsystem, in MB, minimum, mean and maximum over the
+        processes of com, and the resident set at the time of the call.
+        This is a collective call.
+    */
+    std::string report(MPI_Comm com) const
+    {
+        int nproc;
+        MPI_Comm_size(com,&nproc);
+        std::vector<double> v;
+        for(const auto& i : items)
+        {
+            v.push_back(i.bytes);
+            v.push_back(i.peak);
+        }
+        v.push_back(resident_bytes());
+        v.push_back(peak_resident_bytes());
+
+        std::vector<double> lo(v.size()), hi(v.size()), sum(v.size());
+        MPI_Allreduce(v.data(),lo.data(),v.size(),MPI_DOUBLE,MPI_MIN,com);
+        MPI_Allreduce(v.data(),hi.data(),v.size(),MPI_DOUBLE,MPI_MAX,com);
+        MPI_Allreduce(v.data(),sum.data(),v.size(),MPI_DOUBLE,MPI_SUM,com);
+
+        const double MB = 1048576.;
+        std::ostringstream o;
+        o << std::fixed << std::setprecision(1);
+        o << " memory per process in MB (min / mean / max):\n";
+        auto line = [&](const std::string& name, std::size_t k)
+        {
+            o << "   " << std::left << std::setw(28) << name << std::right
+              << std::setw(10) << lo[k]/MB << std::setw(10)
+              << sum[k]/nproc/MB << std::setw(10) << hi[k]/MB;
+        };
+        for(std::size_t i=0;i<items.size();++i)
+        {
+            line(items[i].name,2*i);
+            if(hi[2*i+1] > 0)
+                o << "   (peak " << hi[2*i+1]/MB << ")";
+            o << "\n";
+        }
+        line("resident now",v.size()-2);
+        o << "\n";
+        line("resident peak",v.size()-1);
+        o << "\n";
+        return o.str();
+    }
+};
+
+} // namespace gevolution
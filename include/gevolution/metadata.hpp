@@ -74,6 +74,8 @@ namespace gevolution
 #define MASK_DBARE 8192
 #define MASK_MULTI 16384
 #define MASK_VEL 32768
+#define MASK_HALOS 65536
+#define MASK_MEMBERS 131072
 
 #define ICFLAG_CORRECT_DISPLACEMENT 1
 #define ICFLAG_KSPHERE 2
@@ -97,6 +99,9 @@ namespace gevolution
 #define VECTOR_PARABOLIC 0
 #define VECTOR_ELLIPTIC 1
 
+#define PK_BINNING_LOG 0
+#define PK_BINNING_LINEAR 1
+
 
 // default physical parameters (used in parser.hpp)
 #define P_HUBBLE 0.67556        // default value for h
@@ -214,13 +219,24 @@ struct metadata
     int baryon_flag;
     gravity_theory gr_flag = gravity_theory::GR;
     int vector_flag;
+    int interlacing_flag;
+    int short_range_flag; // P3M forces of the Newtonian engine
+    double short_range_split;     // in lattice units
+    double short_range_cutoff;    // in units of the split
+    double short_range_softening; // in lattice units
     int radiation_flag;
     int fluid_flag;
     int out_pk;
     int out_snapshot;
+    int snapshot_deflate;
+    int snapshot_single; // fields of the snapshots in single precision
+    int snapshot_mantissa_bits; // of the snapshot fields, 0: all
+    double halo_linking_length; // in units of the mean particle separation
+    int halo_min_particles;
     int out_lightcone[MAX_OUTPUTS];
     int num_pk;
     int numbins;
+    int pk_binning_flag;
     int num_snapshot;
     int num_lightcone;
     int num_restart;
@@ -230,6 +246,19 @@ struct metadata
     double steplimit;
     double boxsize;
     double wallclocklimit;
+    double output_buffer; // MB, for the asynchronous output
+    double checkpoint_interval; // hours of wallclock between checkpoints
+    int checkpoint_base_interval; // checkpoints per base image
+    int checkpoint_restart;
+    int ic_hibernation; // hibernation point of the initial conditions
+    int timer_interval; // cycles between the reports of the phase timers
+    int timer_counters;
+    int diagnostics_interval; // cycles between the diagnostics of the log
+    int time_bins; // number of power-of-two time bins of the particles
+    double time_bin_accuracy; // fraction of a cell moved by a kick
+    int reorder_interval; // cycles between reorders of the particles, 0: never
+    int balance_interval; // cycles between weightings of the particle
+                          // domains, 0: never
     double pixelfactor[MAX_OUTPUTS];
     double shellfactor[MAX_OUTPUTS];
     double covering[MAX_OUTPUTS];
@@ -259,9 +288,11 @@ struct icsettings
     int generator;
     int restart_cycle;
     char pclfile[MAX_PCL_SPECIES][PARAM_MAX_LENGTH];
+    int aggregators; // ranks reading the particle files, 0: automatic
     char pkfile[PARAM_MAX_LENGTH];
     char tkfile[PARAM_MAX_LENGTH];
     char metricfile[3][PARAM_MAX_LENGTH];
+    char class_cache[PARAM_MAX_LENGTH]; // directory of the CLASS cache
     double restart_tau;
     double restart_dtau;
     double restart_version;
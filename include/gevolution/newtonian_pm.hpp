@@ -2,19 +2,31 @@
 
 #include "gevolution/config.h"
 #include "gevolution/particle_mesh.hpp"
+#include "gevolution/cic_kernels.hpp"
 #include "LATfield2.hpp"
 #include "gevolution/gevolution.hpp"
 #include "gevolution/power.hpp"
+#include "gevolution/short_range.hpp"
+#ifdef PARTICLES_SOA
+#include "gevolution/particles_soa.hpp"
+#endif
+#include <memory>
 
 namespace gevolution
 {
 
-template<typename complex_type, typename particle_container>
-class newtonian_pm : public particle_mesh<complex_type,particle_container>
+template<
+    typename complex_type,
+    typename particle_container,
+    typename assignment_type = assignment::cic>
+class newtonian_pm :
+    public particle_mesh<complex_type,particle_container,assignment_type>
 {
     public:
-    using base_type = particle_mesh<complex_type,particle_container>;
+    using base_type =
+        particle_mesh<complex_type,particle_container,assignment_type>;
     using typename base_type::real_type;
+    using typename base_type::particle_type;
     using typename base_type::real_field_type;
     using typename base_type::complex_field_type;
     using typename base_type::site_type;
@@ -24,13 +36,38 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
     using typename base_type::fft_plan_type;
     
     using typename base_type::force_reduction;
+    using typename base_type::halo_exchange_type;
     using base_type::com;
+    using base_type::is_cic;
     
     
     real_field_type phi, rho;
     complex_field_type phi_FT ,rho_FT;
     fft_plan_type plan_phi, plan_rho;
     
+    // ghost cells of phi are exchanged while the forces are computed
+    mutable halo_exchange_type phi_halo;
+    
+    // second grid of interlacing, allocated by enable_interlacing
+    bool interlaced{false};
+    real_field_type rho_shifted;
+    complex_field_type rho_shifted_FT;
+    fft_plan_type plan_rho_shifted;
+    
+    // 1/W^2 of the assignment and interpolation windows, per axis
+    std::vector<double> deconvolution;
+    
+    // P3M, allocated by enable_short_range: the mesh forces come from
+    // phi_long, the long-range potential filtered per axis, and the pairs
+    // add the rest; phi stays the full potential of the outputs
+    std::unique_ptr<short_range_force> short_range;
+    std::vector<double> long_range;
+    real_field_type phi_long;
+    complex_field_type phi_long_FT;
+    fft_plan_type plan_phi_long;
+    std::unique_ptr<halo_exchange_type> phi_long_halo;
+    double poisson_coeff{1}; // of the last compute_potential
+    
     public:
     newtonian_pm(int N,const MPI_Comm& that_com):
         base_type(N,that_com),
@@ -42,15 +79,51 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
         rho_FT(base_type::latFT,1),
         
         plan_rho(&rho,&rho_FT),
-        plan_phi (&phi, &phi_FT)
+        plan_phi (&phi, &phi_FT),
+        
+        phi_halo(phi)
     {
         scalar_to_zero(rho);
         scalar_to_zero(phi);
+        for(Real s : kspace_axes::of(N).sinc)
+            deconvolution.push_back(
+                std::pow(1.0*s,-2*assignment_type::order));
     }
     
     void clear_sources() override
     {
         scalar_to_zero(rho);
+        if(interlaced)
+            scalar_to_zero(rho_shifted);
+    }
+    
+    bool enable_interlacing() override
+    {
+        if(not interlaced)
+        {
+            rho_shifted.initialize(base_type::lat,1);
+            rho_shifted_FT.initialize(base_type::latFT,1);
+            plan_rho_shifted.initialize(&rho_shifted,&rho_shifted_FT);
+            scalar_to_zero(rho_shifted);
+            interlaced = true;
+        }
+        return true;
+    }
+    
+    bool enable_short_range(double split, double cutoff,
+                            double softening) override
+    {
+        short_range.reset(new short_range_force(split,cutoff,softening));
+        long_range = short_range->filter(size());
+        if(not phi_long_halo)
+        {
+            phi_long.initialize(base_type::lat,1);
+            phi_long_FT.initialize(base_type::latFT,1);
+            plan_phi_long.initialize(&phi_long,&phi_long_FT);
+            scalar_to_zero(phi_long);
+            phi_long_halo.reset(new halo_exchange_type(phi_long));
+        }
+        return true;
     }
     
     /*
@@ -58,8 +131,25 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
     */
     void sample(const particle_container& pcls, double /* a */=0) override
     {
-        scalarProjectionCIC_project (&pcls, &rho); // samples
-        scalarProjectionCIC_comm (&rho); // communicates the ghost cells
+        if(interlaced)
+        {
+            // both grids go through the same projection
+            assignment::project_density<assignment_type>(pcls,rho);
+            assignment::project_density<assignment_type>(
+                pcls,rho_shifted,-0.5);
+            return;
+        }
+        
+        if constexpr (is_cic)
+        {
+            scalarProjectionCIC_project (&pcls, &rho); // samples
+            scalarProjectionCIC_comm (&rho); // communicates the ghost cells
+        }
+        else
+        {
+            // samples and communicates the ghost cells
+            assignment::project_density<assignment_type>(pcls,rho);
+        }
     }
     
     /*
@@ -68,17 +158,55 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
     void update_kspace()
     {
         plan_rho.execute (LATfield2::FFT_FORWARD); // Newton: directly go to k-space
+        if(interlaced)
+        {
+            plan_rho_shifted.execute (LATfield2::FFT_FORWARD);
+            assignment::interlace(rho_FT,rho_shifted_FT,size());
+        }
         rho_FT.updateHalo (); // update ghost cells
     }
     void update_rspace()
     {
+        phi_halo.end();
         plan_phi.execute (LATfield2::FFT_BACKWARD); // go back to position space
-        phi.updateHalo (); // update ghost cells
+        phi_halo.begin (); // update ghost cells, completed in compute_forces
+        if(short_range)
+        {
+            phi_long_halo->end();
+            plan_phi_long.execute (LATfield2::FFT_BACKWARD);
+            phi_long_halo->begin ();
+        }
     }
     void solve_poisson_eq(double factor=1)
     {
         solveModifiedPoissonFT (rho_FT, phi_FT,factor); // Newton: in k-space
         // (4 pi G)/a = 1
+        
+        // higher order schemes: undo the window of the assignment and of
+        // the interpolation; plain CIC is left as it always was
+        const double* D = deconvolution.data();
+        if(not is_cic)
+            for_each_site<LATfield2::rKSite>(phi_FT.lattice(),
+                [&](const LATfield2::rKSite& k)
+                {
+                    phi_FT(k) *= D[k.coord(0)]*D[k.coord(1)]*D[k.coord(2)];
+                });
+        
+        // P3M: the long-range part in a copy, deconvolved with CIC too as
+        // the pairs expect the unsmoothed long-range force
+        if(short_range)
+        {
+            const double* L = long_range.data();
+            for_each_site<LATfield2::rKSite>(phi_FT.lattice(),
+                [&](const LATfield2::rKSite& k)
+                {
+                    double f = L[k.coord(0)]*L[k.coord(1)]*L[k.coord(2)];
+                    if constexpr (is_cic)
+                        f *= D[k.coord(0)]*D[k.coord(1)]*D[k.coord(2)];
+                    phi_long_FT(k) = phi_FT(k);
+                    phi_long_FT(k) *= f;
+                });
+        }
     }
     void compute_potential(
         double fourpiG    =1, 
@@ -87,12 +215,13 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
         double /* Omega*/ =0) override
     {
         update_kspace();
-        solve_poisson_eq(fourpiG/a);
+        poisson_coeff = fourpiG/a;
+        solve_poisson_eq(poisson_coeff);
         update_rspace();
     }
     
     /*
-        compute forces
+        compute forces, the mesh part and, with P3M, the pairs
     */
     void compute_forces(
         particle_container& pcls, 
@@ -100,8 +229,33 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
         double a = 1,
         force_reduction reduct = force_reduction::assign) const override
     {
-        std::array<real_type,3> force;
+        compute_mesh_forces(pcls,fourpiG,a,reduct);
+        if(not short_range)
+            return;
+        
+        // the point mass m of the mesh, with -a fourpiG grad phi and
+        // laplace phi = poisson_coeff rho, pulls with Gm/r^2
+        const double Gm = a*fourpiG*poisson_coeff*pcls.parts_info()->mass
+                        / (4*M_PI);
+        short_range->add_forces(pcls,Gm,
+            [this](const auto& part)
+            { return base_type::is_active(part); },
+            reduct==force_reduction::minus ? -1 : 1);
+    }
+    
+    void compute_mesh_forces(
+        particle_container& pcls, 
+        double fourpiG,
+        double a,
+        force_reduction reduct) const
+    {
+        // the potential of the mesh forces and its ghost cells
+        const real_field_type& pot = short_range ? phi_long : phi;
+        halo_exchange_type& pot_halo = short_range ? *phi_long_halo
+                                                   : phi_halo;
     #ifdef GEVOLUTION_OLD_VERSION
+        std::array<real_type,3> force;
+        pot_halo.end();
         const double dx = 1.0/size();
         fourpiG /= dx;
         
@@ -111,8 +265,10 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
         {
             for(auto& part : pcls.field()(xpart).parts )
             {
+                if(not base_type::is_active(part))
+                    continue;
                 std::array<real_type,3> pos{part.pos[0],part.pos[1],part.pos[2]};
-                std::array<real_type,3> gradphi=gradient(phi,xpart,pos);
+                std::array<real_type,3> gradphi=gradient(pot,xpart,pos);
                 for (int i=0;i<3;i++)
                 {
                     force[i] = -gradphi[i] * fourpiG * a;
@@ -139,144 +295,189 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
         /*
         Let's do like in Gadget4:
         1. compute Fx field from phi at 4th order FD
-        2. interpolate Fx at particle's position using CIC
+        2. interpolate Fx at particle's position using CIC, or the assignment
+           scheme of the engine
+        
+        The CIC interpolation runs on batches of particles of the same cell
+        through the kernels of cic_kernels.hpp.
+        
+        All three components are computed at once, their ghost cells are
+        exchanged together and they are interpolated in a single pass over the
+        particles. The ghost cells exchanges of phi and Fx are overlapped with
+        the work on the interior of the local domain.
         */
         const double dx = 1.0/pcls.lattice().size()[0];
         fourpiG /= dx;
         
-        real_field_type Fx(base_type::lat);
+        // the force field comes from the scratch pool, hence it is
+        // allocated only once in the life of the engine
+        auto Fx_lease = base_type::scratch.real_field(3);
+        real_field_type& Fx = *Fx_lease;
         
-        site_type x(base_type::lat);
-        site_type xpart(pcls.lattice());
+        // 4th order stencil, reaches 2 sites away
+        // precondition: the ghost cells of pot are valid or being exchanged
+        base_type::for_each_site_overlapped(base_type::lat,{&pot_halo},2,
+            [&](const site_type& x)
+            {
+                for(int i=0;i<3;++i)
+                {
+                    Fx(x,i)
+                    = (-1)*a*fourpiG*( 
+                            2.0/3 * (pot(x+i) - pot(x-i)) 
+                            - 1.0/12 * (pot(x+i+i) - pot(x-i-i))  );
+                }
+            });
         
-        // phi.updateHalo();
-        for(int i=0;i<3;++i)
+        // interpolation, reaches 1 site away with CIC
+        halo_exchange_type Fx_halo(Fx);
+        Fx_halo.begin();
+        if constexpr (not is_cic)
         {
-            for(x.first();x.test();x.next())
-            {
-                Fx(x)
-                = (-1)*a*fourpiG*( 
-                        2.0/3 * (phi(x+i) - phi(x-i)) 
-                        - 1.0/12 * (phi(x+i+i) - phi(x-i-i))  );
-            }
-            Fx.updateHalo();
-            for(xpart.first();xpart.test();xpart.next())
+            base_type::for_each_site_overlapped(pcls.lattice(),{&Fx_halo},
+                assignment::reach<assignment_type>(),
+                [&](const site_type& xpart)
             {
                 for(auto& part : pcls.field()(xpart).parts )
                 {
-                    std::array<double,3> ref_dist;
+                    if(not base_type::is_active(part))
+                        continue;
+                    std::array<real_type,3> u, force;
                     for(int l=0;l<3;++l)
-                        ref_dist[l] = part.pos[l]/dx - xpart.coord(l);
-                    
-                    force[i] = 0.0;
-                    
-                    force[i] +=
-                    (1-ref_dist[0])*(1-ref_dist[1])*(1-ref_dist[2])*Fx(xpart);
-                    
-                    force[i] +=
-                    (ref_dist[0])*(1-ref_dist[1])*(1-ref_dist[2])*Fx(xpart+0);
+                        u[l] = part.pos[l]/dx - xpart.coord(l);
+                    for(int i=0;i<3;++i)
+                        force[i] = assignment::interpolate<assignment_type>(
+                            Fx,xpart,u,i);
                     
-                    force[i] +=
-                    (1-ref_dist[0])*(ref_dist[1])*(1-ref_dist[2])*Fx(xpart+1);
-                    
-                    force[i] +=
-                    (ref_dist[0])*(ref_dist[1])*(1-ref_dist[2])*Fx(xpart+1+0);
-                    
-                    force[i] +=
-                    (1-ref_dist[0])*(1-ref_dist[1])*(ref_dist[2])*Fx(xpart+2);
-                    
-                    force[i] +=
-                    (ref_dist[0])*(1-ref_dist[1])*(ref_dist[2])*Fx(xpart+2+0);
-                    
-                    force[i] +=
-                    (1-ref_dist[0])*(ref_dist[1])*(ref_dist[2])*Fx(xpart+2+1);
-                    
-                    force[i] +=
-                    (ref_dist[0])*(ref_dist[1])*(ref_dist[2])*Fx(xpart+2+1+0);
-                
                     switch(reduct)
                     {
                         case force_reduction::plus :
-                            part.force[i] += force[i];
+                            for(int i=0;i<3;++i)
+                                part.force[i] += force[i];
                         break;
                         case force_reduction::minus :
-                            part.force[i] -= force[i];
+                            for(int i=0;i<3;++i)
+                                part.force[i] -= force[i];
                         break;
                         default:
-                            part.force[i] = force[i];
+                            part.force = force;
                     }
                 }
+            });
+            return;
+        }
+        
+#ifdef PARTICLES_SOA
+        // the particles of the balanced layout read Fx in their domains
+        if constexpr (std::is_same<particle_container,particles_soa>::value)
+            if(pcls.balanced())
+            {
+                Fx_halo.end();
+                pcls.gather_balanced(Fx,base_type::max_active_bin,
+                    reduct==force_reduction::plus ? 1
+                    : reduct==force_reduction::minus ? -1 : 0);
+                return;
             }
+#endif
+#ifdef GPU_OFFLOAD
+        // the particles stay on the device, Fx goes there
+        if constexpr (std::is_same<particle_container,particles_soa>::value)
+        {
+            Fx_halo.end();
+            pcls.gather_forces(Fx,base_type::max_active_bin,
+                reduct==force_reduction::plus ? 1
+                : reduct==force_reduction::minus ? -1 : 0);
+            return;
         }
+#endif
+        
+        // CIC
+        base_type::for_each_site_overlapped(pcls.lattice(),{&Fx_halo},1,
+            [&](const site_type& xpart)
+        {
+            // the force at the corners of the cell, ordered as in cic::
+            real_type cube[24];
+            for(int i=0;i<3;++i)
+            {
+                cube[8*i+0] = Fx(xpart,i);
+                cube[8*i+1] = Fx(xpart+2,i);
+                cube[8*i+2] = Fx(xpart+1,i);
+                cube[8*i+3] = Fx(xpart+1+2,i);
+                cube[8*i+4] = Fx(xpart+0,i);
+                cube[8*i+5] = Fx(xpart+0+2,i);
+                cube[8*i+6] = Fx(xpart+0+1,i);
+                cube[8*i+7] = Fx(xpart+0+1+2,i);
+            }
+            
+            real_type u[3][cic::batch_size], force[3*cic::batch_size];
+            int n = 0;
+            cic::in_batches_if(pcls.field()(xpart).parts,
+                [&](const auto& part){ return base_type::is_active(part); },
+                [&](const auto& part, int k)
+                {
+                    for(int l=0;l<3;++l)
+                        u[l][k] = part.pos[l]/dx - xpart.coord(l);
+                },
+                [&](int batch)
+                {
+                    n = batch;
+                    cic::gather(n,u[0],u[1],u[2],3,cube,force);
+                },
+                [&](auto& part, int k)
+                {
+                    switch(reduct)
+                    {
+                        case force_reduction::plus :
+                            for(int i=0;i<3;++i)
+                                part.force[i] += force[i*n+k];
+                        break;
+                        case force_reduction::minus :
+                            for(int i=0;i<3;++i)
+                                part.force[i] -= force[i*n+k];
+                        break;
+                        default:
+                            for(int i=0;i<3;++i)
+                                part.force[i] = force[i*n+k];
+                    }
+                });
+        });
     #endif
     } 
     ~newtonian_pm() override {}
     
-    std::string report(const particle_container& pcls, double a) const override
+    void complete_halos() const override
+    {
+        phi_halo.end();
+        if(phi_long_halo)
+            phi_long_halo->end();
+    }
+    
+    void diagnose_sources(diagnostics& d) const override
+    {
+        diagnose_msq(d,"RMS(T00)",rho);
+        diagnose_max_abs(d,"max|T00|",rho);
+        diagnose_max_abs(d,"max|halo T00|",rho,true);
+        diagnose_mean(d,"T00hom",rho);
+    }
+    
+    void diagnose_potentials(diagnostics& d) const override
+    {
+        complete_halos();
+        diagnose_msq(d,"RMS(Phi)",phi);
+        diagnose_max_abs(d,"max|Phi|",phi);
+        diagnose_max_abs(d,"max|FT Phi|",phi_FT);
+        diagnose_max_abs(d,"max|halo Phi|",phi,true);
+        diagnose_max_abs(d,"max|halo FT Phi|",phi_FT,true);
+        diagnose_mean(d,"Phihom",phi);
+    }
+    
+    std::string report(const diagnostics& d) const override
     {
         std::stringstream ss;
-        // // sources
-        // double std_t00 = show_msq(source);
-        // // potentials
-        // double std_phi = show_msq(phi);
-        // ss << "RMS(T00) = " << std_t00 << '\n';
-        // ss << "RMS(Phi) = " << std_phi << '\n';
-        
-        double max_pos{}, max_mom{};
-        
-        pcls.for_each(
-            [&max_pos,&max_mom]
-            (const particle& part, const Site& /*xpart*/)
-            {
-                using std::max;
-                for(int i=0;i<3;++i)
-                {
-                    max_pos = max(max_pos,part.pos[i]);
-                    max_mom = max(max_mom,part.momentum[i]);
-                }
-            }
-        );
-        ::boost::mpi::all_reduce(com,max_pos,my_max_func<double>{});
-        ::boost::mpi::all_reduce(com,max_mom,my_max_func<double>{});
-        
-        ss << "max |position| = " << 
-                max_pos << '\n';
-        ss << "max |momentum| = " << 
-                max_mom << '\n';
-        
-        ss << "RMS(T00) = " << 
-            reduce_field(com,rho,0.0,
-                my_sum_func<double>{},
-                my_sqr_func<double>{}) << '\n';
-        ss << "RMS(Phi) = " << 
-            reduce_field(com,phi,0.0,
-                my_sum_func<double>{},
-                my_sqr_func<double>{}) << '\n';
-        ss << "max|T00| = " << 
-            reduce_field(com,rho,0.0,
-                my_max_func<double>{},
-                my_abs_func<double>{}) << '\n';
-        ss << "max|Phi| = " << 
-            reduce_field(com,phi,0.0,
-                my_max_func<double>{},
-                my_abs_func<double>{}) << '\n';
-        ss << "max|FT Phi| = " << 
-            reduce_field(com,phi_FT, 0.0,
-                my_max_func< double >{},
-                my_abs_func<double,LATfield2::Imag>{}) << '\n';
-        
-        ss << "max|halo T00| = " << 
-            reduce_field_halo(com,rho,0.0,
-                my_max_func<double>{},
-                my_abs_func<double>{} ) << '\n';
-        ss << "max|halo Phi| = " << 
-            reduce_field_halo(com,phi,0.0,
-                my_max_func<double>{},
-                my_abs_func<double>{} ) << '\n';
-        ss << "max|halo FT Phi| = " << 
-            reduce_field_halo(com,phi_FT, 0.0,
-                my_max_func< double >{},
-                my_abs_func< double,LATfield2::Imag>{} ) << '\n';
+        for(const char* name : {"RMS(T00)","RMS(Phi)","max|T00|","max|Phi|",
+                "max|FT Phi|","max|halo T00|","max|halo Phi|",
+                "max|halo FT Phi|"})
+            if(d.contains(name))
+                ss << name << " = " << d[name] << '\n';
         return ss.str();
     }
     double density() const override
@@ -327,21 +528,34 @@ class newtonian_pm : public particle_mesh<complex_type,particle_container>
         // save the potentials
         phi.saveHDF5 (prefix + "_phi.h5");
     }
+    // phi is computed from the particles alone, nothing carries over
+    void save_restart(std::string) const override {}
+    void load_restart(const std::array<std::string,3>&) override {}
+    std::vector<real_field_type*> restart_fields() override { return {}; }
+    std::array<real_field_type*,4> lightcone_fields() override
+    {
+        return {&phi,nullptr,nullptr,nullptr};
+    }
+    void save_to_snapshot(h5_snapshot& file) const override
+    {
+        file.write_field("T00",rho);
+        file.write_field("phi",phi);
+    }
     
     virtual void save_power_spectrum(std::string fname) const override
     {
-        real_type phi_mean=show_mean(phi),
-                  rho_mean = show_mean(rho);
-        base_type::save_field_power_spectrum(fname,"_phi.txt",phi_FT);
-        base_type::save_field_power_spectrum(fname,"_T00.txt",rho_FT,rho_mean);
+        base_type::save_power_spectra(fname,
+            {{"_phi.txt",&phi_FT},{"_T00.txt",&rho_FT}});
     }
 };
 
-template<class functor_type, typename complex_type, typename particle_container>
+template<class functor_type, typename complex_type,
+    typename particle_container, typename assignment_type>
 void apply_filter_kspace(
-    newtonian_pm<complex_type,particle_container> &pm,
-    functor_type f)
+    newtonian_pm<complex_type,particle_container,assignment_type> &pm,
+    const functor_type& f)
 {
+    pm.phi_halo.end();
     apply_filter_kspace_scalar(pm.phi,pm.phi_FT,pm.plan_phi,f);
 }
 
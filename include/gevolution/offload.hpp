@@ -0,0 +1,476 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "LATfield2.hpp"
+#include "gevolution/cic_kernels.hpp"
+#include "gevolution/diagnostics.hpp"
+#include "gevolution/halo.hpp"
+#include "gevolution/particle_exchange.hpp"
+#include "gevolution/real_type.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+
+/*
+    Memory and kernels of the accelerator copy of particles_soa, with
+    OpenMP target offload, compiled in with GPU_OFFLOAD.
+
+    particles_soa keeps all its columns resident on the default device, and
+    the particle steps of a cycle of the Newtonian CIC engine run there:
+
+        deposit     per particle, with atomics, so that the particles need
+                    not be sorted by cell on the device
+        gather      of the force field at the particles
+        kick, drift
+        wrap/flag   periodic boundaries of moveParticles, and the list of
+                    the particles leaving the local domain
+
+    What crosses the bus in a cycle is the density (down, for the FFT on the
+    host), the force field (up), and the particles leaving or entering the
+    local domain. The host copy of the particles is only brought up to date
+    where host code reads them, e.g. for output.
+
+    The arrays live in device memory (omp_target_alloc) and the kernels take
+    their raw pointers, is_device_ptr. Without a device they run on the
+    host, which gives the host results up to the order of the sums.
+*/
+
+namespace gevolution
+{
+namespace offload
+{
+
+inline int device() { return omp_get_default_device(); }
+inline int host() { return omp_get_initial_device(); }
+
+/*
+    Array in the memory of the device; copies from and to the host are
+    explicit.
+*/
+template<class T>
+class device_array
+{
+    T* p{nullptr};
+    long n{0};
+
+    public:
+
+    device_array() = default;
+    device_array(const device_array&) = delete;
+    device_array& operator = (const device_array&) = delete;
+    ~device_array()
+    {
+        if(p)
+            omp_target_free(p,device());
+    }
+
+    T* data() const { return p; }
+    long capacity() const { return n; }
+
+    // room for size elements, the first keep ones are kept
+    void reserve(long size, long keep = 0)
+    {
+        if(size <= n)
+            return;
+        T* q = static_cast<T*>(omp_target_alloc(size*sizeof(T),device()));
+        if(not q)
+        {
+            std::cerr << " proc#" << LATfield2::parallel.rank()
+                      << ": error in offload, cannot allocate "
+                      << size*sizeof(T) << " bytes on the device"
+                      << std::endl;
+            LATfield2::parallel.abortForce();
+        }
+        if(p)
+        {
+            if(keep > 0)
+                omp_target_memcpy(q,p,keep*sizeof(T),0,0,device(),device());
+            omp_target_free(p,device());
+        }
+        p = q;
+        n = size;
+    }
+
+    // count elements from h to the device, from element at on
+    void upload(const T* h, long count, long at = 0)
+    {
+        if(count > 0)
+            omp_target_memcpy(p,const_cast<T*>(h),count*sizeof(T),
+                at*sizeof(T),0,device(),host());
+    }
+    // count elements from the device, from element at on, to h
+    void download(T* h, long count, long at = 0) const
+    {
+        if(count > 0)
+            omp_target_memcpy(h,p,count*sizeof(T),0,at*sizeof(T),host(),
+                device());
+    }
+};
+
+/*
+    The columns of particles_soa on the device, room for capacity particles,
+    and the scratch arrays of the kernels.
+*/
+struct particle_columns
+{
+    device_array<particle_id_type> ID;
+    device_array<particle_pos_type> pos[3], vel[3];
+    device_array<particle_real> mass, momentum[3], force[3];
+    device_array<Real> Phi, B[3];
+    device_array<int> bin;
+    long capacity{0};
+
+    device_array<long> index;
+    device_array<migrant> migrants;
+    device_array<Real> mesh;
+
+    // f(column) for all the columns
+    template<class F>
+    void for_each_column(F f)
+    {
+        f(ID);
+        for(int i=0;i<3;++i) { f(pos[i]); f(vel[i]); }
+        f(mass);
+        for(int i=0;i<3;++i) { f(momentum[i]); f(force[i]); }
+        f(Phi);
+        for(int i=0;i<3;++i) f(B[i]);
+        f(bin);
+    }
+
+    // room for n particles, the first keep ones are kept
+    void reserve(long n, long keep)
+    {
+        if(n <= capacity)
+            return;
+        capacity = n + n/8 + 1024;
+        for_each_column([this,keep](auto& column)
+            {
+                column.reserve(capacity,keep);
+            });
+    }
+};
+
+/*
+    Where the kernels find the local site of a position: the cell (x,y,z)
+    of the local domain, in local coordinates, has the raw index
+    base + x*jump[0] + y*jump[1] + z*jump[2].
+*/
+struct site_map
+{
+    long base, jump[3], gross;
+    int lo[3], n[3], N[3]; // local domain and lattice, per direction
+    double dx;
+
+    site_map(const LATfield2::Lattice& L, double that_dx): dx{that_dx}
+    {
+        base = local_site_index(L,0,0,0);
+        jump[0] = local_site_index(L,1,0,0) - base;
+        jump[1] = local_site_index(L,0,1,0) - base;
+        jump[2] = local_site_index(L,0,0,1) - base;
+        gross = L.sitesLocalGross();
+        for(int i=0;i<3;++i)
+        {
+            lo[i] = local_offset(L,i);
+            n[i] = L.sizeLocal(i);
+            N[i] = L.size(i);
+        }
+    }
+};
+
+/*
+    rho += the CIC density of the n particles at (x,y,z), of mass q; the
+    particles must be on the local domain of m. The ghost cells of rho
+    receive the deposits across the boundaries.
+*/
+template<class pos_type>
+void deposit(long n, const pos_type* x, const pos_type* y,
+    const pos_type* z, const site_map& m, Real q, Real* rho)
+{
+    const long b = m.base, j0 = m.jump[0], j1 = m.jump[1], j2 = m.jump[2];
+    const int lo1 = m.lo[1], lo2 = m.lo[2];
+    const int N0 = m.N[0], N1 = m.N[1], N2 = m.N[2];
+    const double dx = m.dx;
+
+    #pragma omp target teams distribute parallel for \
+        is_device_ptr(x,y,z,rho)
+    for(long k=0;k<n;++k)
+    {
+        const int c0 = cell_of(x[k],dx,N0), c1 = cell_of(y[k],dx,N1),
+                  c2 = cell_of(z[k],dx,N2);
+        Real w[8];
+        cic::detail::weights<Real>(x[k]/dx - c0,y[k]/dx - c1,z[k]/dx - c2,
+            w);
+        const long s = b + c0*j0 + (c1-lo1)*j1 + (c2-lo2)*j2;
+        const long at[8] = {s, s+j2, s+j1, s+j1+j2,
+            s+j0, s+j0+j2, s+j0+j1, s+j0+j1+j2};
+        for(int corner=0;corner<8;++corner)
+        {
+            #pragma omp atomic update
+            rho[at[corner]] += q*w[corner];
+        }
+    }
+}
+
+/*
+    The CIC interpolation of the three components of F (m.gross sites
+    each, one after the other) at the particles of the bins up to
+    max_active_bin (negative: all): assigned to f with mode 0, added with
+    mode 1, subtracted with mode -1.
+*/
+template<class pos_type, class force_type>
+void gather(long n, const pos_type* x, const pos_type* y,
+    const pos_type* z, const int* bin, int max_active_bin,
+    const site_map& m, const Real* F, force_type* f0, force_type* f1,
+    force_type* f2, int mode)
+{
+    const long b = m.base, j0 = m.jump[0], j1 = m.jump[1], j2 = m.jump[2],
+               g = m.gross;
+    const int lo1 = m.lo[1], lo2 = m.lo[2];
+    const int N0 = m.N[0], N1 = m.N[1], N2 = m.N[2];
+    const double dx = m.dx;
+
+    #pragma omp target teams distribute parallel for \
+        is_device_ptr(x,y,z,bin,F,f0,f1,f2)
+    for(long k=0;k<n;++k)
+    {
+        if(max_active_bin >= 0 && bin[k] > max_active_bin)
+            continue;
+        const int c0 = cell_of(x[k],dx,N0), c1 = cell_of(y[k],dx,N1),
+                  c2 = cell_of(z[k],dx,N2);
+        Real w[8];
+        cic::detail::weights<Real>(x[k]/dx - c0,y[k]/dx - c1,z[k]/dx - c2,
+            w);
+        const long s = b + c0*j0 + (c1-lo1)*j1 + (c2-lo2)*j2;
+        const long at[8] = {s, s+j2, s+j1, s+j1+j2,
+            s+j0, s+j0+j2, s+j0+j1, s+j0+j1+j2};
+        force_type v[3] = {0,0,0};
+        for(int i=0;i<3;++i)
+            for(int corner=0;corner<8;++corner)
+                v[i] += w[corner]*F[i*g + at[corner]];
+        force_type* f[3] = {f0,f1,f2};
+        for(int i=0;i<3;++i)
+            f[i][k] = mode==0 ? v[i] : f[i][k] + mode*v[i];
+    }
+}
+
+/*
+    Apply the periodic boundaries to the positions and list, in leaving,
+    the particles that are not on the local domain of m; returns their
+    number. The list is in no particular order.
+*/
+template<class pos_type>
+long wrap_and_flag(long n, pos_type* x, pos_type* y, pos_type* z,
+    const site_map& m, long* leaving)
+{
+    const double box[3] = {m.dx*m.N[0],m.dx*m.N[1],m.dx*m.N[2]};
+    const int lo1 = m.lo[1], lo2 = m.lo[2], n1 = m.n[1], n2 = m.n[2];
+    const int N1 = m.N[1], N2 = m.N[2];
+    const double dx = m.dx, b0 = box[0], b1 = box[1], b2 = box[2];
+    long count = 0;
+
+    #pragma omp target teams distribute parallel for map(tofrom: count) \
+        is_device_ptr(x,y,z,leaving)
+    for(long k=0;k<n;++k)
+    {
+        pos_type* p[3] = {x+k,y+k,z+k};
+        const double box_i[3] = {b0,b1,b2};
+        for(int i=0;i<3;++i)
+        {
+            if(*p[i] < 0) *p[i] += box_i[i];
+            else if(*p[i] >= box_i[i]) *p[i] -= box_i[i];
+        }
+        const int c1 = cell_of(y[k],dx,N1) - lo1,
+                  c2 = cell_of(z[k],dx,N2) - lo2;
+        if(c1<0 || c1>=n1 || c2<0 || c2>=n2)
+        {
+            long j;
+            #pragma omp atomic capture
+            j = count++;
+            leaving[j] = k;
+        }
+    }
+    return count;
+}
+
+template<class T>
+void fill(long n, T* c, T value)
+{
+    #pragma omp target teams distribute parallel for is_device_ptr(c)
+    for(long j=0;j<n;++j)
+        c[j] = value;
+}
+
+// c[to[j]] = c[from[j]] for j < n, to and from disjoint
+template<class T>
+void move(long n, const long* to, const long* from, T* c)
+{
+    #pragma omp target teams distribute parallel for is_device_ptr(to,from,c)
+    for(long j=0;j<n;++j)
+        c[to[j]] = c[from[j]];
+}
+
+// the particles which[j], j < n, into out[j]
+inline void pack(particle_columns& c, long n, const long* which,
+    migrant* out)
+{
+    const particle_id_type* ID = c.ID.data();
+    const particle_pos_type* x[3] = {c.pos[0].data(),c.pos[1].data(),
+        c.pos[2].data()};
+    const particle_pos_type* v[3] = {c.vel[0].data(),c.vel[1].data(),
+        c.vel[2].data()};
+    const particle_real* mass = c.mass.data();
+    const particle_real* p[3] = {c.momentum[0].data(),c.momentum[1].data(),
+        c.momentum[2].data()};
+    const particle_real* f[3] = {c.force[0].data(),c.force[1].data(),
+        c.force[2].data()};
+    const int* bin = c.bin.data();
+
+    // the arrays of pointers are copied, they hold device addresses
+    #pragma omp target teams distribute parallel for map(to: x, v, p, f) \
+        is_device_ptr(ID,mass,bin,which,out)
+    for(long j=0;j<n;++j)
+    {
+        const long k = which[j];
+        migrant& m = out[j];
+        m.ID = ID[k];
+        for(int i=0;i<3;++i)
+        {
+            m.pos[i] = x[i][k];
+            m.vel[i] = v[i][k];
+            m.momentum[i] = p[i][k];
+            m.force[i] = f[i][k];
+        }
+        m.mass = mass[k];
+        m.bin = bin[k];
+    }
+}
+
+// the n particles of in into the columns, from particle at on
+inline void unpack(particle_columns& c, long at, long n, const migrant* in)
+{
+    particle_id_type* ID = c.ID.data();
+    particle_pos_type* x[3] = {c.pos[0].data(),c.pos[1].data(),
+        c.pos[2].data()};
+    particle_pos_type* v[3] = {c.vel[0].data(),c.vel[1].data(),
+        c.vel[2].data()};
+    particle_real* mass = c.mass.data();
+    particle_real* p[3] = {c.momentum[0].data(),c.momentum[1].data(),
+        c.momentum[2].data()};
+    particle_real* f[3] = {c.force[0].data(),c.force[1].data(),
+        c.force[2].data()};
+    Real* Phi = c.Phi.data();
+    Real* B[3] = {c.B[0].data(),c.B[1].data(),c.B[2].data()};
+    int* bin = c.bin.data();
+
+    #pragma omp target teams distribute parallel for \
+        map(to: x, v, p, f, B) is_device_ptr(ID,mass,Phi,bin,in)
+    for(long j=0;j<n;++j)
+    {
+        const long k = at + j;
+        const migrant& m = in[j];
+        ID[k] = m.ID;
+        for(int i=0;i<3;++i)
+        {
+            x[i][k] = m.pos[i];
+            v[i][k] = m.vel[i];
+            p[i][k] = m.momentum[i];
+            f[i][k] = m.force[i];
+            B[i][k] = 0;
+        }
+        mass[k] = m.mass;
+        Phi[k] = 0;
+        bin[k] = m.bin;
+    }
+}
+
+// momentum += dtau force, for the n particles
+inline void kick(particle_columns& c, long n, double dtau)
+{
+    for(int i=0;i<3;++i)
+    {
+        particle_real* p = c.momentum[i].data();
+        const particle_real* f = c.force[i].data();
+        #pragma omp target teams distribute parallel for is_device_ptr(p,f)
+        for(long k=0;k<n;++k)
+            p[k] += dtau*f[k];
+    }
+}
+
+/*
+    velocity = inv_a momentum and position += dtau velocity, for the n
+    particles; returns the maximum of momentum^2.
+*/
+inline double drift(particle_columns& c, long n, double dtau, double inv_a)
+{
+    particle_pos_type* x[3] = {c.pos[0].data(),c.pos[1].data(),
+        c.pos[2].data()};
+    particle_pos_type* v[3] = {c.vel[0].data(),c.vel[1].data(),
+        c.vel[2].data()};
+    const particle_real* p[3] = {c.momentum[0].data(),c.momentum[1].data(),
+        c.momentum[2].data()};
+    double p2max = 0;
+
+    #pragma omp target teams distribute parallel for map(to: x, v, p) \
+        map(tofrom: p2max) reduction(max: p2max)
+    for(long k=0;k<n;++k)
+    {
+        double p2 = 0;
+        for(int i=0;i<3;++i)
+        {
+            v[i][k] = inv_a*p[i][k];
+            x[i][k] += dtau*v[i][k];
+            p2 += p[i][k]*p[i][k];
+        }
+        p2max = std::max(p2max,p2);
+    }
+    return p2max;
+}
+
+// the sums of sum_particles, over the n particles
+inline particle_sums sums(particle_columns& c, long n)
+{
+    const particle_pos_type* x[3] = {c.pos[0].data(),c.pos[1].data(),
+        c.pos[2].data()};
+    const particle_real* p[3] = {c.momentum[0].data(),c.momentum[1].data(),
+        c.momentum[2].data()};
+    const particle_real* f[3] = {c.force[0].data(),c.force[1].data(),
+        c.force[2].data()};
+    const particle_real* q = c.mass.data();
+    double mass = 0, masspos = 0, massmom = 0, massacc = 0, max_pos = 0,
+           max_mom = 0;
+
+    #pragma omp target teams distribute parallel for map(to: x, p, f) \
+        map(tofrom: mass, masspos, massmom, massacc, max_pos, max_mom) \
+        reduction(+: mass, masspos, massmom, massacc) \
+        reduction(max: max_pos, max_mom) is_device_ptr(q)
+    for(long k=0;k<n;++k)
+    {
+        double v2 = 0, p2 = 0, a2 = 0;
+        for(int i=0;i<3;++i)
+        {
+            v2 += p[i][k]*p[i][k];
+            p2 += x[i][k]*x[i][k];
+            a2 += f[i][k]*f[i][k];
+            max_pos = std::max<double>(max_pos,std::abs(x[i][k]));
+            max_mom = std::max<double>(max_mom,std::abs(p[i][k]));
+        }
+        masspos += p2*q[k];
+        massmom += v2*q[k];
+        massacc += a2*q[k];
+        mass += q[k];
+    }
+
+    particle_sums s;
+    s.count = n;
+    s.mass = mass;
+    s.masspos = masspos;
+    s.massmom = massmom;
+    s.massacc = massacc;
+    s.max_pos = max_pos;
+    s.max_mom = max_mom;
+    return s;
+}
+
+} // namespace offload
+} // namespace gevolution
@@ -17,7 +17,6 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <set>
 #include <string>
 
 #include "gevolution/config.h"
@@ -114,23 +113,23 @@ void write_snapshot (
 //   tau            conformal time
 //   dtau           conformal time step
 //   dtau_old       conformal time step of previous cycle
-//   maxvel         maximum cdm velocity
 //   cycle          current simulation cycle
 //   h5filename     base name for HDF5 output file
 //   pcls_cdm       pointer to particle handler for CDM
 //   pcls_b         pointer to particle handler for baryons
 //   pcls_ncdm      array of particle handlers for
 //                  non-cold DM (may be set to NULL)
-//   phi            pointer to allocated field
-//   chi            pointer to allocated field
-//   Bi             pointer to allocated field
-//   Sij            pointer to allocated field
-//   BiFT           pointer to allocated field
-//   SijFT          pointer to allocated field
-//   plan_Bi        pointer to FFT planner
-//   plan_Sij       pointer to FFT planner
-//   done_hij       reference to tensor projection flag
-//   IDbacklog      IDs of particles written in previous cycle
+//   phi            pointer to the Newtonian potential in real space
+//   chi            pointer to chi in real space (may be NULL)
+//   Bi             pointer to the vector perturbation in real space (may
+//                  be NULL)
+//   Sij            pointer to the tensor perturbation in real space (may
+//                  be NULL)
+//   IDbacklog      IDs of particles written in previous cycle, updated
+//
+// The ghost cells of the fields must be up to date. The maps of the fields
+// that are NULL are not written. Each HEALPix shell is written as soon as
+// it is complete, so the map buffers hold one shell at a time.
 //
 // Returns:
 //
@@ -139,13 +138,12 @@ void write_snapshot (
 void writeLightcones (
     metadata &sim, const cosmology cosmo, const double a,
     const double tau, const double dtau, const double dtau_old,
-    const double maxvel, const int cycle, std::string h5filename,
+    const int cycle, std::string h5filename,
     Particles_gevolution *pcls_cdm,
     Particles_gevolution *pcls_b,
     Particles_gevolution *pcls_ncdm,
     Field<Real> *phi, Field<Real> *chi, Field<Real> *Bi, Field<Real> *Sij,
-    Field<Cplx> *BiFT, Field<Cplx> *SijFT, PlanFFT<Cplx> *plan_Bi,
-    PlanFFT<Cplx> *plan_Sij, int &done_hij, std::set<long> *IDbacklog);
+    id_backlog *IDbacklog);
 
 //////////////////////////
 // writeSpectra
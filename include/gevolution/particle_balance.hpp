@@ -0,0 +1,341 @@
+#pragma once
+
+#include "LATfield2.hpp"
+#include "gevolution/halo.hpp"
+#include "gevolution/particle_exchange.hpp"
+#include "gevolution/processor_grid.hpp"
+#include "gevolution/real_type.hpp"
+#include <algorithm>
+#include <vector>
+#include <mpi.h>
+#include <boost/mpi/datatype.hpp>
+
+/*
+    Particle domains weighted by the particles, for the particle phases of
+    a cycle, while the fields and FFTs keep the decomposition of LATfield2.
+
+    The lattice is split as LATfield2 does, direction 2 over the first
+    dimension of the processor grid and direction 1 over the second, but at
+    planes where the particles are shared evenly: the rows of planes of
+    constant coordinate 2 first, then each row on its own in direction 1
+    (weighted_blocks). The process at position (r0,r1) of the processor grid
+    holds domain (r0,r1), which starts as its lattice domain.
+
+    A domain has a box of its cells and of the upper layer of cells in
+    directions 1 and 2, the reach of CIC, where the particles deposit their
+    mass and read their forces: add_to folds the boxes into a field of the
+    lattice, fill copies a field into them. Both are one MPI_Alltoallv of
+    lines of direction 0, planned when the domains change.
+
+        particle_domains domains(lat);
+        domains.balance(count,coord);   // coord(k,i) of the local particles
+        ...
+        to.push_back(domains.owner(y,z));
+        domains.redistribute(leaving,to,arrived);
+        domains.add_to(box,rho);
+
+    All but the geometry and owner are collective over the processes of
+    the lattice.
+*/
+
+namespace gevolution
+{
+
+class particle_domains
+{
+    const LATfield2::Lattice* lat;
+    MPI_Comm com;
+    int rank, nproc;
+    int N, n, m;     // lattice size, processor grid
+    int g0, g1;      // position of this process in the processor grid
+
+    // position in the processor grid of each process, and the process at
+    // each position r0*m + r1
+    std::vector<int> pos0, pos1, process;
+
+    // the domains of LATfield2, and the particle domains: rows in
+    // direction 2 and, per row, columns in direction 1
+    site_blocks lattice_z, lattice_y, domain_z;
+    std::vector<site_blocks> domain_y;
+
+    // the lines of add_to and fill, grouped by process: their start in the
+    // box of this process, and the sites of the lattice domain of this
+    // process of the lines of the other boxes
+    std::vector<long> box_lines, lattice_lines;
+    std::vector<int> box_count, box_displ, lattice_count, lattice_displ;
+    mutable std::vector<Real> send, recv;
+
+    MPI_Datatype migrant_type{MPI_DATATYPE_NULL};
+
+    static int block_of(const site_blocks& b, int c)
+    {
+        return std::upper_bound(b.lo.begin(),b.lo.end(),c) - b.lo.begin() - 1;
+    }
+
+    static std::vector<int> displacements(const std::vector<int>& count)
+    {
+        std::vector<int> displ(count.size(),0);
+        for(std::size_t p=1;p<count.size();++p)
+            displ[p] = displ[p-1] + count[p-1];
+        return displ;
+    }
+
+    // C components of a line of direction 0
+    MPI_Datatype line_type(int C) const
+    {
+        MPI_Datatype line;
+        MPI_Type_contiguous(C*N,::boost::mpi::get_mpi_datatype<Real>(),&line);
+        MPI_Type_commit(&line);
+        return line;
+    }
+
+    void plan()
+    {
+        // the lines of the box of this process, by process of the lattice
+        const int ny = cells_y() + 1, nz = cells_z() + 1;
+        std::vector< std::vector<long> > by_process(nproc);
+        for(int z=0;z<nz;++z)
+            for(int y=0;y<ny;++y)
+                by_process[lattice_owner((first_y()+y)%N,(first_z()+z)%N)]
+                    .push_back(((long)z*ny + y)*N);
+        box_lines.clear();
+        box_count.assign(nproc,0);
+        for(int p=0;p<nproc;++p)
+        {
+            box_lines.insert(box_lines.end(),by_process[p].begin(),
+                by_process[p].end());
+            box_count[p] = by_process[p].size();
+        }
+        box_displ = displacements(box_count);
+
+        // the lines of the other boxes on the lattice domain of this
+        // process, in the order of their box
+        const int zlo = lattice_z.lo[g0], zlen = lattice_z.len[g0],
+                  ylo = lattice_y.lo[g1], ylen = lattice_y.len[g1];
+        lattice_lines.clear();
+        lattice_count.assign(nproc,0);
+        for(int p=0;p<nproc;++p)
+        {
+            const site_blocks& by = domain_y[pos0[p]];
+            const int y0 = by.lo[pos1[p]], z0 = domain_z.lo[pos0[p]];
+            const int pny = by.len[pos1[p]] + 1,
+                      pnz = domain_z.len[pos0[p]] + 1;
+            for(int z=0;z<pnz;++z)
+            {
+                const int lz = (z0+z)%N - zlo;
+                if(lz<0 || lz>=zlen)
+                    continue;
+                for(int y=0;y<pny;++y)
+                {
+                    const int ly = (y0+y)%N - ylo;
+                    if(ly<0 || ly>=ylen)
+                        continue;
+                    lattice_lines.push_back(local_site_index(*lat,0,ly,lz));
+                    lattice_count[p]++;
+                }
+            }
+        }
+        lattice_displ = displacements(lattice_count);
+    }
+
+    public:
+
+    // the lattice domains of lat, collective
+    explicit particle_domains(const LATfield2::Lattice& that_lat):
+        lat{&that_lat},
+        com{LATfield2::parallel.lat_world_comm()},
+        N{that_lat.size(0)},
+        n{LATfield2::parallel.grid_size()[0]},
+        m{LATfield2::parallel.grid_size()[1]},
+        g0{LATfield2::parallel.grid_rank()[0]},
+        g1{LATfield2::parallel.grid_rank()[1]}
+    {
+        MPI_Comm_rank(com,&rank);
+        MPI_Comm_size(com,&nproc);
+        MPI_Type_contiguous(sizeof(migrant),MPI_BYTE,&migrant_type);
+        MPI_Type_commit(&migrant_type);
+
+        const int mine[6] = {g0,g1,local_offset(*lat,2),lat->sizeLocal(2),
+                             local_offset(*lat,1),lat->sizeLocal(1)};
+        std::vector<int> all(6*nproc);
+        MPI_Allgather(mine,6,MPI_INT,all.data(),6,MPI_INT,com);
+        pos0.resize(nproc);
+        pos1.resize(nproc);
+        process.resize(n*m);
+        lattice_z.lo.resize(n);
+        lattice_z.len.resize(n);
+        lattice_y.lo.resize(m);
+        lattice_y.len.resize(m);
+        for(int p=0;p<nproc;++p)
+        {
+            const int* a = &all[6*p];
+            pos0[p] = a[0];
+            pos1[p] = a[1];
+            process[a[0]*m + a[1]] = p;
+            lattice_z.lo[a[0]] = a[2];
+            lattice_z.len[a[0]] = a[3];
+            lattice_y.lo[a[1]] = a[4];
+            lattice_y.len[a[1]] = a[5];
+        }
+        domain_z = lattice_z;
+        domain_y.assign(n,lattice_y);
+        plan();
+    }
+    particle_domains(const particle_domains&) = delete;
+    particle_domains& operator = (const particle_domains&) = delete;
+    ~particle_domains()
+    {
+        int finalized;
+        MPI_Finalized(&finalized);
+        if(!finalized)
+            MPI_Type_free(&migrant_type);
+    }
+
+    /*
+        New domains with the particles of all the processes shared evenly,
+        from the count local particles, particle k in the global cell
+        coord(k,i) in direction i.
+    */
+    template<class coord_type>
+    void balance(long count, coord_type coord)
+    {
+        std::vector<double> weight(N,0);
+        for(long k=0;k<count;++k)
+            weight[coord(k,2)] += 1;
+        MPI_Allreduce(MPI_IN_PLACE,weight.data(),N,MPI_DOUBLE,MPI_SUM,com);
+        domain_z = weighted_blocks(weight,n);
+
+        weight.assign((long)n*N,0);
+        for(long k=0;k<count;++k)
+            weight[(long)block_of(domain_z,coord(k,2))*N + coord(k,1)] += 1;
+        MPI_Allreduce(MPI_IN_PLACE,weight.data(),n*N,MPI_DOUBLE,MPI_SUM,com);
+        for(int r=0;r<n;++r)
+            domain_y[r] = weighted_blocks(std::vector<double>(
+                weight.begin()+(long)r*N,weight.begin()+(long)(r+1)*N),m);
+        plan();
+    }
+
+    // process of the domain, or of the lattice domain, of global cell (y,z)
+    int owner(int y, int z) const
+    {
+        const int r0 = block_of(domain_z,z);
+        return process[r0*m + block_of(domain_y[r0],y)];
+    }
+    int lattice_owner(int y, int z) const
+    {
+        return process[block_of(lattice_z,z)*m + block_of(lattice_y,y)];
+    }
+
+    // first global cell and cells of the domain in directions 1 and 2
+    int first_y() const { return domain_y[g0].lo[g1]; }
+    int first_z() const { return domain_z.lo[g0]; }
+    int cells_y() const { return domain_y[g0].len[g1]; }
+    int cells_z() const { return domain_z.len[g0]; }
+
+    // the cells of the domain, and its cell x, y, z (from its first)
+    long cells() const { return (long)N*cells_y()*cells_z(); }
+    long cell(int x, int y, int z) const
+    {
+        return ((long)z*cells_y() + y)*N + x;
+    }
+
+    // the sites of a component of the box, and its site x, y, z
+    long box_sites() const { return (long)N*(cells_y() + 1)*(cells_z() + 1); }
+    long box_site(int x, int y, int z) const
+    {
+        return ((long)z*(cells_y() + 1) + y)*N + x;
+    }
+
+    /*
+        Add the box of this process, of the components of F one after the
+        other, to the sites of F it folds onto.
+    */
+    void add_to(const std::vector<Real>& box, LATfield2::Field<Real>& F) const
+    {
+        const int C = F.components();
+        const long sites = box_sites();
+        send.resize(box_lines.size()*C*N);
+        recv.resize(lattice_lines.size()*C*N);
+        for(std::size_t j=0;j<box_lines.size();++j)
+            for(int c=0;c<C;++c)
+                std::copy_n(box.data() + c*sites + box_lines[j],N,
+                    send.data() + (j*C + c)*N);
+
+        MPI_Datatype line = line_type(C);
+        MPI_Alltoallv(send.data(),box_count.data(),box_displ.data(),line,
+            recv.data(),lattice_count.data(),lattice_displ.data(),line,com);
+        MPI_Type_free(&line);
+
+        LATfield2::Site x(*lat);
+        for(std::size_t j=0;j<lattice_lines.size();++j)
+            for(int c=0;c<C;++c)
+            {
+                const Real* r = recv.data() + (j*C + c)*N;
+                for(int i=0;i<N;++i)
+                {
+                    x.setIndex(lattice_lines[j] + i);
+                    F(x,c) += r[i];
+                }
+            }
+    }
+
+    // the components of F at the sites of the box, one after the other
+    void fill(const LATfield2::Field<Real>& F, std::vector<Real>& box) const
+    {
+        const int C = F.components();
+        const long sites = box_sites();
+        send.resize(lattice_lines.size()*C*N);
+        recv.resize(box_lines.size()*C*N);
+        {
+            LATfield2::Site x(*lat);
+            for(std::size_t j=0;j<lattice_lines.size();++j)
+                for(int c=0;c<C;++c)
+                {
+                    Real* s = send.data() + (j*C + c)*N;
+                    for(int i=0;i<N;++i)
+                    {
+                        x.setIndex(lattice_lines[j] + i);
+                        s[i] = F(x,c);
+                    }
+                }
+        }
+
+        MPI_Datatype line = line_type(C);
+        MPI_Alltoallv(send.data(),lattice_count.data(),lattice_displ.data(),
+            line,recv.data(),box_count.data(),box_displ.data(),line,com);
+        MPI_Type_free(&line);
+
+        box.resize(C*sites);
+        for(std::size_t j=0;j<box_lines.size();++j)
+            for(int c=0;c<C;++c)
+                std::copy_n(recv.data() + (j*C + c)*N,N,
+                    box.data() + c*sites + box_lines[j]);
+    }
+
+    /*
+        Send the migrants out[k] to the processes to[k] and append the
+        migrants sent to this process to in.
+    */
+    void redistribute(const std::vector<migrant>& out,
+        const std::vector<int>& to, std::vector<migrant>& in) const
+    {
+        std::vector<int> count(nproc,0), arriving(nproc);
+        for(int p : to)
+            count[p]++;
+        const std::vector<int> displ = displacements(count);
+        std::vector<int> next(displ);
+        std::vector<migrant> sorted(out.size());
+        for(std::size_t k=0;k<out.size();++k)
+            sorted[next[to[k]]++] = out[k];
+
+        MPI_Alltoall(count.data(),1,MPI_INT,arriving.data(),1,MPI_INT,com);
+        const std::vector<int> arriving_displ = displacements(arriving);
+        const std::size_t first = in.size();
+        in.resize(first + arriving_displ.back() + arriving.back());
+        MPI_Alltoallv(sorted.data(),count.data(),displ.data(),migrant_type,
+            in.data() + first,arriving.data(),arriving_displ.data(),
+            migrant_type,com);
+    }
+};
+
+} // namespace gevolution
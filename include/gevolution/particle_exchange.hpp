@@ -0,0 +1,182 @@
+#pragma once
+
+#include "LATfield2.hpp"
+#include "gevolution/Particles_gevolution.hpp"
+#include <cmath>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <mpi.h>
+
+/*
+    Migration of the particles that left the local domain, for the
+    moveParticles of Particles_gevolution and particles_soa.
+
+    A migrant carries only the variables that are not recomputed before
+    they are used (Phi and B are projected again by the engines), as plain
+    bytes: no per-particle packing. The exchange along one direction of the
+    processor grid only talks to the two neighbours, with non-blocking
+    messages in both ways at once, and keeps its buffers from one call to
+    the next. As in LATfield2, particles may move at most to the
+    neighbouring domain per call.
+
+        particle_exchange exchange;
+        ...
+        exchange.sort(lat,dx,leaving,1);   // out[0] down, out[1] up
+        exchange.run(1,arrived);
+*/
+
+namespace gevolution
+{
+
+using particle_id_type =
+    std::remove_reference_t<decltype(std::declval<particle&>().ID)>;
+using particle_pos_type =
+    std::remove_reference_t<decltype(std::declval<particle&>().pos[0])>;
+
+struct migrant
+{
+    particle_id_type ID;
+    particle_pos_type pos[3], vel[3];
+    particle_real mass;
+    particle_real momentum[3], force[3];
+    int bin;
+
+    static migrant from(const particle& p)
+    {
+        migrant m;
+        m.ID = p.ID;
+        for(int i=0;i<3;++i)
+        {
+            m.pos[i] = p.pos[i];
+            m.vel[i] = p.vel[i];
+            m.momentum[i] = p.momentum[i];
+            m.force[i] = p.force[i];
+        }
+        m.mass = p.mass;
+        m.bin = p.bin;
+        return m;
+    }
+
+    particle to_particle() const
+    {
+        particle p;
+        p.ID = ID;
+        for(int i=0;i<3;++i)
+        {
+            p.pos[i] = pos[i];
+            p.vel[i] = vel[i];
+            p.momentum[i] = momentum[i];
+            p.force[i] = force[i];
+        }
+        p.mass = mass;
+        p.bin = bin;
+        return p;
+    }
+};
+static_assert(std::is_trivially_copyable<migrant>::value,
+    "migrants are sent as raw bytes");
+
+// global cell of a position in direction i, N cells of width dx
+inline int cell_of(double pos, double dx, int N)
+{
+    const int c = (int)std::floor(pos/dx);
+    return c<0 ? 0 : (c>=N ? N-1 : c);
+}
+
+// first global coordinate of the local domain in direction i
+inline int local_offset(const LATfield2::Lattice& lat, int i)
+{
+    return i==0 ? 0 : lat.coordSkip()[i==1 ? 1 : 0];
+}
+
+class particle_exchange
+{
+    std::vector<migrant> out[2], in[2]; // [0] down, [1] up
+    MPI_Datatype type{MPI_DATATYPE_NULL};
+
+    public:
+
+    particle_exchange()
+    {
+        MPI_Type_contiguous(sizeof(migrant),MPI_BYTE,&type);
+        MPI_Type_commit(&type);
+    }
+    particle_exchange(const particle_exchange&) = delete;
+    particle_exchange& operator = (const particle_exchange&) = delete;
+    ~particle_exchange()
+    {
+        int finalized;
+        MPI_Finalized(&finalized);
+        if(!finalized)
+            MPI_Type_free(&type);
+    }
+
+    /*
+        Move the migrants of pending that leave the local domain in
+        direction dir (1 or 2) to the send buffers; the others stay.
+    */
+    void sort(const LATfield2::Lattice& lat, double dx,
+        std::vector<migrant>& pending, int dir)
+    {
+        out[0].clear();
+        out[1].clear();
+        const int N = lat.size(dir), lo = local_offset(lat,dir),
+                  nloc = lat.sizeLocal(dir);
+        std::size_t kept = 0;
+        for(const migrant& m : pending)
+        {
+            int d = cell_of(m.pos[dir],dx,N) - lo;
+            if(d<0) d += N;
+            if(d<nloc)
+                pending[kept++] = m;
+            else
+                out[d-nloc < N-d ? 1 : 0].push_back(m);
+        }
+        pending.resize(kept);
+    }
+
+    /*
+        Exchange the send buffers with the neighbours in direction dir and
+        append what arrives to arrived. Collective over the processes of
+        the same row (dir 1) or column (dir 2) of the processor grid.
+    */
+    void run(int dir, std::vector<migrant>& arrived)
+    {
+        using LATfield2::parallel;
+        const int g = dir==1 ? 1 : 0;
+        const int rank = parallel.grid_rank()[g],
+                  nproc = parallel.grid_size()[g];
+        if(nproc==1)
+            return;
+        MPI_Comm comm = dir==1 ? parallel.dim1_comm()[parallel.grid_rank()[0]]
+                               : parallel.dim0_comm()[parallel.grid_rank()[1]];
+        const int peer[2] = {(rank+nproc-1)%nproc, (rank+1)%nproc};
+
+        // way w sends to peer[w] and receives from peer[1-w], with tag w
+        long n_out[2] = {(long)out[0].size(),(long)out[1].size()},
+             n_in[2] = {0,0};
+        MPI_Request req[4];
+        for(int w=0;w<2;++w)
+        {
+            MPI_Irecv(&n_in[w],1,MPI_LONG,peer[1-w],w,comm,&req[w]);
+            MPI_Isend(&n_out[w],1,MPI_LONG,peer[w],w,comm,&req[2+w]);
+        }
+        MPI_Waitall(4,req,MPI_STATUSES_IGNORE);
+
+        for(int w=0;w<2;++w)
+        {
+            in[w].resize(n_in[w]);
+            MPI_Irecv(in[w].data(),(int)n_in[w],type,peer[1-w],2+w,comm,
+                &req[w]);
+            MPI_Isend(out[w].data(),(int)n_out[w],type,peer[w],2+w,comm,
+                &req[2+w]);
+        }
+        MPI_Waitall(4,req,MPI_STATUSES_IGNORE);
+
+        for(int w=0;w<2;++w)
+            arrived.insert(arrived.end(),in[w].begin(),in[w].end());
+    }
+};
+
+} // namespace gevolution
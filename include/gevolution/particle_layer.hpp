@@ -0,0 +1,248 @@
+#pragma once
+
+#include "LATfield2.hpp"
+#include "gevolution/particle_exchange.hpp"
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+#include <mpi.h>
+
+/*
+    Neighbour lookup of the particles within some distance of each other,
+    for the friends-of-friends halo finder and the short-range forces.
+
+    particle_layer appends to the arrays of the particles of a process the
+    copies of the particles of the neighbouring domains within a given
+    width of its boundaries (the halo layer, exchanged first along
+    direction 1, then along direction 2 with the copies, which covers the
+    corners). A value of the particles, e.g. a label, is then sent again
+    to the copies with update:
+
+        particle_layer layer;
+        layer.exchange(lat,dx,width,ID,pos);  // the copies follow the locals
+        changed = layer.update(label);
+
+    cell_grid sorts the particles by the cells of a periodic grid at least
+    one width wide, such that the neighbours of a particle are in the 27
+    cells around its own.
+
+    Positions are in units of the box, 3 per particle.
+*/
+
+namespace gevolution
+{
+
+class particle_layer
+{
+    // copy of a particle of a neighbouring domain
+    struct layer_copy
+    {
+        long long ID;
+        double pos[3];
+    };
+
+    // indices sent through the halo layer, and first index received,
+    // [direction-1][way], way 0 going down, 1 up
+    std::vector<long> sent_[2][2];
+    long received_[2][2];
+    std::vector<char> in_layer_;
+
+    static MPI_Comm comm(int dir)
+    {
+        using LATfield2::parallel;
+        return dir==1 ? parallel.dim1_comm()[parallel.grid_rank()[0]]
+                      : parallel.dim0_comm()[parallel.grid_rank()[1]];
+    }
+
+    /*
+        Send out[w] to the neighbour peer[w] in direction dir and receive
+        in[w] from the other one, as in particle_exchange. Collective over
+        the processes of the same row or column of the processor grid.
+    */
+    template<class T>
+    static void swap(int dir, std::vector<T> (&out)[2], std::vector<T> (&in)[2])
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+            "the halo layer is sent as raw bytes");
+        using LATfield2::parallel;
+        const int g = dir==1 ? 1 : 0;
+        const int rank = parallel.grid_rank()[g],
+                  nproc = parallel.grid_size()[g];
+        MPI_Comm c = comm(dir);
+        const int peer[2] = {(rank+nproc-1)%nproc, (rank+1)%nproc};
+
+        long n_out[2] = {(long)out[0].size(),(long)out[1].size()},
+             n_in[2] = {0,0};
+        MPI_Request req[4];
+        for(int w=0;w<2;++w)
+        {
+            MPI_Irecv(&n_in[w],1,MPI_LONG,peer[1-w],w,c,&req[w]);
+            MPI_Isend(&n_out[w],1,MPI_LONG,peer[w],w,c,&req[2+w]);
+        }
+        MPI_Waitall(4,req,MPI_STATUSES_IGNORE);
+
+        for(int w=0;w<2;++w)
+        {
+            in[w].resize(n_in[w]);
+            MPI_Irecv(in[w].data(),(int)(n_in[w]*sizeof(T)),MPI_BYTE,
+                peer[1-w],2+w,c,&req[w]);
+            MPI_Isend(out[w].data(),(int)(n_out[w]*sizeof(T)),MPI_BYTE,
+                peer[w],2+w,c,&req[2+w]);
+        }
+        MPI_Waitall(4,req,MPI_STATUSES_IGNORE);
+    }
+
+    static bool distributed(int dir)
+    {
+        return LATfield2::parallel.grid_size()[dir==1 ? 1 : 0] > 1;
+    }
+
+    public:
+
+    /*
+        Append to ID and pos the copies of the particles of the neighbours
+        within width of the boundaries of the local domain of lat, dx being
+        the lattice unit. Collective over the processes of the lattice.
+    */
+    void exchange(const LATfield2::Lattice& lat, double dx, double width,
+        std::vector<long long>& ID, std::vector<double>& pos)
+    {
+        const long nlocal = ID.size();
+        in_layer_.assign(nlocal,0);
+        for(int dir=1;dir<=2;++dir)
+        {
+            sent_[dir-1][0].clear();
+            sent_[dir-1][1].clear();
+            received_[dir-1][0] = received_[dir-1][1] = (long)ID.size();
+            if(not distributed(dir))
+                continue;
+
+            const double lo = local_offset(lat,dir)*dx,
+                         hi = (local_offset(lat,dir)+lat.sizeLocal(dir))*dx;
+            std::vector<layer_copy> out[2], in[2];
+            for(long k=0;k<(long)ID.size();++k)
+            {
+                const double x = pos[3*k+dir];
+                for(int w=0;w<2;++w)
+                    if(w==0 ? x-lo < width : hi-x < width)
+                    {
+                        sent_[dir-1][w].push_back(k);
+                        out[w].push_back({ID[k],
+                            {pos[3*k],pos[3*k+1],pos[3*k+2]}});
+                        if(k < nlocal)
+                            in_layer_[k] = 1;
+                    }
+            }
+            swap(dir,out,in);
+            for(int w=0;w<2;++w)
+            {
+                received_[dir-1][w] = (long)ID.size();
+                for(const layer_copy& c : in[w])
+                {
+                    ID.push_back(c.ID);
+                    pos.insert(pos.end(),c.pos,c.pos+3);
+                }
+            }
+        }
+    }
+
+    // whether local particle k was sent as a copy
+    bool sent(long k) const
+    {
+        return k < (long)in_layer_.size() && in_layer_[k];
+    }
+
+    /*
+        Send values, one per particle and copy, of the particles sent by
+        exchange to their copies; returns whether the value of a copy of
+        this process changed. Collective as exchange.
+    */
+    template<class T>
+    bool update(std::vector<T>& values)
+    {
+        bool changed = false;
+        for(int dir=1;dir<=2;++dir)
+        {
+            if(not distributed(dir))
+                continue;
+            std::vector<T> out[2], in[2];
+            for(int w=0;w<2;++w)
+                for(long k : sent_[dir-1][w])
+                    out[w].push_back(values[k]);
+            swap(dir,out,in);
+            for(int w=0;w<2;++w)
+                for(long i=0;i<(long)in[w].size();++i)
+                    if(values[received_[dir-1][w]+i] != in[w][i])
+                    {
+                        values[received_[dir-1][w]+i] = in[w][i];
+                        changed = true;
+                    }
+        }
+        return changed;
+    }
+};
+
+class cell_grid
+{
+    long nc;
+    std::vector<long> order;   // particles by cell
+    std::vector<long> sorted;  // cell of each entry of order
+
+    public:
+
+    // particles at pos in cells at least width wide
+    cell_grid(const std::vector<double>& pos, double width)
+    {
+        const long n = pos.size()/3;
+        nc = std::max(1l,std::min(1l<<20,(long)std::floor(1./width)));
+
+        auto cell = [&](long k, int i)
+        {
+            double x = pos[3*k+i] - std::floor(pos[3*k+i]);
+            return std::min(nc-1,(long)(x*nc));
+        };
+        std::vector<long> key(n);
+        order.resize(n);
+        for(long k=0;k<n;++k)
+        {
+            key[k] = (cell(k,2)*nc + cell(k,1))*nc + cell(k,0);
+            order[k] = k;
+        }
+        std::sort(order.begin(),order.end(),
+            [&](long i, long j){ return key[i] < key[j]; });
+        sorted.resize(n);
+        for(long s=0;s<n;++s)
+            sorted[s] = key[order[s]];
+    }
+
+    long size() const { return order.size(); }
+
+    // particle of entry s, the entries being sorted by cell
+    long particle(long s) const { return order[s]; }
+
+    long cell(long s) const { return sorted[s]; }
+
+    // entries [first,second) of cell c
+    std::pair<long,long> range(long c) const
+    {
+        const auto r = std::equal_range(sorted.begin(),sorted.end(),c);
+        return {r.first-sorted.begin(),r.second-sorted.begin()};
+    }
+
+    // the distinct cells around cell c, c included, in increasing order
+    void neighbours(long c, std::vector<long>& cells) const
+    {
+        const long x = c%nc, y = (c/nc)%nc, z = c/(nc*nc);
+        cells.clear();
+        for(int a=-1;a<=1;++a)
+        for(int b=-1;b<=1;++b)
+        for(int e=-1;e<=1;++e)
+            cells.push_back((((z+a+nc)%nc)*nc + (y+b+nc)%nc)*nc
+                            + (x+e+nc)%nc);
+        std::sort(cells.begin(),cells.end());
+        cells.erase(std::unique(cells.begin(),cells.end()),cells.end());
+    }
+};
+
+} // namespace gevolution
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <mpi.h>
+#include "LATfield2.hpp"
+#include "gevolution/diagnostics.hpp"
+
+/*
+    Load of the particle phases of a cycle on each process.
+
+    The lattice decomposition of LATfield2, and hence of the particles, is
+    geometric: once structures form, the processes holding the halos have
+    more particles to sample, interpolate and move than the others, and
+    the whole cycle waits for them. particle_load measures it: the number
+    of local particles and the wallclock time spent in the phases that
+    scale with it (sampling, forces, kick, drift, moveParticles), averaged
+    over the cycles since the previous diagnostics. The statistics over the
+    processes go through the diagnostics reduction, at no extra collective.
+
+    It only measures: with particle balance interval, particles_soa moves
+    the particles to domains of their own, weighted by the particles (see
+    particle_balance.hpp), and the report shows the imbalance that is left.
+
+        particle_load load;
+        {
+            particle_load::scope timed(load);
+            PM->sample(pcls,a);
+        }
+        ...
+        load.end_cycle();
+        load.diagnose(diag,pcls);
+        diag.reduce(com);
+        COUT << particle_load::report(diag,nproc);
+*/
+
+namespace gevolution
+{
+
+/*
+    Number of local particles of a container; found by argument-dependent
+    lookup, so that a container that knows it (particles_soa) need not be
+    walked cell by cell.
+*/
+template<class particle_container>
+long local_particles(const particle_container& pcls)
+{
+    long count = 0;
+    LATfield2::Site x(pcls.lattice());
+    for(x.first();x.test();x.next())
+        count += pcls.field()(x).size;
+    return count;
+}
+
+class particle_load
+{
+    double seconds{0};
+    long cycles{0};
+
+    public:
+
+    // adds the wallclock time of its scope to the load
+    class scope
+    {
+        particle_load& load;
+        double start;
+
+        public:
+        explicit scope(particle_load& that_load):
+            load{that_load}, start{MPI_Wtime()}
+        {}
+        scope(const scope&) = delete;
+        scope& operator = (const scope&) = delete;
+        ~scope() { load.seconds += MPI_Wtime() - start; }
+    };
+
+    void end_cycle() { ++cycles; }
+
+    /*
+        Local particle count and seconds per cycle, as sums, maxima and
+        (negated) minima; starts a new measurement.
+    */
+    template<class particle_container>
+    void diagnose(diagnostics& d, const particle_container& pcls)
+    {
+        const double count = local_particles(pcls);
+        // the first window has the sampling and forces of a cycle only
+        const double per_cycle = seconds/std::max(cycles,1l);
+
+        d.sum("load particles",count);
+        d.max("load max particles",count);
+        d.max("load -min particles",-count);
+        d.sum("load seconds",per_cycle);
+        d.max("load max seconds",per_cycle);
+        d.max("load -min seconds",-per_cycle);
+        seconds = 0;
+        cycles = 0;
+    }
+
+    // min, mean, max and imbalance (max/mean) over the nproc processes
+    static std::string report(const diagnostics& d, int nproc)
+    {
+        std::ostringstream o;
+        auto line = [&](const char* what, const std::string& key,
+                        const char* unit)
+        {
+            const double mean = d["load " + key]/nproc;
+            const double max = d["load max " + key];
+            o << " " << what << " per process: min " << -d["load -min " + key]
+              << unit << ", mean " << mean << unit << ", max " << max << unit
+              << " (imbalance " << (mean > 0 ? max/mean : 1.) << ")\n";
+        };
+        line("particles","particles","");
+        line("particle phases","seconds"," s");
+        return o.str();
+    }
+};
+
+} // namespace gevolution
@@ -1,11 +1,23 @@
 #pragma once
 
 #include "LATfield2.hpp"
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <initializer_list>
+#include <string>
 #include <boost/mpi/communicator.hpp>
 #include <boost/mpi/collectives.hpp>
+#include "gevolution/batched_fft.hpp"
+#include "gevolution/diagnostics.hpp"
 #include "gevolution/power.hpp"
+#include "gevolution/field_pool.hpp"
+#include "gevolution/async_output.hpp"
+#include "gevolution/halo.hpp"
+#include "gevolution/kspace_tables.hpp"
+#include "gevolution/mass_assignment.hpp"
+#include "gevolution/threading.hpp"
+#include <type_traits>
 
 namespace gevolution
 {
@@ -61,6 +73,53 @@ double show_mean(const F_type& F,int i=-1, int j=-1)
     const long N = F.lattice().size(0);
     return mean/N/N/N;
 }
+/*
+    Local parts of show_msq, show_mean and of the maximum of |F| over the
+    sites, or over the ghost cells, added to the diagnostics d as name.
+*/
+template<class F_type>
+double site_component(const F_type& F, const LATfield2::Site& x, int i, int j)
+{
+    return i<0 ? F(x) : (j<0 ? F(x,i) : F(x,i,j));
+}
+template<class F_type>
+void diagnose_msq(diagnostics& d, const std::string& name, const F_type& F,
+    int i=-1, int j=-1)
+{
+    double sum = 0;
+    LATfield2::Site x(F.lattice());
+    for(x.first();x.test();x.next())
+    {
+        const double v = site_component(F,x,i,j);
+        sum += v*v;
+    }
+    d.sum(name,sum);
+}
+template<class F_type>
+void diagnose_mean(diagnostics& d, const std::string& name, const F_type& F)
+{
+    double sum = 0;
+    LATfield2::Site x(F.lattice());
+    for(x.first();x.test();x.next())
+        sum += F(x);
+    const long N = F.lattice().size(0);
+    d.sum(name,sum/N/N/N);
+}
+template<class F_type>
+void diagnose_max_abs(diagnostics& d, const std::string& name,
+    const F_type& F, bool halo = false)
+{
+    using std::abs;
+    double m = 0;
+    LATfield2::Site x(F.lattice());
+    if(halo)
+        for(x.haloFirst();x.haloTest();x.haloNext())
+            m = std::max<double>(m,abs(F(x)));
+    else
+        for(x.first();x.test();x.next())
+            m = std::max<double>(m,abs(F(x)));
+    d.max(name,m);
+}
 template<class T, class field_type, class bin_op_type,class un_op_type>
 T reduce_field(
     const ::boost::mpi::communicator& com,
@@ -143,13 +202,13 @@ void apply_filter_kspace_scalar(
     functor_type f)
 {
     plan.execute(::LATfield2::FFT_FORWARD);
-    ::LATfield2::rKSite k(phi_FT.lattice());
     const double N = phi.lattice().size(0);
     const double inv_N3 = 1.0/N/N/N;
-    for (k.first(); k.test(); k.next())
-    {
-        phi_FT(k) *= f({k.coord(0),k.coord(1),k.coord(2)}) * inv_N3;
-    }
+    for_each_site<::LATfield2::rKSite>(phi_FT.lattice(),
+        [&](const ::LATfield2::rKSite& k)
+        {
+            phi_FT(k) *= f({k.coord(0),k.coord(1),k.coord(2)}) * inv_N3;
+        });
     phi_FT.updateHalo();
     plan.execute(LATfield2::FFT_BACKWARD);
     phi.updateHalo();
@@ -162,37 +221,73 @@ void apply_filter_kspace_vector(
     functor_type f)
 {
     plan.execute(::LATfield2::FFT_FORWARD);
-    ::LATfield2::rKSite k(phi_FT.lattice());
     const double N = phi.lattice().size(0);
     const double inv_N3 = 1.0/N/N/N;
-    for (k.first(); k.test(); k.next())
-    {
-        const double factor = f({k.coord(0),k.coord(1),k.coord(2)}) * inv_N3;
-        for(int i=0;i<3;++i)
-            phi_FT(k,i) *= factor;
-    }
+    for_each_site<::LATfield2::rKSite>(phi_FT.lattice(),
+        [&](const ::LATfield2::rKSite& k)
+        {
+            const double factor = f({k.coord(0),k.coord(1),k.coord(2)}) * inv_N3;
+            for(int i=0;i<3;++i)
+                phi_FT(k,i) *= factor;
+        });
+    phi_FT.updateHalo();
+    plan.execute(LATfield2::FFT_BACKWARD);
+    phi.updateHalo();
+}
+/*
+    Same with a filter tabulated once, e.g. to apply it every cycle.
+*/
+template<class field_type1, class field_type2, class fft_plan_type >
+void apply_filter_kspace_scalar(
+    field_type1 &phi, 
+    field_type2 &phi_FT,
+    fft_plan_type &plan,
+    const kspace_table& f)
+{
+    plan.execute(::LATfield2::FFT_FORWARD);
+    const double N = phi.lattice().size(0);
+    f.multiply(phi_FT,1.0/N/N/N);
     phi_FT.updateHalo();
     plan.execute(LATfield2::FFT_BACKWARD);
     phi.updateHalo();
 }
+template<class field_type1, class field_type2, class fft_plan_type >
+void apply_filter_kspace_vector(
+    field_type1 &phi, 
+    field_type2 &phi_FT,
+    fft_plan_type &plan,
+    const kspace_table& f)
+{
+    apply_filter_kspace_scalar(phi,phi_FT,plan,f);
+}
 
-template<typename complex_type, typename particle_container>
+template<
+    typename complex_type,
+    typename particle_container,
+    typename assignment_type = assignment::cic>
 class particle_mesh
 {
     public:
     using real_type = typename complex_type::value_type;
     using particle_type = typename particle_container::value_type;
+    using assignment_scheme = assignment_type;
+    static constexpr bool is_cic =
+        std::is_same<assignment_type,assignment::cic>::value;
     
     using real_field_type = LATfield2::Field<real_type>;
     using complex_field_type = LATfield2::Field<complex_type>;
     using site_type = LATfield2::Site;
     using fft_plan_type = LATfield2::PlanFFT<complex_type>;
+    using batched_fft_type = batched_fft<complex_type>;
     
     
     ::boost::mpi::communicator com;
     std::size_t my_size;
     LATfield2::Lattice lat,latFT;
     
+    // temporary fields and FFT plans, allocated once and reused
+    mutable field_pool<complex_type> scratch;
+    
     std::size_t size() const { return my_size;  }
     
     particle_mesh(unsigned int N,const MPI_Comm& that_com):
@@ -201,7 +296,8 @@ class particle_mesh
         lat(/* dims        = */ 3,
             /* size        = */ N,
             /* ghost cells = */ 2),
-        latFT(lat,0,LATfield2::Lattice::FFT::RealToComplex)
+        latFT(lat,0,LATfield2::Lattice::FFT::RealToComplex),
+        scratch(lat,latFT)
     {
     }
     
@@ -216,46 +312,93 @@ class particle_mesh
     
     void scalar_to_zero(real_field_type& F)
     {
-        site_type x(lat);
-        for(x.first();x.test();x.next())
-            F(x) = 0.0;
+        for_each_site(lat,[&F](const site_type& x){ F(x) = 0.0; });
         F.updateHalo();
     }
     
+    using halo_exchange_type = halo_exchange<real_type>;
     
-    std::array<double,4> test_velocities(const particle_container& pcls) const
+    /*
+        true if the site is at least 'depth' sites away from the boundary of
+        the local domain in the distributed directions 1 and 2, ie. a stencil
+        of that reach around x does not touch the ghost cells (direction 0 is
+        local and its ghost cells are filled by halo_exchange::begin)
+    */
+    bool is_interior(const site_type& x, int depth) const
     {
-        double mass{},massvel{},masspos{},massacc{};
-        int count{};
-        pcls.for_each(
-            [&mass,&massvel,&masspos,&massacc,&count]
-            (const particle_type& part, const site_type& /*xpart*/)
+        for(int d=1;d<3;++d)
+        {
+            const int l = x.coord(d) - lat.coordSkip()[2-d];
+            if(l < depth or l >= lat.sizeLocal(d) - depth)
+                return false;
+        }
+        return true;
+    }
+    
+    /*
+        Apply f to every site of the lattice L (which must share the
+        decomposition of the engine's lattice), while the ghost cells
+        exchange is in flight: first the interior sites, then wait for the
+        exchanges in 'halos', then the sites near the boundary.
+        precondition: the exchanges have been started with begin()
+    */
+    template<class function_type>
+    void for_each_site_overlapped(
+        const LATfield2::Lattice& L,
+        std::initializer_list<halo_exchange_type*> halos,
+        int depth,
+        function_type f) const
+    {
+        for_each_site(L,[&](const site_type& x)
             {
-               double v2 = 0,p2=0,a2=0;
-               for(int i=0;i<3;++i)
-               {
-                   v2 += part.momentum[i]*part.momentum[i];
-                   p2 += part.pos[i]*part.pos[i];
-                   a2 += part.force[i]*part.force[i];
-               }
-               masspos += p2*part.mass;
-               massvel += v2*part.mass;
-               massacc += a2*part.mass;
-               mass += part.mass;
-               count++;
-            }
-            );
-        LATfield2::parallel.sum(count);
-        LATfield2::parallel.sum(masspos);
-        LATfield2::parallel.sum(massvel);
-        LATfield2::parallel.sum(massacc);
-        LATfield2::parallel.sum(mass);
-        massvel /= mass;
-        masspos /= mass;
-        mass /= count;
-        massacc /= mass;
+                if(is_interior(x,depth))
+                    f(x);
+            });
+        for(auto h : halos)
+            h->end();
+        for_each_site(L,[&](const site_type& x)
+            {
+                if(not is_interior(x,depth))
+                    f(x);
+            });
+    }
+    
+    
+    /*
+        Local contributions of the particles to the diagnostics: their
+        number, mass, mass-weighted squares of position, momentum and force,
+        and the largest position and momentum component.
+    */
+    void diagnose_particles(diagnostics& d,
+        const particle_container& pcls) const
+    {
+        const particle_sums s = sum_particles(pcls);
+        d.sum("particles",s.count);
+        d.sum("mass",s.mass);
+        d.sum("mass pos^2",s.masspos);
+        d.sum("mass mom^2",s.massmom);
+        d.sum("mass acc^2",s.massacc);
+        d.max("max|position|",s.max_pos);
+        d.max("max|momentum|",s.max_mom);
+    }
+    
+    // mean mass and RMS of position, momentum and force, from reduced d
+    static std::array<double,4> particle_moments(const diagnostics& d)
+    {
         using std::sqrt;
-        return {mass,sqrt(masspos),sqrt(massvel),sqrt(massacc)};
+        const double mass = d["mass"];
+        return {mass/d["particles"],
+                sqrt(d["mass pos^2"]/mass),
+                sqrt(d["mass mom^2"]/mass),
+                sqrt(d["mass acc^2"]/(mass/d["particles"]))};
+    }
+    
+    std::array<double,4> test_velocities(const particle_container& pcls) const
+    {
+        diagnostics d;
+        diagnose_particles(d,pcls);
+        d.reduce(com);
+        return particle_moments(d);
     }
     
     
@@ -263,7 +406,8 @@ class particle_mesh
         const real_field_type& F, 
         const site_type& x,
         const std::array<real_type,3>& pos)const
-    // First order CIC gradient
+    // First order CIC gradient, or the gradient of the interpolation of the
+    // assignment scheme
     // precondition: F has valid ghost cells
     {
         const int N = size();
@@ -272,6 +416,9 @@ class particle_mesh
         std::array<real_type,3> ref_dist{0,0,0};
         for(int i=0;i<3;++i)
             ref_dist[i] = pos[i]/dx - x.coord(i);
+        
+        if constexpr (not is_cic)
+            return assignment::gradient<assignment_type>(F,x,ref_dist);
             
         std::array<real_type,3> grad{0,0,0};
         for(int i=0;i<3;++i)
@@ -289,11 +436,36 @@ class particle_mesh
         return grad;
     }
     
-    virtual std::string report(const particle_container& pcls, double a) const = 0;
+    /*
+        Diagnostics of the cycle, added locally to d: the sources once
+        sampled, the potentials once computed (with their means as "T00hom"
+        and "Phihom"); report formats them after d.reduce.
+    */
+    virtual void diagnose_sources(diagnostics& d) const = 0;
+    virtual void diagnose_potentials(diagnostics& d) const = 0;
+    virtual std::string report(const diagnostics& d) const = 0;
     virtual double density() const = 0;
     virtual double sum_phi() const = 0;
     virtual void clear_sources() = 0 ;
     virtual void sample(const particle_container& pcls, double a) = 0;
+    
+    /*
+        sample on two grids shifted by half a lattice spacing and average
+        them in Fourier space, see assignment::interlace; returns false if
+        the engine does not support it
+    */
+    virtual bool enable_interlacing() { return false; }
+    
+    /*
+        add the forces of the pairs of particles closer than cutoff to the
+        long-range forces of the mesh, see short_range_force; returns false
+        if the engine does not support it
+    */
+    virtual bool enable_short_range(
+        double /* split */, double /* cutoff */, double /* softening */)
+    {
+        return false;
+    }
     virtual void compute_potential(double fourpiG, double a, double Hc,double Omega) = 0;
     
     enum class force_reduction {
@@ -303,9 +475,41 @@ class particle_mesh
     virtual void compute_forces(
         particle_container& pcls, double fourpiG, double a, 
         force_reduction = force_reduction::assign) const = 0;
+    
+    /*
+        With time bins (see time_bins.hpp), compute_forces only updates the
+        particles of the bins up to max_active_bin, the others keep their
+        force; negative for all the particles.
+    */
+    int max_active_bin{-1};
+    
+    template<class P>
+    bool is_active(const P& part) const
+    {
+        return max_active_bin < 0 || part.bin <= max_active_bin;
+    }
     virtual ~particle_mesh(){}
     
     virtual void save_to_file( std::string  ) const = 0;
+    // the same fields as datasets of a single snapshot file
+    virtual void save_to_snapshot( h5_snapshot& ) const = 0;
+    
+    /*
+        Hibernation: the fields that carry over from one cycle to the next
+        are written to prefix + "_phi.h5", "_chi.h5", "_B.h5" (the metric
+        files of the restart settings) and read back from the metric files;
+        empty names are skipped. Collective.
+    */
+    virtual void save_restart( std::string prefix ) const = 0;
+    virtual void load_restart( const std::array<std::string,3>& ) = 0;
+    // the same fields, for incremental_checkpoint
+    virtual std::vector<real_field_type*> restart_fields() = 0;
+    /*
+        The fields of the lightcone maps, phi, chi, B and h_ij, in real
+        space; nullptr for those the engine does not evolve. Their ghost
+        cells are valid after complete_halos().
+    */
+    virtual std::array<real_field_type*,4> lightcone_fields() = 0;
     
     virtual std::array<real_type,3> momentum_to_velocity(
                           const std::array<real_type,3>& momentum,
@@ -318,14 +522,22 @@ class particle_mesh
                           const LATfield2::Site& xpart,
                           const real_type a) const = 0;
     
+    /*
+        complete any pending ghost cells exchange needed by
+        momentum_to_velocity and velocity_to_momentum, so that they can be
+        called from threads
+    */
+    virtual void complete_halos() const {}
+    
     void compute_velocities(particle_container& pcls, double a=1)
     {
-        pcls.for_each(
+        complete_halos();
+        for_each_particle(pcls,
             [&](particle_type &part, const site_type& xpart)
             {
                 std::array<real_type,3> velocity =
                     momentum_to_velocity(
-                        part.momentum,
+                        {part.momentum[0],part.momentum[1],part.momentum[2]},
                         {part.pos[0],part.pos[1],part.pos[2]},
                         xpart,
                         a);
@@ -339,26 +551,61 @@ class particle_mesh
     
     virtual void save_power_spectrum(std::string fname) const = 0;  
     
-    template<std::size_t N_components = 1 >
-    void save_field_power_spectrum(std::string fname, std::string suffix, 
-        const complex_field_type& F,
-        const real_type normalization = 1.0)  const 
+    // binning of the power spectra written by save_power_spectrum
+    spectrum_bins pk_bins;
+    
+    // if set, the spectrum files are written through it
+    async_output* output{nullptr};
+    
+    struct spectrum_output
+    {
+        std::string suffix;
+        const complex_field_type* F;
+    };
+    
+    /*
+        Write the power spectra of several fields, computed in one pass, to
+        fname + suffix: |k| in units of the fundamental mode, the number of
+        modes and the spectrum of each component.
+    */
+    void save_power_spectra(std::string fname,
+        std::initializer_list<spectrum_output> outputs) const
     {
-        auto power_F = power_spectrum<complex_field_type,N_components>(F);    
-        const int N_global = F.lattice().size(0);
-        const auto& com = LATfield2::parallel.my_comm;
-        if(com.rank()==0)
+        std::vector<const complex_field_type*> fields;
+        std::vector< std::pair<std::string,int> > files;
+        for(const auto& out : outputs)
         {
-            std::ofstream o(fname + suffix);
-            for(size_t i = 1;i<power_F.size();++i)
+            fields.push_back(out.F);
+            files.emplace_back(fname + out.suffix,out.F->components());
+        }
+        auto table = power_spectra(pk_bins,fields);
+        if(com.rank()!=0)
+            return;
+        
+        const std::size_t bytes =
+            sizeof(double)*(table.power.size()+2)*table.k.size();
+        auto write = [table=std::move(table),files=std::move(files)](MPI_Comm)
+        {
+            int col = 0;
+            for(const auto& [name,components] : files)
             {
-                o << i << " " << power_F[i].first ;
-                for(std::size_t j =0 ;j<N_components;++j)
-                    o << " " << power_F[i].second[j] ;
-                o << "\n";
+                std::ofstream o(name);
+                for(std::size_t b=0;b<table.k.size();++b)
+                {
+                    if(table.modes[b]==0)
+                        continue;
+                    o << table.k[b] << " " << table.modes[b];
+                    for(int c=0;c<components;++c)
+                        o << " " << table.power[col+c][b];
+                    o << "\n";
+                }
+                col += components;
             }
-        }
-    
+        };
+        if(output)
+            output->push(bytes,std::move(write));
+        else
+            write(MPI_COMM_SELF);
     }
 };
 
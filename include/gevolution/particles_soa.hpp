@@ -0,0 +1,1003 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "LATfield2.hpp"
+#include "gevolution/cic_kernels.hpp"
+#include "gevolution/halo.hpp"
+#ifdef GPU_OFFLOAD
+#include "gevolution/offload.hpp"
+#include <atomic>
+#include <mutex>
+#endif
+#include "gevolution/Particles_gevolution.hpp"
+#include "gevolution/diagnostics.hpp"
+#include "gevolution/particle_balance.hpp"
+#include "gevolution/particle_exchange.hpp"
+#include "gevolution/real_type.hpp"
+#include "gevolution/threading.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <mpi.h>
+
+namespace gevolution
+{
+
+/*
+    Structure-of-arrays particle storage.
+
+    Every particle variable lives in its own contiguous column and the
+    particles are sorted by the lattice cell they belong to, so that a loop
+    over a cell, or over all the particles, streams only the columns it uses.
+
+    The container mimics the part of the LATfield2::Particles interface used by
+    the PM engines: lattice(), res(), parts_info(), field()(x).parts,
+    field()(x).size, for_each and moveParticles. Its value_type is
+    particle_ref, a handle that exposes the variables of one particle with the
+    same names as gevolution::particle.
+
+    Initial conditions and I/O keep working on Particles_gevolution; the
+    container is built from it and copied back with copy_to.
+
+    With GPU_OFFLOAD the container also holds a copy of its columns on the
+    device, where the mass assignment and force interpolation of the
+    Newtonian CIC engine, kick, drift and moveParticles run (see offload.hpp).
+    Each copy is current or stale: the device steps first bring the device
+    copy up to date, any host access to the particles (field(), for_each,
+    operator [], the column accessors, copy_to) the host copy, so that host
+    code keeps working unchanged, at the price of the transfers.
+
+    rebalance moves the particles to the domains of particle_domains,
+    weighted by the particles, in the balanced layout: sorted by the cells
+    of their domain, which need not be the lattice domain of the process.
+    The CIC mass assignment and force interpolation of the Newtonian engine
+    (project_balanced, gather_balanced), the loops over the columns and
+    moveParticles, which keeps the layout, run there; copy_to still fills
+    the lattice domains. The accessors by site (field(), first_data,
+    for_each) need the lattice layout, which the container has until the
+    first rebalance.
+*/
+
+/*
+    Three components scattered over three columns.
+    Assignment copies the values, it never rebinds the handle.
+*/
+template<class T>
+struct component_ref
+{
+    T* c[3];
+
+    T& operator [] (int i) const { return *c[i]; }
+
+    component_ref& operator = (const component_ref& that)
+    {
+        for(int i=0;i<3;++i)
+            *c[i] = that[i];
+        return *this;
+    }
+    template<class array_type>
+    component_ref& operator = (const array_type& a)
+    {
+        for(int i=0;i<3;++i)
+            *c[i] = a[i];
+        return *this;
+    }
+};
+
+/*
+    Handle to one particle of a particles_soa container. Like a pointer, its
+    constness does not propagate to the particle.
+*/
+struct particle_ref
+{
+    particle_id_type& ID;
+    component_ref<particle_pos_type> pos, vel;
+    particle_real& mass;
+    component_ref<particle_real> momentum, force;
+    Real& Phi;
+    component_ref<Real> B;
+    int& bin;
+};
+
+class particles_soa
+{
+    public:
+    using value_type = particle_ref;
+
+    private:
+
+    const LATfield2::Lattice* lat;
+    particle_info info;
+    double dx;
+
+    std::vector<particle_id_type> ID;
+    std::vector<particle_pos_type> pos[3], vel[3];
+    std::vector<particle_real> mass, momentum[3], force[3];
+    std::vector<Real> Phi, B[3];
+    std::vector<int> bin;
+
+    // particles of the site with raw index i are [first[i],first[i+1])
+    std::vector<long> first;
+
+    template<class F>
+    void for_each_column(F f)
+    {
+        f(ID);
+        for(int i=0;i<3;++i) { f(pos[i]); f(vel[i]); }
+        f(mass);
+        for(int i=0;i<3;++i) { f(momentum[i]); f(force[i]); }
+        f(Phi);
+        for(int i=0;i<3;++i) f(B[i]);
+        f(bin);
+    }
+
+    // keep the particles listed in order, in that order
+    void gather(const std::vector<long>& order)
+    {
+        for_each_column([&order](auto& column)
+            {
+                std::remove_reference_t<decltype(column)> tmp(order.size());
+                for(std::size_t j=0;j<order.size();++j)
+                    tmp[j] = column[order[j]];
+                column.swap(tmp);
+            });
+    }
+
+    void push_back(const particle& p)
+    {
+        ID.push_back(p.ID);
+        for(int i=0;i<3;++i)
+        {
+            pos[i].push_back(p.pos[i]);
+            vel[i].push_back(p.vel[i]);
+            momentum[i].push_back(p.momentum[i]);
+            force[i].push_back(p.force[i]);
+            B[i].push_back(p.B[i]);
+        }
+        mass.push_back(p.mass);
+        Phi.push_back(p.Phi);
+        bin.push_back(p.bin);
+    }
+
+    particle get(long k) const
+    {
+        particle p;
+        p.ID = ID[k];
+        for(int i=0;i<3;++i)
+        {
+            p.pos[i] = pos[i][k];
+            p.vel[i] = vel[i][k];
+            p.momentum[i] = momentum[i][k];
+            p.force[i] = force[i][k];
+            p.B[i] = B[i][k];
+        }
+        p.mass = mass[k];
+        p.Phi = Phi[k];
+        p.bin = bin[k];
+        return p;
+    }
+
+    // global cell of particle k in direction i
+    int cell_coord(long k, int i) const
+    {
+        const int n = lat->size(i);
+        int c = (int)std::floor(pos[i][k]/dx);
+        return c<0 ? 0 : (c>=n ? n-1 : c);
+    }
+
+    // first global coordinate of the local domain, direction i
+    int local_offset(int i) const
+    {
+        return i==0 ? 0 : lat->coordSkip()[i==1 ? 1 : 0];
+    }
+
+    void sort_by_cell();
+    void migrate();
+    void migrate_balanced();
+
+    // the site accessors read first by the sites of the lattice
+    void require_lattice_layout(const char* what) const
+    {
+        if(balanced_)
+        {
+            std::cerr << " proc#" << LATfield2::parallel.rank()
+                      << ": error in particles_soa, " << what
+                      << " by site in the balanced layout" << std::endl;
+            LATfield2::parallel.abortForce();
+        }
+    }
+
+    // buffers of moveParticles, kept from one call to the next
+    particle_exchange exchange;
+    std::vector<migrant> pending;
+
+    // the balanced layout, see rebalance, first then by domain cell, and
+    // the box of the mass assignment and of the force interpolation
+    std::unique_ptr<particle_domains> domains;
+    bool balanced_{false};
+    mutable std::vector<Real> box;
+
+#ifdef GPU_OFFLOAD
+    // the particles of the device are in no particular order
+    mutable offload::particle_columns device;
+    mutable std::vector<Real> staging;
+    mutable std::atomic<bool> host_current{true}, device_current{false};
+    mutable std::mutex syncing;
+
+    // f(host column, device column) for all the columns
+    template<class F>
+    void for_each_column_pair(F f)
+    {
+        f(ID,device.ID);
+        for(int i=0;i<3;++i)
+        {
+            f(pos[i],device.pos[i]);
+            f(vel[i],device.vel[i]);
+        }
+        f(mass,device.mass);
+        for(int i=0;i<3;++i)
+        {
+            f(momentum[i],device.momentum[i]);
+            f(force[i],device.force[i]);
+        }
+        f(Phi,device.Phi);
+        for(int i=0;i<3;++i)
+            f(B[i],device.B[i]);
+        f(bin,device.bin);
+    }
+
+    /*
+        Bring the host copy up to date, sorted by cell; with edit, the
+        caller may change it and the device copy becomes stale. Safe to call
+        from threads.
+    */
+    void to_host(bool edit) const
+    {
+        if(not host_current)
+        {
+            std::lock_guard<std::mutex> lock(syncing);
+            if(not host_current)
+            {
+                auto& self = const_cast<particles_soa&>(*this);
+                const long n = size();
+                self.for_each_column_pair([n](auto& h, const auto& d)
+                    {
+                        d.download(h.data(),n);
+                    });
+                self.sort_by_cell();
+                host_current = true;
+            }
+        }
+        if(edit and device_current)
+            device_current = false;
+    }
+
+    // bring the device copy up to date, from the host
+    void to_device() const
+    {
+        if(device_current)
+            return;
+        auto& self = const_cast<particles_soa&>(*this);
+        const long n = size();
+        device.reserve(n,0);
+        self.for_each_column_pair([n](const auto& h, auto& d)
+            {
+                d.upload(h.data(),n);
+            });
+        device_current = true;
+    }
+
+    void move_on_device();
+#else
+    void to_host(bool) const {}
+#endif
+
+    public:
+
+    /*
+        Copy of a Particles_gevolution container, same lattice and species.
+    */
+    explicit particles_soa(Particles_gevolution& pcls):
+        lat{&pcls.lattice()},
+        info{*pcls.parts_info()},
+        dx{pcls.res()}
+    {
+        pcls.for_each([this](const particle& p, const LATfield2::Site&)
+            {
+                push_back(p);
+            });
+        sort_by_cell();
+    }
+    particles_soa(const particles_soa&) = delete;
+    particles_soa& operator = (const particles_soa&) = delete;
+
+    /*
+        Write the particles back into a Particles_gevolution container living
+        on the same lattice, e.g. before writing a snapshot.
+    */
+    void copy_to(Particles_gevolution& pcls) const
+    {
+        to_host(false);
+        LATfield2::Site x(*lat);
+        for(x.first();x.test();x.next())
+        {
+            auto& cell = pcls.field()(x);
+            cell.parts.clear();
+            cell.size = 0;
+            if(balanced_)
+                continue;
+            for(long k=first[x.index()];k<first[x.index()+1];++k)
+            {
+                cell.parts.push_back(get(k));
+                cell.size++;
+            }
+        }
+        if(not balanced_)
+            return;
+
+        // the particles go to their lattice domain, collective; Phi and B
+        // are not carried, as in moveParticles
+        std::vector<migrant> out(size()), in;
+        std::vector<int> to(size());
+        for(long k=0;k<size();++k)
+        {
+            out[k] = migrant::from(get(k));
+            to[k] = domains->lattice_owner(cell_coord(k,1),cell_coord(k,2));
+        }
+        domains->redistribute(out,to,in);
+        for(const migrant& m : in)
+        {
+            const particle p = m.to_particle();
+            int c[3];
+            for(int i=0;i<3;++i)
+                c[i] = cell_of(p.pos[i],dx,lat->size(i)) - local_offset(i);
+            x.setIndex(local_site_index(*lat,c[0],c[1],c[2]));
+            auto& cell = pcls.field()(x);
+            cell.parts.push_back(p);
+            cell.size++;
+        }
+    }
+
+    const LATfield2::Lattice& lattice() const { return *lat; }
+    double res() const { return dx; }
+    const particle_info* parts_info() const { return &info; }
+    particle_info* parts_info() { return &info; }
+
+    // number of local particles
+    long size() const { return ID.size(); }
+
+    /*
+        Contiguous columns, for loops over all the local particles.
+    */
+    particle_real* momentum_data(int i)
+    {
+        to_host(true);
+        return momentum[i].data();
+    }
+    particle_real* force_data(int i)
+    {
+        to_host(true);
+        return force[i].data();
+    }
+    particle_pos_type* pos_data(int i)
+    {
+        to_host(true);
+        return pos[i].data();
+    }
+    particle_pos_type* vel_data(int i)
+    {
+        to_host(true);
+        return vel[i].data();
+    }
+    const particle_pos_type* pos_data(int i) const
+    {
+        to_host(false);
+        return pos[i].data();
+    }
+    // particles of the site with raw index i are [first[i],first[i+1])
+    const long* first_data() const
+    {
+        require_lattice_layout("first_data");
+        to_host(false);
+        return first.data();
+    }
+
+    particle_ref operator [] (long k) const
+    {
+        to_host(true);
+        // the handle is shallow const, see particle_ref
+        auto& self = const_cast<particles_soa&>(*this);
+        auto three = [k](auto& column)
+        {
+            return component_ref<std::remove_reference_t<
+                decltype(column[0][0])> >
+                {{&column[0][k],&column[1][k],&column[2][k]}};
+        };
+        return particle_ref
+        {
+            self.ID[k],
+            three(self.pos), three(self.vel),
+            self.mass[k],
+            three(self.momentum), three(self.force),
+            self.Phi[k],
+            three(self.B),
+            self.bin[k]
+        };
+    }
+
+    /*
+        The particles of one cell, as in LATfield2::particleList.
+    */
+    class iterator
+    {
+        const particles_soa* p;
+        long k;
+        // range-for binds *it to an lvalue reference, so the handle is kept
+        // here
+        std::optional<particle_ref> current;
+
+        public:
+        iterator(const particles_soa* pcls, long index): p{pcls}, k{index} {}
+
+        particle_ref& operator * ()
+        {
+            current.emplace((*p)[k]);
+            return *current;
+        }
+        iterator& operator ++ () { ++k; return *this; }
+        bool operator != (const iterator& that) const { return k!=that.k; }
+        bool operator == (const iterator& that) const { return k==that.k; }
+    };
+    struct range
+    {
+        const particles_soa* p;
+        long b, e;
+        iterator begin() const { return {p,b}; }
+        iterator end() const { return {p,e}; }
+    };
+    struct cell
+    {
+        range parts;
+        long size;
+    };
+    class cell_table
+    {
+        const particles_soa* p;
+        public:
+        explicit cell_table(const particles_soa* pcls): p{pcls} {}
+        cell operator () (const LATfield2::Site& x) const
+        {
+            const long b = p->first[x.index()], e = p->first[x.index()+1];
+            return cell{range{p,b,e},e-b};
+        }
+    };
+    cell_table field() const
+    {
+        require_lattice_layout("field");
+        to_host(true);
+        return cell_table{this};
+    }
+
+    /*
+        Apply f(particle, site) to all local particles, cell by cell.
+    */
+    template<class function_type>
+    void for_each(function_type f) const
+    {
+        require_lattice_layout("for_each");
+        to_host(true);
+        LATfield2::Site x(*lat);
+        for(x.first();x.test();x.next())
+            for(long k=first[x.index()];k<first[x.index()+1];++k)
+            {
+                particle_ref part = (*this)[k];
+                f(part,x);
+            }
+    }
+
+    /*
+        Apply the periodic boundary conditions, send the particles that left
+        the local domain to the neighbouring processes and sort all the
+        particles by cell again. As for LATfield2, particles may move at most
+        to the neighbouring domain, in the lattice layout; in the balanced
+        layout they go to the process of their domain, wherever it is. This
+        is a collective call.
+    */
+    void moveParticles()
+    {
+#ifdef GPU_OFFLOAD
+        if(device_current && not balanced_)
+        {
+            move_on_device();
+            return;
+        }
+#endif
+        to_host(true);
+        const double box[3] = {dx*lat->size(0),dx*lat->size(1),dx*lat->size(2)};
+        for(int i=0;i<3;++i)
+            for(auto& x : pos[i])
+            {
+                if(x<0) x += box[i];
+                else if(x>=box[i]) x -= box[i];
+            }
+
+        if(balanced_)
+            migrate_balanced();
+        else
+            migrate();
+        sort_by_cell();
+    }
+
+    // whether the particles are in the balanced layout
+    bool balanced() const { return balanced_; }
+
+    /*
+        Weight the particle domains by the local particles of all the
+        processes and move the particles there, in the balanced layout.
+        This is a collective call.
+    */
+    void rebalance()
+    {
+        to_host(true);
+        if(not domains)
+            domains.reset(new particle_domains(*lat));
+        domains->balance(size(),
+            [this](long k, int i){ return cell_coord(k,i); });
+        balanced_ = true;
+        migrate_balanced();
+        sort_by_cell();
+    }
+
+    /*
+        The CIC density of the particles of the balanced layout, each of
+        mass m, added to rho on the lattice domains. This is a collective
+        call.
+    */
+    void project_balanced(Real m, LATfield2::Field<Real>& rho) const;
+
+    /*
+        The CIC interpolation of the three components of F at the particles
+        of the balanced layout of the bins up to max_active_bin (negative:
+        all): assigned to their force with mode 0, added with mode 1,
+        subtracted with mode -1. This is a collective call.
+    */
+    void gather_balanced(const LATfield2::Field<Real>& F, int max_active_bin,
+        int mode);
+
+#ifndef GPU_OFFLOAD
+    // the sums of sum_particles, over the columns in either layout
+    particle_sums sums() const
+    {
+        particle_sums s;
+        for(long k=0;k<size();++k)
+        {
+            double v2 = 0, p2 = 0, a2 = 0;
+            for(int i=0;i<3;++i)
+            {
+                v2 += momentum[i][k]*momentum[i][k];
+                p2 += pos[i][k]*pos[i][k];
+                a2 += force[i][k]*force[i][k];
+                s.max_pos = std::max<double>(s.max_pos,std::abs(pos[i][k]));
+                s.max_mom = std::max<double>(s.max_mom,
+                    std::abs(momentum[i][k]));
+            }
+            s.masspos += p2*mass[k];
+            s.massmom += v2*mass[k];
+            s.massacc += a2*mass[k];
+            s.mass += mass[k];
+            s.count++;
+        }
+        return s;
+    }
+#endif
+
+#ifdef GPU_OFFLOAD
+    /*
+        Steps of the cycle on the device copy.
+    */
+
+    // rho += the CIC density of the particles, each of mass m
+    void project_density(Real m, LATfield2::Field<Real>& rho) const
+    {
+        to_device();
+        const offload::site_map map(*lat,dx);
+        const long g = map.gross;
+        device.mesh.reserve(g);
+        offload::fill(g,device.mesh.data(),Real(0));
+        offload::deposit(size(),device.pos[0].data(),device.pos[1].data(),
+            device.pos[2].data(),map,m,device.mesh.data());
+
+        staging.resize(g);
+        device.mesh.download(staging.data(),g);
+        LATfield2::Site site(rho.lattice());
+        for(long s=0;s<g;++s)
+            if(staging[s] != 0)
+            {
+                site.setIndex(s);
+                rho(site) += staging[s];
+            }
+    }
+
+    /*
+        The CIC interpolation of the three components of F, with valid ghost
+        cells, at the particles of the bins up to max_active_bin (negative:
+        all): assigned to their force with mode 0, added with mode 1,
+        subtracted with mode -1.
+    */
+    void gather_forces(LATfield2::Field<Real>& F, int max_active_bin,
+        int mode)
+    {
+        to_device();
+        const offload::site_map map(*lat,dx);
+        const long g = map.gross;
+        staging.resize(3*g);
+        #pragma omp parallel
+        {
+            LATfield2::Site site(F.lattice());
+            #pragma omp for
+            for(long s=0;s<g;++s)
+            {
+                site.setIndex(s);
+                for(int i=0;i<3;++i)
+                    staging[i*g+s] = F(site,i);
+            }
+        }
+        device.mesh.reserve(3*g);
+        device.mesh.upload(staging.data(),3*g);
+        offload::gather(size(),device.pos[0].data(),device.pos[1].data(),
+            device.pos[2].data(),device.bin.data(),max_active_bin,map,
+            device.mesh.data(),device.force[0].data(),
+            device.force[1].data(),device.force[2].data(),mode);
+        host_current = false;
+    }
+
+    // momentum += dtau force
+    void kick(double dtau)
+    {
+        to_device();
+        offload::kick(device,size(),dtau);
+        host_current = false;
+    }
+
+    /*
+        velocity = inv_a momentum, the velocity of the Newtonian engine, and
+        position += dtau velocity; returns the local maximum of momentum^2.
+    */
+    double drift(double dtau, double inv_a)
+    {
+        to_device();
+        const double p2max = offload::drift(device,size(),dtau,inv_a);
+        host_current = false;
+        return p2max;
+    }
+
+    particle_sums sums() const
+    {
+        to_device();
+        return offload::sums(device,size());
+    }
+#endif
+};
+
+// the container knows its size, see particle_load
+inline long local_particles(const particles_soa& pcls)
+{
+    return pcls.size();
+}
+
+// on the device with GPU_OFFLOAD, see diagnose_particles
+inline particle_sums sum_particles(const particles_soa& pcls)
+{
+    return pcls.sums();
+}
+
+inline void particles_soa::sort_by_cell()
+{
+    const long nsites = balanced_ ? domains->cells() : lat->sitesLocalGross();
+    const long n = size();
+
+    std::vector<long> cell_of(n);
+    if(balanced_)
+        for(long k=0;k<n;++k)
+            cell_of[k] = domains->cell(cell_coord(k,0),
+                cell_coord(k,1)-domains->first_y(),
+                cell_coord(k,2)-domains->first_z());
+    else
+        for(long k=0;k<n;++k)
+            cell_of[k] = local_site_index(*lat,
+                cell_coord(k,0)-local_offset(0),
+                cell_coord(k,1)-local_offset(1),
+                cell_coord(k,2)-local_offset(2));
+
+    // counting sort, stable
+    first.assign(nsites+1,0);
+    for(long k=0;k<n;++k)
+        first[cell_of[k]+1]++;
+    for(long i=0;i<nsites;++i)
+        first[i+1] += first[i];
+
+    std::vector<long> next(first.begin(),first.end()-1), order(n);
+    for(long k=0;k<n;++k)
+        order[next[cell_of[k]]++] = k;
+    gather(order);
+}
+
+inline void particles_soa::migrate()
+{
+    // the particles out of the local domain leave the columns
+    const int lo1 = local_offset(1), lo2 = local_offset(2);
+    const int n1 = lat->sizeLocal(1), n2 = lat->sizeLocal(2);
+    pending.clear();
+    std::vector<long> staying;
+    staying.reserve(size());
+    for(long k=0;k<size();++k)
+    {
+        const int y = cell_coord(k,1) - lo1, z = cell_coord(k,2) - lo2;
+        if(y>=0 && y<n1 && z>=0 && z<n2)
+            staying.push_back(k);
+        else
+            pending.push_back(migrant::from(get(k)));
+    }
+    if((long)staying.size()!=size())
+        gather(staying);
+
+    for(int dir=1;dir<=2;++dir)
+    {
+        exchange.sort(*lat,dx,pending,dir);
+        exchange.run(dir,pending);
+    }
+    for(const auto& m : pending)
+        push_back(m.to_particle());
+}
+
+// the particles that leave the domain go to its process in one exchange
+inline void particles_soa::migrate_balanced()
+{
+    int rank;
+    MPI_Comm_rank(LATfield2::parallel.lat_world_comm(),&rank);
+    pending.clear();
+    std::vector<int> to;
+    std::vector<long> staying;
+    staying.reserve(size());
+    for(long k=0;k<size();++k)
+    {
+        const int p = domains->owner(cell_coord(k,1),cell_coord(k,2));
+        if(p==rank)
+            staying.push_back(k);
+        else
+        {
+            pending.push_back(migrant::from(get(k)));
+            to.push_back(p);
+        }
+    }
+    if((long)staying.size()!=size())
+        gather(staying);
+
+    std::vector<migrant> arrived;
+    domains->redistribute(pending,to,arrived);
+    for(const auto& m : arrived)
+        push_back(m.to_particle());
+}
+
+inline void particles_soa::project_balanced(Real m,
+    LATfield2::Field<Real>& rho) const
+{
+    to_host(false);
+    const particle_domains& d = *domains;
+    const int N = lat->size(0), ny = d.cells_y(), nz = d.cells_z();
+    const int y0 = d.first_y(), z0 = d.first_z();
+    box.assign(d.box_sites(),0);
+
+    // a plane deposits on the next one too, hence even planes first
+    for(int color=0;color<2;++color)
+    {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for(int z=color;z<nz;z+=2)
+        for(int y=0;y<ny;++y)
+        for(int x=0;x<N;++x)
+        {
+            const long c = d.cell(x,y,z);
+            if(first[c]==first[c+1])
+                continue;
+            Real u[3][cic::batch_size], q[cic::batch_size], cube[8] = {};
+            const int at[3] = {x,y0+y,z0+z};
+            cic::in_batches(range{this,first[c],first[c+1]},
+                [&](const particle_ref& p, int k)
+                {
+                    for(int i=0;i<3;++i)
+                        u[i][k] = p.pos[i]/dx - at[i];
+                    q[k] = m;
+                },
+                [&](int n) { cic::deposit(n,u[0],u[1],u[2],q,cube); });
+
+            // the corners in the order of cic::, x periodic in the box
+            const int x1 = (x+1)%N;
+            box[d.box_site(x,y,z)]       += cube[0];
+            box[d.box_site(x,y,z+1)]     += cube[1];
+            box[d.box_site(x,y+1,z)]     += cube[2];
+            box[d.box_site(x,y+1,z+1)]   += cube[3];
+            box[d.box_site(x1,y,z)]      += cube[4];
+            box[d.box_site(x1,y,z+1)]    += cube[5];
+            box[d.box_site(x1,y+1,z)]    += cube[6];
+            box[d.box_site(x1,y+1,z+1)]  += cube[7];
+        }
+    }
+    d.add_to(box,rho);
+}
+
+inline void particles_soa::gather_balanced(const LATfield2::Field<Real>& F,
+    int max_active_bin, int mode)
+{
+    to_host(true);
+    const particle_domains& d = *domains;
+    d.fill(F,box);
+    const int N = lat->size(0), ny = d.cells_y(), nz = d.cells_z();
+    const int y0 = d.first_y(), z0 = d.first_z();
+    const long sites = d.box_sites();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int z=0;z<nz;++z)
+    for(int y=0;y<ny;++y)
+    for(int x=0;x<N;++x)
+    {
+        const long c = d.cell(x,y,z);
+        if(first[c]==first[c+1])
+            continue;
+        const int x1 = (x+1)%N;
+        const long corner[8] = {
+            d.box_site(x,y,z),    d.box_site(x,y,z+1),
+            d.box_site(x,y+1,z),  d.box_site(x,y+1,z+1),
+            d.box_site(x1,y,z),   d.box_site(x1,y,z+1),
+            d.box_site(x1,y+1,z), d.box_site(x1,y+1,z+1)};
+        Real cube[24];
+        for(int i=0;i<3;++i)
+            for(int k=0;k<8;++k)
+                cube[8*i+k] = box[i*sites + corner[k]];
+
+        const int at[3] = {x,y0+y,z0+z};
+        Real u[3][cic::batch_size], f[3*cic::batch_size];
+        int n = 0;
+        cic::in_batches_if(range{this,first[c],first[c+1]},
+            [&](const particle_ref& p)
+            {
+                return max_active_bin < 0 || p.bin <= max_active_bin;
+            },
+            [&](const particle_ref& p, int k)
+            {
+                for(int i=0;i<3;++i)
+                    u[i][k] = p.pos[i]/dx - at[i];
+            },
+            [&](int batch)
+            {
+                n = batch;
+                cic::gather(n,u[0],u[1],u[2],3,cube,f);
+            },
+            [&](particle_ref& p, int k)
+            {
+                for(int i=0;i<3;++i)
+                    p.force[i] = mode==0 ? f[i*n+k]
+                                         : p.force[i] + mode*f[i*n+k];
+            });
+    }
+}
+
+#ifdef GPU_OFFLOAD
+/*
+    moveParticles on the device: only the particles leaving the local domain
+    go to the host, to particle_exchange, and the arrivals back to the
+    device. The last particles that stay fill the holes left by the others.
+*/
+inline void particles_soa::move_on_device()
+{
+    const offload::site_map map(*lat,dx);
+    const long n = size();
+    device.index.reserve(n);
+    const long nleave = offload::wrap_and_flag(n,device.pos[0].data(),
+        device.pos[1].data(),device.pos[2].data(),map,device.index.data());
+
+    // in the order of the columns, for reproducible runs
+    std::vector<long> leaving(nleave);
+    device.index.download(leaving.data(),nleave);
+    std::sort(leaving.begin(),leaving.end());
+    device.index.upload(leaving.data(),nleave);
+    device.migrants.reserve(nleave);
+    offload::pack(device,nleave,device.index.data(),device.migrants.data());
+    pending.resize(nleave);
+    device.migrants.download(pending.data(),nleave);
+
+    // holes below kept, filled from the particles that stay above it
+    const long kept = n - nleave;
+    std::vector<long> moves;
+    for(long k : leaving)
+        if(k < kept)
+            moves.push_back(k);
+    const long holes = moves.size();
+    for(long k=kept, j=holes;k<n;++k)
+        if(j<nleave && leaving[j]==k)
+            ++j;
+        else
+            moves.push_back(k);
+    device.index.reserve(2*holes);
+    device.index.upload(moves.data(),2*holes);
+    const long* to = device.index.data();
+    const long* from = to + holes;
+    device.for_each_column([holes,to,from](auto& column)
+        {
+            offload::move(holes,to,from,column.data());
+        });
+
+    for(int dir=1;dir<=2;++dir)
+    {
+        exchange.sort(*lat,dx,pending,dir);
+        exchange.run(dir,pending);
+    }
+
+    const long arrived = pending.size();
+    device.reserve(kept + arrived,kept);
+    device.migrants.reserve(arrived);
+    device.migrants.upload(pending.data(),arrived);
+    offload::unpack(device,kept,arrived,device.migrants.data());
+    for_each_column([kept,arrived](auto& column)
+        {
+            column.resize(kept + arrived);
+        });
+    host_current = false;
+}
+#endif
+
+/*
+    Mass assignment for particles_soa, same conventions as the LATfield2
+    projection used for Particles_gevolution: the species mass is taken from
+    the particle info and deposited as a density.
+*/
+inline void scalarProjectionCIC_project(
+    const particles_soa* pcls, LATfield2::Field<Real>* rho)
+{
+    const double dx = pcls->res();
+    const Real m = pcls->parts_info()->mass/(dx*dx*dx);
+
+    if(pcls->balanced())
+    {
+        pcls->project_balanced(m,*rho);
+        return;
+    }
+#ifdef GPU_OFFLOAD
+    pcls->project_density(m,*rho);
+#else
+    for_each_site_colored(pcls->lattice(),[&](const LATfield2::Site& xPart)
+        {
+            LATfield2::Site x(rho->lattice());
+            x.setIndex(xPart.index());
+
+            Real u[3][cic::batch_size], q[cic::batch_size], cube[8] = {};
+            cic::in_batches(pcls->field()(xPart).parts,
+                [&](const particle_ref& p, int k)
+                {
+                    for(int i=0;i<3;++i)
+                        u[i][k] = p.pos[i]/dx - xPart.coord(i);
+                    q[k] = m;
+                },
+                [&](int n) { cic::deposit(n,u[0],u[1],u[2],q,cube); });
+
+            (*rho)(x)       += cube[0];
+            (*rho)(x+2)     += cube[1];
+            (*rho)(x+1)     += cube[2];
+            (*rho)(x+1+2)   += cube[3];
+            (*rho)(x+0)     += cube[4];
+            (*rho)(x+0+2)   += cube[5];
+            (*rho)(x+0+1)   += cube[6];
+            (*rho)(x+0+1+2) += cube[7];
+        });
+#endif
+}
+
+} // namespace gevolution
@@ -1,141 +1,142 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <complex> // norm
-#include <vector>  // vector
-#include <utility> // pair
-#include <exception> // runtime_error
-#include <boost/mpi/communicator.hpp>
-#include <boost/mpi/collectives.hpp>
-#include <boost/mpi/inplace.hpp>
-#include <boost/serialization/utility.hpp>
+#include <vector>
+#include <mpi.h>
 #include "LATfield2.hpp"
+#include "gevolution/threading.hpp"
 
 namespace gevolution
 {
-    namespace detail
+    /*
+        Bins of |k|, in units of the fundamental mode, covering the modes of
+        a lattice from 1 to the corner sqrt(3) N/2, with a fixed number of
+        bins of equal width in log |k| or in |k|.
+    */
+    struct spectrum_bins
     {
-        template<typename T, std::size_t N>
-        auto operator + ( std::array<T,N> A, std::array<T,N> B )
+        int count{64};
+        bool log{true};
+
+        static double k_max(int N) { return std::sqrt(3.)*(N/2); }
+
+        // bin of the non-zero mode |k| = k
+        int index(double k, int N) const
         {
-            std::array<T,N> C;
-            for(std::size_t i=0;i<N;++i)
-                C[i] = A[i] + B[i];
-            return C;
+            const double km = k_max(N);
+            const double u = log ? std::log(k)/std::log(km)
+                                 : (k-1)/(km-1);
+            return std::min(count-1,std::max(0,int(u*count)));
         }
-        
-        // define this because boost::mpi does not support lambdas yet
-        template<typename T1, typename T2>
-        struct my_pair_sum
-        {
-            using value_type = typename std::pair<T1,T2>;
-            
-            value_type operator()(const value_type& x, const value_type& y)
-            {
-                return value_type{x.first+y.first,x.second+y.second};
-            }
-        };
-    } // namespace detail
-    // power spectrum of a scalar field
-    template<class complex_field_type, std::size_t N_components =1>
-    auto power_spectrum(const complex_field_type& F)
+    };
+
+    // result of power_spectra, per bin
+    struct power_table
     {
-        using complex_type = typename complex_field_type::value_type;
-        using real_type = typename complex_type::value_type;
-        using data_type = std::array<real_type,N_components>;
-        using std::norm;
-        const int N_global = F.lattice().size(1);
-        const real_type N6 = std::pow( 1.0*N_global , 6 );
-        const int k_nyquist = (N_global - 1)/2;
-        const int k_nyquist2 = k_nyquist*k_nyquist;
-        std::vector< 
-            std::pair<int, data_type > > pw(k_nyquist2);
-        
-        for(std::size_t i=0;i<pw.size();++i)
-        {
-            pw[i].first = 0;
-            for(std::size_t j=0;j<N_components;++j)
-                pw[i].second[j] = 0;
-        }
-        
-        auto signed_mode = [k_nyquist,N_global](int n)
+        std::vector<double> k;      // mean |k| of the modes of the bin
+        std::vector<double> modes;  // number of independent modes
+        std::vector< std::vector<double> > power; // [column][bin]
+    };
+
+    /*
+        Power spectra of several Fourier fields living on the same lattice,
+        in a single traversal. Every component of every field is a column
+        of the table, in the order of the fields. The sums are reduced with
+        MPI_SUM to rank 0 of com, where the table is complete; the other
+        ranks get the bins only.
+    */
+    template<class complex_field_type>
+    power_table power_spectra(
+        const spectrum_bins& bins,
+        const std::vector<const complex_field_type*>& fields,
+        MPI_Comm com = LATfield2::parallel.my_comm)
+    {
+        const LATfield2::Lattice& L = (*fields.begin())->lattice();
+        const int N = L.size(1);
+        const double N6 = std::pow(1.0*N,6);
+        const int k_nyquist = (N - 1)/2;
+
+        int ncols = 0;
+        for(auto F : fields)
+            ncols += F->components();
+        // per bin: number of modes, sum of |k|, sums of |F|^2
+        const int stride = ncols + 2;
+
+        auto signed_mode = [k_nyquist,N](int n)
         {
-            return n <= k_nyquist ? n : n-N_global;
+            return n <= k_nyquist ? n : n-N;
         };
-        
+
         // avoid doubly counting modes, this happens because we have a source
         // field which is real and the complex FFT has been done with FFTW
         // scheme of R2C, hence some modes are omited because of the halcomplex
         // symmetry, while other modes with complex conjugate counterpart are
         // still present.
-        auto unique_mode = [](std::array<int,3> k_mode)
+        auto unique_mode = [](const std::array<int,3>& k_mode)
         {
-            bool answer = true;
             for(auto k: k_mode)
             {
                 if(k<0)
-                    answer = false;
+                    return false;
                 else if(k>0)
                     break;
             }
-            
-            return answer;
+            return true;
         };
-        
-        //if(F.components()>1)
-        //    throw std::runtime_error(
-        //        "gevolution::power_spectrum only works for scalar fields");
-        
-        // accumulate modes on local grid
-        F.for_each( 
-            [&pw,&signed_mode,&unique_mode,&F](
-                const LATfield2::Site & x)
+
+        std::vector< std::vector<double> > partial(num_threads(),
+            std::vector<double>((long)bins.count*stride,0.));
+        for_each_site<LATfield2::rKSite>(L,
+            [&](const LATfield2::rKSite& x)
             {
                 std::array<int,3> k_modes;
-                double global_mode=0;
+                long k2 = 0;
                 for(int i=0;i<3;++i)
                 {
-                    int k_i = signed_mode( x.coord(i) );
-                    k_modes[i] = k_i;
-                    global_mode += k_i*k_i;
-                }
-                // size_t index = std::floor( std::sqrt(global_mode) + 0.5 );
-                size_t index = global_mode;
-                
-                if(unique_mode(k_modes) and index<pw.size())
-                {
-                    auto& [count,sum] = pw[index];
-                    ++count;
-                    using std::norm;
-                    
-                    for(std::size_t i=0;i<N_components;++i)
-                    {
-                        auto z2 = norm(F(x,i));
-                        sum[i] += z2;
-                    }
-                    
-                    // if(index==1)
-                    // {
-                    //     std::cerr << "gevolution::power_spectrum mode: " 
-                    //         << k_modes[0] << " " << k_modes[1] << " " << k_modes[2]
-                    //         << " value = " << z2
-                    //         << '\n';
-                    // }
+                    k_modes[i] = signed_mode( x.coord(i) );
+                    k2 += (long)k_modes[i]*k_modes[i];
                 }
+                if(k2==0 or not unique_mode(k_modes))
+                    return;
+
+                const double k = std::sqrt((double)k2);
+                double* sum = partial[thread_id()].data()
+                            + (long)bins.index(k,N)*stride;
+                sum[0] += 1;
+                sum[1] += k;
+                int col = 2;
+                using std::norm;
+                for(auto F : fields)
+                for(int c=0;c<F->components();++c)
+                    sum[col++] += norm((*F)(x,c));
             });
-        
-        const boost::mpi::communicator& com = LATfield2::parallel.my_comm;
-        ::boost::mpi::all_reduce(com,
-            ::boost::mpi::inplace_t< std::pair<int, data_type >* >(pw.data()),pw.size(),
-            detail::my_pair_sum<int, data_type>());
-        std::vector<real_type> average(pw.size());
-        for(std::size_t i=0;i<pw.size();++i)
+        for(std::size_t t=1;t<partial.size();++t)
+            for(std::size_t i=0;i<partial[0].size();++i)
+                partial[0][i] += partial[t][i];
+
+        std::vector<double>& sums = partial[0];
+        int rank;
+        MPI_Comm_rank(com,&rank);
+        MPI_Reduce(rank==0 ? MPI_IN_PLACE : sums.data(), sums.data(),
+            sums.size(), MPI_DOUBLE, MPI_SUM, 0, com);
+
+        power_table table;
+        table.k.resize(bins.count);
+        table.modes.resize(bins.count);
+        table.power.assign(ncols,std::vector<double>(bins.count,0.));
+        for(int b=0;b<bins.count;++b)
         {
-            if(pw[i].first>0)
-            for(std::size_t j=0;j<N_components;++j)
-            {
-                pw[i].second[j] /= (pw[i].first * N6);
-            }
+            const double* sum = sums.data() + (long)b*stride;
+            table.modes[b] = sum[0];
+            if(sum[0]==0)
+                continue;
+            table.k[b] = sum[1]/sum[0];
+            for(int col=0;col<ncols;++col)
+                table.power[col][b] = sum[col+2]/(sum[0]*N6);
         }
-        return pw;
+        return table;
     }
 } // namespace gevolution
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "gevolution/batched_fft.hpp"
+#include "gevolution/parser.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+/*
+    Choice of the 2D processor grid at startup.
+
+    LATfield2 distributes direction 2 of the lattice over the first dimension
+    (n) of the processor grid and direction 1 over the second (m). The probe
+    runs, on a candidate n x m grid, what dominates the communication of a
+    cycle: a forward and backward FFT of a scalar field through the pencil
+    transposes of batched_fft, and a ghost-cell exchange of the faces. It
+    runs before LATfield2 is initialized, on communicators of its own.
+
+    The lines of sites are split in blocks evenly, as LATfield2 does, or by
+    weights, for the particle domains of particle_balance.hpp.
+*/
+
+namespace gevolution
+{
+
+struct processor_grid
+{
+    int n, m;
+    double seconds; // of the probe, slowest process
+};
+
+/*
+    Value of Ngrid in a settings file, read by rank 0 of com and broadcast;
+    0 if it cannot be read.
+*/
+inline int settings_ngrid(const char* settingsfile, MPI_Comm com)
+{
+    int rank, N = 0;
+    MPI_Comm_rank(com,&rank);
+    if(rank==0)
+    {
+        if(FILE* file = std::fopen(settingsfile,"r"))
+        {
+            char line[PARAM_MAX_LINESIZE], pname[PARAM_MAX_LENGTH],
+                 pvalue[PARAM_MAX_LENGTH];
+            while(std::fgets(line,PARAM_MAX_LINESIZE,file))
+                if(readline(line,pname,pvalue) && std::string(pname)=="Ngrid")
+                    N = std::atoi(pvalue);
+            std::fclose(file);
+        }
+    }
+    MPI_Bcast(&N,1,MPI_INT,0,com);
+    return N;
+}
+
+/*
+    Up to 'count' factorizations n x m of nproc that fit a lattice of N^3
+    sites, the most square first.
+*/
+inline std::vector<processor_grid> grid_candidates(int nproc, int N,
+    int count = 4)
+{
+    std::vector<processor_grid> grids;
+    for(int n=1;n<=nproc;++n)
+        if(nproc%n==0 && n<=N && nproc/n<=N)
+            grids.push_back({n,nproc/n,0});
+    std::stable_sort(grids.begin(),grids.end(),
+        [](const processor_grid& a, const processor_grid& b)
+        {
+            return std::abs(std::log((double)a.n/a.m))
+                 < std::abs(std::log((double)b.n/b.m));
+        });
+    if((int)grids.size()>count)
+        grids.resize(count);
+    return grids;
+}
+
+// consecutive blocks of a line of sites, one per process of a line
+using site_blocks = detail::pencil_transform<double>::blocks;
+
+// total sites in parts blocks, as LATfield2 splits its lattice
+inline site_blocks even_blocks(int total, int parts)
+{
+    site_blocks b;
+    for(int r=0,lo=0;r<parts;++r)
+    {
+        const int len = total/parts + (r<total%parts);
+        b.lo.push_back(lo);
+        b.len.push_back(len);
+        lo += len;
+    }
+    return b;
+}
+
+/*
+    The sites of weight, 0 < parts <= weight.size(), in parts blocks of at
+    least one site, each ending where the running sum of the weights is
+    closest to its share of the total; the even blocks if all weights are 0.
+*/
+inline site_blocks weighted_blocks(const std::vector<double>& weight,
+    int parts)
+{
+    const int total = weight.size();
+    std::vector<double> sum(total+1,0);
+    for(int i=0;i<total;++i)
+        sum[i+1] = sum[i] + weight[i];
+    if(not (sum[total] > 0))
+        return even_blocks(total,parts);
+
+    site_blocks b;
+    for(int r=0,lo=0;r<parts;++r)
+    {
+        int hi = total;
+        if(r<parts-1)
+        {
+            const double share = sum[total]*(r+1)/parts;
+            hi = std::lower_bound(sum.begin(),sum.end(),share) - sum.begin();
+            if(hi>lo+1 && share-sum[hi-1] < sum[hi]-share)
+                --hi;
+            hi = std::clamp(hi,lo+1,total-(parts-1-r));
+        }
+        b.lo.push_back(lo);
+        b.len.push_back(hi-lo);
+        lo = hi;
+    }
+    return b;
+}
+
+/*
+    Time, in seconds, of the probe on an n x m grid, collective over com.
+*/
+inline double probe_grid(MPI_Comm com, int N, int n, int m, int repeat = 2)
+{
+    using pencil_type = detail::pencil_transform<double>;
+
+    int rank;
+    MPI_Comm_rank(com,&rank);
+    // rank = r0*m + r1, r0 along direction 2, r1 along direction 1
+    const int r0 = rank/m, r1 = rank%m;
+
+    pencil_type::line l1, l2;
+    MPI_Comm_split(com,r0,r1,&l1.comm);
+    MPI_Comm_split(com,r1,r0,&l2.comm);
+    l1.rank = r1;
+    l2.rank = r0;
+    l1.a = even_blocks(N,m);
+    l1.t = even_blocks(N/2+1,m);
+    l2.a = even_blocks(N,n);
+    l2.t = even_blocks(N,n);
+
+    double seconds = 0;
+    {
+        pencil_type pencil(N,1,l1,l2);
+        const int ly = l1.a.len[r1], lz = l2.a.len[r0], h = 2;
+        std::fill(pencil.real_data(),pencil.real_data()+(long)N*ly*lz,1.0);
+
+        // faces of the ghost-cell exchange, in both directions of each line
+        std::vector<double> face_y((long)N*lz*h), face_z((long)N*(ly+2*h)*h),
+                            recv_y(face_y.size()), recv_z(face_z.size());
+        auto exchange = [](MPI_Comm line, int r, int size,
+            std::vector<double>& send, std::vector<double>& recv)
+        {
+            for(int way=0;way<2;++way)
+                MPI_Sendrecv(send.data(),send.size(),MPI_DOUBLE,
+                    (r+(way ? size-1 : 1))%size,way,
+                    recv.data(),recv.size(),MPI_DOUBLE,
+                    (r+(way ? 1 : size-1))%size,way,line,MPI_STATUS_IGNORE);
+        };
+
+        // the first round is not timed
+        for(int i=0;i<=repeat;++i)
+        {
+            if(i==1)
+            {
+                MPI_Barrier(com);
+                seconds = MPI_Wtime();
+            }
+            pencil.forward();
+            pencil.backward();
+            exchange(l1.comm,r1,m,face_y,recv_y);
+            exchange(l2.comm,r0,n,face_z,recv_z);
+        }
+        seconds = MPI_Wtime() - seconds;
+    }
+    MPI_Allreduce(MPI_IN_PLACE,&seconds,1,MPI_DOUBLE,MPI_MAX,com);
+
+    MPI_Comm_free(&l1.comm);
+    MPI_Comm_free(&l2.comm);
+    return seconds/repeat;
+}
+
+/*
+    Probe the candidate grids for a lattice of N^3 sites, collective over
+    com. The fastest grid comes first.
+*/
+inline std::vector<processor_grid> tune_processor_grid(MPI_Comm com, int N)
+{
+    int nproc;
+    MPI_Comm_size(com,&nproc);
+    auto grids = grid_candidates(nproc,N);
+    for(auto& g : grids)
+        g.seconds = probe_grid(com,N,g.n,g.m);
+    std::stable_sort(grids.begin(),grids.end(),
+        [](const processor_grid& a, const processor_grid& b)
+        { return a.seconds < b.seconds; });
+    return grids;
+}
+
+} // namespace gevolution
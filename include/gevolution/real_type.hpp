@@ -7,4 +7,12 @@ namespace gevolution
 {
     using LATfield2::Real;
     typedef LATfield2::Imag Cplx;
+
+    /*
+        Positions, masses, momenta and forces of the particles. They stay
+        in double precision in the mixed-precision build (SINGLE), where the
+        fields and FFTs are float: the kicks and drifts accumulate small
+        changes over many steps.
+    */
+    typedef double particle_real;
 }
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "LATfield2.hpp"
+#include "gevolution/kspace_tables.hpp"
+#include "gevolution/particle_layer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/*
+    Short-range correction of the forces of a Newtonian particle-mesh
+    engine (P3M with the Gaussian split of the TreePM of Gadget-2).
+
+    The mesh forces only come from the long-range potential, the Fourier
+    modes of the potential being multiplied by exp(-k^2 r_s^2), and the
+    pairs of particles closer than the cutoff, a few r_s, add the rest of the
+    Newtonian force,
+
+        F = -G m d / (r^2+eps^2)^(3/2)
+              * (erfc(r/2r_s) + r/(r_s sqrt(pi)) exp(-r^2/4r_s^2)),
+
+    d being the separation from the source, and eps a Plummer softening,
+    such that the forces are resolved down to eps rather than to a few
+    lattice units.
+
+    The pairs are looked up in a cell_grid of cells of one cutoff over the
+    particles of the process and the copies of the particles of the
+    neighbouring domains within one cutoff (particle_layer), hence the
+    cutoff must be smaller than the local domain. Each particle sums the
+    forces of all its neighbours, the cells being shared among the
+    threads, so that no force is written twice.
+
+        short_range_force sr(1.25,4.5,0.05);    // lattice units
+        const auto L = sr.filter(N);            // per axis
+        phi_long_FT(k) = phi_FT(k)*L[k.coord(0)]*L[k.coord(1)]*L[k.coord(2)];
+        sr.add_forces(pcls,Gm,active,+1);  // after the mesh forces
+
+    split and softening are in lattice units, the cutoff in units of split.
+*/
+
+namespace gevolution
+{
+
+class short_range_force
+{
+    double split, cutoff, softening;
+    std::vector<double> shape; // of the force, in r^2/cutoff^2
+
+    static constexpr int table_size = 1024;
+
+    // nearest periodic image of a difference of positions
+    static double wrap(double d) { return d - std::round(d); }
+
+    public:
+
+    short_range_force(double that_split, double that_cutoff,
+        double that_softening):
+        split{that_split}, cutoff{that_cutoff*that_split},
+        softening{that_softening}
+    {
+        // tabulated in r^2, with r in units of split
+        shape.resize(table_size+2);
+        for(int i=0;i<=table_size+1;++i)
+        {
+            const double r = cutoff/split*std::sqrt((double)i/table_size);
+            shape[i] = std::erfc(r/2) + r/std::sqrt(M_PI)*std::exp(-r*r/4);
+        }
+    }
+
+    // the cutoff, in lattice units
+    double range() const { return cutoff; }
+
+    // exp(-k_n^2 r_s^2) of the modes of an axis of a lattice of size N
+    std::vector<double> filter(int N) const
+    {
+        const double rs = split/N;
+        std::vector<double> L;
+        for(Real k2 : kspace_axes::of(N).linear_k2)
+            L.push_back(std::exp(-k2*rs*rs));
+        return L;
+    }
+
+    /*
+        Add sign times the short-range force to the particles of pcls
+        selected by active, Gm being the coupling of a pair, such that the
+        Newtonian force is Gm/r^2 at separation r in units of the box. All
+        the particles are sources. Collective over the processes of the
+        lattice.
+    */
+    template<class particle_container, class active_type>
+    void add_forces(particle_container& pcls, double Gm,
+        const active_type& active, double sign) const
+    {
+        const LATfield2::Lattice& lat = pcls.lattice();
+        const double dx = pcls.res(), width = cutoff*dx;
+
+        std::vector<long long> ID;
+        std::vector<double> pos;
+        std::vector<char> target;
+        LATfield2::Site x(lat);
+        for(x.first();x.test();x.next())
+            for(const auto& p : pcls.field()(x).parts)
+            {
+                ID.push_back(p.ID);
+                for(int i=0;i<3;++i)
+                    pos.push_back(p.pos[i]);
+                target.push_back(active(p));
+            }
+        const long nlocal = ID.size();
+
+        particle_layer layer;
+        layer.exchange(lat,dx,width,ID,pos);
+        const cell_grid grid(pos,width);
+
+        std::vector<long> runs;  // first entry of each cell
+        for(long s=0;s<grid.size();s=grid.range(grid.cell(s)).second)
+            runs.push_back(s);
+
+        const double w2 = width*width, eps2 = softening*softening*dx*dx,
+                     scale = table_size/w2;
+        std::vector<double> force(3*nlocal,0.);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for(long r=0;r<(long)runs.size();++r)
+        {
+            const long own = grid.cell(runs[r]),
+                       end = grid.range(own).second;
+            std::vector<long> cells;
+            grid.neighbours(own,cells);
+            for(long s=runs[r];s<end;++s)
+            {
+                const long k = grid.particle(s);
+                if(k >= nlocal or not target[k])
+                    continue;
+                double f[3] = {0,0,0};
+                for(long c : cells)
+                {
+                    const auto range = grid.range(c);
+                    for(long t=range.first;t<range.second;++t)
+                    {
+                        const long j = grid.particle(t);
+                        double d[3], r2 = 0;
+                        for(int i=0;i<3;++i)
+                        {
+                            d[i] = wrap(pos[3*k+i]-pos[3*j+i]);
+                            r2 += d[i]*d[i];
+                        }
+                        if(r2 >= w2 or j==k)
+                            continue;
+
+                        const double u = r2*scale;
+                        const int b = (int)u;
+                        const double S = shape[b]
+                                       + (u-b)*(shape[b+1]-shape[b]);
+                        const double q = r2 + eps2;
+                        const double g = S/(q*std::sqrt(q));
+                        for(int i=0;i<3;++i)
+                            f[i] -= g*d[i];
+                    }
+                }
+                for(int i=0;i<3;++i)
+                    force[3*k+i] = sign*Gm*f[i];
+            }
+        }
+
+        long k = 0;
+        for(x.first();x.test();x.next())
+            for(auto& p : pcls.field()(x).parts)
+            {
+                if(target[k])
+                    for(int i=0;i<3;++i)
+                        p.force[i] += force[3*k+i];
+                ++k;
+            }
+    }
+};
+
+} // namespace gevolution
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "LATfield2.hpp"
+#include "gevolution/halo.hpp"
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+    Thread-parallel loops over the local part of a lattice.
+
+    With OpenMP enabled (meson option OPENMP) the planes of constant
+    coordinate in direction 2 are shared among the threads of each MPI
+    process, otherwise the loops are plain serial loops.
+
+    The functors must be safe to call concurrently for different sites; MPI
+    must not be called from inside them.
+*/
+
+namespace gevolution
+{
+
+inline int num_threads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+inline int thread_id()
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+namespace detail
+{
+    template<class site_type, class function_type>
+    void for_each_site_in_plane(
+        const LATfield2::Lattice& L, int z, function_type& f)
+    {
+        site_type x(L);
+        const int nx = L.sizeLocal(0), ny = L.sizeLocal(1);
+        for(int y=0;y<ny;++y)
+        for(int i=0;i<nx;++i)
+        {
+            x.setIndex(local_site_index(L,i,y,z));
+            f(x);
+        }
+    }
+} // namespace detail
+
+/*
+    Apply f to every local site of L.
+    Use site_type = LATfield2::rKSite for Fourier lattices.
+*/
+template<class site_type = LATfield2::Site, class function_type>
+void for_each_site(const LATfield2::Lattice& L, function_type f)
+{
+    const int nz = L.sizeLocal(2);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int z=0;z<nz;++z)
+        detail::for_each_site_in_plane<site_type>(L,z,f);
+}
+
+/*
+    Same as for_each_site, but planes closer than 'colors' are never processed
+    at the same time: with the default, even planes first, then odd planes.
+    This makes CIC-like deposits, which write to x and x+2 (and the other
+    directions), safe without atomics; deposits reaching n planes need
+    colors = n.
+*/
+template<class site_type = LATfield2::Site, class function_type>
+void for_each_site_colored(
+    const LATfield2::Lattice& L, function_type f, int colors = 2)
+{
+    const int nz = L.sizeLocal(2);
+    for(int color=0;color<colors;++color)
+    {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for(int z=color;z<nz;z+=colors)
+            detail::for_each_site_in_plane<site_type>(L,z,f);
+    }
+}
+
+/*
+    Apply f(particle, site) to all particles of the container.
+*/
+template<class particle_container, class function_type>
+void for_each_particle(particle_container& pcls, function_type f)
+{
+    for_each_site(pcls.lattice(),
+        [&pcls,&f](const LATfield2::Site& x)
+        {
+            for(auto& part : pcls.field()(x).parts)
+                f(part,x);
+        });
+}
+
+/*
+    Apply f(particle, site) to all particles of the container and reduce the
+    values it returns with op, starting from init. The reduction is local to
+    the process.
+*/
+template<class T, class particle_container, class function_type, class op_type>
+T transform_reduce_particles(
+    particle_container& pcls, T init, op_type op, function_type f)
+{
+    std::vector<T> partial(num_threads(),init);
+    for_each_site(pcls.lattice(),
+        [&](const LATfield2::Site& x)
+        {
+            T& acc = partial[thread_id()];
+            for(auto& part : pcls.field()(x).parts)
+                acc = op(acc,f(part,x));
+        });
+    for(const auto& p : partial)
+        init = op(init,p);
+    return init;
+}
+
+} // namespace gevolution
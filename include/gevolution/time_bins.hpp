@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "LATfield2.hpp"
+#include "gevolution/diagnostics.hpp"
+
+/*
+    Hierarchical (power-of-two) time bins of the particles.
+
+    The cycle keeps its global step and every particle drifts every cycle,
+    so that the sources stay synchronous. The kicks of a particle of bin b
+    are merged over 2^b cycles: it is kicked at the cycles c with
+    c mod 2^b == 0, with the forces of that cycle and the sum of the kick
+    steps since its previous kick. Cycle c is therefore the step of all the
+    bins up to active(c), and compute_forces only needs to update the
+    particles of these bins (particle_mesh::max_active_bin).
+
+    After its kick, a particle gets the bin of its step criterion
+
+        dtau_i = sqrt( eta dx a / |force| ),
+
+    the step over which the kick moves it by a fraction eta of a cell,
+    bounded by the bins active at that cycle: a particle goes to a finer bin
+    at any of its kicks, to a coarser one only when that bin starts a new
+    step together with it.
+
+        time_bins bins(sim.time_bins,sim.time_bin_accuracy);
+        PM->max_active_bin = bins.active(cycle);
+        PM->compute_forces(pcls,1.0,a);
+        bins.advance(dtau_eff);
+        for_each_particle(pcls,[&](auto& part, const Site&)
+            { bins.kick(part,cycle,a,dx); });
+        bins.kicked(cycle);
+*/
+
+namespace gevolution
+{
+
+class time_bins
+{
+    int bins;
+    double eta;
+    double step{0};            // last kick step of the finest bin
+    std::vector<double> pending; // kick steps since the last kick, per bin
+
+    public:
+
+    time_bins(int count, double accuracy):
+        bins{std::max(1,count)}, eta{accuracy}, pending(bins,0.)
+    {}
+
+    int count() const { return bins; }
+
+    // coarsest bin kicked at cycle c, every finer bin is kicked as well
+    int active(long cycle) const
+    {
+        int b = 0;
+        while(b+1 < bins && cycle % (2l << b) == 0)
+            ++b;
+        return b;
+    }
+
+    // adds the kick step of a cycle to all the bins
+    void advance(double dtau_eff)
+    {
+        step = dtau_eff;
+        for(auto& p : pending)
+            p += dtau_eff;
+    }
+
+    // the bins kicked at cycle c start over
+    void kicked(long cycle)
+    {
+        const int top = active(cycle);
+        for(int b=0;b<=top;++b)
+            pending[b] = 0;
+    }
+
+    // bin of a particle of force squared f2, at most top
+    int bin_of(double f2, double a, double dx, int top) const
+    {
+        if(f2 <= 0 || step <= 0)
+            return top;
+        const double dtau_i = std::sqrt(eta*dx*a/std::sqrt(f2));
+        const int b = (int)std::floor(std::log2(dtau_i/step));
+        return std::max(0,std::min(top,b));
+    }
+
+    /*
+        Kick part if its bin is active at cycle c, with the steps merged
+        since its previous kick, and move it to the bin of its criterion.
+    */
+    template<class particle_type>
+    void kick(particle_type& part, long cycle, double a, double dx) const
+    {
+        const int top = active(cycle);
+        if(part.bin > top)
+            return;
+        const double dtau_kick = pending[std::min<int>(part.bin,bins-1)];
+        double f2 = 0;
+        for(int i=0;i<3;++i)
+        {
+            part.momentum[i] += dtau_kick * part.force[i];
+            f2 += part.force[i]*part.force[i];
+        }
+        part.bin = bin_of(f2,a,dx,top);
+    }
+
+    // local occupation of the bins, as "time bin <b>"
+    template<class particle_container>
+    void diagnose(diagnostics& d, const particle_container& pcls) const
+    {
+        std::vector<long> occupation(bins,0);
+        pcls.for_each([&](const auto& part, const LATfield2::Site&)
+            {
+                ++occupation[std::min<int>(part.bin,bins-1)];
+            });
+        for(int b=0;b<bins;++b)
+            d.sum("time bin " + std::to_string(b),occupation[b]);
+    }
+};
+
+} // namespace gevolution
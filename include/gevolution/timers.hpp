@@ -0,0 +1,280 @@
+#pragma once
+
+#include "gevolution/config.h"
+#include "gevolution/memory_usage.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+    Timers of the phases of a cycle, compiled in with BENCHMARK.
+
+    A phase_timer adds the wallclock time of its scope to its phase; report
+    reduces the times accumulated since the previous report over the
+    processes (minimum, maximum and mean) and rank 0 appends one line per
+    phase to a text file:
+
+        cycle phase calls min max mean rss_max rss_mean
+              [cycles instructions cache-misses]
+
+    rss is the peak resident set of a process during the phase, in MB, the
+    maximum and mean over the processes of its largest value since the
+    previous report; the high-water mark of the process is reset at the
+    start of each phase where the kernel allows it, otherwise it is the
+    peak since the start of the run.
+
+    With counters the hardware counters are opened with perf_event_open on
+    every thread of the OpenMP team, from a parallel region, then read
+    around each phase and summed over the threads and the processes; the
+    threads of a team larger than the one at construction are not counted.
+    They are skipped, with a single message, where the kernel does not
+    allow them.
+
+        {
+            phase_timer timed(timers,phase::sample);
+            PM->sample(pcls,a);
+        }
+*/
+
+namespace gevolution
+{
+
+enum class phase
+{
+    clear_sources, sample, potential, forces, kick, drift, move, output,
+    count
+};
+
+inline const char* phase_name(phase p)
+{
+    static const char* names[] = {"clear_sources","sample",
+        "compute_potential","compute_forces","kick","drift",
+        "moveParticles","output"};
+    return names[static_cast<int>(p)];
+}
+
+class phase_timers
+{
+    static constexpr int nphases = static_cast<int>(phase::count);
+    static constexpr int ncounters = 3;
+
+    std::array<double,nphases> seconds{};
+    std::array<long long,nphases> calls{};
+    std::array<double,nphases> peak{};   // resident, bytes
+    std::array< std::array<double,ncounters>,nphases > counts{};
+    std::vector< std::array<int,ncounters> > fd; // per thread
+
+    std::string filename;
+    bool header_written{false};
+
+    void read_counters(std::array<uint64_t,ncounters>& v) const
+    {
+#ifdef __linux__
+        v.fill(0);
+        for(const auto& f : fd)
+            for(int c=0;c<ncounters;++c)
+            {
+                uint64_t n;
+                if(f[c] >= 0 && ::read(f[c],&n,sizeof(n)) == sizeof(n))
+                    v[c] += n;
+            }
+#else
+        v.fill(0);
+#endif
+    }
+
+    friend class phase_timer;
+
+    public:
+
+    phase_timers(const std::string& report_file, bool counters):
+        filename{report_file}
+    {
+#if defined(BENCHMARK) && defined(__linux__)
+        if(!counters)
+            return;
+        const uint64_t config[ncounters] = {PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,PERF_COUNT_HW_CACHE_MISSES};
+        int nthreads = 1;
+#ifdef _OPENMP
+        nthreads = omp_get_max_threads();
+#endif
+        fd.assign(nthreads,{-1,-1,-1});
+
+        // a counter of the calling thread only, on each thread of the team,
+        // which persist from one parallel region to the next
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads)
+#endif
+        {
+#ifdef _OPENMP
+            const int t = omp_get_thread_num();
+#else
+            const int t = 0;
+#endif
+            for(int c=0;c<ncounters;++c)
+            {
+                perf_event_attr attr;
+                std::memset(&attr,0,sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = config[c];
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                fd[t][c] = syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+            }
+        }
+        int ok = 1, all;
+        for(const auto& f : fd)
+            ok = ok && f[0] >= 0;
+        MPI_Allreduce(&ok,&all,1,MPI_INT,MPI_MIN,MPI_COMM_WORLD);
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+        if(!all)
+        {
+            for(auto& f : fd)
+                for(int& c : f)
+                    if(c >= 0)
+                        ::close(c);
+            fd.clear();
+            if(rank==0)
+                std::cout << " hardware counters are not available "
+                             "(perf_event_paranoid?), timing only"
+                          << std::endl;
+        }
+#else
+        (void)counters;
+#endif
+    }
+    phase_timers(const phase_timers&) = delete;
+    phase_timers& operator = (const phase_timers&) = delete;
+    ~phase_timers()
+    {
+#ifdef __linux__
+        for(const auto& f : fd)
+            for(int c : f)
+                if(c >= 0)
+                    ::close(c);
+#endif
+    }
+
+    /*
+        Append the statistics since the previous report to the file and
+        start over, collective over com.
+    */
+    void report(MPI_Comm com, int cycle)
+    {
+#ifdef BENCHMARK
+        int rank, nproc;
+        MPI_Comm_rank(com,&rank);
+        MPI_Comm_size(com,&nproc);
+        std::array<double,nphases> tmin, tmax, tsum;
+        MPI_Reduce(seconds.data(),tmin.data(),nphases,MPI_DOUBLE,MPI_MIN,0,
+            com);
+        MPI_Reduce(seconds.data(),tmax.data(),nphases,MPI_DOUBLE,MPI_MAX,0,
+            com);
+        MPI_Reduce(seconds.data(),tsum.data(),nphases,MPI_DOUBLE,MPI_SUM,0,
+            com);
+        std::array<double,nphases> pmax, psum;
+        MPI_Reduce(peak.data(),pmax.data(),nphases,MPI_DOUBLE,MPI_MAX,0,com);
+        MPI_Reduce(peak.data(),psum.data(),nphases,MPI_DOUBLE,MPI_SUM,0,com);
+        auto csum = counts;
+        MPI_Reduce(rank==0 ? MPI_IN_PLACE : counts.data(),csum.data(),
+            nphases*ncounters,MPI_DOUBLE,MPI_SUM,0,com);
+        const bool with_counters = !fd.empty();
+
+        if(rank==0)
+        {
+            std::ofstream o(filename,header_written ? std::ios::app
+                                                    : std::ios::trunc);
+            if(!header_written)
+            {
+                o << "# cycle phase calls min max mean rss_max rss_mean";
+                if(with_counters)
+                    o << " cycles instructions cache-misses";
+                o << "\n";
+                header_written = true;
+            }
+            for(int p=0;p<nphases;++p)
+            {
+                o << cycle << " " << phase_name(static_cast<phase>(p))
+                  << " " << calls[p] << std::setprecision(6)
+                  << " " << tmin[p] << " " << tmax[p] << " "
+                  << tsum[p]/nproc << " " << pmax[p]/1048576. << " "
+                  << psum[p]/nproc/1048576.;
+                if(with_counters)
+                    for(int c=0;c<ncounters;++c)
+                        o << " " << csum[p][c];
+                o << "\n";
+            }
+        }
+        seconds.fill(0);
+        calls.fill(0);
+        peak.fill(0);
+        for(auto& c : counts)
+            c.fill(0);
+#else
+        (void)com;
+        (void)cycle;
+#endif
+    }
+};
+
+// adds the time of its scope to a phase
+class phase_timer
+{
+#ifdef BENCHMARK
+    phase_timers& timers;
+    int p;
+    double start;
+    std::array<uint64_t,phase_timers::ncounters> count0;
+#endif
+
+    public:
+
+    phase_timer(phase_timers& that_timers, phase that_phase)
+#ifdef BENCHMARK
+        : timers{that_timers}, p{static_cast<int>(that_phase)}
+    {
+        reset_peak_resident();
+        timers.read_counters(count0);
+        start = MPI_Wtime();
+    }
+#else
+    {
+        (void)that_timers;
+        (void)that_phase;
+    }
+#endif
+    phase_timer(const phase_timer&) = delete;
+    phase_timer& operator = (const phase_timer&) = delete;
+    ~phase_timer()
+    {
+#ifdef BENCHMARK
+        timers.seconds[p] += MPI_Wtime() - start;
+        ++timers.calls[p];
+        timers.peak[p] = std::max(timers.peak[p],peak_resident_bytes());
+        std::array<uint64_t,phase_timers::ncounters> count1;
+        timers.read_counters(count1);
+        for(int c=0;c<phase_timers::ncounters;++c)
+            timers.counts[p][c] += count1[c] - count0[c];
+#endif
+    }
+};
+
+} // namespace gevolution
@@ -1,135 +1,118 @@
 #include "gevolution/Particles_gevolution.hpp"
+#include "gevolution/halo.hpp"
+#include "gevolution/particle_exchange.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+#include <vector>
 
 namespace gevolution
 {
-void Particles_gevolution::saveGadget2 (
-    std::string filename, gadget2_header &hdr, const int tracer_factor)
-    const
-{
-    float *posdata;
-    float *veldata;
-    void *IDs;
-    MPI_File outfile;
-    long count, npart;
-    MPI_Offset offset_pos, offset_vel, offset_ID;
-    MPI_Status status;
-    uint32_t blocksize;
-    uint32_t i;
-    char fname[filename.length () + 8];
-    
-    double rescale_vel = 1. / sqrt (hdr.time) / GADGET_VELOCITY_CONVERSION;
-
-    filename.copy (fname, filename.length ());
-    fname[filename.length ()] = '\0';
-
-    Site xPart (this->lat_part_);
-
-    if (hdr.num_files != 1 && hdr.num_files != parallel.grid_size ()[1])
-    {
-        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
-             << ": number of Gadget2 files does not match the number of "
-                "processes in dim-1!"
-             << std::endl;
-        return;
-    }
 
-    posdata = (float *)std::malloc (3 * sizeof (float) * PCLBUFFER);
-    veldata = (float *)std::malloc (3 * sizeof (float) * PCLBUFFER);
+namespace
+{
 
 #if GADGET_ID_BYTES == 8
-    IDs = std::malloc (sizeof (int64_t) * PCLBUFFER);
+typedef int64_t gadget2_id;
 #else
-    IDs = std::malloc (sizeof (int32_t) * PCLBUFFER);
+typedef int32_t gadget2_id;
 #endif
 
-    npart = 0;
-    for (xPart.first (); xPart.test (); xPart.next ())
-    {
-        if (this->field_part_ (xPart).size != 0)
-        {
-            for (auto it = (this->field_part_) (xPart).parts.begin ();
-                 it != (this->field_part_) (xPart).parts.end (); ++it)
-            {
-                if ((*it).ID % tracer_factor == 0)
-                    npart++;
-            }
-        }
-    }
-
-    if (hdr.num_files == 1)
-    {
-        if (parallel.rank () == 0)
-        {
-            parallel.send<long> (npart, 1);
-            parallel.receive<long> (count, parallel.size () - 1);
-            if (count != hdr.npart[1])
-                std::cout << " error: number of particles in saveGadget2 "
-                             "does not "
-                             "match "
-                             "request!"
-                          << std::endl;
-            count = 0;
-        }
-        else
-        {
-            parallel.receive<long> (count, parallel.rank () - 1);
-            npart += count;
-            parallel.send<long> (npart,
-                                 (parallel.rank () + 1) % parallel.size ());
-        }
-
-        MPI_File_open (parallel.lat_world_comm (), fname,
-                       MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL,
-                       &outfile);
-    }
-    else
-    {
-        if (parallel.grid_rank ()[0] == 0)
-        {
-            parallel.send_dim0<long> (npart, 1);
-            parallel.receive_dim0<long> (count, parallel.grid_size ()[0] - 1);
-            hdr.npart[1] = (uint32_t)count;
-            count = 0;
-        }
-        else
-        {
-            parallel.receive_dim0<long> (count, parallel.grid_rank ()[0] - 1);
-            npart += count;
-            parallel.send_dim0<long> (npart, (parallel.grid_rank ()[0] + 1)
-                                                 % parallel.grid_size ()[0]);
-        }
-
-        parallel.broadcast_dim0<uint32_t> (hdr.npart[1], 0);
+//////////////////////////
+// gadget2Hints
+//////////////////////////
+// Description:
+//   MPI-IO hints for writing Gadget2 files: collective buffering, with as
+//   many aggregators and stripes as there are processes in dim-0 (at most
+//   the size of the communicator); further site-specific hints can be
+//   given to ROMIO with the ROMIO_HINTS file
+//
+// Arguments:
+//   comm       communicator of the processes writing the file
+//
+// Returns: info object, to be freed by the caller
+//
+//////////////////////////
+
+MPI_Info gadget2Hints (MPI_Comm comm)
+{
+    MPI_Info info;
+    int nproc;
 
-        sprintf (fname + filename.length (), ".%d", parallel.grid_rank ()[1]);
+    MPI_Comm_size (comm, &nproc);
+    const std::string nodes
+        = std::to_string (std::min (nproc, parallel.grid_size ()[0]));
 
-        MPI_File_open (parallel.dim0_comm ()[parallel.grid_rank ()[1]], fname,
-                       MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL,
-                       &outfile);
-    }
+    MPI_Info_create (&info);
+    MPI_Info_set (info, "romio_cb_write", "enable");
+    MPI_Info_set (info, "cb_nodes", nodes.c_str ());
+    MPI_Info_set (info, "striping_factor", nodes.c_str ());
+    MPI_Info_set (info, "striping_unit", "4194304");
 
-    offset_pos = (MPI_Offset)hdr.npart[1];
-    offset_pos *= (MPI_Offset) (
-        6 * sizeof (float)
-        + ((GADGET_ID_BYTES == 8) ? sizeof (int64_t) : sizeof (int32_t)));
-    offset_pos += (MPI_Offset) (8 * sizeof (uint32_t) + sizeof (hdr));
-    MPI_File_set_size (outfile, offset_pos);
+    return info;
+}
 
-    offset_pos = (MPI_Offset) (3 * sizeof (uint32_t) + sizeof (hdr))
-                 + ((MPI_Offset)count) * ((MPI_Offset) (3 * sizeof (float)));
-    offset_vel
+//////////////////////////
+// writeGadget2
+//////////////////////////
+// Description:
+//   writes a Gadget2 file collectively: every process contributes its
+//   particles at the position given by the prefix sum of the particle
+//   counts, and each block (POS, VEL, ID) is written with a single
+//   collective call
+//
+// Arguments:
+//   fname      file name
+//   comm       communicator of the processes writing the file
+//   hdr        header of the file (written by the first process)
+//   posdata    positions of the local particles, 3 per particle
+//   veldata    velocities of the local particles, 3 per particle
+//   IDs        IDs of the local particles
+//
+// Returns: total number of particles in the file
+//
+//////////////////////////
+
+long writeGadget2 (const char *fname, MPI_Comm comm, gadget2_header &hdr,
+                   const std::vector<float> &posdata,
+                   const std::vector<float> &veldata,
+                   const std::vector<gadget2_id> &IDs)
+{
+    MPI_File outfile;
+    MPI_Status status;
+    MPI_Datatype triple;
+    MPI_Info info;
+    uint32_t blocksize;
+    int rank;
+    long npart = IDs.size (), first = 0, total;
+
+    MPI_Comm_rank (comm, &rank);
+    MPI_Exscan (&npart, &first, 1, MPI_LONG, MPI_SUM, comm);
+    if (rank == 0)
+        first = 0;
+    MPI_Allreduce (&npart, &total, 1, MPI_LONG, MPI_SUM, comm);
+
+    info = gadget2Hints (comm);
+    MPI_File_open (comm, fname, MPI_MODE_WRONLY | MPI_MODE_CREATE, info,
+                   &outfile);
+    MPI_Info_free (&info);
+
+    const MPI_Offset offset_pos
+        = (MPI_Offset) (3 * sizeof (uint32_t) + sizeof (hdr));
+    const MPI_Offset offset_vel
         = offset_pos + (MPI_Offset) (2 * sizeof (uint32_t))
-          + ((MPI_Offset)hdr.npart[1]) * ((MPI_Offset) (3 * sizeof (float)));
-    offset_ID
+          + ((MPI_Offset)total) * ((MPI_Offset) (3 * sizeof (float)));
+    const MPI_Offset offset_ID
         = offset_vel + (MPI_Offset) (2 * sizeof (uint32_t))
-          + ((MPI_Offset)hdr.npart[1] - (MPI_Offset)count)
-                * ((MPI_Offset) (3 * sizeof (float)))
-          + ((MPI_Offset)count)
-                * ((MPI_Offset) ((GADGET_ID_BYTES == 8) ? sizeof (int64_t)
-                                                        : sizeof (int32_t)));
-
-    if ((hdr.num_files == 1 && parallel.rank () == 0)
-        || (hdr.num_files > 1 && parallel.grid_rank ()[0] == 0))
+          + ((MPI_Offset)total) * ((MPI_Offset) (3 * sizeof (float)));
+    MPI_File_set_size (outfile,
+                       offset_ID + (MPI_Offset) sizeof (uint32_t)
+                           + ((MPI_Offset)total)
+                                 * ((MPI_Offset) sizeof (gadget2_id)));
+
+    if (rank == 0)
     {
         blocksize = sizeof (hdr);
         MPI_File_write_at (outfile, 0, &blocksize, 1, MPI_UNSIGNED, &status);
@@ -137,8 +120,8 @@ void Particles_gevolution::saveGadget2 (
                            MPI_BYTE, &status);
         MPI_File_write_at (outfile, sizeof (hdr) + sizeof (uint32_t),
                            &blocksize, 1, MPI_UNSIGNED, &status);
-        blocksize = 3 * sizeof (float) * hdr.npart[1];
-        MPI_File_write_at (outfile, sizeof (hdr) + 2 * sizeof (uint32_t),
+        blocksize = 3 * sizeof (float) * total;
+        MPI_File_write_at (outfile, offset_pos - sizeof (uint32_t),
                            &blocksize, 1, MPI_UNSIGNED, &status);
         MPI_File_write_at (outfile, offset_vel - 2 * sizeof (uint32_t),
                            &blocksize, 1, MPI_UNSIGNED, &status);
@@ -146,16 +129,74 @@ void Particles_gevolution::saveGadget2 (
                            1, MPI_UNSIGNED, &status);
         MPI_File_write_at (outfile, offset_ID - 2 * sizeof (uint32_t),
                            &blocksize, 1, MPI_UNSIGNED, &status);
-        blocksize
-            = ((GADGET_ID_BYTES == 8) ? sizeof (int64_t) : sizeof (int32_t))
-              * hdr.npart[1];
+        blocksize = sizeof (gadget2_id) * total;
         MPI_File_write_at (outfile, offset_ID - sizeof (uint32_t), &blocksize,
                            1, MPI_UNSIGNED, &status);
-        MPI_File_write_at (outfile, offset_ID + blocksize, &blocksize, 1,
-                           MPI_UNSIGNED, &status);
+        MPI_File_write_at (outfile, offset_ID + (MPI_Offset)blocksize,
+                           &blocksize, 1, MPI_UNSIGNED, &status);
+    }
+
+    // one element of the POS and VEL blocks, such that the counts stay
+    // within int for any local number of particles
+    MPI_Type_contiguous (3, MPI_FLOAT, &triple);
+    MPI_Type_commit (&triple);
+
+    MPI_File_write_at_all (
+        outfile, offset_pos + (MPI_Offset)first * (3 * sizeof (float)),
+        posdata.data (), (int)npart, triple, &status);
+    MPI_File_write_at_all (
+        outfile, offset_vel + (MPI_Offset)first * (3 * sizeof (float)),
+        veldata.data (), (int)npart, triple, &status);
+    MPI_File_write_at_all (
+        outfile, offset_ID + (MPI_Offset)first * sizeof (gadget2_id),
+        IDs.data (), (int)npart,
+        (GADGET_ID_BYTES == 8) ? MPI_INT64_T : MPI_INT32_T, &status);
+
+    MPI_Type_free (&triple);
+    MPI_File_close (&outfile);
+
+    return total;
+}
+
+}
+
+void Particles_gevolution::saveGadget2 (
+    std::string filename, gadget2_header &hdr, const int tracer_factor)
+    const
+{
+    std::vector<float> posdata;
+    std::vector<float> veldata;
+    std::vector<gadget2_id> IDs;
+    long count, npart;
+    uint32_t i;
+    char fname[filename.length () + 8];
+    
+    double rescale_vel = 1. / sqrt (hdr.time) / GADGET_VELOCITY_CONVERSION;
+
+    filename.copy (fname, filename.length ());
+    fname[filename.length ()] = '\0';
+
+    Site xPart (this->lat_part_);
+
+    if (hdr.num_files != 1 && hdr.num_files != parallel.grid_size ()[1])
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": number of Gadget2 files does not match the number of "
+                "processes in dim-1!"
+             << std::endl;
+        return;
     }
 
-    count = 0;
+    // the buffers are reserved from the cell counts, and filled in the same
+    // pass that selects the tracers
+    npart = 0;
+    for (xPart.first (); xPart.test (); xPart.next ())
+        npart += this->field_part_ (xPart).size;
+    npart = (npart + tracer_factor - 1) / tracer_factor;
+    posdata.reserve (3 * npart);
+    veldata.reserve (3 * npart);
+    IDs.reserve (npart);
+
     for (xPart.first (); xPart.test (); xPart.next ())
     {
         if (this->field_part_ (xPart).size != 0)
@@ -166,76 +207,63 @@ void Particles_gevolution::saveGadget2 (
                 if ((*it).ID % tracer_factor == 0)
                 {
                     for (i = 0; i < 3; i++)
-                        posdata[3 * count + i] = (*it).pos[i] * hdr.BoxSize;
+                        posdata.push_back ((*it).pos[i] * hdr.BoxSize);
                     
                     // for (i = 0; i < 3; i++)
-                    //     veldata[3 * count + i]
-                    //         = (*it).vel[i] * rescale_vel / hdr.time;
+                    //     veldata.push_back ((*it).vel[i] * rescale_vel
+                    //                        / hdr.time);
                     
                     // Note: rescaled momentum is not the same as velocity,
                     // anyways this was done when the meaning of 'vel' was not
                     // velocity * a, but momentum
                     for (i = 0; i < 3; i++)
-                        veldata[3 * count + i]
-                            = (*it).momentum[i] * rescale_vel / hdr.time;
-
-#if GADGET_ID_BYTES == 8
-                    *((int64_t *)IDs + count) = (int64_t) (*it).ID;
-#else
-                    *((int32_t *)IDs + count) = (int32_t) (*it).ID;
-#endif
+                        veldata.push_back ((*it).momentum[i] * rescale_vel
+                                           / hdr.time);
 
-                    count++;
-
-                    if (count == PCLBUFFER)
-                    {
-                        MPI_File_write_at (outfile, offset_pos, posdata,
-                                           3 * count, MPI_FLOAT, &status);
-                        offset_pos += 3 * PCLBUFFER * sizeof (float);
-                        MPI_File_write_at (outfile, offset_vel, veldata,
-                                           3 * count, MPI_FLOAT, &status);
-                        offset_vel += 3 * PCLBUFFER * sizeof (float);
-                        count *= (GADGET_ID_BYTES == 8) ? sizeof (int64_t)
-                                                        : sizeof (int32_t);
-                        MPI_File_write_at (outfile, offset_ID, IDs, count,
-                                           MPI_BYTE, &status);
-                        offset_ID += count;
-                        count = 0;
-                    }
+                    IDs.push_back ((gadget2_id) (*it).ID);
                 }
             }
         }
     }
 
-    MPI_File_write_at_all (outfile, offset_pos, posdata, 3 * count, MPI_FLOAT,
-                           &status);
-    MPI_File_write_at_all (outfile, offset_vel, veldata, 3 * count, MPI_FLOAT,
-                           &status);
-    count *= (GADGET_ID_BYTES == 8) ? sizeof (int64_t) : sizeof (int32_t);
-    MPI_File_write_at_all (outfile, offset_ID, IDs, count, MPI_BYTE, &status);
+    if (hdr.num_files == 1)
+    {
+        count = writeGadget2 (fname, parallel.lat_world_comm (), hdr, posdata,
+                              veldata, IDs);
+
+        if (parallel.rank () == 0 && count != hdr.npart[1])
+            std::cout << " error: number of particles in saveGadget2 "
+                         "does not "
+                         "match "
+                         "request!"
+                      << std::endl;
+    }
+    else
+    {
+        // the header of each file holds its own number of particles
+        npart = IDs.size ();
+        MPI_Allreduce (&npart, &count, 1, MPI_LONG, MPI_SUM,
+                       parallel.dim0_comm ()[parallel.grid_rank ()[1]]);
+        hdr.npart[1] = (uint32_t)count;
 
-    MPI_File_close (&outfile);
+        sprintf (fname + filename.length (), ".%d", parallel.grid_rank ()[1]);
 
-    free (posdata);
-    free (veldata);
-    free (IDs);
+        writeGadget2 (fname, parallel.dim0_comm ()[parallel.grid_rank ()[1]],
+                      hdr, posdata, veldata, IDs);
+    }
 }
 
 void Particles_gevolution::saveGadget2 (
     std::string filename, gadget2_header &hdr, lightcone_geometry &lightcone,
     double dist, double dtau, double dtau_old, double dadtau,
     double vertex[MAX_INTERSECTS][3], const int vertexcount,
-    std::set<long> &IDbacklog, std::set<long> &IDprelog, Field<Real> *phi,
+    const id_backlog &IDbacklog, id_backlog &IDprelog, Field<Real> *phi,
     const int tracer_factor)
 {
-    float *posdata;
-    float *veldata;
-    void *IDs;
-    MPI_File outfile;
+    std::vector<float> posdata;
+    std::vector<float> veldata;
+    std::vector<gadget2_id> IDs;
     long count, npart;
-    MPI_Offset offset_pos, offset_vel, offset_ID;
-    MPI_Status status;
-    uint32_t blocksize;
     uint32_t i;
     char fname[filename.length () + 1];
     double rescale_vel = 1. / GADGET_VELOCITY_CONVERSION;
@@ -244,6 +272,7 @@ void Particles_gevolution::saveGadget2 (
     double d, v2, e2;
     double ref_dist[3];
     Real gradphi[3];
+    float x[3], u[3];
 
     filename.copy (fname, filename.length ());
     fname[filename.length ()] = '\0';
@@ -259,16 +288,7 @@ void Particles_gevolution::saveGadget2 (
         return;
     }
 
-    posdata = (float *)std::malloc (3 * sizeof (float) * PCLBUFFER);
-    veldata = (float *)std::malloc (3 * sizeof (float) * PCLBUFFER);
-
-#if GADGET_ID_BYTES == 8
-    IDs = std::malloc (sizeof (int64_t) * PCLBUFFER);
-#else
-    IDs = std::malloc (sizeof (int32_t) * PCLBUFFER);
-#endif
-
-    npart = 0;
+    // the particles are selected, and their data computed, in a single pass
     if (vertexcount > 0)
     {
         for (xPart.first (), xField.first (); xPart.test ();
@@ -305,8 +325,7 @@ void Particles_gevolution::saveGadget2 (
                             {
                                 if (outer - d
                                         > LIGHTCONE_IDCHECK_ZONE * dtau_old
-                                    || IDbacklog.find ((*it).ID)
-                                           == IDbacklog.end ())
+                                    || !IDbacklog.contains ((*it).ID))
                                 {
                                     if (d - inner
                                         < 2. * LIGHTCONE_IDCHECK_ZONE * dtau)
@@ -383,13 +402,12 @@ void Particles_gevolution::saveGadget2 (
                                     e2 = sqrt (e2);
 
                                     for (uint32_t j = 0; j < 3; j++)
-                                        veldata[3 * (npart % PCLBUFFER) + j]
-                                            = ((*it).momentum[j]
-                                               - (dist - d + 0.5 * dtau_old)
-                                                     * e2 * gradphi[j])
-                                              * rescale_vel
-                                              / (hdr.time
-                                                 + (dist - d) * dadtau);
+                                        u[j] = ((*it).momentum[j]
+                                                - (dist - d + 0.5 * dtau_old)
+                                                      * e2 * gradphi[j])
+                                               * rescale_vel
+                                               / (hdr.time
+                                                  + (dist - d) * dadtau);
 
                                     if (d >= dist)
                                     {
@@ -400,12 +418,11 @@ void Particles_gevolution::saveGadget2 (
                                                      - dtau_old * dadtau));
 
                                         for (uint32_t j = 0; j < 3; j++)
-                                            posdata[3 * (npart % PCLBUFFER) + j]
-                                                = ((*it).pos[j] - vertex[i][j]
-                                                   + lightcone.vertex[j]
-                                                   + (dist - d) * (*it).momentum[j]
-                                                         / e2)
-                                                  * hdr.BoxSize;
+                                            x[j] = ((*it).pos[j] - vertex[i][j]
+                                                    + lightcone.vertex[j]
+                                                    + (dist - d) * (*it).momentum[j]
+                                                          / e2)
+                                                   * hdr.BoxSize;
                                     }
                                     else
                                     {
@@ -416,26 +433,19 @@ void Particles_gevolution::saveGadget2 (
                                         v2 = sqrt (v2 + hdr.time * hdr.time);
 
                                         for (uint32_t j = 0; j < 3; j++)
-                                            posdata[3 * (npart % PCLBUFFER) + j]
-                                                = ((*it).pos[j] - vertex[i][j]
-                                                   + lightcone.vertex[j]
-                                                   + (dist - d)
-                                                         * ((*it).momentum[j]
-                                                            - dtau * v2
-                                                                  * gradphi[j])
-                                                         / e2)
-                                                  * hdr.BoxSize;
+                                            x[j] = ((*it).pos[j] - vertex[i][j]
+                                                    + lightcone.vertex[j]
+                                                    + (dist - d)
+                                                          * ((*it).momentum[j]
+                                                             - dtau * v2
+                                                                   * gradphi[j])
+                                                          / e2)
+                                                   * hdr.BoxSize;
                                     }
 
-#if GADGET_ID_BYTES == 8
-                                    *((int64_t *)IDs + (npart % PCLBUFFER))
-                                        = (int64_t) (*it).ID;
-#else
-                                    *((int32_t *)IDs + (npart % PCLBUFFER))
-                                        = (int32_t) (*it).ID;
-#endif
-
-                                    npart++;
+                                    posdata.insert (posdata.end (), x, x + 3);
+                                    veldata.insert (veldata.end (), u, u + 3);
+                                    IDs.push_back ((gadget2_id) (*it).ID);
                                 }
 
                                 break;
@@ -447,436 +457,386 @@ void Particles_gevolution::saveGadget2 (
         }
     }
 
-    if (LATfield2::parallel.rank () == 0)
-    {
-        LATfield2::parallel.send<long> (npart, 1);
-        LATfield2::parallel.receive<long> (count,
-                                           LATfield2::parallel.size () - 1);
-        hdr.npart[1] = (uint32_t) (count % (1ll << 32));
-        hdr.npartTotal[1] = (uint32_t) (count % (1ll << 32));
-        hdr.npartTotalHW[1] = (uint32_t) (count / (1ll << 32));
-        count = 0;
-    }
-    else
-    {
-        LATfield2::parallel.receive<long> (count,
-                                           LATfield2::parallel.rank () - 1);
-        count += npart;
-        LATfield2::parallel.send<long> (count,
-                                        (LATfield2::parallel.rank () + 1)
-                                            % LATfield2::parallel.size ());
-        count -= npart;
-    }
-
-    LATfield2::parallel.broadcast<uint32_t> (hdr.npartTotal[1], 0);
-    LATfield2::parallel.broadcast<uint32_t> (hdr.npartTotalHW[1], 0);
-
-    if (hdr.npartTotal[1] + ((int64_t)hdr.npartTotalHW[1] << 32) > 0)
-    {
-        MPI_File_open (LATfield2::parallel.lat_world_comm (), fname,
-                       MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL,
-                       &outfile);
-
-        offset_pos = (MPI_Offset) ((int64_t)hdr.npartTotal[1]
-                                   + ((int64_t)hdr.npartTotalHW[1] << 32));
-        offset_pos *= (MPI_Offset) (
-            6 * sizeof (float)
-            + ((GADGET_ID_BYTES == 8) ? sizeof (int64_t) : sizeof (int32_t)));
-        offset_pos += (MPI_Offset) (8 * sizeof (uint32_t) + sizeof (hdr));
-        MPI_File_set_size (outfile, offset_pos);
-
-        offset_pos
-            = (MPI_Offset) (3 * sizeof (uint32_t) + sizeof (hdr))
-              + ((MPI_Offset)count) * ((MPI_Offset) (3 * sizeof (float)));
-        offset_vel = offset_pos + (MPI_Offset) (2 * sizeof (uint32_t))
-                     + ((MPI_Offset) ((int64_t)hdr.npartTotal[1]
-                                      + ((int64_t)hdr.npartTotalHW[1] << 32)))
-                           * ((MPI_Offset) (3 * sizeof (float)));
-        offset_ID = offset_vel + (MPI_Offset) (2 * sizeof (uint32_t))
-                    + ((MPI_Offset) ((int64_t)hdr.npartTotal[1]
-                                     + ((int64_t)hdr.npartTotalHW[1] << 32))
-                       - (MPI_Offset)count)
-                          * ((MPI_Offset) (3 * sizeof (float)))
-                    + ((MPI_Offset)count)
-                          * ((MPI_Offset) ((GADGET_ID_BYTES == 8)
-                                               ? sizeof (int64_t)
-                                               : sizeof (int32_t)));
-
-        if (LATfield2::parallel.rank () == 0)
-        {
-            blocksize = sizeof (hdr);
-            MPI_File_write_at (outfile, 0, &blocksize, 1, MPI_UNSIGNED,
-                               &status);
-            MPI_File_write_at (outfile, sizeof (uint32_t), &hdr, sizeof (hdr),
-                               MPI_BYTE, &status);
-            MPI_File_write_at (outfile, sizeof (hdr) + sizeof (uint32_t),
-                               &blocksize, 1, MPI_UNSIGNED, &status);
-            blocksize = 3 * sizeof (float) * hdr.npart[1];
-            MPI_File_write_at (outfile, sizeof (hdr) + 2 * sizeof (uint32_t),
-                               &blocksize, 1, MPI_UNSIGNED, &status);
-            MPI_File_write_at (outfile, offset_vel - 2 * sizeof (uint32_t),
-                               &blocksize, 1, MPI_UNSIGNED, &status);
-            MPI_File_write_at (outfile, offset_vel - sizeof (uint32_t),
-                               &blocksize, 1, MPI_UNSIGNED, &status);
-            MPI_File_write_at (outfile, offset_ID - 2 * sizeof (uint32_t),
-                               &blocksize, 1, MPI_UNSIGNED, &status);
-            blocksize
-                = ((GADGET_ID_BYTES == 8) ? sizeof (int64_t) : sizeof (int32_t))
-                  * hdr.npart[1];
-            MPI_File_write_at (outfile, offset_ID - sizeof (uint32_t),
-                               &blocksize, 1, MPI_UNSIGNED, &status);
-            MPI_File_write_at (outfile, offset_ID + blocksize, &blocksize, 1,
-                               MPI_UNSIGNED, &status);
-        }
-
-        count = (npart < PCLBUFFER) ? npart : PCLBUFFER;
-        npart -= count;
-        MPI_File_write_at_all (outfile, offset_pos, posdata, 3 * count,
-                               MPI_FLOAT, &status);
-        offset_pos += 3 * count * sizeof (float);
-        MPI_File_write_at_all (outfile, offset_vel, veldata, 3 * count,
-                               MPI_FLOAT, &status);
-        offset_vel += 3 * count * sizeof (float);
-        count *= (GADGET_ID_BYTES == 8) ? sizeof (int64_t) : sizeof (int32_t);
-        MPI_File_write_at_all (outfile, offset_ID, IDs, count, MPI_BYTE,
-                               &status);
-        offset_ID += count;
-        count = 0;
-
-        if (npart > 0)
-        {
-            for (xPart.first (); xPart.test () && npart > 0; xPart.next ())
-            {
-                if (this->field_part_ (xPart).size != 0)
-                {
-                    for (auto it = (this->field_part_) (xPart).parts.begin ();
-                         it != (this->field_part_) (xPart).parts.end (); ++it)
-                    {
-                        if ((*it).ID % tracer_factor == 0)
-                        {
-                            for (i = 0; i < (uint32_t)vertexcount; i++)
-                            {
-                                d = sqrt (
-                                    ((*it).pos[0] - vertex[i][0])
-                                        * ((*it).pos[0] - vertex[i][0])
-                                    + ((*it).pos[1] - vertex[i][1])
-                                          * ((*it).pos[1] - vertex[i][1])
-                                    + ((*it).pos[2] - vertex[i][2])
-                                          * ((*it).pos[2] - vertex[i][2]));
-
-                                if (d < inner || d >= outer)
-                                    continue;
-
-                                if (lightcone.opening == -1.
-                                    || (((*it).pos[0] - vertex[i][0])
-                                            * lightcone.direction[0]
-                                        + ((*it).pos[1] - vertex[i][1])
-                                              * lightcone.direction[1]
-                                        + ((*it).pos[2] - vertex[i][2])
-                                              * lightcone.direction[2])
-                                               / d
-                                           > lightcone.opening)
-                                {
-                                    if (outer - d
-                                            > LIGHTCONE_IDCHECK_ZONE * dtau_old
-                                        || IDbacklog.find ((*it).ID)
-                                               == IDbacklog.end ())
-                                    {
-                                        for (int j = 0; j < 3; j++)
-                                            ref_dist[j] = modf (
-                                                (*it).pos[j]
-                                                    / this->lat_resolution_,
-                                                &v2);
-
-                                        v2 = (*it).momentum[0] * (*it).momentum[0]
-                                             + (*it).momentum[1] * (*it).momentum[1]
-                                             + (*it).momentum[2] * (*it).momentum[2];
-                                        e2 = v2
-                                             + hdr.time
-                                                   * (hdr.time
-                                                      + (dist - d
-                                                         - 0.5 * dtau_old)
-                                                            * dadtau);
-
-                                        gradphi[0] = (1. - ref_dist[1])
-                                                     * (1. - ref_dist[2])
-                                                     * ((*phi) (xField + 0)
-                                                        - (*phi) (xField));
-                                        gradphi[1] = (1. - ref_dist[0])
-                                                     * (1. - ref_dist[2])
-                                                     * ((*phi) (xField + 1)
-                                                        - (*phi) (xField));
-                                        gradphi[2] = (1. - ref_dist[0])
-                                                     * (1. - ref_dist[1])
-                                                     * ((*phi) (xField + 2)
-                                                        - (*phi) (xField));
-                                        gradphi[0] += ref_dist[1]
-                                                      * (1. - ref_dist[2])
-                                                      * ((*phi) (xField + 1 + 0)
-                                                         - (*phi) (xField + 1));
-                                        gradphi[1] += ref_dist[0]
-                                                      * (1. - ref_dist[2])
-                                                      * ((*phi) (xField + 1 + 0)
-                                                         - (*phi) (xField + 0));
-                                        gradphi[2] += ref_dist[0]
-                                                      * (1. - ref_dist[1])
-                                                      * ((*phi) (xField + 2 + 0)
-                                                         - (*phi) (xField + 0));
-                                        gradphi[0] += (1. - ref_dist[1])
-                                                      * ref_dist[2]
-                                                      * ((*phi) (xField + 2 + 0)
-                                                         - (*phi) (xField + 2));
-                                        gradphi[1] += (1. - ref_dist[0])
-                                                      * ref_dist[2]
-                                                      * ((*phi) (xField + 2 + 1)
-                                                         - (*phi) (xField + 2));
-                                        gradphi[2] += (1. - ref_dist[0])
-                                                      * ref_dist[1]
-                                                      * ((*phi) (xField + 2 + 1)
-                                                         - (*phi) (xField + 1));
-                                        gradphi[0]
-                                            += ref_dist[1] * ref_dist[2]
-                                               * ((*phi) (xField + 2 + 1 + 0)
-                                                  - (*phi) (xField + 2 + 1));
-                                        gradphi[1]
-                                            += ref_dist[0] * ref_dist[2]
-                                               * ((*phi) (xField + 2 + 1 + 0)
-                                                  - (*phi) (xField + 2 + 0));
-                                        gradphi[2]
-                                            += ref_dist[0] * ref_dist[1]
-                                               * ((*phi) (xField + 2 + 1 + 0)
-                                                  - (*phi) (xField + 1 + 0));
-
-                                        gradphi[0] *= (v2 + e2) / e2
-                                                      / this->lat_resolution_;
-                                        gradphi[1] *= (v2 + e2) / e2
-                                                      / this->lat_resolution_;
-                                        gradphi[2] *= (v2 + e2) / e2
-                                                      / this->lat_resolution_;
-
-                                        e2 = sqrt (e2);
-
-                                        for (uint32_t j = 0; j < 3; j++)
-                                            veldata[3 * (npart % PCLBUFFER) + j]
-                                                = ((*it).momentum[j]
-                                                   - (dist - d + 0.5 * dtau_old)
-                                                         * e2 * gradphi[j])
-                                                  * rescale_vel
-                                                  / (hdr.time
-                                                     + (dist - d) * dadtau);
-
-                                        if (d >= dist)
-                                        {
-                                            e2 = sqrt (
-                                                v2
-                                                + hdr.time
-                                                      * (hdr.time
-                                                         - dtau_old * dadtau));
-
-                                            for (uint32_t j = 0; j < 3; j++)
-                                                posdata[3 * (npart % PCLBUFFER)
-                                                        + j]
-                                                    = ((*it).pos[j]
-                                                       - vertex[i][j]
-                                                       + lightcone.vertex[j]
-                                                       + (dist - d)
-                                                             * (*it).momentum[j]
-                                                             / e2)
-                                                      * hdr.BoxSize;
-                                        }
-                                        else
-                                        {
-                                            e2 = sqrt (
-                                                v2
-                                                + hdr.time
-                                                      * (hdr.time
-                                                         + dtau * dadtau));
-                                            v2 = sqrt (v2
-                                                       + hdr.time * hdr.time);
-
-                                            for (uint32_t j = 0; j < 3; j++)
-                                                posdata[3 * (npart % PCLBUFFER)
-                                                        + j]
-                                                    = ((*it).pos[j]
-                                                       - vertex[i][j]
-                                                       + lightcone.vertex[j]
-                                                       + (dist - d)
-                                                             * ((*it).momentum[j]
-                                                                - dtau * v2
-                                                                      * gradphi
-                                                                            [j])
-                                                             / e2)
-                                                      * hdr.BoxSize;
-                                        }
-
-#if GADGET_ID_BYTES == 8
-                                        *((int64_t *)IDs + count)
-                                            = (int64_t) (*it).ID;
-#else
-                                        *((int32_t *)IDs + count)
-                                            = (int32_t) (*it).ID;
-#endif
-
-                                        npart--;
-                                        count++;
-                                    }
-                                    break;
-                                }
-                            }
-
-                            if (count == PCLBUFFER)
-                            {
-                                MPI_File_write_at (outfile, offset_pos, posdata,
-                                                   3 * count, MPI_FLOAT,
-                                                   &status);
-                                offset_pos += 3 * PCLBUFFER * sizeof (float);
-                                MPI_File_write_at (outfile, offset_vel, veldata,
-                                                   3 * count, MPI_FLOAT,
-                                                   &status);
-                                offset_vel += 3 * PCLBUFFER * sizeof (float);
-                                count *= (GADGET_ID_BYTES == 8)
-                                             ? sizeof (int64_t)
-                                             : sizeof (int32_t);
-                                MPI_File_write_at (outfile, offset_ID, IDs,
-                                                   count, MPI_BYTE, &status);
-                                offset_ID += count;
-                                count = 0;
-                            }
-
-                            if (npart <= 0)
-                                break;
-                        }
-                    }
-                }
-            }
-
-            if (count > 0)
-            {
-                MPI_File_write_at (outfile, offset_pos, posdata, 3 * count,
-                                   MPI_FLOAT, &status);
-                MPI_File_write_at (outfile, offset_vel, veldata, 3 * count,
-                                   MPI_FLOAT, &status);
-                count *= (GADGET_ID_BYTES == 8) ? sizeof (int64_t)
-                                                : sizeof (int32_t);
-                MPI_File_write_at (outfile, offset_ID, IDs, count, MPI_BYTE,
-                                   &status);
-            }
-        }
+    // the number of particles on the light cone must be known for the
+    // header before the file is written
+    npart = IDs.size ();
+    MPI_Allreduce (&npart, &count, 1, MPI_LONG, MPI_SUM,
+                   LATfield2::parallel.lat_world_comm ());
+    hdr.npart[1] = (uint32_t) (count % (1ll << 32));
+    hdr.npartTotal[1] = (uint32_t) (count % (1ll << 32));
+    hdr.npartTotalHW[1] = (uint32_t) (count / (1ll << 32));
+
+    if (count > 0)
+        writeGadget2 (fname, LATfield2::parallel.lat_world_comm (), hdr,
+                      posdata, veldata, IDs);
+}
 
-        MPI_File_close (&outfile);
-    }
+namespace
+{
 
-    free (posdata);
-    free (veldata);
-    free (IDs);
-}
+// one particle of a Gadget2 file, as routed from the aggregators
+struct gadget2_record
+{
+    gadget2_id ID;
+    float pos[3];
+    float vel[3];
+};
 
-void Particles_gevolution::loadGadget2 (
-    std::string filename, gadget2_header &hdr)
+// reads the header block of a Gadget2 file; false if not recognized
+bool readGadget2Header (const std::string &filename, gadget2_header &hdr)
 {
-    float *posdata;
-    float *veldata;
-    void *IDs;
-    particle pcl;
     MPI_File infile;
-    uint32_t i, count, npart = 0;
-    MPI_Offset offset_pos, offset_vel, offset_ID;
     MPI_Status status;
-    uint32_t blocksize;
-    char fname[filename.length () + 1];
-    double rescale_vel = 1. / GADGET_VELOCITY_CONVERSION;
-
-    filename.copy (fname, filename.length ());
-    fname[filename.length ()] = '\0';
-
-    posdata = (float *)std::malloc (3 * sizeof (float) * PCLBUFFER);
-    veldata = (float *)std::malloc (3 * sizeof (float) * PCLBUFFER);
+    uint32_t blocksize = 0;
+
+    if (MPI_File_open (MPI_COMM_SELF, filename.c_str (), MPI_MODE_RDONLY,
+                       MPI_INFO_NULL, &infile)
+        != MPI_SUCCESS)
+        return false;
+    MPI_File_read_at (infile, 0, &blocksize, 1, MPI_UNSIGNED, &status);
+    if (blocksize == sizeof (hdr))
+        MPI_File_read_at (infile, (MPI_Offset)sizeof (uint32_t), &hdr,
+                          sizeof (hdr), MPI_BYTE, &status);
+    MPI_File_close (&infile);
 
-#if GADGET_ID_BYTES == 8
-    IDs = std::malloc (sizeof (int64_t) * PCLBUFFER);
-#else
-    IDs = std::malloc (sizeof (int32_t) * PCLBUFFER);
-#endif
+    return blocksize == sizeof (hdr);
+}
 
-    MPI_File_open (LATfield2::parallel.lat_world_comm (), fname,
-                   MPI_MODE_RDONLY, MPI_INFO_NULL, &infile);
+}
 
-    MPI_File_read_all (infile, &blocksize, 1, MPI_UNSIGNED, &status);
+long Particles_gevolution::loadGadget2 (std::string filename,
+                                         gadget2_header &hdr,
+                                         int aggregators)
+{
+    const MPI_Comm comm = parallel.lat_world_comm ();
+    const LATfield2::Lattice &lat = this->lat_part_;
+    const double dx = this->lat_resolution_;
+    int rank, nproc, ok = 1;
+
+    MPI_Comm_rank (comm, &rank);
+    MPI_Comm_size (comm, &nproc);
+
+    // the headers of all files, read by the root; the files of a multi-file
+    // input are named as the first one with the extension replaced by their
+    // number
+    std::vector<gadget2_header> headers (1);
+    std::vector<std::string> files (1, filename);
+    if (rank == 0)
+        ok = readGadget2Header (filename, headers[0]) ? 1 : 0;
+    MPI_Bcast (&ok, 1, MPI_INT, 0, comm);
+    if (!ok)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": file type not recognized when reading Gadget2 file!"
+             << std::endl;
+        hdr.npart[1] = 0;
+        return 0;
+    }
+    MPI_Bcast (&headers[0], sizeof (gadget2_header), MPI_BYTE, 0, comm);
 
-    if (blocksize != sizeof (hdr))
+    const int num_files = headers[0].num_files > 1 ? headers[0].num_files : 1;
+    const std::string stem
+        = filename.substr (0, filename.find_last_of ('.') + 1);
+    headers.resize (num_files);
+    for (int f = 1; f < num_files; f++)
+    {
+        files.push_back (stem + std::to_string (f));
+        if (rank == 0 && !readGadget2Header (files[f], headers[f]))
+            ok = 0;
+    }
+    MPI_Bcast (&ok, 1, MPI_INT, 0, comm);
+    if (!ok)
     {
         COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
              << ": file type not recognized when reading Gadget2 file!"
              << std::endl;
-        return;
+        hdr.npart[1] = 0;
+        return 0;
+    }
+    MPI_Bcast (headers.data (), num_files * sizeof (gadget2_header),
+               MPI_BYTE, 0, comm);
+    hdr = headers[0];
+
+    // the particles of all files in one global index range, the file f
+    // holding [first[f], first[f+1])
+    std::vector<long> first (num_files + 1, 0);
+    for (int f = 0; f < num_files; f++)
+        first[f + 1] = first[f] + headers[f].npart[1];
+    const long total = first[num_files];
+
+    // A aggregators, spread over the ranks, each read a contiguous share of
+    // the global range, in rounds of at most chunk particles
+    int A = aggregators > 0 ? aggregators : parallel.grid_size ()[0];
+    if (A > nproc)
+        A = nproc;
+    int me = -1;
+    for (int g = 0; g < A; g++)
+        if ((long)g * nproc / A == rank)
+            me = g;
+    const long chunk = std::min<long> (PCLBUFFER, INT_MAX / A);
+    const long share = (total + A - 1) / A;
+    const long rounds = (share + chunk - 1) / chunk;
+    const long begin = me < 0 ? 0 : (long)me * total / A;
+    const long end = me < 0 ? 0 : (long)(me + 1) * total / A;
+
+    // the owner of a position: the ranks by their domain in y and z
+    int domain[4] = { local_offset (lat, 1), lat.sizeLocal (1),
+                      local_offset (lat, 2), lat.sizeLocal (2) };
+    std::vector<int> domains (4 * nproc);
+    MPI_Allgather (domain, 4, MPI_INT, domains.data (), 4, MPI_INT, comm);
+    const int Ny = lat.size (1), Nz = lat.size (2);
+    std::vector<int> row (Ny), column (Nz), owner;
+    std::vector<int> ylo, zlo;
+    for (int r = 0; r < nproc; r++)
+    {
+        ylo.push_back (domains[4 * r]);
+        zlo.push_back (domains[4 * r + 2]);
+    }
+    std::sort (ylo.begin (), ylo.end ());
+    ylo.erase (std::unique (ylo.begin (), ylo.end ()), ylo.end ());
+    std::sort (zlo.begin (), zlo.end ());
+    zlo.erase (std::unique (zlo.begin (), zlo.end ()), zlo.end ());
+    owner.assign (ylo.size () * zlo.size (), 0);
+    for (int r = 0; r < nproc; r++)
+    {
+        const int *d = &domains[4 * r];
+        const int j = std::lower_bound (ylo.begin (), ylo.end (), d[0])
+                      - ylo.begin ();
+        const int k = std::lower_bound (zlo.begin (), zlo.end (), d[2])
+                      - zlo.begin ();
+        for (int y = d[0]; y < d[0] + d[1]; y++)
+            row[y] = j;
+        for (int z = d[2]; z < d[2] + d[3]; z++)
+            column[z] = k;
+        owner[k * ylo.size () + j] = r;
     }
 
-    MPI_File_read_all (infile, &hdr, sizeof (hdr), MPI_BYTE, &status);
+    MPI_Datatype type;
+    MPI_Type_contiguous (sizeof (gadget2_record), MPI_BYTE, &type);
+    MPI_Type_commit (&type);
 
-    rescale_vel /= sqrt (hdr.time);
-    offset_pos
-        = (MPI_Offset)sizeof (hdr) + (MPI_Offset) (3 * sizeof (uint32_t));
-    offset_vel
-        = offset_pos
-          + ((MPI_Offset)hdr.npart[1]) * ((MPI_Offset) (3 * sizeof (float)))
-          + (MPI_Offset) (2 * sizeof (uint32_t));
-    offset_ID = offset_vel + offset_vel - offset_pos;
+    std::vector<gadget2_record> records, sendbuf, recvbuf;
+    std::vector<float> posdata, veldata;
+    std::vector<int> dest, sendcount (nproc), senddispl (nproc),
+        recvcount (nproc), recvdispl (nproc);
+    std::vector<char> IDs;
+    MPI_File infile;
+    MPI_Status status;
+    int opened = -1;
+    long next = begin;
+    particle pcl;
 
-    MPI_File_seek (infile, offset_pos, MPI_SEEK_SET);
-    while (npart < hdr.npart[1])
+    for (long round = 0; round < rounds; round++)
     {
-        count = (hdr.npart[1] - npart > PCLBUFFER) ? PCLBUFFER
-                                                   : (hdr.npart[1] - npart);
-
-        MPI_File_read_all (infile, posdata, 3 * count, MPI_FLOAT, &status);
-        offset_pos += (MPI_Offset) (3 * count * sizeof (float));
-        MPI_File_seek (infile, offset_vel, MPI_SEEK_SET);
-        MPI_File_read_all (infile, veldata, 3 * count, MPI_FLOAT, &status);
-        offset_vel += (MPI_Offset) (3 * count * sizeof (float));
-        MPI_File_seek (infile, offset_ID, MPI_SEEK_SET);
-#if GADGET_ID_BYTES == 8
-        MPI_File_read_all (infile, IDs, count * sizeof (int64_t), MPI_BYTE,
-                           &status);
-        offset_ID += (MPI_Offset) (count * sizeof (int64_t));
-#else
-        MPI_File_read_all (infile, IDs, count * sizeof (int32_t), MPI_BYTE,
-                           &status);
-        offset_ID += (MPI_Offset) (count * sizeof (int32_t));
-#endif
-        MPI_File_seek (infile, offset_pos, MPI_SEEK_SET);
+        // phase 1: the aggregators read the next part of their share, file
+        // by file
+        records.clear ();
+        const long stop = std::min (end, next + chunk);
+        while (next < stop)
+        {
+            const int f = std::upper_bound (first.begin (), first.end (), next)
+                          - first.begin () - 1;
+            const long local = next - first[f];
+            const long count = std::min (stop, first[f + 1]) - next;
+            const long npart = headers[f].npart[1];
+
+            if (f != opened)
+            {
+                if (opened >= 0)
+                    MPI_File_close (&infile);
+                MPI_File_open (MPI_COMM_SELF, files[f].c_str (),
+                               MPI_MODE_RDONLY, MPI_INFO_NULL, &infile);
+                opened = f;
+            }
+
+            const MPI_Offset offset_pos
+                = (MPI_Offset)sizeof (gadget2_header)
+                  + (MPI_Offset) (3 * sizeof (uint32_t));
+            const MPI_Offset offset_vel
+                = offset_pos + (MPI_Offset)npart * (3 * sizeof (float))
+                  + (MPI_Offset) (2 * sizeof (uint32_t));
+            const MPI_Offset offset_ID = offset_vel + offset_vel - offset_pos;
+
+            posdata.resize (3 * count);
+            veldata.resize (3 * count);
+            IDs.resize (count * sizeof (gadget2_record::ID));
+            MPI_File_read_at (infile,
+                              offset_pos
+                                  + (MPI_Offset)local * (3 * sizeof (float)),
+                              posdata.data (), 3 * count, MPI_FLOAT, &status);
+            MPI_File_read_at (infile,
+                              offset_vel
+                                  + (MPI_Offset)local * (3 * sizeof (float)),
+                              veldata.data (), 3 * count, MPI_FLOAT, &status);
+            MPI_File_read_at (infile,
+                              offset_ID
+                                  + (MPI_Offset)local
+                                        * sizeof (gadget2_record::ID),
+                              IDs.data (), IDs.size (), MPI_BYTE, &status);
+
+            const double time = headers[f].time;
+            const double rescale_vel
+                = 1. / GADGET_VELOCITY_CONVERSION / sqrt (time);
+            for (long i = 0; i < count; i++)
+            {
+                gadget2_record r;
+                std::memcpy (&r.ID, &IDs[i * sizeof (r.ID)], sizeof (r.ID));
+                for (int j = 0; j < 3; j++)
+                {
+                    r.pos[j] = posdata[3 * i + j] / headers[f].BoxSize;
+                    if (r.pos[j] >= 1.)
+                        r.pos[j] -= 1.;
+                    r.vel[j] = veldata[3 * i + j] * time / rescale_vel;
+                }
+                records.push_back (r);
+            }
+            next += count;
+        }
 
-        for (i = 0; i < 3 * count; i++)
+        // phase 2: the particles go to their owners in one all-to-all
+        dest.resize (records.size ());
+        std::fill (sendcount.begin (), sendcount.end (), 0);
+        for (std::size_t i = 0; i < records.size (); i++)
         {
-            posdata[i] /= hdr.BoxSize;
-            if (posdata[i] >= 1.)
-                posdata[i] -= 1.;
-            veldata[i] *= hdr.time / rescale_vel;
+            const int y = cell_of (records[i].pos[1], dx, Ny),
+                      z = cell_of (records[i].pos[2], dx, Nz);
+            dest[i] = owner[column[z] * ylo.size () + row[y]];
+            sendcount[dest[i]]++;
         }
+        MPI_Alltoall (sendcount.data (), 1, MPI_INT, recvcount.data (), 1,
+                      MPI_INT, comm);
+        std::partial_sum (sendcount.begin (), sendcount.end () - 1,
+                          senddispl.begin () + 1);
+        std::partial_sum (recvcount.begin (), recvcount.end () - 1,
+                          recvdispl.begin () + 1);
+        sendbuf.resize (records.size ());
+        {
+            std::vector<int> at (senddispl);
+            for (std::size_t i = 0; i < records.size (); i++)
+                sendbuf[at[dest[i]]++] = records[i];
+        }
+        recvbuf.resize (recvdispl[nproc - 1] + recvcount[nproc - 1]);
+        MPI_Alltoallv (sendbuf.data (), sendcount.data (), senddispl.data (),
+                       type, recvbuf.data (), recvcount.data (),
+                       recvdispl.data (), type, comm);
 
-        for (i = 0; i < count; i++)
+        for (const gadget2_record &r : recvbuf)
         {
-#if GADGET_ID_BYTES == 8
-            pcl.ID = *((int64_t *)IDs + i);
-#else
-            pcl.ID = *((int32_t *)IDs + i);
-#endif
-            pcl.pos[0] = posdata[3 * i];
-            pcl.pos[1] = posdata[3 * i + 1];
-            pcl.pos[2] = posdata[3 * i + 2];
-            pcl.momentum[0] = veldata[3 * i];
-            pcl.momentum[1] = veldata[3 * i + 1];
-            pcl.momentum[2] = veldata[3 * i + 2];
+            pcl.ID = r.ID;
+            for (int j = 0; j < 3; j++)
+            {
+                pcl.pos[j] = r.pos[j];
+                pcl.momentum[j] = r.vel[j];
+            }
             this->addParticle_global (pcl);
         }
+    }
 
-        npart += count;
+    if (opened >= 0)
+        MPI_File_close (&infile);
+    MPI_Type_free (&type);
+
+    return total;
+}
+
+void Particles_gevolution::moveParticles ()
+{
+    // buffers kept from one call to the next, shared by the species
+    static particle_exchange exchange;
+    static std::vector<migrant> pending;
+
+    const LATfield2::Lattice &lat = this->lat_part_;
+    const double dx = this->lat_resolution_;
+    const int N[3] = {lat.size (0), lat.size (1), lat.size (2)};
+    const int lo[3] = {0, local_offset (lat, 1), local_offset (lat, 2)};
+    const int nloc[3] = {lat.sizeLocal (0), lat.sizeLocal (1),
+                         lat.sizeLocal (2)};
+
+    pending.clear ();
+    Site x (lat), target (lat);
+    for (x.first (); x.test (); x.next ())
+    {
+        auto &cell = this->field_part_ (x);
+        for (auto it = cell.parts.begin (); it != cell.parts.end ();)
+        {
+            int c[3];
+            bool here = true, local = true;
+            for (int i = 0; i < 3; i++)
+            {
+                const double box = dx * N[i];
+                if (it->pos[i] < 0)
+                    it->pos[i] += box;
+                else if (it->pos[i] >= box)
+                    it->pos[i] -= box;
+                c[i] = cell_of (it->pos[i], dx, N[i]) - lo[i];
+                here = here && c[i] == x.coord (i) - lo[i];
+                local = local && c[i] >= 0 && c[i] < nloc[i];
+            }
+            if (here)
+            {
+                ++it;
+                continue;
+            }
+            auto next = std::next (it);
+            if (local)
+            {
+                target.setIndex (local_site_index (lat, c[0], c[1], c[2]));
+                auto &to = this->field_part_ (target);
+                to.parts.splice (to.parts.end (), cell.parts, it);
+                to.size++;
+            }
+            else
+            {
+                pending.push_back (migrant::from (*it));
+                cell.parts.erase (it);
+            }
+            cell.size--;
+            it = next;
+        }
     }
 
-    MPI_File_close (&infile);
+    for (int dir = 1; dir <= 2; dir++)
+    {
+        exchange.sort (lat, dx, pending, dir);
+        exchange.run (dir, pending);
+    }
+    for (const auto &m : pending)
+    {
+        particle p = m.to_particle ();
+        int c[3];
+        for (int i = 0; i < 3; i++)
+            c[i] = cell_of (p.pos[i], dx, N[i]) - lo[i];
+        target.setIndex (local_site_index (lat, c[0], c[1], c[2]));
+        auto &to = this->field_part_ (target);
+        to.parts.push_back (p);
+        to.size++;
+    }
+}
 
-    free (posdata);
-    free (veldata);
-    free (IDs);
+void Particles_gevolution::reorder ()
+{
+    const LATfield2::Lattice &lat = this->lat_part_;
+    std::vector<particle> copy;
+    std::vector<long> count;
+    Site x (lat);
+
+    // all the nodes are freed before the first is allocated again, such that
+    // the allocator hands out contiguous memory
+    for (x.first (); x.test (); x.next ())
+    {
+        auto &cell = this->field_part_ (x);
+        count.push_back (cell.parts.size ());
+        copy.insert (copy.end (), cell.parts.begin (), cell.parts.end ());
+        cell.parts.clear ();
+    }
+
+    long k = 0, i = 0;
+    for (x.first (); x.test (); x.next (), i++)
+    {
+        auto &cell = this->field_part_ (x);
+        for (long n = 0; n < count[i]; n++)
+            cell.parts.push_back (copy[k++]);
+    }
 }
 
 }
@@ -10,12 +10,151 @@
 //////////////////////////
 
 #include "gevolution/background.hpp"
+#include "LATfield2.hpp" // COUT
 #include "gevolution/metadata.hpp"
+#include <algorithm>
+#include <cmath>
 #include <gsl/gsl_integration.h>
+#include <gsl/gsl_spline.h>
+#include <iostream>
+#include <vector>
 
 namespace gevolution
 {
 
+namespace
+{
+// cubic spline of a function of log a, see tabulateBackground
+struct spline_table
+{
+    gsl_spline *spline = nullptr;
+    double x_min = 0, x_max = 0;
+
+    spline_table () = default;
+    spline_table (const spline_table &) = delete;
+    spline_table &operator= (const spline_table &) = delete;
+    ~spline_table () { clear (); }
+
+    void clear ()
+    {
+        if (spline)
+            gsl_spline_free (spline);
+        spline = nullptr;
+    }
+
+    bool contains (const double x) const
+    {
+        return spline && x >= x_min && x <= x_max;
+    }
+
+    // without an accelerator, so that it can be called from any thread
+    double operator() (const double x) const
+    {
+        return gsl_spline_eval (spline, x, nullptr);
+    }
+
+    /*
+        Tabulate f on [lo,hi], doubling the number of intervals until the
+        spline is within tolerance of f at the midpoints, which then become
+        nodes. The error is absolute: f is the log of the tabulated quantity,
+        whose relative error it is, and it may cross zero. Warns if the
+        tolerance is not reached with max_nodes; returns the number of nodes.
+    */
+    template <class function_type>
+    int build (function_type f, const double lo, const double hi,
+               const double tolerance, const char *name)
+    {
+        const int max_nodes = 1 << 16;
+        std::vector<double> x, y;
+        for (int i = 0; i <= 128; i++)
+        {
+            x.push_back (lo + (hi - lo) * i / 128.);
+            y.push_back (f (x.back ()));
+        }
+        for (;;)
+        {
+            clear ();
+            spline = gsl_spline_alloc (gsl_interp_cspline, x.size ());
+            gsl_spline_init (spline, x.data (), y.data (), x.size ());
+            x_min = lo;
+            x_max = hi;
+
+            double error = 0;
+            std::vector<double> xm, ym;
+            for (std::size_t i = 0; i + 1 < x.size (); i++)
+            {
+                xm.push_back (0.5 * (x[i] + x[i + 1]));
+                ym.push_back (f (xm.back ()));
+                error = std::max (
+                    error, std::fabs ((*this) (xm.back ()) - ym.back ()));
+            }
+            if (error <= tolerance)
+                break;
+            if ((int)x.size () >= max_nodes)
+            {
+                COUT << COLORTEXT_YELLOW << " /!\\ warning" << COLORTEXT_RESET
+                     << ": the table of the " << name << " reaches "
+                     << error << " instead of the tolerance " << tolerance
+                     << " with " << x.size () << " nodes" << std::endl;
+                break;
+            }
+
+            std::vector<double> x2, y2;
+            for (std::size_t i = 0; i < xm.size (); i++)
+            {
+                x2.push_back (x[i]);
+                y2.push_back (y[i]);
+                x2.push_back (xm[i]);
+                y2.push_back (ym[i]);
+            }
+            x2.push_back (x.back ());
+            y2.push_back (y.back ());
+            x.swap (x2);
+            y.swap (y2);
+        }
+        return x.size ();
+    }
+};
+
+// the tables and the cosmology they were computed for
+struct background_tables
+{
+    cosmology cosmo;
+    spline_table ncdm[MAX_PCL_SPECIES - 2]; // log(a bg_ncdm) of log a
+    spline_table horizon;                   // log(tau) of log a
+    spline_table growth;                    // log(growth integral) of log a
+};
+
+background_tables tables;
+
+bool same_ncdm (const cosmology &c1, const cosmology &c2, const int p)
+{
+    return c1.Omega_g == c2.Omega_g && c1.h == c2.h
+           && c1.Omega_ncdm[p] == c2.Omega_ncdm[p]
+           && c1.m_ncdm[p] == c2.m_ncdm[p] && c1.T_ncdm[p] == c2.T_ncdm[p];
+}
+
+bool same_expansion (const cosmology &c1, const cosmology &c2)
+{
+    if (c1.num_ncdm != c2.num_ncdm)
+        return false;
+    for (int p = 0; p < c1.num_ncdm; p++)
+        if (!same_ncdm (c1, c2, p))
+            return false;
+    return c1.Omega_cdm == c2.Omega_cdm && c1.Omega_b == c2.Omega_b
+           && c1.Omega_Lambda == c2.Omega_Lambda
+           && c1.Omega_rad == c2.Omega_rad && c1.Omega_fld == c2.Omega_fld
+           && c1.w0_fld == c2.w0_fld && c1.wa_fld == c2.wa_fld
+           && c1.fourpiG == c2.fourpiG;
+}
+
+double bg_ncdm_integral (const double a, const cosmology &cosmo,
+                         const int p);
+double particleHorizon_integral (const double a, cosmology cosmo);
+double growthIntegral (const double a, cosmology cosmo);
+double growthIntegral_integral (const double a, cosmology cosmo);
+} // namespace
+
 static double FermiDiracIntegrand (double q, void *w)
 {
     return q * q * sqrt (q * q + *(double *)w) / (exp (q) + 1.0l);
@@ -69,22 +208,33 @@ double bg_ncdm (const double a, const cosmology cosmo, const int p)
 {
     if (p < 0 || p >= cosmo.num_ncdm)
         return 0;
-    else
-    {
-        double w
-            = a * cosmo.m_ncdm[p]
-              / (pow (cosmo.Omega_g * cosmo.h * cosmo.h / cosmo.C_PLANCK_LAW, 0.25)
-                 * cosmo.T_ncdm[p] * cosmo.C_BOLTZMANN_CST);
-        w *= w;
-
-        return FermiDiracIntegral (w) * cosmo.Omega_ncdm[p]
-               * pow (cosmo.Omega_g * cosmo.h * cosmo.h / cosmo.C_PLANCK_LAW, 0.25)
-               * cosmo.T_ncdm[p] * cosmo.C_BOLTZMANN_CST / cosmo.m_ncdm[p]
-               / cosmo.C_FD_NORM
-               / a;
-    }
+
+    const spline_table &table = tables.ncdm[p];
+    const double x = log (a);
+    if (table.contains (x) && same_ncdm (cosmo, tables.cosmo, p))
+        return exp (table (x)) / a;
+
+    return bg_ncdm_integral (a, cosmo, p);
 }
 
+namespace
+{
+double bg_ncdm_integral (const double a, const cosmology &cosmo,
+                         const int p)
+{
+    double w
+        = a * cosmo.m_ncdm[p]
+          / (pow (cosmo.Omega_g * cosmo.h * cosmo.h / cosmo.C_PLANCK_LAW, 0.25)
+             * cosmo.T_ncdm[p] * cosmo.C_BOLTZMANN_CST);
+    w *= w;
+
+    return FermiDiracIntegral (w) * cosmo.Omega_ncdm[p]
+           * pow (cosmo.Omega_g * cosmo.h * cosmo.h / cosmo.C_PLANCK_LAW, 0.25)
+           * cosmo.T_ncdm[p] * cosmo.C_BOLTZMANN_CST / cosmo.m_ncdm[p]
+           / cosmo.C_FD_NORM / a;
+}
+} // namespace
+
 //////////////////////////
 // bg_ncdm (2)
 //////////////////////////
@@ -227,6 +377,17 @@ static double particleHorizonIntegrand (double sqrta, void *cosmo)
 //////////////////////////
 
 double particleHorizon (const double a, cosmology cosmo)
+{
+    const double x = log (a);
+    if (tables.horizon.contains (x) && same_expansion (cosmo, tables.cosmo))
+        return exp (tables.horizon (x));
+
+    return particleHorizon_integral (a, cosmo);
+}
+
+namespace
+{
+double particleHorizon_integral (const double a, cosmology cosmo)
 {
     double result;
     gsl_function f;
@@ -241,4 +402,126 @@ double particleHorizon (const double a, cosmology cosmo)
 
     return result;
 }
+} // namespace
+
+static double growthIntegrand (double a, void *cosmo)
+{
+    const double Om = ((cosmology *)cosmo)->Omega_m;
+    return 1. / (pow (a, 3) * pow (1. - Om + Om / pow (a, 3), 1.5));
+}
+
+namespace
+{
+// int_0^a da' / (a' E(a'))^3, E = H/H0 of a flat LCDM model
+double growthIntegral (const double a, cosmology cosmo)
+{
+    const double x = log (a);
+    if (tables.growth.contains (x) && cosmo.Omega_m == tables.cosmo.Omega_m)
+        return exp (tables.growth (x));
+
+    return growthIntegral_integral (a, cosmo);
+}
+
+double growthIntegral_integral (const double a, cosmology cosmo)
+{
+    double result, err;
+    gsl_function f;
+    gsl_integration_workspace *w = gsl_integration_workspace_alloc (10000);
+
+    f.function = &growthIntegrand;
+    f.params = &cosmo;
+
+    gsl_integration_qag (&f, 0, a, 0, 1e-7, 10000, GSL_INTEG_GAUSS61, w,
+                         &result, &err);
+    gsl_integration_workspace_free (w);
+
+    return result;
+}
+} // namespace
+
+//////////////////////////
+// growthFactor
+//////////////////////////
+// Description:
+//   computes the linear growth factor D1 of a flat LCDM model with the
+//   matter density of the cosmology, normalized to D1 = a at early times
+//
+// Arguments:
+//   a          scale factor
+//   cosmo      structure containing the cosmological parameters
+//
+// Returns: linear growth factor
+//
+//////////////////////////
+
+double growthFactor (const double a, const cosmology cosmo)
+{
+    const double Om = cosmo.Omega_m;
+    return 2.5 * Om * sqrt (1. - Om + Om / pow (a, 3))
+           * growthIntegral (a, cosmo);
+}
+
+//////////////////////////
+// growthFactorDerivative
+//////////////////////////
+// Description:
+//   computes dD1/da, see growthFactor
+//
+// Arguments:
+//   a          scale factor
+//   cosmo      structure containing the cosmological parameters
+//
+// Returns: derivative of the linear growth factor with respect to a
+//
+//////////////////////////
+
+double growthFactorDerivative (const double a, const cosmology cosmo)
+{
+    const double Om = cosmo.Omega_m;
+    const double E = sqrt (1. - Om + Om / pow (a, 3));
+
+    // D1 = 5/2 Om E I, dI/da = 1 / (a E)^3, dE/da = -3 Om / (2 a^4 E)
+    return 2.5 * Om
+           * (-1.5 * Om / (pow (a, 4) * E) * growthIntegral (a, cosmo)
+              + 1. / (pow (a, 3) * E * E));
+}
+
+//////////////////////////
+// tabulateBackground
+//////////////////////////
+
+int tabulateBackground (const cosmology cosmo, const double a_min,
+                        const double a_max, const double tolerance)
+{
+    const double lo = log (a_min), hi = log (a_max);
+    int nodes = 0;
+
+    tables.horizon.clear ();
+    tables.growth.clear ();
+    for (int p = 0; p < MAX_PCL_SPECIES - 2; p++)
+        tables.ncdm[p].clear ();
+    tables.cosmo = cosmo;
+
+    for (int p = 0; p < cosmo.num_ncdm; p++)
+        nodes += tables.ncdm[p].build (
+            [&] (const double x) {
+                return log (exp (x) * bg_ncdm_integral (exp (x), cosmo, p));
+            },
+            lo, hi, tolerance, "ncdm background");
+
+    // with the ncdm tables in place, Hconf is cheap
+    nodes += tables.horizon.build (
+        [&] (const double x) {
+            return log (particleHorizon_integral (exp (x), cosmo));
+        },
+        lo, hi, tolerance, "particle horizon");
+
+    nodes += tables.growth.build (
+        [&] (const double x) {
+            return log (growthIntegral_integral (exp (x), cosmo));
+        },
+        lo, hi, tolerance, "growth integral");
+
+    return nodes;
+}
 }
@@ -0,0 +1,780 @@
+/*
+    gevolution_bench: micro-benchmarks of the particle-mesh kernels on a
+    lattice of uniformly distributed particles, without initial conditions
+    or settings file.
+
+        mpirun -np 8 ./gevolution_bench -N 128,256 -p 1,8 -r 5 -o pm.jsonl
+
+    -N      lattice sizes, comma separated (default 64)
+    -p      particles per lattice site, comma separated (default 1)
+    -r      timed repetitions of each kernel, after one warm-up (default 5)
+    -w      weak scaling: N is the size per process, the lattice is
+            N * nproc^(1/3) (rounded to a multiple of n and m) sites wide
+    -n, -m  processor grid (default: the most square one)
+    -o      file to which one JSON object per run is appended
+    -s      file to which the spectra of the source and the potential are
+            written, as a reference for -c, on the initial particles and
+            after -e cycles of the Newtonian engine
+    -e      kick and drift cycles before the second spectra of -s and -c
+            (default 8)
+    -c      reference file of -s to compare the spectra with; the exit
+            status is 1 if they differ by more than the tolerance
+    -t      relative tolerance of -c and -b (default 1e-3)
+    -b      compare batched_fft with PlanFFT on the same vector and tensor
+            fields, forward and backward, and time both; the exit status is
+            1 if they differ by more than the tolerance, relative to the
+            largest value
+    -h      file base of a hibernation round trip: two cycles of the
+            Newtonian engine are compared with one cycle, the particles
+            being written and read back as hibernate and readIC do, and a
+            second one; the exit status is 1 if the positions or momenta
+            differ by more than the tolerance, relative to the largest
+            value
+    -a      random drifts of up to half a cell, each followed by
+            moveParticles, after which the newtonian_pm sample and forces
+            are timed again, before and after Particles_gevolution::reorder
+            (default 0, not in the particles_soa build)
+
+    Every kernel is timed on every process with MPI_Wtime between barriers;
+    the repetitions are averaged and the minimum, maximum and mean over
+    the processes reported. A strong-scaling sweep is a series of runs with
+    the same -N and growing process counts, a weak-scaling sweep the same
+    with -w; each run appends a line to the -o file:
+
+        for np in 1 8 64; do mpirun -np $np ./gevolution_bench -w -N 64 \
+            -o weak.jsonl; done
+
+    The particles only depend on the seed and the processor grid, so that
+    -s and -c compare two builds, e.g. the mixed-precision one against the
+    double one, with the same process count:
+
+        mpirun -np 4 ./double/gevolution_bench -N 128 -p 2 -s ref.dat
+        mpirun -np 4 ./mixed/gevolution_bench -N 128 -p 2 -c ref.dat
+*/
+
+#include <boost/mpi/environment.hpp>
+#include <boost/mpi/communicator.hpp>
+namespace mpi = boost::mpi;
+
+#include "gevolution/gevolution.hpp"
+#include "gevolution/newtonian_pm.hpp"
+#include "gevolution/gr_pm.hpp"
+#include "gevolution/batched_fft.hpp"
+#include "gevolution/power.hpp"
+#include "gevolution/processor_grid.hpp"
+#include "gevolution/threading.hpp"
+#include "LATfield2.hpp"
+#include "gevolution/Particles_gevolution.hpp"
+#include "gevolution/particles_soa.hpp"
+#include "version.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+using namespace LATfield2;
+using namespace gevolution;
+
+namespace
+{
+
+#ifdef PARTICLES_SOA
+using pm_particles = particles_soa;
+#else
+using pm_particles = Particles_gevolution;
+#endif
+#if defined(MASS_ASSIGNMENT_PCS)
+using pm_assignment = assignment::pcs;
+#elif defined(MASS_ASSIGNMENT_TSC)
+using pm_assignment = assignment::tsc;
+#else
+using pm_assignment = assignment::cic;
+#endif
+
+struct timing
+{
+    std::string kernel;
+    int N;
+    int ppc; // particles per site
+    double min, max, mean; // seconds per call, over the processes
+};
+
+// one bin of the spectra of the source and of the potential, after cycles
+// of the Newtonian engine
+struct spectrum_point
+{
+    int N, ppc, cycles, bin;
+    double k, source, phi;
+};
+
+std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> values;
+    std::stringstream s(arg);
+    for(std::string item;std::getline(s,item,',');)
+        if(!item.empty())
+            values.push_back(std::atoi(item.c_str()));
+    return values;
+}
+
+/*
+    Seconds per call of f on this process, averaged over repeats calls
+    after a warm-up call; prepare runs before each call, untimed.
+*/
+double time_kernel(int repeats, const std::function<void()>& f,
+    const std::function<void()>& prepare = []{})
+{
+    double total = 0;
+    for(int r=-1;r<repeats;++r)
+    {
+        prepare();
+        MPI_Barrier(parallel.lat_world_comm());
+        const double start = MPI_Wtime();
+        f();
+        const double seconds = MPI_Wtime() - start;
+        if(r >= 0)
+            total += seconds;
+    }
+    return total/repeats;
+}
+
+timing reduce(const std::string& kernel, int N, int ppc, double seconds)
+{
+    timing t{kernel,N,ppc,0,0,0};
+    MPI_Comm com = parallel.lat_world_comm();
+    int nproc;
+    MPI_Comm_size(com,&nproc);
+    MPI_Allreduce(&seconds,&t.min,1,MPI_DOUBLE,MPI_MIN,com);
+    MPI_Allreduce(&seconds,&t.max,1,MPI_DOUBLE,MPI_MAX,com);
+    MPI_Allreduce(&seconds,&t.mean,1,MPI_DOUBLE,MPI_SUM,com);
+    t.mean /= nproc;
+    return t;
+}
+
+// ppc particles per site on average, uniformly distributed in the box
+void fill_uniform(Particles_gevolution& pcls, const Lattice& lat, int ppc)
+{
+    const int N = lat.size(0);
+    const long local = (long)ppc*lat.sizeLocal(0)*lat.sizeLocal(1)
+                     * lat.sizeLocal(2);
+    long first = 0;
+    MPI_Exscan(&local,&first,1,MPI_LONG,MPI_SUM,parallel.lat_world_comm());
+    if(parallel.rank()==0)
+        first = 0;
+
+    std::mt19937_64 gen(12345 + parallel.rank());
+    std::uniform_real_distribution<double> u(0.,1.);
+    const double lo[3] = {0.,(double)lat.coordSkip()[1],
+                          (double)lat.coordSkip()[0]};
+    const double width[3] = {(double)lat.sizeLocal(0),
+                             (double)lat.sizeLocal(1),
+                             (double)lat.sizeLocal(2)};
+    particle part;
+    part.mass = pcls.parts_info()->mass;
+    for(long k=0;k<local;++k)
+    {
+        part.ID = first + k;
+        for(int i=0;i<3;++i)
+        {
+            // inside the local domain, away from its upper edge
+            double x = (lo[i] + u(gen)*width[i])/N;
+            part.pos[i] = std::min(x,(lo[i] + width[i])/N - 1e-7);
+            part.vel[i] = 0;
+        }
+        pcls.addParticle_global(part);
+    }
+}
+
+/*
+    Largest difference of batched_fft to PlanFFT on a field of C components,
+    forward and backward from the same data, relative to the largest value,
+    over the processes; the forward transforms are recorded.
+*/
+double batched_difference(const Lattice& lat, const Lattice& latFT, int C,
+    int repeats, const std::function<void(const std::string&,double)>& record)
+{
+    Field<Real> a(lat,C), b(lat,C);
+    Field<Cplx> aFT(latFT,C), bFT(latFT,C);
+    PlanFFT<Cplx> plan(&a,&aFT);
+    batched_fft<Cplx> batched(&b,&bFT);  // overwrites b and bFT
+    const std::string tag = " (" + std::to_string(C) + " components)";
+    if(not batched.batched())
+        COUT << " batched_fft falls back to PlanFFT" << tag << std::endl;
+
+    auto fill = [&]
+    {
+        for_each_site(lat,[&](const Site& x)
+        {
+            for(int c=0;c<C;++c)
+                a(x,c) = b(x,c) = std::sin(1. + 0.37*x.coord(0)
+                    + 1.91*x.coord(1) + 2.53*x.coord(2) + 0.71*c);
+        });
+    };
+    record("PlanFFT forward" + tag,time_kernel(repeats,
+        [&]{ plan.execute(FFT_FORWARD); },fill));
+    record("batched_fft forward" + tag,time_kernel(repeats,
+        [&]{ batched.execute(FFT_FORWARD); },fill));
+
+    auto distance = [](const Cplx& u, const Cplx& v)
+    {
+        return std::hypot(u.real()-v.real(),u.imag()-v.imag());
+    };
+    double forward[2] = {0,0}, backward[2] = {0,0}; // |a-b|, |a|
+    rKSite k(latFT);
+    for(k.first();k.test();k.next())
+        for(int c=0;c<C;++c)
+        {
+            forward[0] = std::max(forward[0],distance(aFT(k,c),bFT(k,c)));
+            forward[1] = std::max(forward[1],distance(aFT(k,c),Cplx(0,0)));
+            bFT(k,c) = aFT(k,c);
+        }
+
+    plan.execute(FFT_BACKWARD);
+    batched.execute(FFT_BACKWARD);
+    Site x(lat);
+    for(x.first();x.test();x.next())
+        for(int c=0;c<C;++c)
+        {
+            backward[0] = std::max(backward[0],
+                (double)std::abs(a(x,c)-b(x,c)));
+            backward[1] = std::max(backward[1],(double)std::abs(a(x,c)));
+        }
+
+    MPI_Comm com = parallel.lat_world_comm();
+    MPI_Allreduce(MPI_IN_PLACE,forward,2,MPI_DOUBLE,MPI_MAX,com);
+    MPI_Allreduce(MPI_IN_PLACE,backward,2,MPI_DOUBLE,MPI_MAX,com);
+    return std::max(forward[0]/forward[1],backward[0]/backward[1]);
+}
+
+// the particles of fill_uniform, of the total mass 1, or none of their mass
+void initialize_uniform(Particles_gevolution& pcls, Lattice& lat, int ppc,
+    bool fill = true)
+{
+    double boxSize[3] = {1.,1.,1.};
+    particle_info info;
+    particle_dataType dataType;
+    std::strcpy(info.type_name,"part_simple");
+    info.mass = 1./((double)ppc*lat.size(0)*lat.size(1)*lat.size(2));
+    info.relativistic = false;
+    pcls.initialize(info,dataType,&lat,boxSize);
+    if(fill)
+        fill_uniform(pcls,lat,ppc);
+}
+
+/*
+    Kick and drift cycles of newtonian_pm, as in the main loop. The time
+    step is set by the first call, such that the largest force moves its
+    particle by about a quarter of a cell, rounded down to a power of 2 so
+    that the builds of both precisions take the same steps.
+*/
+class newtonian_steps
+{
+    int N;
+    newtonian_pm<Cplx,Particles_gevolution,pm_assignment> PM;
+    double dtau{-1};
+
+    void forces(Particles_gevolution& pcls)
+    {
+        PM.clear_sources();
+        PM.sample(pcls,1.);
+        PM.compute_potential(1.,1.,1.,1.);
+        PM.compute_forces(pcls,1.,1.);
+    }
+
+    public:
+
+    explicit newtonian_steps(int that_N):
+        N{that_N}, PM(that_N,parallel.lat_world_comm())
+    {}
+
+    void run(Particles_gevolution& pcls, int cycles)
+    {
+        if(dtau < 0)
+        {
+            forces(pcls);
+            double fmax = 0;
+            pcls.for_each([&](const particle& part, const Site&)
+            {
+                for(int i=0;i<3;++i)
+                    fmax = std::max(fmax,(double)std::abs(part.force[i]));
+            });
+            MPI_Allreduce(MPI_IN_PLACE,&fmax,1,MPI_DOUBLE,MPI_MAX,
+                parallel.lat_world_comm());
+            dtau = fmax > 0
+                 ? std::exp2(std::floor(std::log2(std::sqrt(0.25/N/fmax))))
+                 : 0;
+        }
+        for(int c=0;c<cycles;++c)
+        {
+            forces(pcls);
+            pcls.for_each([&](particle& part, const Site&)
+            {
+                for(int i=0;i<3;++i)
+                    part.momentum[i] += dtau*part.force[i];
+            });
+            PM.compute_velocities(pcls,1.);
+            pcls.for_each([&](particle& part, const Site&)
+            {
+                for(int i=0;i<3;++i)
+                    part.pos[i] += dtau*part.vel[i];
+            });
+            pcls.moveParticles();
+        }
+    }
+};
+
+/*
+    Largest difference of the positions and momenta of a run of two cycles
+    of newtonian_pm with one interrupted after its first cycle by the
+    particle files of a hibernation point, relative to the largest value,
+    over the processes; infinite if the particles differ.
+*/
+double restart_difference(Lattice& lat, int ppc, const std::string& base)
+{
+    Particles_gevolution uninterrupted, interrupted, restarted;
+    initialize_uniform(uninterrupted,lat,ppc);
+    initialize_uniform(interrupted,lat,ppc);
+    initialize_uniform(restarted,lat,ppc,false);
+
+    newtonian_steps steps(lat.size(0));
+    steps.run(uninterrupted,2);
+
+    steps.run(interrupted,1);
+    interrupted.swap_velocity_momentum();
+    interrupted.saveHDF5(base + "_cdm",1);
+    restarted.loadHDF5(base + "_cdm",1);
+    restarted.swap_velocity_momentum();
+    restarted.update_mass();
+    steps.run(restarted,1);
+
+    using state = std::array<double,6>; // position, momentum
+    auto states = [](Particles_gevolution& pcls)
+    {
+        std::map<long long,state> m;
+        pcls.for_each([&](const particle& part, const Site&)
+        {
+            m[part.ID] = {part.pos[0],part.pos[1],part.pos[2],
+                part.momentum[0],part.momentum[1],part.momentum[2]};
+        });
+        return m;
+    };
+    const auto a = states(uninterrupted), b = states(restarted);
+    double d[4] = {0,0,0,0}; // |dx|, |x|, |dp|, |p|
+    bool same = a.size()==b.size();
+    for(const auto& [ID,x] : a)
+    {
+        const auto y = b.find(ID);
+        if(y==b.end())
+        {
+            same = false;
+            continue;
+        }
+        for(int i=0;i<6;++i)
+        {
+            const int k = i < 3 ? 0 : 2;
+            d[k] = std::max(d[k],std::abs(x[i]-y->second[i]));
+            d[k+1] = std::max(d[k+1],std::abs(x[i]));
+        }
+    }
+    int all_same = same;
+    MPI_Comm com = parallel.lat_world_comm();
+    MPI_Allreduce(MPI_IN_PLACE,&all_same,1,MPI_INT,MPI_LAND,com);
+    MPI_Allreduce(MPI_IN_PLACE,d,4,MPI_DOUBLE,MPI_MAX,com);
+    if(not all_same)
+        return std::numeric_limits<double>::infinity();
+    return std::max(d[0]/std::max(d[1],1e-300),d[2]/std::max(d[3],1e-300));
+}
+
+// the bins with modes of a table complete on rank 0 only
+void append_spectra(const power_table& table, int N, int ppc, int cycles,
+    std::vector<spectrum_point>& spectra)
+{
+    for(std::size_t b=0;b<table.k.size();++b)
+        if(table.modes[b] > 0)
+            spectra.push_back({N,ppc,cycles,(int)b,table.k[b],
+                table.power[0][b],table.power[1][b]});
+}
+
+/*
+    Spectra of the source and of the potential, as measured by run, after
+    cycles of the Newtonian engine from the same particles, such that -c
+    compares the builds after the kicks and drifts and not only on the
+    initial conditions.
+*/
+void evolved_spectra(Lattice& lat, const Lattice& latFT, int ppc,
+    int cycles, std::vector<spectrum_point>& spectra)
+{
+    Particles_gevolution pcls;
+    initialize_uniform(pcls,lat,ppc);
+    newtonian_steps(lat.size(0)).run(pcls,cycles);
+
+    Field<Real> source(lat,1), phi(lat,1);
+    Field<Cplx> sourceFT(latFT,1), phiFT(latFT,1);
+    PlanFFT<Cplx> plan_source(&source,&sourceFT);
+    for_each_site(lat,[&](const Site& x)
+    {
+        source(x) = 0;
+        phi(x) = 0;
+    });
+    projection_T00_project(&pcls,&source,1.,&phi);
+    projection_T00_comm(&source);
+    plan_source.execute(FFT_FORWARD);
+    solveModifiedPoissonFT(sourceFT,phiFT,1.,3.);
+    append_spectra(power_spectra(spectrum_bins{},
+        std::vector<const Field<Cplx>*>{&sourceFT,&phiFT}),
+        lat.size(0),ppc,cycles,spectra);
+}
+
+// all the kernels at one lattice size and particle density
+void run(int N, int ppc, int repeats, int drifts, int evolve,
+    bool check_batched, const std::string& restart,
+    std::vector<timing>& results, std::vector<spectrum_point>& spectra,
+    double& batched_worst, double& restart_worst)
+{
+    Lattice lat(3,N,2);
+    Lattice latFT;
+    latFT.initializeRealFFT(lat,0);
+
+    Particles_gevolution pcls_cdm;
+    initialize_uniform(pcls_cdm,lat,ppc);
+#ifdef PARTICLES_SOA
+    particles_soa pcls_pm(pcls_cdm);
+#else
+    Particles_gevolution& pcls_pm = pcls_cdm;
+#endif
+
+    auto record = [&](const std::string& kernel, double seconds)
+    {
+        results.push_back(reduce(kernel,N,ppc,seconds));
+    };
+
+    {
+        Field<Real> source(lat,1), phi(lat,1);
+        Field<Cplx> sourceFT(latFT,1), phiFT(latFT,1);
+        PlanFFT<Cplx> plan_source(&source,&sourceFT);
+        PlanFFT<Cplx> plan_phi(&phi,&phiFT);
+        auto zero = [&]
+        {
+            for_each_site(lat,[&](const Site& x)
+            {
+                source(x) = 0;
+                phi(x) = 0;
+            });
+        };
+        zero();
+
+        record("projection_T00_project",time_kernel(repeats,
+            [&]
+            {
+                projection_T00_project(&pcls_cdm,&source,1.,&phi);
+                projection_T00_comm(&source);
+            },zero));
+        record("fft_forward",time_kernel(repeats,
+            [&]{ plan_source.execute(FFT_FORWARD); }));
+        record("solveModifiedPoissonFT",time_kernel(repeats,
+            [&]{ solveModifiedPoissonFT(sourceFT,phiFT,1.,3.); }));
+        record("power_spectra",time_kernel(repeats,
+            [&]
+            {
+                power_spectra(spectrum_bins{},
+                    std::vector<const Field<Cplx>*>{&sourceFT,&phiFT});
+            }));
+
+        append_spectra(power_spectra(spectrum_bins{},
+            std::vector<const Field<Cplx>*>{&sourceFT,&phiFT}),N,ppc,0,
+            spectra);
+    }
+    if(evolve > 0)
+        evolved_spectra(lat,latFT,ppc,evolve,spectra);
+
+    // the Bi and S0i, and the Sij of relativistic_pm
+    if(check_batched)
+        for(int C : {3,6})
+            batched_worst = std::max(batched_worst,
+                batched_difference(lat,latFT,C,repeats,record));
+
+    if(!restart.empty())
+        restart_worst = std::max(restart_worst,
+            restart_difference(lat,ppc,restart));
+
+    {
+        newtonian_pm<Cplx,pm_particles,pm_assignment> PM(N,
+            parallel.lat_world_comm());
+        record("newtonian_pm::sample",time_kernel(repeats,
+            [&]{ PM.sample(pcls_pm,1.); },
+            [&]{ PM.clear_sources(); }));
+        record("newtonian_pm::compute_potential",time_kernel(repeats,
+            [&]{ PM.compute_potential(1.,1.,1.,1.); }));
+        record("newtonian_pm::compute_forces",time_kernel(repeats,
+            [&]{ PM.compute_forces(pcls_pm,1.,1.); }));
+
+#ifndef PARTICLES_SOA
+        // the list nodes as scattered by the migrations of a run
+        std::mt19937_64 gen(54321 + parallel.rank());
+        std::uniform_real_distribution<double> u(-0.5/N,0.5/N);
+        for(int d=0;d<drifts;++d)
+        {
+            pcls_pm.for_each([&](particle& part, const Site&)
+            {
+                for(int i=0;i<3;++i)
+                    part.pos[i] += u(gen);
+            });
+            pcls_pm.moveParticles();
+        }
+        auto pm_kernels = [&](const std::string& suffix)
+        {
+            record("newtonian_pm::sample" + suffix,time_kernel(repeats,
+                [&]{ PM.sample(pcls_pm,1.); },
+                [&]{ PM.clear_sources(); }));
+            record("newtonian_pm::compute_forces" + suffix,
+                time_kernel(repeats,
+                    [&]{ PM.compute_forces(pcls_pm,1.,1.); }));
+        };
+        if(drifts > 0)
+        {
+            pm_kernels(" (scattered)");
+            record("Particles_gevolution::reorder",time_kernel(repeats,
+                [&]{ pcls_pm.reorder(); }));
+            pm_kernels(" (reordered)");
+        }
+#endif
+    }
+
+#if !defined(MASS_ASSIGNMENT_PCS) && !defined(MASS_ASSIGNMENT_TSC)
+    {
+        relativistic_pm<Cplx,pm_particles> PM(N,parallel.lat_world_comm());
+        record("relativistic_pm::sample",time_kernel(repeats,
+            [&]{ PM.sample(pcls_pm,1.); },
+            [&]{ PM.clear_sources(); }));
+    }
+#endif
+
+    // a drift of a fraction of a cell, so that particles change cells and
+    // some of them processes
+    const double shift[3] = {0.31/N,0.23/N,0.17/N};
+    record("moveParticles",time_kernel(repeats,
+        [&]{ pcls_pm.moveParticles(); },
+        [&]
+        {
+            for_each_particle(pcls_pm,[&](auto& part, const Site&)
+            {
+                for(int i=0;i<3;++i)
+                    part.pos[i] += shift[i];
+            });
+        }));
+}
+
+std::string to_json(const std::vector<timing>& results, int n, int m,
+    bool weak, int repeats)
+{
+    std::ostringstream o;
+    o.precision(6);
+    o << "{\"commit\":\"" GIT_COMMIT "\",\"nproc\":" << n*m
+      << ",\"n\":" << n << ",\"m\":" << m
+      << ",\"threads\":" << num_threads()
+      << ",\"scaling\":\"" << (weak ? "weak" : "strong") << "\""
+      << ",\"precision\":\"" << (sizeof(Real)==4 ? "mixed" : "double")
+      << "\""
+      << ",\"repeats\":" << repeats << ",\"results\":[";
+    for(std::size_t i=0;i<results.size();++i)
+    {
+        const timing& t = results[i];
+        o << (i ? "," : "") << "{\"kernel\":\"" << t.kernel << "\""
+          << ",\"N\":" << t.N << ",\"particles_per_site\":" << t.ppc
+          << ",\"min\":" << t.min << ",\"max\":" << t.max
+          << ",\"mean\":" << t.mean << "}";
+    }
+    o << "]}";
+    return o.str();
+}
+
+void write_spectra(const std::string& filename,
+    const std::vector<spectrum_point>& spectra)
+{
+    std::ofstream o(filename);
+    o << "# N ppc cycles bin k P_source P_phi\n";
+    o.precision(17);
+    for(const auto& s : spectra)
+        o << s.N << " " << s.ppc << " " << s.cycles << " " << s.bin << " "
+          << s.k << " " << s.source << " " << s.phi << "\n";
+}
+
+/*
+    Largest relative difference of the spectra to the reference file, over
+    the bins present in both; negative if there are none.
+*/
+double compare_spectra(const std::string& filename,
+    const std::vector<spectrum_point>& spectra)
+{
+    std::ifstream in(filename);
+    std::vector<spectrum_point> ref;
+    for(std::string line;std::getline(in,line);)
+    {
+        if(line.empty() || line[0]=='#')
+            continue;
+        std::istringstream s(line);
+        spectrum_point p;
+        if(s >> p.N >> p.ppc >> p.cycles >> p.bin >> p.k >> p.source
+              >> p.phi)
+            ref.push_back(p);
+    }
+
+    auto relative = [](double a, double b)
+    {
+        return b==0 ? (a==0 ? 0 : 1) : std::abs(a-b)/std::abs(b);
+    };
+    double worst = -1;
+    for(const auto& p : spectra)
+        for(const auto& r : ref)
+            if(r.N==p.N && r.ppc==p.ppc && r.cycles==p.cycles
+               && r.bin==p.bin)
+                worst = std::max({worst,relative(p.source,r.source),
+                                  relative(p.phi,r.phi)});
+    return worst;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    mpi::environment env(argc,argv);
+    mpi::communicator com_world;
+    const int nproc = com_world.size();
+
+    std::vector<int> sizes{64}, densities{1};
+    int n = 0, m = 0, repeats = 5, drifts = 0, evolve = 8;
+    bool weak = false, check_batched = false;
+    double tolerance = 1e-3;
+    std::string json, save, reference, restart;
+    for(int i=1;i<argc;++i)
+    {
+        if(argv[i][0] != '-')
+            continue;
+        const bool has_value = i+1 < argc;
+        switch(argv[i][1])
+        {
+            case 'N': if(has_value) sizes = parse_list(argv[++i]); break;
+            case 'p': if(has_value) densities = parse_list(argv[++i]); break;
+            case 'r': if(has_value) repeats = std::atoi(argv[++i]); break;
+            case 'a': if(has_value) drifts = std::atoi(argv[++i]); break;
+            case 'e': if(has_value) evolve = std::atoi(argv[++i]); break;
+            case 'n': if(has_value) n = std::atoi(argv[++i]); break;
+            case 'm': if(has_value) m = std::atoi(argv[++i]); break;
+            case 'o': if(has_value) json = argv[++i]; break;
+            case 's': if(has_value) save = argv[++i]; break;
+            case 'c': if(has_value) reference = argv[++i]; break;
+            case 'h': if(has_value) restart = argv[++i]; break;
+            case 't': if(has_value) tolerance = std::atof(argv[++i]); break;
+            case 'w': weak = true; break;
+            case 'b': check_batched = true; break;
+        }
+    }
+    repeats = std::max(1,repeats);
+
+    if(n*m != nproc)
+    {
+        int N = 0;
+        for(int s : sizes)
+            N = std::max(N,s);
+        auto grids = grid_candidates(nproc,N,1);
+        if(grids.empty())
+        {
+            std::cerr << " error: no processor grid of " << nproc
+                      << " processes fits N = " << N << std::endl;
+            com_world.abort(1);
+        }
+        n = grids.front().n;
+        m = grids.front().m;
+    }
+    parallel.initialize(com_world,n,m);
+
+    if(weak)
+        for(int& N : sizes)
+        {
+            const int q = n*m/std::gcd(n,m);
+            N = std::max(q,(int)std::lround(N*std::cbrt((double)nproc)/q)*q);
+        }
+
+    COUT << " gevolution_bench on " << n << " x " << m << " processes, "
+         << num_threads() << " threads each" << std::endl;
+    std::vector<timing> results;
+    std::vector<spectrum_point> spectra;
+    double batched_worst = 0, restart_worst = 0;
+    for(int N : sizes)
+        for(int ppc : densities)
+        {
+            COUT << " N = " << N << ", " << ppc << " particles per site"
+                 << std::endl;
+            run(N,ppc,repeats,drifts,
+                save.empty() && reference.empty() ? 0 : evolve,
+                check_batched,restart,results,spectra,batched_worst,
+                restart_worst);
+        }
+
+    int status = 0;
+    if(parallel.rank()==0)
+    {
+        std::cout << std::endl;
+        for(const auto& t : results)
+            std::cout << "   " << t.kernel << "  N = " << t.N << "  ppc = "
+                      << t.ppc << "  " << t.mean << " s (" << t.min << " - "
+                      << t.max << ")" << std::endl;
+        if(!json.empty())
+            std::ofstream(json,std::ios::app)
+                << to_json(results,n,m,weak,repeats) << "\n";
+        if(!save.empty())
+            write_spectra(save,spectra);
+        if(!reference.empty())
+        {
+            const double worst = compare_spectra(reference,spectra);
+            std::cout << std::endl;
+            if(worst < 0)
+            {
+                std::cout << " error: no spectra of these runs in "
+                          << reference << std::endl;
+                status = 1;
+            }
+            else
+            {
+                status = worst > tolerance;
+                std::cout << " spectra differ from " << reference
+                          << " by at most " << worst << " (tolerance "
+                          << tolerance << ")" << (status ? ", FAILED" : "")
+                          << std::endl;
+            }
+        }
+        if(check_batched)
+        {
+            const bool failed = batched_worst > tolerance;
+            std::cout << std::endl << " batched_fft differs from PlanFFT by "
+                      << "at most " << batched_worst << " (tolerance "
+                      << tolerance << ")" << (failed ? ", FAILED" : "")
+                      << std::endl;
+            status = status || failed;
+        }
+        if(!restart.empty())
+        {
+            const bool failed = !(restart_worst <= tolerance);
+            std::cout << std::endl << " the restarted run differs from the "
+                      << "uninterrupted one by at most " << restart_worst
+                      << " (tolerance " << tolerance << ")"
+                      << (failed ? ", FAILED" : "") << std::endl;
+            status = status || failed;
+        }
+    }
+    MPI_Bcast(&status,1,MPI_INT,0,parallel.lat_world_comm());
+
+    return status;
+}
@@ -56,23 +56,11 @@ using LATfield2::Site;
 void projectFTscalar (Field<Cplx> &SijFT, Field<Cplx> &chiFT, const int add)
 {
     const int linesize = chiFT.lattice ().size (1);
-    int i;
-    Real *gridk2;
-    Cplx *kshift;
+    const kspace_axes &axes = kspace_axes::of (linesize);
+    const Real *gridk2 = axes.grid_k2.data ();
+    const Cplx *kshift = axes.kshift.data ();
     rKSite k (chiFT.lattice ());
 
-    gridk2 = (Real *)malloc (linesize * sizeof (Real));
-    kshift = (Cplx *)malloc (linesize * sizeof (Cplx));
-
-    for (i = 0; i < linesize; i++)
-    {
-        gridk2[i] = 2. * (Real)linesize * sin (M_PI * (Real)i / (Real)linesize);
-        kshift[i] = gridk2[i]
-                    * Cplx (cos (M_PI * (Real)i / (Real)linesize),
-                            -sin (M_PI * (Real)i / (Real)linesize));
-        gridk2[i] *= gridk2[i];
-    }
-
     k.first ();
     if (k.coord (0) == 0 && k.coord (1) == 0 && k.coord (2) == 0)
     {
@@ -135,8 +123,6 @@ void projectFTscalar (Field<Cplx> &SijFT, Field<Cplx> &chiFT, const int add)
         }
     }
 
-    free (gridk2);
-    free (kshift);
 }
 
 //////////////////////////
@@ -158,24 +144,12 @@ void projectFTscalar (Field<Cplx> &SijFT, Field<Cplx> &chiFT, const int add)
 void evolveFTvector (Field<Cplx> &SijFT, Field<Cplx> &BiFT, const Real a2dtau)
 {
     const int linesize = BiFT.lattice ().size (1);
-    int i;
-    Real *gridk2;
-    Cplx *kshift;
+    const kspace_axes &axes = kspace_axes::of (linesize);
+    const Real *gridk2 = axes.grid_k2.data ();
+    const Cplx *kshift = axes.kshift.data ();
     rKSite k (BiFT.lattice ());
     Real k4;
 
-    gridk2 = (Real *)malloc (linesize * sizeof (Real));
-    kshift = (Cplx *)malloc (linesize * sizeof (Cplx));
-
-    for (i = 0; i < linesize; i++)
-    {
-        gridk2[i] = 2. * (Real)linesize * sin (M_PI * (Real)i / (Real)linesize);
-        kshift[i] = gridk2[i]
-                    * Cplx (cos (M_PI * (Real)i / (Real)linesize),
-                            -sin (M_PI * (Real)i / (Real)linesize));
-        gridk2[i] *= gridk2[i];
-    }
-
     k.first ();
     if (k.coord (0) == 0 && k.coord (1) == 0 && k.coord (2) == 0)
     {
@@ -228,8 +202,6 @@ void evolveFTvector (Field<Cplx> &SijFT, Field<Cplx> &BiFT, const Real a2dtau)
                                    + kshift[k.coord (1)] * SijFT (k, 1, 2)));
     }
 
-    free (gridk2);
-    free (kshift);
 }
 
 //////////////////////////
@@ -253,25 +225,13 @@ void projectFTvector (Field<Cplx> &SiFT, Field<Cplx> &BiFT, const Real coeff,
                       const Real modif)
 {
     const int linesize = BiFT.lattice ().size (1);
-    int i;
-    Real *gridk2;
-    Cplx *kshift;
+    const kspace_axes &axes = kspace_axes::of (linesize);
+    const Real *gridk2 = axes.grid_k2.data ();
+    const Cplx *kshift = axes.kshift.data ();
     rKSite k (BiFT.lattice ());
     Real k2;
     Cplx tmp (0., 0.);
 
-    gridk2 = (Real *)malloc (linesize * sizeof (Real));
-    kshift = (Cplx *)malloc (linesize * sizeof (Cplx));
-
-    for (i = 0; i < linesize; i++)
-    {
-        gridk2[i] = 2. * (Real)linesize * sin (M_PI * (Real)i / (Real)linesize);
-        kshift[i] = gridk2[i]
-                    * Cplx (cos (M_PI * (Real)i / (Real)linesize),
-                            -sin (M_PI * (Real)i / (Real)linesize));
-        gridk2[i] *= gridk2[i];
-    }
-
     k.first ();
     if (k.coord (0) == 0 && k.coord (1) == 0 && k.coord (2) == 0)
     {
@@ -298,8 +258,6 @@ void projectFTvector (Field<Cplx> &SiFT, Field<Cplx> &BiFT, const Real coeff,
                       * coeff / (k2 + modif);
     }
 
-    free (gridk2);
-    free (kshift);
 }
 
 //////////////////////////
@@ -322,24 +280,13 @@ void projectFTtensor (Field<Cplx> &SijFT, Field<Cplx> &hijFT)
 {
     const int linesize = hijFT.lattice ().size (1);
     int i;
-    Real *gridk2;
-    Cplx *kshift;
+    const kspace_axes &axes = kspace_axes::of (linesize);
+    const Real *gridk2 = axes.grid_k2.data ();
+    const Cplx *kshift = axes.kshift.data ();
     rKSite k (hijFT.lattice ());
     Cplx SxxFT, SxyFT, SxzFT, SyyFT, SyzFT, SzzFT;
     Real k2, k6;
 
-    gridk2 = (Real *)malloc (linesize * sizeof (Real));
-    kshift = (Cplx *)malloc (linesize * sizeof (Cplx));
-
-    for (i = 0; i < linesize; i++)
-    {
-        gridk2[i] = 2. * (Real)linesize * sin (M_PI * (Real)i / (Real)linesize);
-        kshift[i] = gridk2[i]
-                    * Cplx (cos (M_PI * (Real)i / (Real)linesize),
-                            -sin (M_PI * (Real)i / (Real)linesize));
-        gridk2[i] *= gridk2[i];
-    }
-
     k.first ();
     if (k.coord (0) == 0 && k.coord (1) == 0 && k.coord (2) == 0)
     {
@@ -449,8 +396,6 @@ void projectFTtensor (Field<Cplx> &SijFT, Field<Cplx> &hijFT)
               / k6;
     }
 
-    free (gridk2);
-    free (kshift);
 }
 
 #endif
@@ -940,23 +885,15 @@ void update_pos_Newton (double dtau,
 void projectFTtheta (Field<Cplx> &thFT, Field<Cplx> &viFT)
 {
     const int linesize = thFT.lattice ().size (1);
-    int i;
-    Real *gridk;
+    const Real *gridk = kspace_axes::of (linesize).central_k.data ();
     rKSite k (thFT.lattice ());
     Cplx tmp (0., 0.);
 
-    gridk = (Real *)malloc (linesize * sizeof (Real));
-
-    for (i = 0; i < linesize; i++)
-        gridk[i] = (Real)linesize * sin (M_PI * 2.0 * (Real)i / (Real)linesize);
-
     for (k.first (); k.test (); k.next ())
         thFT (k) = Cplx (0., 1.)
                    * (gridk[k.coord (0)] * viFT (k, 0)
                       + gridk[k.coord (1)] * viFT (k, 1)
                       + gridk[k.coord (2)] * viFT (k, 2));
-
-    free (gridk);
 }
 
 //////////////////////////
@@ -976,23 +913,13 @@ void projectFTtheta (Field<Cplx> &thFT, Field<Cplx> &viFT)
 void projectFTomega (Field<Cplx> &viFT)
 {
     const int linesize = viFT.lattice ().size (1);
-    int i;
-    Real *gridk2;
-    // Cplx *kshift;
-    Real *gridk;
+    const kspace_axes &axes = kspace_axes::of (linesize);
+    const Real *gridk2 = axes.central_k2.data ();
+    const Real *gridk = axes.central_k.data ();
     rKSite k (viFT.lattice ());
     Cplx tmp (0., 0.);
     Cplx vr[3];
 
-    gridk2 = (Real *)malloc (linesize * sizeof (Real));
-    gridk = (Real *)malloc (linesize * sizeof (Real));
-
-    for (i = 0; i < linesize; i++)
-    {
-        gridk[i] = (Real)linesize * sin (M_PI * 2.0 * (Real)i / (Real)linesize);
-        gridk2[i] = gridk[i] * gridk[i];
-    }
-
     k.first ();
     if (k.coord (0) == 0 && k.coord (1) == 0 && k.coord (2) == 0)
     {
@@ -1035,7 +962,5 @@ void projectFTomega (Field<Cplx> &viFT)
                   * (gridk[k.coord (0)] * vr[1] - gridk[k.coord (1)] * vr[0]);
         }
     }
-
-    free (gridk2);
 }
 }
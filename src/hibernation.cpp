@@ -1,6 +1,7 @@
 #include "gevolution/hibernation.hpp"
 
 //#include "LATfield2.hpp"
+#include <functional>
 #include <iostream>
 #include <string>
 
@@ -61,7 +62,9 @@ void writeRestartSettings (metadata &sim, icsettings &ic, cosmology &cosmo,
             fprintf (outfile, "due to wallclock limit ");
         else
             fprintf (outfile, "requested ");
-        fprintf (outfile, "at redshift z=%f\n\n", (1. / a) - 1.);
+        fprintf (outfile, "at redshift z=%f\n", (1. / a) - 1.);
+        fprintf (outfile, "# processor grid of the run: -n %d -m %d\n\n",
+                 parallel.grid_size ()[0], parallel.grid_size ()[1]);
 
         fprintf (outfile, "# info related to IC generation\n\n");
         fprintf (outfile, "IC generator       = restart\n");
@@ -89,25 +92,10 @@ void writeRestartSettings (metadata &sim, icsettings &ic, cosmology &cosmo,
                      sim.restart_path, sim.basename_restart, buffer);
             fprintf (outfile, ", %s%s%s_chi.h5", sim.restart_path,
                      sim.basename_restart, buffer);
-            if (sim.vector_flag == VECTOR_PARABOLIC)
-                fprintf (outfile, ", %s%s%s_B.h5\n", sim.restart_path,
-                         sim.basename_restart, buffer);
-            else
-#ifdef CHECK_B
-                fprintf (outfile, ", %s%s%s_B_check.h5\n", sim.restart_path,
-                         sim.basename_restart, buffer);
-#else
-                fprintf (outfile, "\n");
-#endif
+            fprintf (outfile, ", %s%s%s_B.h5\n", sim.restart_path,
+                     sim.basename_restart, buffer);
         }
-        else if (sim.vector_flag == VECTOR_PARABOLIC)
-            fprintf (outfile, "metric file        = %s%s%s_B.h5\n",
-                     sim.restart_path, sim.basename_restart, buffer);
-#ifdef CHECK_B
-        else
-            fprintf (outfile, "metric file        = %s%s%s_B_check.h5\n",
-                     sim.restart_path, sim.basename_restart, buffer);
-#endif
+        // the Newtonian engine computes its potential from the particles
 
         fprintf (outfile, "restart redshift   = %.15lf\n", (1. / a) - 1.);
         fprintf (outfile, "cycle              = %d\n", cycle);
@@ -181,6 +169,18 @@ void writeRestartSettings (metadata &sim, icsettings &ic, cosmology &cosmo,
             fprintf (outfile, "vector method       = elliptic\n");
         else
             fprintf (outfile, "vector method       = parabolic\n");
+        if (sim.interlacing_flag)
+            fprintf (outfile, "interlacing         = yes\n");
+        if (sim.short_range_flag)
+        {
+            fprintf (outfile, "short-range forces  = yes\n");
+            fprintf (outfile, "short-range split   = %lg\n",
+                     sim.short_range_split);
+            fprintf (outfile, "short-range cutoff  = %lg\n",
+                     sim.short_range_cutoff);
+            fprintf (outfile, "short-range softening = %lg\n",
+                     sim.short_range_softening);
+        }
         fprintf (outfile, "\ninitial redshift    = %lg\n", sim.z_in);
         fprintf (outfile, "boxsize             = %lg\n", sim.boxsize);
         fprintf (outfile, "Ngrid               = %d\n", sim.numpts);
@@ -293,8 +293,67 @@ void writeRestartSettings (metadata &sim, icsettings &ic, cosmology &cosmo,
             {
                 fprintf (outfile, "deltaN");
             }
+            if (sim.out_snapshot & MASK_HALOS)
+            {
+                if (sim.out_snapshot & MASK_DBARE)
+                    fprintf (outfile, ", ");
+                fprintf (outfile, (sim.out_snapshot & MASK_MEMBERS)
+                                      ? "halo members"
+                                      : "halos");
+            }
             fprintf (outfile, "\n");
         }
+        if (sim.out_snapshot & MASK_HALOS)
+        {
+            fprintf (outfile, "halo linking length = %lg\n",
+                     sim.halo_linking_length);
+            fprintf (outfile, "halo min particles  = %d\n",
+                     sim.halo_min_particles);
+        }
+        if (sim.snapshot_deflate > 0)
+            fprintf (outfile, "snapshot compression = %d\n",
+                     sim.snapshot_deflate);
+        if (sim.snapshot_single)
+        {
+            const char *names[] = {"phi", "chi", "B", "T00", "Tij", "p"};
+            const int masks[] = {MASK_PHI, MASK_CHI, MASK_B,
+                                 MASK_T00, MASK_TIJ, MASK_P};
+            const char *separator = "";
+            fprintf (outfile, "snapshot single precision = ");
+            for (i = 0; i < 6; i++)
+                if (sim.snapshot_single & masks[i])
+                {
+                    fprintf (outfile, "%s%s", separator, names[i]);
+                    separator = ", ";
+                }
+            fprintf (outfile, "\n");
+        }
+        if (sim.snapshot_mantissa_bits > 0)
+            fprintf (outfile, "snapshot mantissa bits = %d\n",
+                     sim.snapshot_mantissa_bits);
+        if (sim.timer_interval > 0)
+            fprintf (outfile, "timer interval      = %d\n",
+                     sim.timer_interval);
+        if (sim.timer_counters)
+            fprintf (outfile, "timer counters      = yes\n");
+        if (sim.diagnostics_interval != CYCLE_INFO_INTERVAL)
+            fprintf (outfile, "diagnostics interval = %d\n",
+                     sim.diagnostics_interval);
+        if (sim.reorder_interval > 0)
+            fprintf (outfile, "reorder interval    = %d\n",
+                     sim.reorder_interval);
+        if (sim.balance_interval > 0)
+            fprintf (outfile, "particle balance interval = %d\n",
+                     sim.balance_interval);
+        if (sim.time_bins > 1)
+        {
+            fprintf (outfile, "time bins           = %d\n", sim.time_bins);
+            fprintf (outfile, "time bin accuracy   = %lg\n",
+                     sim.time_bin_accuracy);
+        }
+        if (sim.output_buffer > 0.)
+            fprintf (outfile, "output buffer       = %lg\n",
+                     sim.output_buffer);
         if (sim.out_snapshot & MASK_GADGET)
         {
             fprintf (outfile, "tracer factor       = %d", sim.tracer_factor[0]);
@@ -387,6 +446,8 @@ void writeRestartSettings (metadata &sim, icsettings &ic, cosmology &cosmo,
             fprintf (outfile, "\n");
         }
         fprintf (outfile, "Pk bins             = %d\n", sim.numbins);
+        if (sim.pk_binning_flag == PK_BINNING_LINEAR)
+            fprintf (outfile, "Pk binning          = linear\n");
         if (sim.num_lightcone == 1)
         {
             fprintf (outfile, "lightcone vertex    = %lg, %lg, %lg\n",
@@ -520,6 +581,13 @@ void writeRestartSettings (metadata &sim, icsettings &ic, cosmology &cosmo,
         if (sim.wallclocklimit > 0.)
             fprintf (outfile, "hibernation wallclock limit = %lg\n",
                      sim.wallclocklimit);
+        if (sim.checkpoint_interval > 0.)
+        {
+            fprintf (outfile, "checkpoint interval         = %lg\n",
+                     sim.checkpoint_interval);
+            fprintf (outfile, "checkpoint base interval    = %d\n",
+                     sim.checkpoint_base_interval);
+        }
         if (sim.restart_path[0] != '\0')
             fprintf (outfile, "hibernation path            = %s\n",
                      sim.restart_path);
@@ -544,13 +612,14 @@ void writeRestartSettings (metadata &sim, icsettings &ic, cosmology &cosmo,
 //   pcls_cdm       pointer to particle handler for CDM
 //   pcls_b         pointer to particle handler for baryons
 //   pcls_ncdm      array of particle handlers for non-cold DM
-//   phi            reference to field containing first Bardeen potential
-//   chi            reference to field containing difference of Bardeen
-//   potentials Bi             reference to vector field containing
-//   frame-dragging potential a              scale factor tau conformal
-//   coordinate time dtau           time step cycle          current main
-//   control loop cycle count restartcount   restart counter aka number of
-//   hibernation point (default -1)
+//   save_fields    writes the fields of the particle_mesh engine, called
+//                  collectively with the file base of the hibernation point
+//   a              scale factor
+//   tau            conformal coordinate time
+//   dtau           time step
+//   cycle          current main control loop cycle count
+//   restartcount   restart counter aka number of hibernation point (default
+//   -1)
 //                  if < 0 no number is associated to the hibernation point
 //
 // Returns:
@@ -562,14 +631,13 @@ void hibernate (
     Particles_gevolution *pcls_cdm,
     Particles_gevolution *pcls_b,
     Particles_gevolution *pcls_ncdm,
-    Field<Real> &phi, Field<Real> &chi, Field<Real> &Bi, const double a,
-    const double tau, const double dtau, const int cycle,
+    const std::function<void (const std::string &)> &save_fields,
+    const double a, const double tau, const double dtau, const int cycle,
     const int restartcount)
 {
     std::string h5filename;
     char buffer[50];
     int i;
-    Site x (Bi.lattice ());
 
     h5filename.reserve (2 * PARAM_MAX_LENGTH);
     h5filename.assign (sim.restart_path);
@@ -582,15 +650,17 @@ void hibernate (
 
     writeRestartSettings (sim, ic, cosmo, a, tau, dtau, cycle, restartcount);
 
-#ifndef CHECK_B
-    if (sim.vector_flag == VECTOR_PARABOLIC)
-#endif
-        for (x.first (); x.test (); x.next ())
-        {
-            Bi (x, 0) /= a * a * sim.numpts;
-            Bi (x, 1) /= a * a * sim.numpts;
-            Bi (x, 2) /= a * a * sim.numpts;
-        }
+    // the files carry the momentum, see swap_velocity_momentum
+    auto swap_species = [&] ()
+    {
+        pcls_cdm->swap_velocity_momentum ();
+        if (sim.baryon_flag)
+            pcls_b->swap_velocity_momentum ();
+        for (int j = 0; j < cosmo.num_ncdm; j++)
+            if (sim.numpcl[1 + sim.baryon_flag + j] >= 1)
+                pcls_ncdm[j].swap_velocity_momentum ();
+    };
+    swap_species ();
 
 #ifdef EXTERNAL_IO
     while (ioserver.openOstream () == OSTREAM_FAIL)
@@ -607,19 +677,6 @@ void hibernate (
         pcls_ncdm[i].saveHDF5_server_open (h5filename + "_ncdm" + buffer);
     }
 
-    if (sim.gr_flag == gravity_theory::GR)
-    {
-        phi.saveHDF5_server_open (h5filename + "_phi");
-        chi.saveHDF5_server_open (h5filename + "_chi");
-    }
-
-    if (sim.vector_flag == VECTOR_PARABOLIC)
-        Bi.saveHDF5_server_open (h5filename + "_B");
-#ifdef CHECK_B
-    else
-        Bi.saveHDF5_server_open (h5filename + "_B_check");
-#endif
-
     pcls_cdm->saveHDF5_server_write ();
     if (sim.baryon_flag)
         pcls_b->saveHDF5_server_write ();
@@ -630,17 +687,6 @@ void hibernate (
         pcls_ncdm[i].saveHDF5_server_write ();
     }
 
-    if (sim.gr_flag == gravity_theory::GR)
-    {
-        phi.saveHDF5_server_write (NUMBER_OF_IO_FILES);
-        chi.saveHDF5_server_write (NUMBER_OF_IO_FILES);
-    }
-
-#ifndef CHECK_B
-    if (sim.vector_flag == VECTOR_PARABOLIC)
-#endif
-        Bi.saveHDF5_server_write (NUMBER_OF_IO_FILES);
-
     ioserver.closeOstream ();
 #else
     pcls_cdm->saveHDF5 (h5filename + "_cdm", 1);
@@ -653,19 +699,9 @@ void hibernate (
         sprintf (buffer, "%d", i);
         pcls_ncdm[i].saveHDF5 (h5filename + "_ncdm" + buffer, 1);
     }
-
-    if (sim.gr_flag == gravity_theory::GR)
-    {
-        phi.saveHDF5 (h5filename + "_phi.h5");
-        chi.saveHDF5 (h5filename + "_chi.h5");
-    }
-
-    if (sim.vector_flag == VECTOR_PARABOLIC)
-        Bi.saveHDF5 (h5filename + "_B.h5");
-#ifdef CHECK_B
-    else
-        Bi.saveHDF5 (h5filename + "_B_check.h5");
-#endif
 #endif
+    swap_species ();
+
+    save_fields (h5filename);
 }
 }
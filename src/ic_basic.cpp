@@ -11,7 +11,11 @@
 
 #include "gevolution/ic_basic.hpp"
 #include "gevolution/background.hpp"
+#include "gevolution/kspace_tables.hpp"
+#include <algorithm>
 #include <iostream>
+#include <numeric>
+#include <vector>
 
 #define MAX_LINESIZE 2048
 
@@ -1294,6 +1298,33 @@ void generateCICKernel (Field<Real> &ker, const long numpcl, float *pcldata,
     }
 }
 
+//////////////////////////
+// generateCICKernelFT
+//////////////////////////
+// Description:
+//   sets the Fourier image of the standard convolution kernel of
+//   generateCICKernel, 6 N^2 at the origin and -N^2 at its six neighbours,
+//   which is the sum over the directions of (2 N sin(pi n / N))^2
+//
+// Arguments:
+//   kerFT      reference to allocated field that will contain the Fourier
+//              image of the kernel
+//
+// Returns:
+//
+//////////////////////////
+
+void generateCICKernelFT (Field<Cplx> &kerFT)
+{
+    const kspace_axes &t = kspace_axes::of (kerFT.lattice ().size (1));
+
+    for_each_site<rKSite> (kerFT.lattice (), [&] (const rKSite &k) {
+        kerFT (k) = Cplx (t.grid_k2[k.coord (0)] + t.grid_k2[k.coord (1)]
+                              + t.grid_k2[k.coord (2)],
+                          0.);
+    });
+}
+
 //////////////////////////
 // initializeParticlePositions
 //////////////////////////
@@ -1317,8 +1348,9 @@ void initializeParticlePositions (
     const long numpart, const float *partdata, const int numtile,
     Particles_gevolution &pcls)
 {
-    long xtile, ytile, ztile, i;
-    Site p (pcls.lattice ());
+    const LATfield2::Lattice &lat = pcls.lattice ();
+    const long N = lat.size (1);
+    long xtile, ytile, ztile;
 
     particle part{};
 
@@ -1326,23 +1358,43 @@ void initializeParticlePositions (
     part.momentum[1] = 0.;
     part.momentum[2] = 0.;
 
-    for (ztile = (pcls.lattice ().coordSkip ()[0] * numtile)
-                 / pcls.lattice ().size (2);
-         ztile
-         <= ((pcls.lattice ().coordSkip ()[0] + pcls.lattice ().sizeLocal (2))
-             * numtile)
-                / pcls.lattice ().size (2);
+    // the local domain in y and z in units of the box, with a margin of one
+    // cell: addParticle_global has the final word
+    const double ylo = (lat.coordSkip ()[1] - 1.) / N,
+                 yhi = (lat.coordSkip ()[1] + lat.sizeLocal (1) + 1.) / N,
+                 zlo = (lat.coordSkip ()[0] - 1.) / N,
+                 zhi = (lat.coordSkip ()[0] + lat.sizeLocal (2) + 1.) / N;
+
+    // the template by z, so that a tile only visits its local particles
+    std::vector<long> byz (numpart), local;
+    std::iota (byz.begin (), byz.end (), 0l);
+    std::sort (byz.begin (), byz.end (), [&] (const long p, const long q) {
+        return partdata[3 * p + 2] < partdata[3 * q + 2];
+    });
+    auto z_of = [&] (const long p, const double z) {
+        return partdata[3 * p + 2] < z;
+    };
+
+    for (ztile = (lat.coordSkip ()[0] * numtile) / lat.size (2);
+         ztile <= ((lat.coordSkip ()[0] + lat.sizeLocal (2)) * numtile)
+                      / lat.size (2);
          ztile++)
     {
         if (ztile >= numtile)
             break;
 
-        for (ytile = (pcls.lattice ().coordSkip ()[1] * numtile)
-                     / pcls.lattice ().size (1);
-             ytile <= ((pcls.lattice ().coordSkip ()[1]
-                        + pcls.lattice ().sizeLocal (1))
-                       * numtile)
-                          / pcls.lattice ().size (1);
+        // template particles of this tile within [zlo, zhi], in the order
+        // of the template
+        auto first = std::lower_bound (byz.begin (), byz.end (),
+                                       zlo * numtile - ztile, z_of);
+        auto last = std::lower_bound (first, byz.end (),
+                                      zhi * numtile - ztile, z_of);
+        local.assign (first, last);
+        std::sort (local.begin (), local.end ());
+
+        for (ytile = (lat.coordSkip ()[1] * numtile) / lat.size (1);
+             ytile <= ((lat.coordSkip ()[1] + lat.sizeLocal (1)) * numtile)
+                          / lat.size (1);
              ytile++)
         {
             if (ytile >= numtile)
@@ -1350,12 +1402,14 @@ void initializeParticlePositions (
 
             for (xtile = 0; xtile < numtile; xtile++)
             {
-                for (i = 0; i < numpart; i++)
+                for (const long i : local)
                 {
-                    part.pos[0]
-                        = ((Real)xtile + partdata[3 * i]) / (Real)numtile;
                     part.pos[1]
                         = ((Real)ytile + partdata[3 * i + 1]) / (Real)numtile;
+                    if (part.pos[1] < ylo || part.pos[1] > yhi)
+                        continue;
+                    part.pos[0]
+                        = ((Real)xtile + partdata[3 * i]) / (Real)numtile;
                     part.pos[2]
                         = ((Real)ztile + partdata[3 * i + 2]) / (Real)numtile;
 
@@ -1615,6 +1669,16 @@ void generateIC_basic (
     ic_fields[0] = chi;
     ic_fields[1] = phi;
 
+    // the Fourier image of the convolution kernel is needed again for every
+    // realization; the standard kernel is set without a transform
+    bool explicit_kernel = ic.flags & ICFLAG_CORRECT_DISPLACEMENT;
+    auto kernelFT = [&] () {
+        if (explicit_kernel)
+            plan_source->execute (FFT_FORWARD);
+        else
+            generateCICKernelFT (*scalarFT);
+    };
+
 #ifdef HAVE_CLASS
     background class_background;
     thermo class_thermo;
@@ -1629,12 +1693,9 @@ void generateIC_basic (
         parallel.abortForce ();
     }
 
-    if (ic.flags & ICFLAG_CORRECT_DISPLACEMENT)
+    if (explicit_kernel)
         generateCICKernel (*source, sim.numpcl[0], pcldata, ic.numtile[0]);
-    else
-        generateCICKernel (*source);
-
-    plan_source->execute (FFT_FORWARD);
+    kernelFT ();
 
     if (ic.pkfile[0] != '\0') // initial displacements & velocities are derived
     // from a single power spectrum
@@ -2201,7 +2262,7 @@ void generateIC_basic (
             plan_phi->execute (FFT_BACKWARD);
             phi->updateHalo (); // phi now contains the baryonic
                                 // displacement
-            plan_source->execute (FFT_FORWARD);
+            kernelFT ();
         }
 
         generateDisplacementField (*scalarFT, 0., tk_d1, (unsigned int)ic.seed,
@@ -2300,10 +2361,8 @@ void generateIC_basic (
 
     if (ic.pkfile[0] == '\0') // set velocities using transfer functions
     {
-        if (ic.flags & ICFLAG_CORRECT_DISPLACEMENT)
-            generateCICKernel (*source);
-
-        plan_source->execute (FFT_FORWARD);
+        explicit_kernel = false; // the velocities use the standard kernel
+        kernelFT ();
 
         if (sim.baryon_flag == 1 || sim.baryon_flag == 3)
         {
@@ -2314,7 +2373,7 @@ void generateIC_basic (
             phi->updateHalo (); // phi now contains the baryonic
                                 // velocity potential
             gsl_spline_free (tk_t2);
-            plan_source->execute (FFT_FORWARD);
+            kernelFT ();
         }
 
         generateDisplacementField (*scalarFT, 0., tk_t1, (unsigned int)ic.seed,
@@ -2429,7 +2488,7 @@ void generateIC_basic (
             gsl_spline_init (tk_d1, pkspline->x, temp1, pkspline->size);
             gsl_spline_init (tk_t1, pkspline->x, temp2, pkspline->size);
 
-            plan_source->execute (FFT_FORWARD);
+            kernelFT ();
             generateDisplacementField (*scalarFT, 0., tk_d1,
                                        (unsigned int)ic.seed,
                                        ic.flags & ICFLAG_KSPHERE);
@@ -2439,7 +2498,7 @@ void generateIC_basic (
             chi->updateHalo ();
             gsl_spline_free (tk_d1);
 
-            plan_source->execute (FFT_FORWARD);
+            kernelFT ();
             generateDisplacementField (*scalarFT, 0., tk_t1,
                                        (unsigned int)ic.seed,
                                        ic.flags & ICFLAG_KSPHERE, 0);
@@ -2492,7 +2551,7 @@ void generateIC_basic (
 
     if (ic.pkfile[0] == '\0')
     {
-        plan_source->execute (FFT_FORWARD);
+        kernelFT ();
         generateDisplacementField (*scalarFT, 0., pkspline,
                                    (unsigned int)ic.seed,
                                    ic.flags & ICFLAG_KSPHERE, 0);
@@ -2579,30 +2638,34 @@ void generateIC_basic (
             = pcls_ncdm[p].updateVel (update_q, 0., &phi, 1, &a);
     }
 
-    projection_init (Bi);
-    projection_T0i_project (pcls_cdm, Bi, phi);
-    if (sim.baryon_flag)
-        projection_T0i_project (pcls_b, Bi, phi);
-    projection_T0i_comm (Bi);
-    plan_Bi->execute (FFT_FORWARD);
-    projectFTvector (*BiFT, *BiFT,
-                     cosmo.fourpiG / (double)sim.numpts / (double)sim.numpts);
-    plan_Bi->execute (FFT_BACKWARD);
-    Bi->updateHalo (); // B initialized
-
-    projection_init (Sij);
-    projection_Tij_project (pcls_cdm, Sij, a, phi);
-    if (sim.baryon_flag)
-        projection_Tij_project (pcls_b, Sij, a, phi);
-    projection_Tij_comm (Sij);
-
-    prepareFTsource<Real> (*phi, *Sij, *Sij,
-                           2. * cosmo.fourpiG / a / (double)sim.numpts
-                               / (double)sim.numpts);
-    plan_Sij->execute (FFT_FORWARD);
-    projectFTscalar (*SijFT, *scalarFT);
-    plan_chi->execute (FFT_BACKWARD);
-    chi->updateHalo (); // chi now finally contains chi
+    if (Bi != NULL && Sij != NULL) // B and chi, see the note in ic_basic.hpp
+    {
+        projection_init (Bi);
+        projection_T0i_project (pcls_cdm, Bi, phi);
+        if (sim.baryon_flag)
+            projection_T0i_project (pcls_b, Bi, phi);
+        projection_T0i_comm (Bi);
+        plan_Bi->execute (FFT_FORWARD);
+        projectFTvector (*BiFT, *BiFT,
+                         cosmo.fourpiG / (double)sim.numpts
+                             / (double)sim.numpts);
+        plan_Bi->execute (FFT_BACKWARD);
+        Bi->updateHalo (); // B initialized
+
+        projection_init (Sij);
+        projection_Tij_project (pcls_cdm, Sij, a, phi);
+        if (sim.baryon_flag)
+            projection_Tij_project (pcls_b, Sij, a, phi);
+        projection_Tij_comm (Sij);
+
+        prepareFTsource<Real> (*phi, *Sij, *Sij,
+                               2. * cosmo.fourpiG / a / (double)sim.numpts
+                                   / (double)sim.numpts);
+        plan_Sij->execute (FFT_FORWARD);
+        projectFTscalar (*SijFT, *scalarFT);
+        plan_chi->execute (FFT_BACKWARD);
+        chi->updateHalo (); // chi now finally contains chi
+    }
 
     gsl_spline_free (pkspline);
     if (sim.gr_flag == gravity_theory::Newtonian)
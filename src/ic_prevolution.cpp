@@ -1193,33 +1193,8 @@ void generateIC_prevolution (
         phi->updateHalo ();
     }
 
-    if (perturb_free (&class_perturbs) == _FAILURE_)
-    {
-        COUT << " error: calling perturb_free from CLASS library failed!"
-             << endl
-             << " following error message was passed: "
-             << class_perturbs.error_message << endl;
-        parallel.abortForce ();
-    }
-
-    if (thermodynamics_free (&class_thermo) == _FAILURE_)
-    {
-        COUT << " error: calling thermodynamics_free from CLASS library "
-                "failed!"
-             << endl
-             << " following error message was passed: "
-             << class_thermo.error_message << endl;
-        parallel.abortForce ();
-    }
-
-    if (background_free (&class_background) == _FAILURE_)
-    {
-        COUT << " error: calling background_free from CLASS library failed!"
-             << endl
-             << " following error message was passed: "
-             << class_background.error_message << endl;
-        parallel.abortForce ();
-    }
+    // writes the CLASS cache, and frees only what CLASS has computed
+    freeCLASSstructures (class_background, class_thermo, class_perturbs);
 
     gsl_spline_free (phispline);
     gsl_spline_free (chispline);
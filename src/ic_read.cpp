@@ -72,7 +72,7 @@ void readIC (
     Field<Cplx> *BiFT, Field<Cplx> *SijFT, PlanFFT<Cplx> *plan_phi,
     PlanFFT<Cplx> *plan_chi, PlanFFT<Cplx> *plan_Bi, PlanFFT<Cplx> *plan_source,
     PlanFFT<Cplx> *plan_Sij, int &cycle, int &snapcount, int &pkcount,
-    int &restartcount, std::set<long> *IDbacklog)
+    int &restartcount, id_backlog *IDbacklog)
 {
     particle_info pcls_cdm_info;
     particle_dataType pcls_cdm_dataType;
@@ -129,37 +129,25 @@ void readIC (
         for (i = 0; i < fd.numProcPerFile; i++)
             sim.numpcl[0] += numpcl[i];
         pcls_cdm->loadHDF5 (filename, 1);
+        pcls_cdm->swap_velocity_momentum (); // the files carry the momentum
         free (numpcl);
         free (dummy1);
         free (dummy2);
     }
     else
     {
-        i = 0;
-        do
+        filename.assign (ic.pclfile[0]);
+        sim.numpcl[0]
+            += pcls_cdm->loadGadget2 (filename, hdr, ic.aggregators);
+        if (hdr.npart[1] > 0
+            && (hdr.time / a > 1.001 || hdr.time / a < 0.999))
         {
-            filename.assign (ic.pclfile[0]);
-            pcls_cdm->loadGadget2 (filename, hdr);
-            if (hdr.npart[1] == 0)
-                break;
-            if (hdr.time / a > 1.001 || hdr.time / a < 0.999)
-            {
-                COUT << COLORTEXT_YELLOW << " /!\\ warning" << COLORTEXT_RESET
-                     << ": redshift indicated in Gadget2 header "
-                        "does not match "
-                        "initial redshift of simulation!"
-                     << std::endl;
-            }
-            sim.numpcl[0] += hdr.npart[1];
-            i++;
-            if (hdr.num_files > 1)
-            {
-                ext = ic.pclfile[0];
-                while (strchr (ext, (int)'.') != NULL)
-                    ext = strchr (ext, (int)'.') + 1;
-                sprintf (ext, "%d", i);
-            }
-        } while (i < hdr.num_files);
+            COUT << COLORTEXT_YELLOW << " /!\\ warning" << COLORTEXT_RESET
+                 << ": redshift indicated in Gadget2 header "
+                    "does not match "
+                    "initial redshift of simulation!"
+                 << std::endl;
+        }
 
         if (sim.baryon_flag == 1)
             pcls_cdm->parts_info ()->mass
@@ -196,39 +184,27 @@ void readIC (
             for (i = 0; i < fd.numProcPerFile; i++)
                 sim.numpcl[1] += numpcl[i];
             pcls_b->loadHDF5 (filename, 1);
+            pcls_b->swap_velocity_momentum ();
             free (numpcl);
             free (dummy1);
             free (dummy2);
         }
         else
         {
-            i = 0;
-            do
+            filename.assign (ic.pclfile[1]);
+            sim.numpcl[1]
+                += pcls_b->loadGadget2 (filename, hdr, ic.aggregators);
+            if (hdr.npart[1] > 0
+                && (hdr.time / a > 1.001 || hdr.time / a < 0.999))
             {
-                filename.assign (ic.pclfile[1]);
-                pcls_b->loadGadget2 (filename, hdr);
-                if (hdr.npart[1] == 0)
-                    break;
-                if (hdr.time / a > 1.001 || hdr.time / a < 0.999)
-                {
-                    COUT << COLORTEXT_YELLOW << " /!\\ warning"
-                         << COLORTEXT_RESET
-                         << ": redshift indicated in Gadget2 "
-                            "header does not "
-                            "match initial redshift of "
-                            "simulation!"
-                         << std::endl;
-                }
-                sim.numpcl[1] += hdr.npart[1];
-                i++;
-                if (hdr.num_files > 1)
-                {
-                    ext = ic.pclfile[1];
-                    while (strchr (ext, (int)'.') != NULL)
-                        ext = strchr (ext, (int)'.') + 1;
-                    sprintf (ext, "%d", i);
-                }
-            } while (i < hdr.num_files);
+                COUT << COLORTEXT_YELLOW << " /!\\ warning"
+                     << COLORTEXT_RESET
+                     << ": redshift indicated in Gadget2 "
+                        "header does not "
+                        "match initial redshift of "
+                        "simulation!"
+                     << std::endl;
+            }
 
             pcls_b->parts_info ()->mass = cosmo.Omega_b / (Real)sim.numpcl[1];
         }
@@ -269,39 +245,27 @@ void readIC (
             for (i = 0; i < fd.numProcPerFile; i++)
                 sim.numpcl[1] += numpcl[i];
             pcls_ncdm[p].loadHDF5 (filename, 1);
+            pcls_ncdm[p].swap_velocity_momentum ();
             free (numpcl);
             free (dummy1);
             free (dummy2);
         }
         else
         {
-            i = 0;
-            do
+            filename.assign (ic.pclfile[sim.baryon_flag + 1 + p]);
+            sim.numpcl[sim.baryon_flag + 1 + p]
+                += pcls_ncdm[p].loadGadget2 (filename, hdr, ic.aggregators);
+            if (hdr.npart[1] > 0
+                && (hdr.time / a > 1.001 || hdr.time / a < 0.999))
             {
-                filename.assign (ic.pclfile[sim.baryon_flag + 1 + p]);
-                pcls_ncdm[p].loadGadget2 (filename, hdr);
-                if (hdr.npart[1] == 0)
-                    break;
-                if (hdr.time / a > 1.001 || hdr.time / a < 0.999)
-                {
-                    COUT << COLORTEXT_YELLOW << " /!\\ warning"
-                         << COLORTEXT_RESET
-                         << ": redshift indicated in Gadget2 "
-                            "header does not "
-                            "match initial redshift of "
-                            "simulation!"
-                         << std::endl;
-                }
-                sim.numpcl[sim.baryon_flag + 1 + p] += hdr.npart[1];
-                i++;
-                if (hdr.num_files > 1)
-                {
-                    ext = ic.pclfile[sim.baryon_flag + 1 + p];
-                    while (strchr (ext, (int)'.') != NULL)
-                        ext = strchr (ext, (int)'.') + 1;
-                    sprintf (ext, "%d", i);
-                }
-            } while (i < hdr.num_files);
+                COUT << COLORTEXT_YELLOW << " /!\\ warning"
+                     << COLORTEXT_RESET
+                     << ": redshift indicated in Gadget2 "
+                        "header does not "
+                        "match initial redshift of "
+                        "simulation!"
+                     << std::endl;
+            }
     
             pcls_ncdm[p].parts_info ()->mass
                 = cosmo.Omega_ncdm[p]
@@ -360,11 +324,15 @@ void readIC (
 
     if (ic.restart_cycle >= 0)
     {
+        const char *Bfile
+            = ic.metricfile[2 * (sim.gr_flag == gravity_theory::GR ? 1 : 0)];
 #ifndef CHECK_B
-        if (sim.vector_flag == VECTOR_PARABOLIC)
+        if (sim.vector_flag == VECTOR_PARABOLIC && Bfile[0] != '\0')
+#else
+        if (Bfile[0] != '\0')
 #endif
         {
-            filename.assign (ic.metricfile[2 * ( sim.gr_flag == gravity_theory::GR ? 1 : 0 )]);
+            filename.assign (Bfile);
             Bi->loadHDF5 (filename);
 
             for (x.first (); x.test (); x.next ())
@@ -1047,6 +1015,7 @@ void readIC (
                     if (parallel.isRoot () && lcfile != NULL)
                         fclose (lcfile);
 
+                    IDbacklog[p].commit ();
                     IDlookup.clear ();
                 }
             }
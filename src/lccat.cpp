@@ -1,10 +1,81 @@
 #include "gevolution/metadata.hpp"
 #include "gevolution/parser.hpp"
+#include <algorithm>
 #include <cmath>
+#include <fcntl.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
 
 using namespace std;
+using namespace gevolution;
+
+// input file, whose particles are [first, first + numpart) of the
+// catenated light cone
+struct lightcone_file
+{
+    char name[1024];
+    int64_t numpart;
+    int64_t first;
+};
+
+// byte offset of the data of block b (0: positions, 1: velocities, 2: IDs;
+// 3 gives the file size) in a Gadget-2 file of n particles
+static off_t blockOffset (const int b, const int64_t n, const int IDbytes)
+{
+    off_t offset = 3 * sizeof (uint32_t) + sizeof (gadget2_header);
+
+    for (int i = 0; i < b; i++)
+        offset += (i < 2 ? 3l * sizeof (float) : (long)IDbytes) * n
+                  + 2 * sizeof (uint32_t);
+
+    return (b < 3) ? offset : offset - sizeof (uint32_t);
+}
+
+static int64_t blockBytes (const int b, const int64_t n, const int IDbytes)
+{
+    return (b < 2 ? 3l * sizeof (float) : (long)IDbytes) * n;
+}
+
+// number of particles of output file f; the last file takes the remainder
+static int64_t outputParticles (const int f, const int numfiles,
+                                const uint64_t numpart_tot)
+{
+    return (int64_t)numpart_tot / numfiles
+           + ((f == numfiles - 1) ? (int64_t)numpart_tot % numfiles : 0);
+}
+
+// pread/pwrite until all bytes are transferred
+static bool readFully (const int fd, void *buf, size_t bytes, off_t offset)
+{
+    while (bytes > 0)
+    {
+        ssize_t done = pread (fd, buf, bytes, offset);
+        if (done <= 0)
+            return false;
+        buf = (char *)buf + done;
+        bytes -= done;
+        offset += done;
+    }
+    return true;
+}
+
+static bool writeFully (const int fd, const void *buf, size_t bytes,
+                        off_t offset)
+{
+    while (bytes > 0)
+    {
+        ssize_t done = pwrite (fd, buf, bytes, offset);
+        if (done <= 0)
+            return false;
+        buf = (const char *)buf + done;
+        bytes -= done;
+        offset += done;
+    }
+    return true;
+}
 
 int main (int argc, char **argv)
 {
@@ -25,32 +96,21 @@ int main (int argc, char **argv)
     char filename[1024];
     char ofilename[1024];
     FILE *infile;
-    FILE *outfile;
 
     uint64_t numpart_tot = 0;
-    uint64_t numpart_write = 0;
     uint32_t blocksize = 0;
     int numfiles = 1;
     long numread = 0;
-    long numwrite = 0;
     gadget2_header hdr;
     gadget2_header outhdr;
+    vector<lightcone_file> input;
 
     double *vertex = NULL;
     double z_obs = -2.;
 
-    long backtrack;
-    long fastforward;
-    float *posbatch = NULL;
-    float *velbatch = NULL;
-    uint32_t batch;
-#if GADGET_ID_BYTES == 8
-    uint64_t *IDbatch = NULL;
-#else
-    uint32_t *IDbatch = NULL;
-#endif
-
     double offset = 0.;
+    long chunksize = 1l << 20;
+    bool parallel = false;
 
     if (argc < 2)
     {
@@ -63,6 +123,17 @@ int main (int argc, char **argv)
              << endl;
 
         cout << " List of command-line options:" << endl;
+        cout << " -b <particles>      : number of particles copied per chunk "
+                "(optional, default"
+             << endl;
+        cout << "                       1048576); the memory use is 12 bytes "
+                "per particle and"
+             << endl;
+        cout << "                       thread" << endl;
+        cout << " -p                  : copy the input files in parallel, "
+                "with OMP_NUM_THREADS"
+             << endl;
+        cout << "                       threads (optional)" << endl;
         cout << " -s <filename>       : gevolution settings file of the "
                 "simulation (mandatory)"
              << endl;
@@ -104,6 +175,12 @@ int main (int argc, char **argv)
             continue;
         switch (argv[i][1])
         {
+        case 'b':
+            chunksize = atol (argv[++i]); // particles per chunk
+            break;
+        case 'p':
+            parallel = true; // input files in parallel
+            break;
         case 'c':
             cycleparam = argv[++i]; // cycle range selector
             break;
@@ -141,6 +218,12 @@ int main (int argc, char **argv)
              << ": number of output files not recognized!" << endl;
         return -1;
     }
+    else if (chunksize < 1)
+    {
+        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": chunk size not recognized!" << endl;
+        return -1;
+    }
 
     cout << COLORTEXT_WHITE << " LCARS tools: lccat" << COLORTEXT_RESET << endl
          << endl
@@ -351,8 +434,13 @@ int main (int argc, char **argv)
                     continue;
                 }
 
-                numpart_tot += (uint64_t)hdr.npartTotal[1]
-                               + ((uint64_t)hdr.npartTotalHW[1] << 32);
+                input.emplace_back ();
+                sprintf (input.back ().name, "%s", filename);
+                input.back ().numpart = (int64_t)hdr.npartTotal[1]
+                                        + ((int64_t)hdr.npartTotalHW[1] << 32);
+                input.back ().first = numpart_tot;
+
+                numpart_tot += input.back ().numpart;
                 numread++;
                 fclose (infile);
             }
@@ -395,335 +483,204 @@ int main (int argc, char **argv)
     outhdr.mass[1] = hdr.mass[1];
     outhdr.num_files = numfiles;
 
-    posbatch
-        = (float *)malloc (3 * (outhdr.npart[1] + numfiles) * sizeof (float));
-    velbatch
-        = (float *)malloc (3 * (outhdr.npart[1] + numfiles) * sizeof (float));
-#if GADGET_ID_BYTES == 8
-    IDbatch
-        = (uint64_t *)malloc ((outhdr.npart[1] + numfiles) * sizeof (uint64_t));
-#else
-    IDbatch
-        = (uint32_t *)malloc ((outhdr.npart[1] + numfiles) * sizeof (uint32_t));
-#endif
-
-    if (posbatch == NULL || velbatch == NULL || IDbatch == NULL)
+    if (numpart_tot < (uint64_t)numfiles)
     {
         cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-             << ": unable to allocate memory for data read!" << endl;
+             << ": fewer particles than output files!" << endl;
         return -1;
     }
 
-    cout << " building up particle light cone..." << endl << endl;
+    // the output files are laid out before any data is copied, such that
+    // each input file can be copied independently, chunk by chunk, to the
+    // position of its particles in the catenated light cone
 
-    numread = 0;
+    const int64_t numpart_file = (int64_t)numpart_tot / numfiles;
 
-    for (int cycle = min_cycle; cycle <= max_cycle; cycle++)
+    vector<int> outfd (numfiles, -1);
+
+    for (int f = 0; f < numfiles; f++)
     {
-        cout << " cycle " << cycle << " ..." << endl;
+        const int64_t n = outputParticles (f, numfiles, numpart_tot);
 
-        for (int i = 0; i < sim.num_lightcone; i++)
-        {
-            if (!use_lightcone[i])
-                continue;
+        if (numfiles > 1)
+            sprintf (ofilename, "%s%s_cdm.%d", sim.output_path,
+                     sim.basename_lightcone, f);
+        else
+            sprintf (ofilename, "%s%s_cdm", sim.output_path,
+                     sim.basename_lightcone);
 
-            if (sim.num_lightcone > 1)
-                sprintf (filename, "%s%s%d_%04d_cdm", sim.output_path,
-                         sim.basename_lightcone, i, cycle);
-            else
-                sprintf (filename, "%s%s_%04d_cdm", sim.output_path,
-                         sim.basename_lightcone, cycle);
+        outfd[f] = open (ofilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-            infile = fopen (filename, "rb");
+        if (outfd[f] < 0
+            || ftruncate (outfd[f], blockOffset (3, n, GADGET_ID_BYTES)) != 0)
+        {
+            cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": unable to open file " << ofilename << " for output!"
+                 << endl;
+            return -1;
+        }
 
-            if (infile != NULL)
+        for (int b = 0; b < 3; b++)
+        {
+            blocksize = (uint32_t) (blockBytes (b, n, GADGET_ID_BYTES));
+
+            if (!writeFully (outfd[f], &blocksize, sizeof (uint32_t),
+                             blockOffset (b, n, GADGET_ID_BYTES)
+                                 - sizeof (uint32_t))
+                || !writeFully (outfd[f], &blocksize, sizeof (uint32_t),
+                                blockOffset (b, n, GADGET_ID_BYTES)
+                                    + blockBytes (b, n, GADGET_ID_BYTES)))
             {
-                fread (&blocksize, sizeof (uint32_t), 1, infile);
-
-                if (blocksize != sizeof (hdr))
-                {
-                    cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                         << ": unknown file format " << filename << "!" << endl;
-                    fclose (infile);
-                    continue;
-                }
-
-                if (fread (&hdr, sizeof (hdr), 1, infile) != 1)
-                {
-                    cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                         << ": unable to read header block from " << filename
-                         << "!" << endl;
-                    fclose (infile);
-                    continue;
-                }
-
-                fread (&blocksize, sizeof (uint32_t), 1, infile);
-                fread (&blocksize, sizeof (uint32_t), 1, infile);
-
-                long blockoffset
-                    = 3l * sizeof (float)
-                          * ((int64_t)hdr.npartTotal[1]
-                             + ((int64_t)hdr.npartTotalHW[1] << 32))
-                      + 2l * sizeof (uint32_t);
+                cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                     << ": unable to write block markers to " << ofilename
+                     << "!" << endl;
+                return -1;
+            }
+        }
+    }
 
-                backtrack = ftell (infile);
+    cout << " building up particle light cone ("
+         << (parallel ? "input files in parallel" : "serial")
+         << ", chunks of " << chunksize << " particles)..." << endl
+         << endl;
 
-                if (fseek (infile, 2 * blockoffset, SEEK_CUR))
-                {
-                    cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                         << ": unable to fast forward to ID "
-                            "block in "
-                         << filename << "!" << endl;
-                    fclose (infile);
-                    continue;
-                }
+    int status = 0;
+    double boxsize = outhdr.BoxSize;
 
-                for (int64_t p = 0;
-                     p < (int64_t)hdr.npartTotal[1]
-                             + ((int64_t)hdr.npartTotalHW[1] << 32);
-                     p += batch)
-                {
-                    batch
-                        = ((int64_t)hdr.npartTotal[1]
-                               + ((int64_t)hdr.npartTotalHW[1] << 32) - p
-                           >= (int64_t)outhdr.npart[1] - numread)
-                              ? (outhdr.npart[1] - (uint32_t)numread)
-                              : (uint32_t) (
-                                    (int64_t)hdr.npartTotal[1]
-                                    + ((int64_t)hdr.npartTotalHW[1] << 32) - p);
-
-                    if (
-#if GADGET_ID_BYTES == 8
-                        fread (IDbatch + numread, sizeof (uint64_t), batch,
-                               infile)
-#else
-                        fread (IDbatch + numread, sizeof (uint32_t), batch,
-                               infile)
-#endif
-                        != batch)
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to read ID batch "
-                                "from "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        return -1;
-                    }
+#pragma omp parallel if (parallel) reduction(max : boxsize)
+    {
+        char *chunk = (char *)malloc (
+            chunksize * max (3 * sizeof (float), (size_t)GADGET_ID_BYTES));
 
-                    fastforward = ftell (infile);
+        if (chunk == NULL)
+        {
+#pragma omp atomic write
+            status = -1;
+#pragma omp critical(lccat_output)
+            cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": unable to allocate memory for data read!" << endl;
+        }
 
-                    if (fseek (infile, backtrack, SEEK_SET))
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to rewind to "
-                                "positions block in "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        return -1;
-                    }
+#pragma omp for schedule(dynamic)
+        for (long j = 0; j < (long)input.size (); j++)
+        {
+            int failed;
+#pragma omp atomic read
+            failed = status;
+            if (failed)
+                continue;
 
-                    if (fread (posbatch + 3l * numread, sizeof (float),
-                               3l * batch, infile)
-                        != 3l * batch)
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to read position "
-                                "data from "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        return -1;
-                    }
+            const int64_t n = input[j].numpart;
+            const char *error = NULL;
+            int fd = open (input[j].name, O_RDONLY);
 
-                    backtrack = ftell (infile);
+            if (fd < 0)
+                error = "unable to open";
 
-                    if (fseek (infile,
-                               blockoffset - 3l * batch * sizeof (float),
-                               SEEK_CUR))
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to fast forward "
-                                "to velocities block "
-                                "in "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        return -1;
-                    }
+#pragma omp critical(lccat_output)
+            cout << " copying " << n << " particles from " << input[j].name
+                 << " ..." << endl;
 
-                    if (fread (velbatch + 3l * numread, sizeof (float),
-                               3l * batch, infile)
-                        != 3l * batch)
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to read velocity "
-                                "data from "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        return -1;
-                    }
+            for (int b = 0; b < 3 && error == NULL; b++)
+            {
+                const size_t width
+                    = (b < 2) ? 3 * sizeof (float) : GADGET_ID_BYTES;
 
-                    if (fseek (infile, fastforward, SEEK_SET))
+                for (int64_t p = 0, count; p < n && error == NULL; p += count)
+                {
+                    // global index of the particle, and output file
+                    const int64_t g = input[j].first + p;
+                    const int f = (g / numpart_file < numfiles)
+                                      ? (int)(g / numpart_file)
+                                      : numfiles - 1;
+
+                    count = min ((int64_t)chunksize, n - p);
+                    count = min (count, f * numpart_file
+                                            + outputParticles (f, numfiles,
+                                                               numpart_tot)
+                                            - g);
+
+                    if (!readFully (fd, chunk, count * width,
+                                    blockOffset (b, n, GADGET_ID_BYTES)
+                                        + p * width))
                     {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to fast forward "
-                                "to ID block in "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        return -1;
+                        error = "unable to read data block from";
+                        break;
                     }
 
-                    numread += batch;
-
-                    if ((numread == outhdr.npart[1] && numwrite < numfiles - 1)
-                        || (uint64_t)numread + numpart_write == numpart_tot)
+                    if (b == 0)
                     {
-                        for (long q = 0; q < 3l * numread; q++)
-                        {
-                            posbatch[q] += offset;
-                            if (posbatch[q] > outhdr.BoxSize)
-                                outhdr.BoxSize = posbatch[q];
-                        }
-
-                        if (numfiles > 1)
-                            sprintf (ofilename, "%s%s_cdm.%ld", sim.output_path,
-                                     sim.basename_lightcone, numwrite);
-                        else
-                            sprintf (ofilename, "%s%s_cdm", sim.output_path,
-                                     sim.basename_lightcone);
-
-                        outfile = fopen (ofilename, "wb");
-
-                        if (outfile == NULL)
-                        {
-                            fclose (infile);
-                            cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                                 << ": unable to open "
-                                    "file "
-                                 << ofilename << " for output!" << endl;
-                            return -1;
-                        }
-
-                        blocksize = sizeof (outhdr);
-
-                        cout << COLORTEXT_CYAN << " writing" << COLORTEXT_RESET
-                             << " output file " << ofilename << " ..." << endl;
-
-                        fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-                        fwrite (&outhdr, sizeof (outhdr), 1, outfile);
-                        fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-
-                        blocksize = 3l * outhdr.npart[1] * sizeof (float);
-
-                        fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-
-                        if (fwrite (posbatch, sizeof (float),
-                                    3l * outhdr.npart[1], outfile)
-                            != 3l * outhdr.npart[1])
-                        {
-                            fclose (infile);
-                            fclose (outfile);
-                            cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                                 << ": unable to write "
-                                    "position block!"
-                                 << endl;
-                            return -1;
-                        }
-
-                        fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-                        fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-
-                        if (fwrite (velbatch, sizeof (float),
-                                    3l * outhdr.npart[1], outfile)
-                            != 3l * outhdr.npart[1])
-                        {
-                            fclose (infile);
-                            fclose (outfile);
-                            cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                                 << ": unable to write "
-                                    "velocity block!"
-                                 << endl;
-                            return -1;
-                        }
-
-                        fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-
-                        blocksize = outhdr.npart[1] * GADGET_ID_BYTES;
-
-                        fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-
-                        if (fwrite (IDbatch, GADGET_ID_BYTES, outhdr.npart[1],
-                                    outfile)
-                            != outhdr.npart[1])
+                        float *pos = (float *)chunk;
+                        for (int64_t q = 0; q < 3 * count; q++)
                         {
-                            fclose (infile);
-                            fclose (outfile);
-                            cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                                 << ": unable to write "
-                                    "ID block!"
-                                 << endl;
-                            return -1;
+                            pos[q] += offset;
+                            if (pos[q] > boxsize)
+                                boxsize = pos[q];
                         }
-
-                        fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-
-                        fclose (outfile);
-
-                        cout << " output file written, "
-                                "contains "
-                             << outhdr.npart[1] << " particles." << endl;
-
-                        numpart_write += outhdr.npart[1];
-                        numwrite++;
-
-                        if (numwrite == numfiles - 1)
-                            outhdr.npart[1]
-                                += (uint32_t) (((long)numpart_tot) % numfiles);
-
-                        numread = 0;
                     }
+
+                    if (!writeFully (
+                            outfd[f], chunk, count * width,
+                            blockOffset (b,
+                                         outputParticles (f, numfiles,
+                                                          numpart_tot),
+                                         GADGET_ID_BYTES)
+                                + (g - f * numpart_file) * width))
+                        error = "unable to write data block while copying";
                 }
+            }
 
-                fclose (infile);
+            if (fd >= 0)
+                close (fd);
+
+            if (error != NULL)
+            {
+#pragma omp atomic write
+                status = -1;
+#pragma omp critical(lccat_output)
+                cout << COLORTEXT_RED << " error" << COLORTEXT_RESET << ": "
+                     << error << " " << input[j].name << "!" << endl;
             }
         }
+
+        free (chunk);
     }
 
+    if (status != 0)
+        return -1;
+
     cout << endl
          << COLORTEXT_GREEN << " particle light cone complete." << endl
          << COLORTEXT_RESET << endl;
 
-    free (IDbatch);
-    free (posbatch);
-    free (velbatch);
-
-    if (outhdr.BoxSize != sim.boxsize / GADGET_LENGTH_CONVERSION)
-    {
-        cout << " correcting header information (BoxSize = " << outhdr.BoxSize
+    if (boxsize != outhdr.BoxSize)
+        cout << " correcting header information (BoxSize = " << boxsize
              << ") ..." << endl;
 
-        outhdr.npart[1]
-            = (uint32_t) ((((long)numpart_tot) / numfiles) % (1ll << 32));
-        blocksize = sizeof (outhdr);
+    outhdr.BoxSize = boxsize;
+    blocksize = sizeof (outhdr);
 
-        for (int i = 0; i < numwrite - 1; i++)
+    for (int f = 0; f < numfiles; f++)
+    {
+        outhdr.npart[1] = (uint32_t) (
+            outputParticles (f, numfiles, numpart_tot) % (1ll << 32));
+
+        if (!writeFully (outfd[f], &blocksize, sizeof (uint32_t), 0)
+            || !writeFully (outfd[f], &outhdr, sizeof (outhdr),
+                            sizeof (uint32_t))
+            || !writeFully (outfd[f], &blocksize, sizeof (uint32_t),
+                            sizeof (uint32_t) + sizeof (outhdr))
+            || close (outfd[f]) != 0)
         {
-            sprintf (ofilename, "%s%s_cdm.%d", sim.output_path,
-                     sim.basename_lightcone, i);
-
-            outfile = fopen (ofilename, "r+b");
-
-            if (outfile == NULL)
-            {
-                cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                     << ": unable to open file " << ofilename << " for output!"
-                     << endl;
-                return -1;
-            }
-
-            fwrite (&blocksize, sizeof (uint32_t), 1, outfile);
-            fwrite (&outhdr, sizeof (outhdr), 1, outfile);
-
-            fclose (outfile);
+            cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": unable to write header of output file " << f << "!"
+                 << endl;
+            return -1;
         }
+
+        cout << COLORTEXT_CYAN << " written" << COLORTEXT_RESET
+             << " output file " << f << ", contains " << outhdr.npart[1]
+             << " particles." << endl;
     }
 
     cout << endl
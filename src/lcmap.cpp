@@ -5,12 +5,16 @@
 #include "gevolution/parser.hpp"
 #include <array>
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <vector>
 
 using namespace std;
+using namespace gevolution;
 
 struct background_data
 {
@@ -23,6 +27,17 @@ struct metric_data
 {
     healpix_header hdr;
     float *pixel;
+    void *map;     // mapping of the data block holding pixel, or NULL if
+    size_t maplen; // pixel is allocated
+    void release ()
+    {
+        if (map != NULL)
+            munmap (map, maplen);
+        else
+            free (pixel);
+        map = NULL;
+        pixel = NULL;
+    }
 };
 
 struct metric_container
@@ -48,7 +63,7 @@ struct metric_container
             if (it->second.hdr.distance >= min_dist)
                 break;
             else
-                free (it->second.pixel);
+                it->second.release ();
         }
 
         if (it != healpix_data.begin ())
@@ -58,7 +73,7 @@ struct metric_container
     {
         for (std::map<int, metric_data>::iterator it = healpix_data.begin ();
              it != healpix_data.end (); it++)
-            free (it->second.pixel);
+            it->second.release ();
         healpix_data.clear ();
     }
 };
@@ -68,6 +83,16 @@ bool kappa (float *pixel, const int64_t Nside, int64_t ipix, float &result);
 int loadHealpixData (metric_container *field, double min_dist, double max_dist,
                      char *lightconeparam = NULL);
 
+const char *mapDataBlock (FILE *infile, const size_t bytes, void *&map,
+                          size_t &maplen);
+
+float mappedDouble (const char *block, const int64_t i)
+{
+    double d;
+    memcpy (&d, block + i * sizeof (double), sizeof (double));
+    return d;
+}
+
 float lin_int (float a, float b, float f) { return a + (f * (b - a)); }
 
 int main (int argc, char **argv)
@@ -191,10 +216,10 @@ int main (int argc, char **argv)
              << endl;
     }
 
-    double tauobs = particleHorizon (1,
-                                     1.5 * sim.boxsize * sim.boxsize
-                                         / C_SPEED_OF_LIGHT / C_SPEED_OF_LIGHT,
-                                     cosmo);
+    cosmo.fourpiG = 1.5 * sim.boxsize * sim.boxsize / cosmo.C_SPEED_OF_LIGHT
+                    / cosmo.C_SPEED_OF_LIGHT;
+
+    double tauobs = particleHorizon (1, cosmo);
 
     FILE *background_file;
     char *buffer;
@@ -379,10 +404,7 @@ int main (int argc, char **argv)
         {
             distances[i]
                 = tauobs
-                  - particleHorizon (1. / (redshifts[i] + 1.),
-                                     1.5 * sim.boxsize * sim.boxsize
-                                         / C_SPEED_OF_LIGHT / C_SPEED_OF_LIGHT,
-                                     cosmo);
+                  - particleHorizon (1. / (redshifts[i] + 1.), cosmo);
 
             if (i != 0)
                 cout << ", ";
@@ -692,6 +714,7 @@ int main (int argc, char **argv)
                         itNpix++;
                     }
 
+#pragma omp parallel for firstprivate(helper) private(v1, ptg, nnpix, nnwgt, p)
                     for (long l = 0; l < Npix_final; l++)
                     {
                         pix2vec_ring64 (Nside_final, l, v1);
@@ -776,6 +799,7 @@ int main (int argc, char **argv)
 
                 if (Nside_final > Nside_initial)
                 {
+#pragma omp parallel for firstprivate(helper) private(ptg, nnpix, nnwgt, q)
                     for (long l = 0; l < Npix_final; l++)
                     {
                         helper.SetNside (Nside_final, RING);
@@ -939,6 +963,7 @@ int main (int argc, char **argv)
 
                 if (Nside_final > Nside_initial)
                 {
+#pragma omp parallel for firstprivate(helper) private(ptg, nnpix, nnwgt, q)
                     for (long l = 0; l < Npix_final; l++)
                     {
                         helper.SetNside (Nside_final, RING);
@@ -1058,7 +1083,11 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
     int pixbatch_delim[3];
     int pixbatch_size[3] = { 0, 0, 0 };
 
+    const char *block;
+
     metric.pixel = NULL;
+    metric.map = NULL;
+    metric.maplen = 0;
 
     if (!field->healpix_data.empty ())
     {
@@ -1290,7 +1319,17 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
                 return -1;
             }
 
-            metric.pixel = (float *)malloc (metric.hdr.Npix * sizeof (float));
+            block = mapDataBlock (infile, blocksize[1], metric.map,
+                                  metric.maplen);
+
+            if (block == NULL)
+            {
+                cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                     << ": unable to map data block in map file " << filename
+                     << "!" << endl;
+                fclose (infile);
+                return -1;
+            }
 
             if (metric.hdr.Nside_ring > 0
                 && metric.hdr.Nside_ring < metric.hdr.Nside)
@@ -1357,21 +1396,12 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
                                             * metric.hdr.Nside_ring;
                 }
 
+                metric.pixel
+                    = (float *)malloc (metric.hdr.Npix * sizeof (float));
+
                 if (metric.hdr.precision == 4)
                 {
-                    float *fpix
-                        = (float *)malloc (metric.hdr.Npix * sizeof (float));
-                    if (fread (fpix, sizeof (float), metric.hdr.Npix, infile)
-                        != metric.hdr.Npix)
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to read data "
-                                "block in map file "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        free (metric.pixel);
-                        return -1;
-                    }
+                    const float *fpix = (const float *)block;
 
 #pragma omp parallel for private(j) collapse(2)
                     for (int p = 0; p < pixbatch_delim[0]; p++)
@@ -1428,24 +1458,9 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
                         }
                     }
 
-                    free (fpix);
                 }
                 else if (metric.hdr.precision == 8)
                 {
-                    double *dpix
-                        = (double *)malloc (metric.hdr.Npix * sizeof (double));
-                    if (fread (dpix, sizeof (double), metric.hdr.Npix, infile)
-                        != metric.hdr.Npix)
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to read data "
-                                "block in map file "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        free (metric.pixel);
-                        return -1;
-                    }
-
 #pragma omp parallel for private(j) collapse(2)
                     for (int p = 0; p < pixbatch_delim[0]; p++)
                     {
@@ -1454,7 +1469,8 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
                             ring2nest64 (metric.hdr.Nside_ring, p, &j);
                             j = j * pixbatch_size[0] + i;
                             nest2ring64 (metric.hdr.Nside, j, &j);
-                            metric.pixel[j] = dpix[pixbatch_size[0] * p + i];
+                            metric.pixel[j] = mappedDouble (
+                                block, pixbatch_size[0] * p + i);
                         }
                     }
 #pragma omp parallel for private(q, j)
@@ -1468,11 +1484,12 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
                             nest2ring64 (metric.hdr.Nside, j, &j);
                             if (j < metric.hdr.Npix)
                             {
-                                metric.pixel[j]
-                                    = dpix[pixbatch_size[0] * pixbatch_delim[0]
-                                           + pixbatch_size[1]
-                                                 * (p - pixbatch_delim[0])
-                                           + q];
+                                metric.pixel[j] = mappedDouble (
+                                    block,
+                                    pixbatch_size[0] * pixbatch_delim[0]
+                                        + pixbatch_size[1]
+                                              * (p - pixbatch_delim[0])
+                                        + q);
                                 q++;
                             }
                         }
@@ -1488,71 +1505,52 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
                             nest2ring64 (metric.hdr.Nside, j, &j);
                             if (j < metric.hdr.Npix)
                             {
-                                metric.pixel[j]
-                                    = dpix[pixbatch_size[0] * pixbatch_delim[0]
-                                           + pixbatch_size[1]
-                                                 * (pixbatch_delim[1]
-                                                    - pixbatch_delim[0])
-                                           + pixbatch_size[2]
-                                                 * (p - pixbatch_delim[1])
-                                           + q];
+                                metric.pixel[j] = mappedDouble (
+                                    block,
+                                    pixbatch_size[0] * pixbatch_delim[0]
+                                        + pixbatch_size[1]
+                                              * (pixbatch_delim[1]
+                                                 - pixbatch_delim[0])
+                                        + pixbatch_size[2]
+                                              * (p - pixbatch_delim[1])
+                                        + q);
                                 q++;
                             }
                         }
                     }
 
-                    free (dpix);
                 }
                 else
                 {
                     cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
                          << ": precision " << metric.hdr.precision
                          << " bytes not supported for map files!" << endl;
-                    free (metric.pixel);
                 }
+
+                munmap (metric.map, metric.maplen);
+                metric.map = NULL;
             }
             else
             {
-                if (metric.hdr.precision == 4)
-                {
-                    if (fread (metric.pixel, sizeof (float), metric.hdr.Npix,
-                               infile)
-                        != metric.hdr.Npix)
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to read data "
-                                "block in map file "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        free (metric.pixel);
-                        return -1;
-                    }
-                }
+                if (metric.hdr.precision == 4) // used in place
+                    metric.pixel = (float *)block;
                 else if (metric.hdr.precision == 8)
                 {
-                    double *dpix
-                        = (double *)malloc (metric.hdr.Npix * sizeof (double));
-                    if (fread (dpix, sizeof (double), metric.hdr.Npix, infile)
-                        != metric.hdr.Npix)
-                    {
-                        cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
-                             << ": unable to read data "
-                                "block in map file "
-                             << filename << "!" << endl;
-                        fclose (infile);
-                        free (metric.pixel);
-                        return -1;
-                    }
+                    metric.pixel
+                        = (float *)malloc (metric.hdr.Npix * sizeof (float));
+#pragma omp parallel for
                     for (int p = 0; p < metric.hdr.Npix; p++)
-                        metric.pixel[p] = dpix[p];
-                    free (dpix);
+                        metric.pixel[p] = mappedDouble (block, p);
+                    munmap (metric.map, metric.maplen);
+                    metric.map = NULL;
                 }
                 else
                 {
                     cout << COLORTEXT_RED << " error" << COLORTEXT_RESET
                          << ": precision " << metric.hdr.precision
                          << " bytes not supported for map files!" << endl;
-                    free (metric.pixel);
+                    munmap (metric.map, metric.maplen);
+                    metric.map = NULL;
                 }
             }
 
@@ -1579,7 +1577,7 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
                     }
                 }
 
-                free (metric.pixel);
+                metric.release ();
                 metric.pixel = fpix;
                 metric.hdr.Nside /= 2;
                 metric.hdr.Npix /= 4;
@@ -1704,6 +1702,33 @@ int loadHealpixData (metric_container *field, double min_dist, double max_dist,
     return count;
 }
 
+// maps the data block of the given size that starts at the current position
+// of infile, which is moved past the block; the mapping outlives the file
+const char *mapDataBlock (FILE *infile, const size_t bytes, void *&map,
+                          size_t &maplen)
+{
+    const off_t offset = ftello (infile);
+    const off_t start = offset - offset % sysconf (_SC_PAGESIZE);
+
+    map = NULL;
+
+    if (offset < 0 || fseeko (infile, bytes, SEEK_CUR))
+        return NULL;
+
+    maplen = bytes + (offset - start);
+    map = mmap (NULL, maplen, PROT_READ, MAP_PRIVATE, fileno (infile), start);
+
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        return NULL;
+    }
+
+    madvise (map, maplen, MADV_WILLNEED);
+
+    return (const char *)map + (offset - start);
+}
+
 bool kappa (float *pixel, const int64_t Nside, int64_t ipix, float &result)
 {
     int64_t j, k, l, q, ring;
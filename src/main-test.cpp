@@ -186,7 +186,7 @@ int main (int argc, char **argv)
 
     Particles_gevolution
         pcls_cdm,pcls_b,pcls_ncdm[MAX_PCL_SPECIES-2];
-    set<long> IDbacklog[MAX_PCL_SPECIES];
+    id_backlog IDbacklog[MAX_PCL_SPECIES];
 
 
 
@@ -38,6 +38,8 @@
 #include <boost/mpi/communicator.hpp>
 namespace mpi = boost::mpi;
 
+#include "gevolution/async_output.hpp"
+#include "gevolution/checkpoint.hpp"
 #include "gevolution/gevolution.hpp"
 #include "gevolution/newtonian_pm.hpp"
 #include "gevolution/gr_pm.hpp"
@@ -55,6 +57,7 @@ namespace mpi = boost::mpi;
 #endif
 #include "LATfield2.hpp"
 #include "gevolution/Particles_gevolution.hpp"
+#include "gevolution/particles_soa.hpp"
 #include "gevolution/background.hpp"
 #include "gevolution/class_tools.hpp"
 #include "gevolution/ic_basic.hpp"
@@ -70,6 +73,14 @@ namespace mpi = boost::mpi;
 #include "gevolution/hibernation.hpp"
 #include "gevolution/output.hpp"
 #include "gevolution/parser.hpp"
+#include "gevolution/particle_load.hpp"
+#include "gevolution/diagnostics.hpp"
+#include "gevolution/fof.hpp"
+#include "gevolution/memory_estimate.hpp"
+#include "gevolution/memory_usage.hpp"
+#include "gevolution/time_bins.hpp"
+#include "gevolution/timers.hpp"
+#include "gevolution/processor_grid.hpp"
 #include "gevolution/radiation.hpp"
 #ifdef VELOCITY
 #include "gevolution/velocity.hpp"
@@ -118,29 +129,15 @@ auto string_fill(std::string s, int n , char c = ' ')
 
 int main (int argc, char **argv)
 {
-    mpi::environment env;
+    // the thread of async_output writes with MPI-IO while the main thread
+    // computes; the OpenMP threads do not call MPI
+    mpi::environment env (argc, argv, mpi::threading::multiple);
     mpi::communicator com_world;
     
-// #ifdef BENCHMARK
-//     // benchmarking variables
-//     double ref_time, ref2_time, cycle_start_time;
-//     double initialization_time;
-//     double run_time;
-//     double cycle_time = 0;
-//     double projection_time = 0;
-//     double snapshot_output_time = 0;
-//     double spectra_output_time = 0;
-//     double lightcone_output_time = 0;
-//     double gravity_solver_time = 0;
-//     double fft_time = 0;
-//     int fft_count = 0;
-//     double update_q_time = 0;
-//     int update_q_count = 0;
-//     double moveParts_time = 0;
-//     int moveParts_count = 0;
-// #endif // BENCHMARK
 
     int n = 0, m = 0;
+    bool tune_grid = false;
+    bool dry_run = false;
 #ifdef EXTERNAL_IO
     int io_size = 0;
     int io_group_size = 0;
@@ -186,6 +183,12 @@ int main (int argc, char **argv)
         case 'm':
             m = atoi (argv[++i]); // size of the dim 2 of the processor grid
             break;
+        case 't':
+            tune_grid = true; // probe the processor grids, overrides -n, -m
+            break;
+        case 'd':
+            dry_run = true; // predict the memory of the run and stop
+            break;
         case 'p':
             cout << "HAVE_CLASS needs to be set at compilation to use "
                     "CLASS "
@@ -209,6 +212,18 @@ int main (int argc, char **argv)
         }
     }
 
+    std::vector<processor_grid> probed_grids;
+    if (tune_grid && settingsfile != NULL)
+    {
+        const int N = settings_ngrid (settingsfile, com_world);
+        if (N > 0)
+        {
+            probed_grids = tune_processor_grid (com_world, N);
+            n = probed_grids.front ().n;
+            m = probed_grids.front ().m;
+        }
+    }
+
     parallel.initialize (com_world, n, m);
 
     COUT << COLORTEXT_WHITE << endl;
@@ -220,6 +235,23 @@ int main (int argc, char **argv)
     COUT << "Version date: " GIT_DATE "\n"
             "Commit: " GIT_COMMIT "\n\n";
 
+    if (!probed_grids.empty ())
+    {
+        COUT << " processor grids probed (seconds per FFT + halo round):"
+             << endl;
+        for (const auto &g : probed_grids)
+            COUT << "   -n " << g.n << " -m " << g.m << "  " << g.seconds
+                 << endl;
+        COUT << " processor grid set to: " << COLORTEXT_CYAN << "-n " << n
+             << " -m " << m << COLORTEXT_RESET
+             << " (pass these flags to reuse the choice)" << endl
+             << endl;
+    }
+    else if (tune_grid)
+        COUT << " processor grid probe skipped: Ngrid not found in the "
+                "settings file"
+             << endl;
+
     if (settingsfile == NULL)
     {
         COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
@@ -238,6 +270,37 @@ int main (int argc, char **argv)
     COUT << " parsing of settings file completed. " << numparam
          << " parameters found, " << usedparams << " were used." << endl;
 
+    if (dry_run)
+    {
+        // the particles of the templates, as generateIC_basic counts them;
+        // one cdm particle per site for the other generators
+        const int species = 1 + (sim.baryon_flag == 1) + cosmo.num_ncdm;
+        long numpcl[MAX_PCL_SPECIES] = {};
+        for (int i = 0; i < species; i++)
+        {
+            if (ic.generator != ICGEN_BASIC)
+                numpcl[i] = i ? 0 : (long)sim.numpts * sim.numpts * sim.numpts;
+            else if (ic.numtile[i] > 0)
+            {
+                float *pcldata = NULL;
+                loadHomogeneousTemplate (ic.pclfile[i], numpcl[i], pcldata);
+                free (pcldata);
+                numpcl[i] *= (long)ic.numtile[i] * ic.numtile[i]
+                             * ic.numtile[i];
+            }
+        }
+        const memory_estimate e
+            = predict_memory (sim, ic, numpcl, species, n, m);
+        // with -t, n and m are the grid chosen by the probe above
+        COUT << " dry run: memory per process on " << n << " x " << m
+             << " processes" << (probed_grids.empty () ? "" : " (grid of -t)")
+             << ", " << numpcl[0] << " cdm particles"
+             << (ic.generator != ICGEN_BASIC ? " (assumed)" : "") << endl
+             << e.report () << endl;
+        free (params);
+        return 0;
+    }
+
     sprintf (filename, "%s%s_settings_used.ini", sim.output_path,
              sim.basename_generic);
     saveParameterFile (filename, params, numparam);
@@ -259,7 +322,7 @@ int main (int argc, char **argv)
 
     Particles_gevolution
         pcls_cdm,pcls_b,pcls_ncdm[MAX_PCL_SPECIES-2];
-    set<long> IDbacklog[MAX_PCL_SPECIES];
+    id_backlog IDbacklog[MAX_PCL_SPECIES];
 
 
 
@@ -280,6 +343,7 @@ int main (int argc, char **argv)
     cosmo.fourpiG
         = 1.5 * sim.boxsize * sim.boxsize / cosmo.C_SPEED_OF_LIGHT / cosmo.C_SPEED_OF_LIGHT;
     a = 1. / (1. + sim.z_in);
+    tabulateBackground (cosmo, 0.01 * a, 2.);
     tau = particleHorizon (a, cosmo);
     unique_ptr<debugger_t> Debugger_ptr{
         Debugger = new
@@ -292,7 +356,10 @@ int main (int argc, char **argv)
     dtau = std::min(sim.Cf * dx, sim.steplimit/Hconf(a,cosmo));
     dtau_old = dtau;
 
+    memory_ledger ledger;
     {
+    // the fields of the generators are freed at the end of the scope
+    memory_ledger::scope measured (ledger, "particles");
     Field<Real> phi;
     Field<Real> source;
     Field<Real> chi;
@@ -308,17 +375,24 @@ int main (int argc, char **argv)
     PlanFFT<Cplx> plan_source (&source, &scalarFT);
     PlanFFT<Cplx> plan_phi (&phi, &scalarFT);
     PlanFFT<Cplx> plan_chi (&chi, &scalarFT);
-    Sij.initialize (lat, 3, 3, matrix_symmetry::symmetric);
-    SijFT.initialize (latFT, 3, 3, matrix_symmetry::symmetric);
-    PlanFFT<Cplx> plan_Sij (&Sij, &SijFT);
-    Bi.initialize (lat, 3);
-    BiFT.initialize (latFT, 3);
-    PlanFFT<Cplx> plan_Bi (&Bi, &BiFT);
+    PlanFFT<Cplx> plan_Sij;
+    PlanFFT<Cplx> plan_Bi;
+    // the engines do not take over the metric of the basic generator, which
+    // then does without the vector and tensor fields
+    if (ic.generator != ICGEN_BASIC)
+    {
+        Sij.initialize (lat, 3, 3, matrix_symmetry::symmetric);
+        SijFT.initialize (latFT, 3, 3, matrix_symmetry::symmetric);
+        plan_Sij.initialize (&Sij, &SijFT);
+        Bi.initialize (lat, 3);
+        BiFT.initialize (latFT, 3);
+        plan_Bi.initialize (&Bi, &BiFT);
+    }
     if (ic.generator == ICGEN_BASIC)
         generateIC_basic (sim, ic, cosmo, &pcls_cdm, &pcls_b,
-                          pcls_ncdm, maxvel, &phi, &chi, &Bi, &source, &Sij,
-                          &scalarFT, &BiFT, &SijFT, &plan_phi, &plan_chi,
-                          &plan_Bi, &plan_source, &plan_Sij, params,
+                          pcls_ncdm, maxvel, &phi, &chi, NULL, &source, NULL,
+                          &scalarFT, NULL, NULL, &plan_phi, &plan_chi,
+                          NULL, &plan_source, NULL, params,
                           numparam); // generates ICs on the fly
     else if (ic.generator == ICGEN_READ_FROM_DISK)
         readIC (sim, ic, cosmo, a, tau, dtau, dtau_old, &pcls_cdm,
@@ -373,22 +447,145 @@ int main (int argc, char **argv)
              << endl;
 
     
-    std::unique_ptr< particle_mesh<Cplx,Particles_gevolution> > PM;
+#ifdef PARTICLES_SOA
+    using pm_particles = particles_soa;
+#else
+    using pm_particles = Particles_gevolution;
+#endif
+#if defined(MASS_ASSIGNMENT_PCS)
+    using pm_assignment = assignment::pcs;
+#elif defined(MASS_ASSIGNMENT_TSC)
+    using pm_assignment = assignment::tsc;
+#else
+    using pm_assignment = assignment::cic;
+#endif
+    
+    std::unique_ptr< particle_mesh<Cplx,pm_particles,pm_assignment> > PM;
     
+    {
+    memory_ledger::scope measured (ledger, "engine");
     if(sim.gr_flag==gravity_theory::GR)
     {
+#if defined(MASS_ASSIGNMENT_PCS) || defined(MASS_ASSIGNMENT_TSC)
+        // T0i, Tij and the gradient of B are written for CIC
+        COUT << " error: the relativistic engine only supports CIC mass "
+                "assignment" << endl;
+        parallel.abortForce ();
+#else
         PM.reset(
-            new relativistic_pm<Cplx,Particles_gevolution>(sim.numpts,com_world)
+            new relativistic_pm<Cplx,pm_particles>(sim.numpts,com_world)
         );
+#endif
     }else
     {
         PM.reset(
-            new newtonian_pm<Cplx,Particles_gevolution>(sim.numpts,com_world)
+            new newtonian_pm<Cplx,pm_particles,pm_assignment>(
+                sim.numpts,com_world)
         );
     }
+    }
+    
+    PM->pk_bins = {std::max (sim.numbins, 1),
+                   sim.pk_binning_flag == PK_BINNING_LOG};
+    
+    async_output output (com_world,
+                         std::size_t (sim.output_buffer * 1024 * 1024));
+    ledger.record ("output buffer", sim.output_buffer * 1024 * 1024);
+    if (sim.output_buffer > 0 && !output.asynchronous ())
+        COUT << " MPI does not support MPI_THREAD_MULTIPLE, the output is "
+                "synchronous" << endl;
+    PM->output = &output;
+    
+    // the potentials of the hibernation point, the particles having been
+    // read by readIC
+    if (ic.generator == ICGEN_READ_FROM_DISK && ic.restart_cycle >= 0)
+        PM->load_restart ({ic.metricfile[0], ic.metricfile[1],
+                           ic.metricfile[2]});
+    
+    if(sim.interlacing_flag && !PM->enable_interlacing())
+        COUT << " interlacing is not supported by the relativistic engine, "
+                "ignored" << endl;
+    
+    if(sim.short_range_flag
+       && !PM->enable_short_range(sim.short_range_split,
+                                  sim.short_range_cutoff,
+                                  sim.short_range_softening))
+        COUT << " short-range forces are not supported by the relativistic "
+                "engine, ignored" << endl;
+    
+    // particle domains weighted by the particles, see particles_soa
+    int balance_interval = sim.balance_interval;
+#if defined(PARTICLES_SOA) && !defined(GPU_OFFLOAD) \
+    && !defined(MASS_ASSIGNMENT_PCS) && !defined(MASS_ASSIGNMENT_TSC)
+    if (balance_interval > 0
+        && (sim.gr_flag == gravity_theory::GR || sim.interlacing_flag
+            || sim.short_range_flag || sim.time_bins > 1))
+    {
+        COUT << " particle balancing needs the Newtonian engine without "
+                "interlacing, short-range forces or time bins, ignored"
+             << endl;
+        balance_interval = 0;
+    }
+#else
+    if (balance_interval > 0)
+    {
+        COUT << " particle balancing needs the particles_soa build with CIC "
+                "mass assignment and without GPU offload, ignored" << endl;
+        balance_interval = 0;
+    }
+#endif
     
     pcls_cdm.update_mass(); // fix the mass legacy problem
     
+    incremental_checkpoint checkpoint (std::string (sim.restart_path)
+                                           + sim.basename_restart,
+                                       com_world,
+                                       sim.checkpoint_base_interval);
+    if (sim.checkpoint_restart)
+    {
+        checkpoint_clock clock;
+        if (checkpoint.restore_latest (clock, pcls_cdm, PM->restart_fields ()))
+        {
+            a = clock.a;
+            tau = clock.tau;
+            dtau = clock.dtau;
+            dtau_old = clock.dtau_old;
+            cycle = clock.cycle;
+            snapcount = clock.snapcount;
+            pkcount = clock.pkcount;
+            restartcount = clock.restartcount;
+            COUT << " continuing from the checkpoint of cycle " << cycle
+                 << ", z = " << (1. / a) - 1. << endl;
+        }
+        else
+            COUT << " no checkpoint found for this processor grid, "
+                    "starting from the initial conditions" << endl;
+    }
+    double checkpoint_time = MPI_Wtime ();
+    
+    phase_timers timers (std::string (sim.output_path) + sim.basename_generic
+                             + "_timers.dat",
+                         sim.timer_counters);
+    
+    time_bins bins (sim.time_bins, sim.time_bin_accuracy);
+    particle_load load;
+    
+#ifdef PARTICLES_SOA
+    // the PM loop evolves a cell-sorted structure-of-arrays copy, pcls_cdm is
+    // brought up to date before output
+    const double resident_before_soa = resident_bytes ();
+    particles_soa pcls_pm(pcls_cdm);
+    ledger.record ("particles_soa copy",
+                   resident_bytes () - resident_before_soa);
+#else
+    Particles_gevolution& pcls_pm = pcls_cdm;
+#endif
+    {
+        // collective
+        const std::string memory = ledger.report (com_world);
+        COUT << memory;
+    }
+    
     // background file initialization
     fs::path BackgroundPath{sim.output_path};
     BackgroundPath /= std::string(sim.basename_generic) + "_background.dat";
@@ -410,106 +607,156 @@ int main (int argc, char **argv)
     }
     
     
-    // TODO: remove this ugly fix. The problem is that initialization is still
-    // thinking that 'vel' is momentum
-    // pcls_cdm.for_each(
-    //     [](particle &part, const Site& /* xpart */)
-    //     {
-    //         for(int i=0;i<3;++i)
-    //             part.momentum[i] = part.vel[i];
-    //     }
-    // );
+    // hibernation point, count < 0 for the wallclock limit
+    auto write_hibernation = [&] (int count)
+    {
+        phase_timer timed (timers, phase::output);
+#ifdef PARTICLES_SOA
+        pcls_pm.copy_to (pcls_cdm);
+#endif
+        output.flush (); // HDF5 is not used from two threads
+        hibernate (sim, ic, cosmo, &pcls_cdm, &pcls_b, pcls_ncdm,
+                   [&] (const std::string &prefix)
+                   { PM->save_restart (prefix); },
+                   a, tau, dtau, cycle, count);
+    };
+
+    // the initial conditions as the hibernation point <file base>_ic, from
+    // which other runs can start instead of generating them again
+    if (sim.ic_hibernation && cycle == 0
+        && ic.generator != ICGEN_READ_FROM_DISK)
+    {
+        metadata sim_ic = sim;
+        strncat (sim_ic.basename_restart, "_ic",
+                 PARAM_MAX_LENGTH - strlen (sim_ic.basename_restart) - 1);
+        COUT << COLORTEXT_CYAN << " writing the initial conditions"
+             << COLORTEXT_RESET << " as hibernation point "
+             << sim_ic.basename_restart << endl;
+        hibernate (sim_ic, ic, cosmo, &pcls_cdm, &pcls_b, pcls_ncdm,
+                   [&] (const std::string &prefix)
+                   { PM->save_restart (prefix); },
+                   a, tau, dtau, cycle);
+    }
     
     do // main loop
     {
         COUT << "Starting cycle: " << cycle << '\n';        
         
         // PM step 1. construction of the energy momentum tensor
-        PM->clear_sources();
-        PM->sample(pcls_cdm,a);
-        
-        for(auto report = PM->report(pcls_cdm,a);;)
         {
-            COUT << report << "\n";
-            break;
+            phase_timer timed (timers, phase::clear_sources);
+            PM->clear_sources();
+        }
+        {
+            phase_timer timed (timers, phase::sample);
+            particle_load::scope loaded (load);
+            PM->sample(pcls_pm,a);
         }
         
-        // EM tensor
-        double T00hom = PM->density();
+        // statistics of the cycle, reduced at once after the forces
+        const bool diagnose = cycle % sim.diagnostics_interval == 0;
+        diagnostics diag;
+        if (diagnose)
+            PM->diagnose_sources(diag);
          
         // PM step 2. compute the potentials
-        PM->compute_potential(
-            cosmo.fourpiG, 
-            a,
-            Hconf(a,cosmo),
-            // dtau_old,
-            cosmo.Omega_cdm + cosmo.Omega_b + bg_ncdm (a, cosmo));
-        
-        double Phihom = PM->sum_phi();
-        
-        // Sources
-        for(auto report = PM->report(pcls_cdm,a);;)
-        {
-            COUT << report << "\n";
-            break;
-        }
-
-        // record some background data
         {
-            if(com_world.rank()==0)
-            {
-                // select main process
-                std::ofstream f(BackgroundPath,std::ios_base::app);
-                if(!f)
-                {
-                    std::cerr << "Could not open the background file: " 
-                              << BackgroundPath << '\n';
-                }else
-                {
-                    f << std::setw(tabwidth) << cycle 
-                      << std::setw(tabwidth) << tau
-                      << std::setw(tabwidth) << a
-                      << std::setw(tabwidth) << Hconf(a,cosmo)/Hconf(1.0,cosmo)
-                      << std::setw(tabwidth) << Phihom 
-                      << std::setw(tabwidth) << T00hom << '\n';
-                }
-            }
+            phase_timer timed (timers, phase::potential);
+            PM->compute_potential(
+                cosmo.fourpiG, 
+                a,
+                Hconf(a,cosmo),
+                // dtau_old,
+                cosmo.Omega_cdm + cosmo.Omega_b + bg_ncdm (a, cosmo));
         }
+        
+        if (diagnose)
+            PM->diagnose_potentials(diag);
 
         // lightcone output
         if (sim.num_lightcone > 0)
         {
-            //writeLightcones (sim, cosmo, a, tau, dtau, dtau_old,
-            //                 maxvel[0], cycle,
-            //                 h5filename + sim.basename_lightcone, &pcls_cdm,
-            //                 &pcls_b, pcls_ncdm, &PM->phi, &PM->chi, &PM->Bi,
-            //                 &PM->Tij, &PM->Bi_FT,
-            //                 &PM->Tij_FT, &PM->plan_Bi, &PM->plan_Tij, done_hij, IDbacklog);
-            ;
-        }
-        else
-        {
-            // done_hij = 0;
+            phase_timer timed (timers, phase::output);
+#ifdef PARTICLES_SOA
+            for (int i = 0; i < sim.num_lightcone; i++)
+                if (sim.out_lightcone[i] & MASK_GADGET)
+                {
+                    pcls_pm.copy_to (pcls_cdm);
+                    break;
+                }
+#endif
+            PM->complete_halos ();
+            const auto fields = PM->lightcone_fields ();
+            writeLightcones (sim, cosmo, a, tau, dtau, dtau_old, cycle,
+                             h5filename + sim.basename_lightcone, &pcls_cdm,
+                             &pcls_b, pcls_ncdm, fields[0], fields[1],
+                             fields[2], fields[3], IDbacklog);
         }
 
         // TODO: snapshot output
         if (snapcount < sim.num_snapshot
             && 1. / a < sim.z_snapshot[snapcount] + 1.)
         {
+            phase_timer timed (timers, phase::output);
             COUT << COLORTEXT_CYAN << " writing snapshot" << COLORTEXT_RESET
                  << " at z = " << ((1. / a) - 1.) << " (cycle " << cycle
                  << "), tau/boxsize = " << tau << endl;
             
+#ifdef PARTICLES_SOA
+            pcls_pm.copy_to(pcls_cdm);
+#endif
             write_snapshot(sim,cosmo,a,pcls_cdm,
                 h5filename
                     +sim.basename_snapshot
                     + string_fill(std::to_string(snapcount),3,'0') 
                     +"_cdm");
             
-            PM->save_to_file(
-                h5filename
-                    +sim.basename_snapshot
-                    + string_fill(std::to_string(snapcount),3,'0') ); 
+            {
+                h5_snapshot file(
+                    h5filename
+                        +sim.basename_snapshot
+                        + string_fill(std::to_string(snapcount),3,'0')
+                        +".h5",
+                    com_world, sim.snapshot_deflate);
+                file.attribute("a",a);
+                file.attribute("boxsize",sim.boxsize);
+                file.attribute("Ngrid",sim.numpts);
+                if (sim.out_snapshot & MASK_PCLS)
+                    file.write_particles("cdm",pcls_cdm);
+                const std::pair<const char*,int> fields[] = {
+                    {"phi",MASK_PHI}, {"chi",MASK_CHI}, {"B",MASK_B},
+                    {"T00",MASK_T00}, {"T0i",MASK_P}, {"Tij",MASK_TIJ}};
+                for (const auto& [name,mask] : fields)
+                    file.format(name,{sim.downgrade_factor,
+                        (sim.snapshot_single & mask) != 0,
+                        sim.snapshot_mantissa_bits});
+                PM->save_to_snapshot(file);
+                output.push(std::move(file));
+            }
+
+            // halo catalog, in its own file
+            if (sim.out_snapshot & MASK_HALOS)
+            {
+                fof_halos halos(pcls_cdm, sim.halo_linking_length,
+                                sim.halo_min_particles,
+                                sim.out_snapshot & MASK_MEMBERS, com_world);
+                long long count = halos.halos().size();
+                MPI_Allreduce(MPI_IN_PLACE, &count, 1, MPI_LONG_LONG,
+                              MPI_SUM, com_world);
+                COUT << " " << count << " halos found with at least "
+                     << sim.halo_min_particles << " particles" << endl;
+
+                h5_snapshot file(
+                    h5filename
+                        +sim.basename_snapshot
+                        + string_fill(std::to_string(snapcount),3,'0')
+                        +"_halos.h5",
+                    com_world, sim.snapshot_deflate);
+                file.attribute("a",a);
+                file.attribute("boxsize",sim.boxsize);
+                halos.write(file,"halos");
+                output.push(std::move(file));
+            }
             
             snapcount++;
         }
@@ -518,6 +765,7 @@ int main (int argc, char **argv)
         // TODO: power spectra output
         if (pkcount < sim.num_pk && 1. / a < sim.z_pk[pkcount] + 1.)
         {
+            phase_timer timed (timers, phase::output);
             COUT << COLORTEXT_CYAN << " writing power spectra"
                  << COLORTEXT_RESET << " at z = " << ((1. / a) - 1.)
                  << " (cycle " << cycle << "), tau/boxsize = " << tau << endl;
@@ -535,6 +783,8 @@ int main (int argc, char **argv)
             pkcount++;
         }
 
+        // the last cycle still reports its diagnostics
+        bool complete = false;
         if (pkcount >= sim.num_pk && snapcount >= sim.num_snapshot)
         {
             int i;
@@ -543,12 +793,34 @@ int main (int argc, char **argv)
                 if (sim.lightcone[i].z + 1. < 1. / a)
                     i = sim.num_lightcone + 1;
             }
-            if (i == sim.num_lightcone)
-                break; // simulation complete
+            complete = (i == sim.num_lightcone);
         }
 
-        if (cycle % CYCLE_INFO_INTERVAL == 0)
+        // cdm and baryon particle update, the forces of the particles kicked
+        // in this cycle only
+        PM->max_active_bin = bins.count () > 1 ? bins.active (cycle) : -1;
         {
+            phase_timer timed (timers, phase::forces);
+            particle_load::scope loaded (load);
+            PM->compute_forces(pcls_pm,1.0,a);
+        }
+        
+        if (diagnose)
+        {
+            PM->diagnose_particles (diag, pcls_pm);
+            if (bins.count () > 1)
+                bins.diagnose (diag, pcls_pm);
+            load.diagnose (diag, pcls_pm);
+            for (int i = 0; i < numspecies; i++)
+                diag.max ("max|v| " + std::to_string (i), maxvel[i]);
+            diag.reduce (com_world);
+            for (int i = 0; i < numspecies; i++)
+                maxvel[i] = diag["max|v| " + std::to_string (i)];
+            const double T00hom = diag["T00hom"];
+            const double Phihom = diag["Phihom"];
+            
+            COUT << PM->report (diag) << "\n";
+            
             COUT << " cycle " << cycle
                  << ", time integration information: max |v| = " << maxvel[0]
                  << " (cdm Courant factor = " << maxvel[0] * dtau / dx;
@@ -557,68 +829,212 @@ int main (int argc, char **argv)
                  << Hconf (a, cosmo) * dtau;
 
             COUT << endl;
-        }
-
-        // cdm and baryon particle update
-        PM->compute_forces(pcls_cdm,1.0,a);
-        if (cycle % CYCLE_INFO_INTERVAL == 0)
-        {
+            
             COUT << " cycle " << cycle
                  << ", background information: z = " << (1. / a) - 1.
                  << ", average T00 = " << T00hom << ", background model = "
                  << cosmo.Omega_cdm + cosmo.Omega_b + bg_ncdm (a, cosmo)
                  << endl;
             
-            auto [mass,pos,mom,acc]  = PM->test_velocities(pcls_cdm);
+            auto [mass,pos,mom,acc] = PM->particle_moments(diag);
             
+            COUT << " max |position| = " << diag["max|position|"] << "\n";
+            COUT << " max |momentum| = " << diag["max|momentum|"] << "\n";
             COUT << " mean     mass: " << mass << "\n";
             COUT << " mean sqr(pos): " << pos << "\n";
             COUT << " mean sqr(mom): " << mom << "\n";
             COUT << " mean sqr(acc): " << acc << "\n";
+            if (bins.count () > 1)
+            {
+                COUT << " particles per time bin:";
+                for (int b = 0; b < bins.count (); b++)
+                    COUT << " " << diag["time bin " + std::to_string (b)];
+                COUT << "\n";
+            }
+            COUT << particle_load::report (diag, com_world.size ());
+            
+            // record some background data
+            if(com_world.rank()==0)
+            {
+                // select main process
+                std::ofstream f(BackgroundPath,std::ios_base::app);
+                if(!f)
+                {
+                    std::cerr << "Could not open the background file: " 
+                              << BackgroundPath << '\n';
+                }else
+                {
+                    f << std::setw(tabwidth) << cycle 
+                      << std::setw(tabwidth) << tau
+                      << std::setw(tabwidth) << a
+                      << std::setw(tabwidth) << Hconf(a,cosmo)/Hconf(1.0,cosmo)
+                      << std::setw(tabwidth) << Phihom 
+                      << std::setw(tabwidth) << T00hom << '\n';
+                }
+            }
         }
         
+        if (complete)
+            break; // simulation complete
+        
         // Kick
-        pcls_cdm.for_each(
-            [&]
-            (particle& part, const Site& /*xpart*/)
+        if (bins.count () > 1)
+        {
+            phase_timer timed (timers, phase::kick);
+            particle_load::scope loaded (load);
+            bins.advance ((dtau + dtau_old) * 0.5);
+            for_each_particle(pcls_pm,
+                [&] (auto& part, const Site& /*xpart*/)
+                {
+                    bins.kick (part, cycle, a, dx);
+                });
+            bins.kicked (cycle);
+        }
+        else
+#ifdef PARTICLES_SOA
+        {
+            phase_timer timed (timers, phase::kick);
+            particle_load::scope loaded (load);
+            const double dtau_eff = (dtau + dtau_old) * 0.5;
+#ifdef GPU_OFFLOAD
+            pcls_pm.kick(dtau_eff);
+#else
+            const long n = pcls_pm.size();
+            for(int i=0;i<3;++i)
             {
-               const double dtau_eff =  
-                               (dtau + dtau_old) * 0.5 ;
-               for(int i=0;i<3;++i)
-               {
-                   part.momentum[i] += dtau_eff * part.force[i];
-               }
+                particle_real* p = pcls_pm.momentum_data(i);
+                const particle_real* f = pcls_pm.force_data(i);
+#ifdef _OPENMP
+                #pragma omp parallel for simd
+#endif
+                for(long k=0;k<n;++k)
+                    p[k] += dtau_eff * f[k];
             }
-            );
+#endif
+        }
+#else
+        {
+            phase_timer timed (timers, phase::kick);
+            particle_load::scope loaded (load);
+            for_each_particle(pcls_pm,
+                [&]
+                (particle& part, const Site& /*xpart*/)
+                {
+                   const double dtau_eff =  
+                                   (dtau + dtau_old) * 0.5 ;
+                   for(int i=0;i<3;++i)
+                   {
+                       part.momentum[i] += dtau_eff * part.force[i];
+                   }
+                }
+                );
+        }
+#endif
         
         Debugger_ptr -> flush();
 
         rungekutta4bg (a, cosmo,
                        0.5 * dtau); // evolve background by half a time step
         
-        maxvel[0]=0;
-        PM->compute_velocities(pcls_cdm,a);
         // Drift
-        pcls_cdm.for_each(
-            [&](particle& part, const Site& /* xpart */)
+#ifdef PARTICLES_SOA
+        {
+            phase_timer timed (timers, phase::drift);
+            particle_load::scope loaded (load);
+#ifdef GPU_OFFLOAD
+            // on the device, with the velocity p/a of the Newtonian engine
+            if (sim.gr_flag == gravity_theory::Newtonian)
+                maxvel[0] = pcls_pm.drift(dtau, 1. / a);
+            else
+#endif
             {
-                double v2 = 0;
+                if (pcls_pm.balanced ())
+                {
+                    // the velocity p/a of the Newtonian engine, the sites of
+                    // the particles being those of their domain
+                    PM->complete_halos ();
+                    const double inv_a = 1. / a;
+                    const long n = pcls_pm.size();
+                    for(int i=0;i<3;++i)
+                    {
+                        const particle_real* p = pcls_pm.momentum_data(i);
+                        auto* v = pcls_pm.vel_data(i);
+#ifdef _OPENMP
+                        #pragma omp parallel for simd
+#endif
+                        for(long k=0;k<n;++k)
+                            v[k] = p[k] * inv_a;
+                    }
+                }
+                else
+                    PM->compute_velocities(pcls_pm,a);
+                const long n = pcls_pm.size();
                 for(int i=0;i<3;++i)
                 {
-                    part.pos[i] += dtau * part.vel[i];
-                    v2 += part.momentum[i]*part.momentum[i];
+                    auto* x = pcls_pm.pos_data(i);
+                    const auto* v = pcls_pm.vel_data(i);
+#ifdef _OPENMP
+                    #pragma omp parallel for simd
+#endif
+                    for(long k=0;k<n;++k)
+                        x[k] += dtau * v[k];
                 }
-               maxvel[0]=std::max(maxvel[0],v2);
+                const particle_real *p0 = pcls_pm.momentum_data(0),
+                                    *p1 = pcls_pm.momentum_data(1),
+                                    *p2 = pcls_pm.momentum_data(2);
+                double v2max = 0;
+#ifdef _OPENMP
+                #pragma omp parallel for simd reduction(max:v2max)
+#endif
+                for(long k=0;k<n;++k)
+                    v2max = std::max(v2max,
+                        (double)(p0[k]*p0[k] + p1[k]*p1[k] + p2[k]*p2[k]));
+                maxvel[0] = v2max;
             }
-        );
-        pcls_cdm.moveParticles();
+        }
+#else
+        {
+            phase_timer timed (timers, phase::drift);
+            particle_load::scope loaded (load);
+            PM->compute_velocities(pcls_pm,a);
+            maxvel[0] = transform_reduce_particles(pcls_pm, 0.0,
+                [](double u, double v){ return std::max(u,v); },
+                [&](particle& part, const Site& /* xpart */)
+                {
+                    double v2 = 0;
+                    for(int i=0;i<3;++i)
+                    {
+                        part.pos[i] += dtau * part.vel[i];
+                        v2 += part.momentum[i]*part.momentum[i];
+                    }
+                    return v2;
+                }
+            );
+        }
+#endif
+        {
+            phase_timer timed (timers, phase::move);
+            particle_load::scope loaded (load);
+            pcls_pm.moveParticles();
+#ifndef PARTICLES_SOA
+            // particles_soa is sorted by cell in every moveParticles
+            if (sim.reorder_interval > 0
+                && (cycle + 1) % sim.reorder_interval == 0)
+                pcls_pm.reorder();
+#else
+            // in the balanced layout from the first one on
+            if (balance_interval > 0
+                && (cycle + 1) % balance_interval == 0)
+                pcls_pm.rebalance();
+#endif
+        }
         
         maxvel[0] = std::sqrt(maxvel[0]);              
             
         rungekutta4bg (a, cosmo,
                        0.5 * dtau); // evolve background by half a time step
 
-        parallel.max<double> (maxvel, numspecies);
+        // maxvel is local to the process until the next diagnostics
 
         if (sim.gr_flag == gravity_theory::GR)
         {
@@ -643,13 +1059,7 @@ int main (int argc, char **argv)
                      << COLORTEXT_RESET << " at z = " << ((1. / a) - 1.)
                      << " (cycle " << cycle << "), tau/boxsize = " << tau
                      << endl;
-                if (sim.vector_flag == VECTOR_PARABOLIC 
-                    && sim.gr_flag == gravity_theory::Newtonian)
-                {
-                    // PM->plan_Bi.execute (FFT_BACKWARD);
-                }
-                // hibernate (sim, ic, cosmo, &pcls_cdm, &pcls_b, pcls_ncdm,
-                //            PM->phi, PM->chi, PM->Bi, a, tau, dtau, cycle);
+                write_hibernation (-1);
                 break;
             }
         }
@@ -660,21 +1070,46 @@ int main (int argc, char **argv)
             COUT << COLORTEXT_CYAN << " writing hibernation point"
                  << COLORTEXT_RESET << " at z = " << ((1. / a) - 1.)
                  << " (cycle " << cycle << "), tau/boxsize = " << tau << endl;
-            if (sim.vector_flag == VECTOR_PARABOLIC 
-                && sim.gr_flag ==gravity_theory::Newtonian)
-            {
-                // PM->plan_Bi.execute (FFT_BACKWARD);
-            }
-            // hibernate (sim, ic, cosmo, &pcls_cdm, &pcls_b, pcls_ncdm, PM->phi,
-            //               PM->chi, PM->Bi, a, tau, dtau, cycle, restartcount);
+            write_hibernation (restartcount);
             restartcount++;
         }
 
         dtau_old = dtau;
         dtau = std::min(sim.Cf,sim.steplimit/Hconf(a,cosmo));
         cycle++;
+        load.end_cycle ();
+        
+        if (sim.checkpoint_interval > 0.)
+        {
+            tmp = MPI_Wtime () - checkpoint_time;
+            parallel.max (tmp);
+            if (tmp > sim.checkpoint_interval * 3600.)
+            {
+                phase_timer timed (timers, phase::output);
+                COUT << COLORTEXT_CYAN << " writing checkpoint"
+                     << COLORTEXT_RESET << " before cycle " << cycle << endl;
+#ifdef PARTICLES_SOA
+                pcls_pm.copy_to (pcls_cdm);
+#endif
+                checkpoint.write ({a, tau, dtau, dtau_old, cycle, snapcount,
+                                   pkcount, restartcount},
+                                  pcls_cdm, PM->restart_fields ());
+                checkpoint_time = MPI_Wtime ();
+            }
+        }
+        
+        if (sim.timer_interval > 0 && cycle % sim.timer_interval == 0)
+            timers.report (com_world, cycle);
     }while( not stop(com_world) );
 
+    output.flush();
+
+    {
+        // collective, while COUT writes on the root only
+        const auto report = PM->scratch.report();
+        COUT << " " << report << "\n";
+    }
+
     COUT << COLORTEXT_GREEN << " simulation complete." << COLORTEXT_RESET
          << endl;
     return 0;
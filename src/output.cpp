@@ -13,8 +13,8 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <set>
 #include <string>
+#include <vector>
 
 namespace gevolution
 {
@@ -359,13 +359,73 @@ void write_snapshot (
         }
     }
 
-    // saveHDF5 is not const
-    // if (sim.out_snapshot & MASK_PCLS)
-    // {
-    //     pcls.saveHDF5 (filename, 1);
-    // }
+    // HDF5 particles are written with the fields in one file, see
+    // h5_snapshot
 }
 
+#ifdef HAVE_HEALPIX
+//////////////////////////
+// healpixShellMap
+//////////////////////////
+// Description:
+//   resolution of the HEALPix map of a lightcone shell
+//
+// Arguments:
+//   sim            simulation metadata structure
+//   i              index of the lightcone
+//   maphdr         map header, with the distance of the shell; Nside and
+//                  Npix are set
+//
+// Returns: index of the outermost ring of the map
+//
+//////////////////////////
+
+static int healpixShellMap (metadata &sim, const int i,
+                            healpix_header &maphdr)
+{
+    int p;
+
+    for (maphdr.Nside = sim.Nside[i][0]; maphdr.Nside < sim.Nside[i][1];
+         maphdr.Nside *= 2)
+    {
+        if (12. * maphdr.Nside * maphdr.Nside
+            > sim.pixelfactor[i] * 4. * M_PI * maphdr.distance
+                  * maphdr.distance * sim.numpts * sim.numpts)
+            break;
+    }
+
+    if (sim.lightcone[i].opening > 2. / 3.)
+    {
+        p = 1
+            + (int)floor (maphdr.Nside
+                          * sqrt (3. - 3. * sim.lightcone[i].opening));
+        maphdr.Npix = 2 * p * (p + 1);
+    }
+    else if (sim.lightcone[i].opening > -2. / 3.)
+    {
+        p = 1
+            + (int)floor (maphdr.Nside
+                          * (2. - 1.5 * sim.lightcone[i].opening));
+        maphdr.Npix = 2 * maphdr.Nside * (maphdr.Nside + 1)
+                      + (p - maphdr.Nside) * 4 * maphdr.Nside;
+    }
+    else if (sim.lightcone[i].opening > -1.)
+    {
+        p = (int)floor (maphdr.Nside
+                        * sqrt (3. + 3. * sim.lightcone[i].opening));
+        maphdr.Npix = 12 * maphdr.Nside * maphdr.Nside - 2 * p * (p + 1);
+        p = 4 * maphdr.Nside - 1 - p;
+    }
+    else
+    {
+        maphdr.Npix = 12 * maphdr.Nside * maphdr.Nside;
+        p = 4 * maphdr.Nside - 1;
+    }
+
+    return p;
+}
+#endif
+
 //////////////////////////
 // writeLightcones
 //////////////////////////
@@ -379,23 +439,23 @@ void write_snapshot (
 //   tau            conformal time
 //   dtau           conformal time step
 //   dtau_old       conformal time step of previous cycle
-//   maxvel         maximum cdm velocity
 //   cycle          current simulation cycle
 //   h5filename     base name for HDF5 output file
 //   pcls_cdm       pointer to particle handler for CDM
 //   pcls_b         pointer to particle handler for baryons
 //   pcls_ncdm      array of particle handlers for
 //                  non-cold DM (may be set to NULL)
-//   phi            pointer to allocated field
-//   chi            pointer to allocated field
-//   Bi             pointer to allocated field
-//   Sij            pointer to allocated field
-//   BiFT           pointer to allocated field
-//   SijFT          pointer to allocated field
-//   plan_Bi        pointer to FFT planner
-//   plan_Sij       pointer to FFT planner
-//   done_hij       reference to tensor projection flag
-//   IDbacklog      IDs of particles written in previous cycle
+//   phi            pointer to the Newtonian potential in real space
+//   chi            pointer to chi in real space (may be NULL)
+//   Bi             pointer to the vector perturbation in real space (may
+//                  be NULL)
+//   Sij            pointer to the tensor perturbation in real space (may
+//                  be NULL)
+//   IDbacklog      IDs of particles written in previous cycle, updated
+//
+// The ghost cells of the fields must be up to date. The maps of the fields
+// that are NULL are not written. Each HEALPix shell is written as soon as
+// it is complete, so the map buffers hold one shell at a time.
 //
 // Returns:
 //
@@ -404,39 +464,29 @@ void write_snapshot (
 void writeLightcones (
     metadata &sim, const cosmology cosmo, const double a,
     const double tau, const double dtau, const double dtau_old,
-    const double /* maxvel */, 
-    const int cycle, 
-    std::string h5filename,
+    const int cycle, std::string h5filename,
     Particles_gevolution *pcls_cdm,
     Particles_gevolution *pcls_b,
     Particles_gevolution *pcls_ncdm,
-    Field<Real> *phi, 
-    Field<Real> * /* chi */, 
-    Field<Real> * /* Bi */, 
-    Field<Real> * /* Sij */,
-    Field<Cplx> * /* BiFT */, 
-    Field<Cplx> * /* SijFT */, 
-    PlanFFT<Cplx> * /* plan_Bi */,
-    PlanFFT<Cplx> * /* plan_Sij */, 
-    int &done_hij, 
-    std::set<long> *IDbacklog)
+    Field<Real> *phi, Field<Real> *chi, Field<Real> *Bi, Field<Real> *Sij,
+    id_backlog *IDbacklog)
 {
     int i, j, n, p;
     double d;
     double vertex[MAX_INTERSECTS][3];
     double domain[6];
-    // double pos[3];
     double s[2];
     char filename[2 * PARAM_MAX_LENGTH + 24];
     char buffer[268];
     FILE *outfile = nullptr;
     gadget2_header hdr;
-    std::set<long> IDprelog[MAX_PCL_SPECIES];
-    long *IDcombuf;
-    long *IDcombuf2;
+    id_backlog IDprelog[MAX_PCL_SPECIES];
+    std::vector<long> IDcombuf;
+    std::vector<long> IDcombuf2;
     Site xsim;
-    // int done_B = 0;
 #ifdef HAVE_HEALPIX
+    double pos[3];
+    int out;
     int64_t pix, pix2, q;
     vector<int> pixbatch_id;
     vector<int> sender_proc;
@@ -449,7 +499,6 @@ void writeLightcones (
     int pixbuf_size[9];
     int pixbuf_reserve[9];
     int64_t bytes, bytes2, offset2;
-    vector<MPI_Offset> offset;
     char **outbuf = new char *[LIGHTCONE_MAX_FIELDS];
     healpix_header maphdr;
     double R[3][3];
@@ -458,7 +507,7 @@ void writeLightcones (
     int base_pos[3];
     int shell, shell_inner, shell_outer, shell_write;
     uint32_t blocksize;
-    MPI_File mapfile;
+    MPI_File mapfile[LIGHTCONE_MAX_FIELDS];
     MPI_Status status;
     MPI_Datatype patch;
     int io_group_size;
@@ -471,8 +520,6 @@ void writeLightcones (
         outbuf[j] = NULL;
 #endif
 
-    done_hij = 0;
-
     domain[0] = -0.5;
     domain[1] = phi->lattice ().coordSkip ()[1] - 0.5;
     domain[2] = phi->lattice ().coordSkip ()[0] - 0.5;
@@ -578,6 +625,14 @@ void writeLightcones (
         if (shell_outer < shell_inner && s[1] > 0)
             shell_outer = shell_inner;
 
+        out = sim.out_lightcone[i];
+        if (chi == NULL)
+            out &= ~MASK_CHI;
+        if (Bi == NULL)
+            out &= ~MASK_B;
+        if (Sij == NULL)
+            out &= ~MASK_HIJ;
+
         maphdr.precision = sizeof (Real);
         maphdr.Ngrid = sim.numpts;
         maphdr.direction[0] = sim.lightcone[i].direction[0];
@@ -667,21 +722,21 @@ void writeLightcones (
             for (j = 0; j < 9; j++)
                 pixbuf_reserve[j] = PIXBUFFER;
 
-            if (sim.out_lightcone[i] & MASK_PHI)
+            if (out & MASK_PHI)
             {
                 for (j = 0; j < 9; j++)
                     pixbuf[LIGHTCONE_PHI_OFFSET][j]
                         = (Real *)malloc (sizeof (Real) * PIXBUFFER);
             }
 
-            if (sim.out_lightcone[i] & MASK_CHI)
+            if (out & MASK_CHI)
             {
                 for (j = 0; j < 9; j++)
                     pixbuf[LIGHTCONE_CHI_OFFSET][j]
                         = (Real *)malloc (sizeof (Real) * PIXBUFFER);
             }
 
-            if (sim.out_lightcone[i] & MASK_B)
+            if (out & MASK_B)
             {
                 for (j = 0; j < 9; j++)
                 {
@@ -694,7 +749,7 @@ void writeLightcones (
                 }
             }
 
-            if (sim.out_lightcone[i] & MASK_HIJ)
+            if (out & MASK_HIJ)
             {
                 for (j = 0; j < 9; j++)
                 {
@@ -711,22 +766,6 @@ void writeLightcones (
                 }
             }
 
-            if (sim.gr_flag == gravity_theory::Newtonian && sim.out_lightcone[i] & MASK_B
-                && done_B == 0)
-            {
-                plan_Bi->execute (FFT_BACKWARD);
-                Bi->updateHalo ();
-                done_B = 1;
-            }
-
-            if (sim.out_lightcone[i] & MASK_HIJ && done_hij == 0)
-            {
-                projectFTtensor (*SijFT, *SijFT);
-                plan_Sij->execute (FFT_BACKWARD);
-                Sij->updateHalo ();
-                done_hij = 1;
-            }
-
             if ((shell_outer + 1 - shell_inner) > parallel.size ())
             {
                 shell_write
@@ -748,20 +787,81 @@ void writeLightcones (
                                    / (shell_outer + 1 - shell_inner));
             }
 
+            // the maps are written shell by shell as they are completed,
+            // into files of the size of all the shells
             for (shell = shell_inner; shell <= shell_outer; shell++)
             {
                 maphdr.distance
                     = (double)shell / (double)sim.numpts / sim.shellfactor[i];
+                healpixShellMap (sim, i, maphdr);
+                bytes += maphdr.Npix * maphdr.precision + 272;
+            }
 
-                for (maphdr.Nside = sim.Nside[i][0];
-                     maphdr.Nside < sim.Nside[i][1]; maphdr.Nside *= 2)
+            for (j = 0; j < LIGHTCONE_MAX_FIELDS; j++)
+            {
+                if (pixbuf[j][0] == NULL || shell_outer < shell_inner)
+                    continue;
+
+                if (sim.num_lightcone > 1)
                 {
-                    if (12. * maphdr.Nside * maphdr.Nside
-                        > sim.pixelfactor[i] * 4. * M_PI * maphdr.distance
-                              * maphdr.distance * sim.numpts * sim.numpts)
-                        break;
+                    if (j == LIGHTCONE_PHI_OFFSET)
+                        sprintf (filename, "%s%s%d_%04d_phi.map",
+                                 sim.output_path, sim.basename_lightcone, i,
+                                 cycle);
+                    else if (j == LIGHTCONE_CHI_OFFSET)
+                        sprintf (filename, "%s%s%d_%04d_chi.map",
+                                 sim.output_path, sim.basename_lightcone, i,
+                                 cycle);
+                    else if (j >= LIGHTCONE_B_OFFSET
+                             && j < LIGHTCONE_B_OFFSET + 3)
+                        sprintf (filename, "%s%s%d_%04d_B%d.map",
+                                 sim.output_path, sim.basename_lightcone, i,
+                                 cycle, j + 1 - LIGHTCONE_B_OFFSET);
+                    else if (j >= LIGHTCONE_HIJ_OFFSET
+                             && j < LIGHTCONE_HIJ_OFFSET + 5)
+                        sprintf (filename, "%s%s%d_%04d_h%d%d.map",
+                                 sim.output_path, sim.basename_lightcone, i,
+                                 cycle, (j - LIGHTCONE_HIJ_OFFSET < 3 ? 1 : 2),
+                                 j - LIGHTCONE_HIJ_OFFSET
+                                     + (j - LIGHTCONE_HIJ_OFFSET < 3 ? 1 : -1));
+                }
+                else
+                {
+                    if (j == LIGHTCONE_PHI_OFFSET)
+                        sprintf (filename, "%s%s_%04d_phi.map", sim.output_path,
+                                 sim.basename_lightcone, cycle);
+                    else if (j == LIGHTCONE_CHI_OFFSET)
+                        sprintf (filename, "%s%s_%04d_chi.map", sim.output_path,
+                                 sim.basename_lightcone, cycle);
+                    else if (j >= LIGHTCONE_B_OFFSET
+                             && j < LIGHTCONE_B_OFFSET + 3)
+                        sprintf (filename, "%s%s_%04d_B%d.map", sim.output_path,
+                                 sim.basename_lightcone, cycle,
+                                 j + 1 - LIGHTCONE_B_OFFSET);
+                    else if (j >= LIGHTCONE_HIJ_OFFSET
+                             && j < LIGHTCONE_HIJ_OFFSET + 5)
+                        sprintf (filename, "%s%s_%04d_h%d%d.map",
+                                 sim.output_path, sim.basename_lightcone, cycle,
+                                 (j - LIGHTCONE_HIJ_OFFSET < 3 ? 1 : 2),
+                                 j - LIGHTCONE_HIJ_OFFSET
+                                     + (j - LIGHTCONE_HIJ_OFFSET < 3 ? 1 : -1));
                 }
 
+                MPI_File_open (parallel.lat_world_comm (), filename,
+                               MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL,
+                               &mapfile[j]);
+                MPI_File_set_size (mapfile[j], (MPI_Offset)bytes);
+            }
+
+            bytes = 0;
+
+            for (shell = shell_inner; shell <= shell_outer; shell++)
+            {
+                maphdr.distance
+                    = (double)shell / (double)sim.numpts / sim.shellfactor[i];
+
+                p = healpixShellMap (sim, i, maphdr);
+
                 for (maphdr.Nside_ring = 2;
                      2.137937882409166 * sim.numpts * maphdr.distance
                              / maphdr.Nside_ring
@@ -773,37 +873,6 @@ void writeLightcones (
                      maphdr.Nside_ring *= 2)
                     ;
 
-                if (sim.lightcone[i].opening > 2. / 3.)
-                {
-                    p = 1
-                        + (int)floor (
-                              maphdr.Nside
-                              * sqrt (3. - 3. * sim.lightcone[i].opening));
-                    maphdr.Npix = 2 * p * (p + 1);
-                }
-                else if (sim.lightcone[i].opening > -2. / 3.)
-                {
-                    p = 1
-                        + (int)floor (maphdr.Nside
-                                      * (2. - 1.5 * sim.lightcone[i].opening));
-                    maphdr.Npix = 2 * maphdr.Nside * (maphdr.Nside + 1)
-                                  + (p - maphdr.Nside) * 4 * maphdr.Nside;
-                }
-                else if (sim.lightcone[i].opening > -1.)
-                {
-                    p = (int)floor (
-                        maphdr.Nside
-                        * sqrt (3. + 3. * sim.lightcone[i].opening));
-                    maphdr.Npix
-                        = 12 * maphdr.Nside * maphdr.Nside - 2 * p * (p + 1);
-                    p = 4 * maphdr.Nside - 1 - p;
-                }
-                else
-                {
-                    maphdr.Npix = 12 * maphdr.Nside * maphdr.Nside;
-                    p = 4 * maphdr.Nside - 1;
-                }
-
                 pixbatch_size[0].push_back (maphdr.Nside / maphdr.Nside_ring);
 
                 pixbatch_delim[1].push_back (p / pixbatch_size[0].back ());
@@ -1059,7 +1128,7 @@ void writeLightcones (
 
                         if (xsim.setCoord (base_pos))
                         {
-                            if (sim.out_lightcone[i] & MASK_PHI)
+                            if (out & MASK_PHI)
                             {
                                 *(pixbuf[LIGHTCONE_PHI_OFFSET][j]
                                   + pixbuf_size[j] + q)
@@ -1082,7 +1151,7 @@ void writeLightcones (
                                        * ((1. - w[2]) * (*phi) (xsim + 1)
                                           + w[2] * (*phi) (xsim + 1 + 2));
                             }
-                            if (sim.out_lightcone[i] & MASK_CHI)
+                            if (out & MASK_CHI)
                             {
                                 *(pixbuf[LIGHTCONE_CHI_OFFSET][j]
                                   + pixbuf_size[j] + q)
@@ -1105,7 +1174,7 @@ void writeLightcones (
                                        * ((1. - w[2]) * (*chi) (xsim + 1)
                                           + w[2] * (*chi) (xsim + 1 + 2));
                             }
-                            if (sim.out_lightcone[i] & MASK_B)
+                            if (out & MASK_B)
                             {
 #ifdef LIGHTCONE_INTERPOLATE
                                 *(pixbuf[LIGHTCONE_B_OFFSET][j] + pixbuf_size[j]
@@ -1369,7 +1438,7 @@ void writeLightcones (
                                     /= a * a * sim.numpts;
 #endif
                             }
-                            if (sim.out_lightcone[i] & MASK_HIJ)
+                            if (out & MASK_HIJ)
                             {
                                 *(pixbuf[LIGHTCONE_HIJ_OFFSET][j]
                                   + pixbuf_size[j] + q)
@@ -1572,15 +1641,15 @@ void writeLightcones (
                         }
                         else
                         {
-                            if (sim.out_lightcone[i] & MASK_PHI)
+                            if (out & MASK_PHI)
                                 *(pixbuf[LIGHTCONE_PHI_OFFSET][j]
                                   + pixbuf_size[j] + q)
                                     = 0;
-                            if (sim.out_lightcone[i] & MASK_CHI)
+                            if (out & MASK_CHI)
                                 *(pixbuf[LIGHTCONE_CHI_OFFSET][j]
                                   + pixbuf_size[j] + q)
                                     = 0;
-                            if (sim.out_lightcone[i] & MASK_B)
+                            if (out & MASK_B)
                             {
                                 *(pixbuf[LIGHTCONE_B_OFFSET][j] + pixbuf_size[j]
                                   + q)
@@ -1592,7 +1661,7 @@ void writeLightcones (
                                   + pixbuf_size[j] + q)
                                     = 0;
                             }
-                            if (sim.out_lightcone[i] & MASK_HIJ)
+                            if (out & MASK_HIJ)
                             {
                                 *(pixbuf[LIGHTCONE_HIJ_OFFSET][j]
                                   + pixbuf_size[j] + q)
@@ -1935,117 +2004,59 @@ void writeLightcones (
                     {
                         if (pixbuf[j][0] != NULL)
                         {
-                            if (bytes2 == 0)
-                            {
-                                outbuf[j] = (char *)malloc (
-                                    maphdr.Npix * maphdr.precision + 272);
+                            outbuf[j] = (char *)malloc (
+                                maphdr.Npix * maphdr.precision + 272);
 
-                                if (outbuf[j] == NULL)
-                                {
-                                    std::cout
-                                        << COLORTEXT_RED
-                                        << " er"
-                                           "ror"
-                                        << COLORTEXT_RESET
-                                        << ": "
-                                           "pro"
-                                           "c#"
-                                        << parallel.rank ()
-                                        << " un"
-                                           "abl"
-                                           "e "
-                                           "to "
-                                           "all"
-                                           "oca"
-                                           "te "
-                                        << maphdr.Npix * maphdr.precision + 272
-                                        << " by"
-                                           "tes"
-                                           " of"
-                                           " me"
-                                           "mor"
-                                           "y "
-                                           "for"
-                                           " pi"
-                                           "xel"
-                                           "isa"
-                                           "tio"
-                                           "n!"
-                                        << std::endl;
-                                    parallel.abortForce ();
-                                }
-                            }
-                            else
+                            if (outbuf[j] == NULL)
                             {
-                                outbuf[j] = (char *)realloc (
-                                    (void *)outbuf[j],
-                                    bytes2 + maphdr.Npix * maphdr.precision
-                                        + 272);
-
-                                if (outbuf[j] == NULL)
-                                {
-                                    std::cout
-                                        << COLORTEXT_RED
-                                        << " er"
-                                           "ror"
-                                        << COLORTEXT_RESET
-                                        << ": "
-                                           "pro"
-                                           "c#"
-                                        << parallel.rank ()
-                                        << " un"
-                                           "abl"
-                                           "e "
-                                           "to "
-                                           "rea"
-                                           "llo"
-                                           "cat"
-                                           "e "
-                                        << bytes2
-                                               + maphdr.Npix * maphdr.precision
-                                               + 272
-                                        << " by"
-                                           "tes"
-                                           " of"
-                                           " me"
-                                           "mor"
-                                           "y ("
-                                        << maphdr.Npix * maphdr.precision + 272
-                                        << " ad"
-                                           "dit"
-                                           "ion"
-                                           "al "
-                                           "byt"
-                                           "es)"
-                                           " fo"
-                                           "r "
-                                           "pix"
-                                           "eli"
-                                           "sat"
-                                           "ion"
-                                           "!"
-                                        << std::endl;
-                                    parallel.abortForce ();
-                                }
+                                std::cout
+                                    << COLORTEXT_RED
+                                    << " er"
+                                       "ror"
+                                    << COLORTEXT_RESET
+                                    << ": "
+                                       "pro"
+                                       "c#"
+                                    << parallel.rank ()
+                                    << " un"
+                                       "abl"
+                                       "e "
+                                       "to "
+                                       "all"
+                                       "oca"
+                                       "te "
+                                    << maphdr.Npix * maphdr.precision + 272
+                                    << " by"
+                                       "tes"
+                                       " of"
+                                       " me"
+                                       "mor"
+                                       "y "
+                                       "for"
+                                       " pi"
+                                       "xel"
+                                       "isa"
+                                       "tio"
+                                       "n!"
+                                    << std::endl;
+                                parallel.abortForce ();
                             }
 
                             blocksize = 256;
-                            memcpy ((void *)(outbuf[j] + bytes2),
-                                    (void *)&blocksize, 4);
-                            memcpy ((void *)(outbuf[j] + bytes2 + 4),
-                                    (void *)&maphdr, 256);
-                            memcpy ((void *)(outbuf[j] + bytes2 + 260),
+                            memcpy ((void *)outbuf[j], (void *)&blocksize, 4);
+                            memcpy ((void *)(outbuf[j] + 4), (void *)&maphdr,
+                                    256);
+                            memcpy ((void *)(outbuf[j] + 260),
                                     (void *)&blocksize, 4);
                             blocksize = maphdr.precision * maphdr.Npix;
-                            memcpy ((void *)(outbuf[j] + bytes2 + 264),
+                            memcpy ((void *)(outbuf[j] + 264),
+                                    (void *)&blocksize, 4);
+                            memcpy ((void *)(outbuf[j] + 268 + blocksize),
                                     (void *)&blocksize, 4);
-                            memcpy (
-                                (void *)(outbuf[j] + bytes2 + 268 + blocksize),
-                                (void *)&blocksize, 4);
                         }
                     }
-                    offset2 = bytes2 + 268;
-                    bytes2 += maphdr.Npix * maphdr.precision + 272;
+                    offset2 = 268;
+                    bytes2 = maphdr.Npix * maphdr.precision + 272;
                     p = 0;
                     q = pixbatch_delim[2].back ();
                 }
@@ -2520,74 +2531,46 @@ void writeLightcones (
                     pix2 += n * pixbatch_size[pixbatch_type].back ();
                 }
 
-                offset.push_back (bytes);
+                if ((io_group_size == 0
+                     && parallel.rank ()
+                            == ((shell - shell_inner) * parallel.size ())
+                                   / (shell_outer + 1 - shell_inner))
+                    || (io_group_size > 0
+                        && shell - shell_inner == shell_write))
+                    offset2 = (io_group_size > 0) ? bytes + offset2 : bytes;
+                else
+                {
+                    offset2 = bytes;
+                    bytes2 = 0;
+                }
+
+                for (j = 0; j < LIGHTCONE_MAX_FIELDS; j++)
+                {
+                    if (pixbuf[j][0] == NULL)
+                        continue;
+
+                    MPI_File_write_at_all (mapfile[j], (MPI_Offset)offset2,
+                                           (void *)outbuf[j], bytes2, MPI_BYTE,
+                                           &status);
+
+                    if (outbuf[j] != NULL)
+                    {
+                        free (outbuf[j]);
+                        outbuf[j] = NULL;
+                    }
+                }
+
                 bytes += maphdr.Npix * maphdr.precision + 272;
+                bytes2 = 0;
 
                 pixbatch_id.clear ();
                 sender_proc.clear ();
             } // shell-loop
 
-            if (io_group_size == 0)
-                offset2 = 0;
-
             for (j = 0; j < LIGHTCONE_MAX_FIELDS; j++)
             {
-                if (pixbuf[j][0] == NULL || shell_outer < shell_inner)
-                    continue;
-
-                if (sim.num_lightcone > 1)
-                {
-                    if (j == LIGHTCONE_PHI_OFFSET)
-                        sprintf (filename, "%s%s%d_%04d_phi.map",
-                                 sim.output_path, sim.basename_lightcone, i,
-                                 cycle);
-                    else if (j == LIGHTCONE_CHI_OFFSET)
-                        sprintf (filename, "%s%s%d_%04d_chi.map",
-                                 sim.output_path, sim.basename_lightcone, i,
-                                 cycle);
-                    else if (j >= LIGHTCONE_B_OFFSET
-                             && j < LIGHTCONE_B_OFFSET + 3)
-                        sprintf (filename, "%s%s%d_%04d_B%d.map",
-                                 sim.output_path, sim.basename_lightcone, i,
-                                 cycle, j + 1 - LIGHTCONE_B_OFFSET);
-                    else if (j >= LIGHTCONE_HIJ_OFFSET
-                             && j < LIGHTCONE_HIJ_OFFSET + 5)
-                        sprintf (filename, "%s%s%d_%04d_h%d%d.map",
-                                 sim.output_path, sim.basename_lightcone, i,
-                                 cycle, (j - LIGHTCONE_HIJ_OFFSET < 3 ? 1 : 2),
-                                 j - LIGHTCONE_HIJ_OFFSET
-                                     + (j - LIGHTCONE_HIJ_OFFSET < 3 ? 1 : -1));
-                }
-                else
-                {
-                    if (j == LIGHTCONE_PHI_OFFSET)
-                        sprintf (filename, "%s%s_%04d_phi.map", sim.output_path,
-                                 sim.basename_lightcone, cycle);
-                    else if (j == LIGHTCONE_CHI_OFFSET)
-                        sprintf (filename, "%s%s_%04d_chi.map", sim.output_path,
-                                 sim.basename_lightcone, cycle);
-                    else if (j >= LIGHTCONE_B_OFFSET
-                             && j < LIGHTCONE_B_OFFSET + 3)
-                        sprintf (filename, "%s%s_%04d_B%d.map", sim.output_path,
-                                 sim.basename_lightcone, cycle,
-                                 j + 1 - LIGHTCONE_B_OFFSET);
-                    else if (j >= LIGHTCONE_HIJ_OFFSET
-                             && j < LIGHTCONE_HIJ_OFFSET + 5)
-                        sprintf (filename, "%s%s_%04d_h%d%d.map",
-                                 sim.output_path, sim.basename_lightcone, cycle,
-                                 (j - LIGHTCONE_HIJ_OFFSET < 3 ? 1 : 2),
-                                 j - LIGHTCONE_HIJ_OFFSET
-                                     + (j - LIGHTCONE_HIJ_OFFSET < 3 ? 1 : -1));
-                }
-
-                MPI_File_open (parallel.lat_world_comm (), filename,
-                               MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL,
-                               &mapfile);
-                MPI_File_set_size (mapfile, (MPI_Offset)bytes);
-                MPI_File_write_at_all (
-                    mapfile, (MPI_Offset)offset[shell_write] + offset2,
-                    (void *)outbuf[j], bytes2, MPI_BYTE, &status);
-                MPI_File_close (&mapfile);
+                if (pixbuf[j][0] != NULL && shell_outer >= shell_inner)
+                    MPI_File_close (&mapfile[j]);
             }
 
             for (j = 0; j < 3; j++)
@@ -2596,8 +2579,6 @@ void writeLightcones (
                 pixbatch_delim[j].clear ();
             }
 
-            offset.clear ();
-
             for (j = 0; j < 9 * LIGHTCONE_MAX_FIELDS; j++)
             {
                 if (pixbuf[j / 9][j % 9] != NULL)
@@ -2606,15 +2587,6 @@ void writeLightcones (
                     pixbuf[j / 9][j % 9] = NULL;
                 }
             }
-
-            for (j = 0; j < LIGHTCONE_MAX_FIELDS; j++)
-            {
-                if (outbuf[j] != NULL)
-                {
-                    free (outbuf[j]);
-                    outbuf[j] = NULL;
-                }
-            }
 #endif // HAVE_HEALPIX
         }
         else if (parallel.isRoot () && outfile != NULL)
@@ -2718,7 +2690,8 @@ void writeLightcones (
 
     for (p = 0; p <= cosmo.num_ncdm + sim.baryon_flag; p++)
     {
-        IDbacklog[p] = IDprelog[p];
+        IDprelog[p].commit ();
+        IDbacklog[p].swap (IDprelog[p]);
         IDprelog[p].clear ();
 
         n = IDbacklog[p].size ();
@@ -2752,33 +2725,29 @@ void writeLightcones (
 
         if (n + i + j > 0)
         {
-            IDcombuf = (long *)malloc ((n + i + j) * sizeof (long));
-
-            n = 0;
-            for (std::set<long>::iterator it = IDbacklog[p].begin ();
-                 it != IDbacklog[p].end (); it++)
-                IDcombuf[n++] = *it;
+            IDcombuf.assign (IDbacklog[p].data (), IDbacklog[p].data () + n);
+            IDcombuf.resize (n + i + j);
 
             if (parallel.grid_rank ()[0] % 2 == 0)
             {
                 if (n > 0)
-                    parallel.send_dim0<long> (IDcombuf, n,
+                    parallel.send_dim0<long> (IDcombuf.data (), n,
                                               (parallel.grid_size ()[0]
                                                + parallel.grid_rank ()[0] - 1)
                                                   % parallel.grid_size ()[0]);
                 if (i > 0)
                     parallel.receive_dim0<long> (
-                        IDcombuf + n, i,
+                        IDcombuf.data () + n, i,
                         (parallel.grid_size ()[0] + parallel.grid_rank ()[0]
                          - 1)
                             % parallel.grid_size ()[0]);
                 if (n > 0)
-                    parallel.send_dim0<long> (IDcombuf, n,
+                    parallel.send_dim0<long> (IDcombuf.data (), n,
                                               (parallel.grid_rank ()[0] + 1)
                                                   % parallel.grid_size ()[0]);
                 if (j > 0)
                     parallel.receive_dim0<long> (
-                        IDcombuf + n + i, j,
+                        IDcombuf.data () + n + i, j,
                         (parallel.grid_rank ()[0] + 1)
                             % parallel.grid_size ()[0]);
             }
@@ -2786,30 +2755,28 @@ void writeLightcones (
             {
                 if (i > 0)
                     parallel.receive_dim0<long> (
-                        IDcombuf + n, i,
+                        IDcombuf.data () + n, i,
                         (parallel.grid_rank ()[0] + 1)
                             % parallel.grid_size ()[0]);
                 if (n > 0)
-                    parallel.send_dim0<long> (IDcombuf, n,
+                    parallel.send_dim0<long> (IDcombuf.data (), n,
                                               (parallel.grid_rank ()[0] + 1)
                                                   % parallel.grid_size ()[0]);
                 if (j > 0)
                     parallel.receive_dim0<long> (
-                        IDcombuf + n + i, j,
+                        IDcombuf.data () + n + i, j,
                         (parallel.grid_size ()[0] + parallel.grid_rank ()[0]
                          - 1)
                             % parallel.grid_size ()[0]);
                 if (n > 0)
-                    parallel.send_dim0<long> (IDcombuf, n,
+                    parallel.send_dim0<long> (IDcombuf.data (), n,
                                               (parallel.grid_size ()[0]
                                                + parallel.grid_rank ()[0] - 1)
                                                   % parallel.grid_size ()[0]);
             }
 
+            IDbacklog[p].insert (IDcombuf.begin () + n, IDcombuf.end ());
             n += i + j;
-
-            for (i = IDbacklog[p].size (); i < n; i++)
-                IDbacklog[p].insert (IDcombuf[i]);
         }
 
         // dim 1 send/rec
@@ -2828,39 +2795,32 @@ void writeLightcones (
 
             if (n > 0)
                 parallel.send_dim1<long> (
-                    IDcombuf, n,
+                    IDcombuf.data (), n,
                     (parallel.grid_size ()[1] + parallel.grid_rank ()[1] - 1)
                         % parallel.grid_size ()[1]);
 
             if (i > 0)
             {
-                IDcombuf2 = (long *)malloc (i * sizeof (long));
+                IDcombuf2.resize (i);
                 parallel.receive_dim1<long> (
-                    IDcombuf2, i,
+                    IDcombuf2.data (), i,
                     (parallel.grid_size ()[1] + parallel.grid_rank ()[1] - 1)
                         % parallel.grid_size ()[1]);
-                while (i > 0)
-                    IDbacklog[p].insert (IDcombuf2[--i]);
-                free (IDcombuf2);
+                IDbacklog[p].insert (IDcombuf2.begin (), IDcombuf2.end ());
             }
 
             if (n > 0)
-            {
-                parallel.send_dim1<long> (IDcombuf, n,
+                parallel.send_dim1<long> (IDcombuf.data (), n,
                                           (parallel.grid_rank ()[1] + 1)
                                               % parallel.grid_size ()[1]);
-                free (IDcombuf);
-            }
 
             if (j > 0)
             {
-                IDcombuf2 = (long *)malloc (j * sizeof (long));
-                parallel.receive_dim1<long> (IDcombuf2, j,
+                IDcombuf2.resize (j);
+                parallel.receive_dim1<long> (IDcombuf2.data (), j,
                                              (parallel.grid_rank ()[1] + 1)
                                                  % parallel.grid_size ()[1]);
-                while (j > 0)
-                    IDbacklog[p].insert (IDcombuf2[--j]);
-                free (IDcombuf2);
+                IDbacklog[p].insert (IDcombuf2.begin (), IDcombuf2.end ());
             }
         }
         else
@@ -2878,41 +2838,36 @@ void writeLightcones (
 
             if (i > 0)
             {
-                IDcombuf2 = (long *)malloc (i * sizeof (long));
-                parallel.receive_dim1<long> (IDcombuf2, i,
+                IDcombuf2.resize (i);
+                parallel.receive_dim1<long> (IDcombuf2.data (), i,
                                              (parallel.grid_rank ()[1] + 1)
                                                  % parallel.grid_size ()[1]);
-                while (i > 0)
-                    IDbacklog[p].insert (IDcombuf2[--i]);
-                free (IDcombuf2);
+                IDbacklog[p].insert (IDcombuf2.begin (), IDcombuf2.end ());
             }
 
             if (n > 0)
-                parallel.send_dim1<long> (IDcombuf, n,
+                parallel.send_dim1<long> (IDcombuf.data (), n,
                                           (parallel.grid_rank ()[1] + 1)
                                               % parallel.grid_size ()[1]);
 
             if (j > 0)
             {
-                IDcombuf2 = (long *)malloc (j * sizeof (long));
+                IDcombuf2.resize (j);
                 parallel.receive_dim1<long> (
-                    IDcombuf2, j,
+                    IDcombuf2.data (), j,
                     (parallel.grid_size ()[1] + parallel.grid_rank ()[1] - 1)
                         % parallel.grid_size ()[1]);
-                while (j > 0)
-                    IDbacklog[p].insert (IDcombuf2[--j]);
-                free (IDcombuf2);
+                IDbacklog[p].insert (IDcombuf2.begin (), IDcombuf2.end ());
             }
 
             if (n > 0)
-            {
                 parallel.send_dim1<long> (
-                    IDcombuf, n,
+                    IDcombuf.data (), n,
                     (parallel.grid_size ()[1] + parallel.grid_rank ()[1] - 1)
                         % parallel.grid_size ()[1]);
-                free (IDcombuf);
-            }
         }
+
+        IDbacklog[p].commit ();
     }
 }
 
@@ -759,6 +759,12 @@ bool parseFieldSpecifiers (parameter *&params, const int numparam,
                 else if (strcmp (item, "v") == 0
                          || strcmp (item, "velocity") == 0)
                     pvalue |= MASK_VEL;
+                else if (strcmp (item, "halos") == 0 || strcmp (item, "FoF") == 0
+                         || strcmp (item, "fof") == 0)
+                    pvalue |= MASK_HALOS;
+                else if (strcmp (item, "halo members") == 0
+                         || strcmp (item, "members") == 0)
+                    pvalue |= MASK_HALOS | MASK_MEMBERS;
 
                 start = comma + 1;
                 while (*start == ' ' || *start == '\t')
@@ -816,6 +822,12 @@ bool parseFieldSpecifiers (parameter *&params, const int numparam,
             else if (strcmp (start, "v") == 0
                      || strcmp (start, "velocity") == 0)
                 pvalue |= MASK_VEL;
+            else if (strcmp (start, "halos") == 0 || strcmp (start, "FoF") == 0
+                     || strcmp (start, "fof") == 0)
+                pvalue |= MASK_HALOS;
+            else if (strcmp (start, "halo members") == 0
+                     || strcmp (start, "members") == 0)
+                pvalue |= MASK_HALOS | MASK_MEMBERS;
 
             params[i].used = true;
             return true;
@@ -864,6 +876,8 @@ int parseMetadata (parameter *&params, const int numparam, metadata &sim,
     ic.metricfile[0][0] = '\0';
     ic.metricfile[1][0] = '\0';
     ic.metricfile[2][0] = '\0';
+    ic.class_cache[0] = '\0';
+    ic.aggregators = 0;
     ic.seed = 0;
     ic.flags = 0;
     ic.z_ic = -2.;
@@ -926,6 +940,8 @@ int parseMetadata (parameter *&params, const int numparam, metadata &sim,
             parallel.abortForce ();
 #endif
         }
+        parseParameter (params, numparam, "particle file aggregators",
+                        ic.aggregators);
     }
     else if (!parseParameter (params, numparam, "template file", pptr, i))
     {
@@ -975,6 +991,8 @@ int parseMetadata (parameter *&params, const int numparam, metadata &sim,
 #endif
     }
 
+    parseParameter (params, numparam, "CLASS cache", ic.class_cache);
+
     if (parseParameter (params, numparam, "correct displacement", par_string))
     {
         if (par_string[0] == 'Y' || par_string[0] == 'y')
@@ -1346,11 +1364,34 @@ int parseMetadata (parameter *&params, const int numparam, metadata &sim,
     for (i = 0; i < MAX_PCL_SPECIES; i++)
         sim.numpcl[i] = 0;
     sim.vector_flag = VECTOR_PARABOLIC;
+    sim.interlacing_flag = 0;
+    sim.short_range_flag = 0;
+    sim.short_range_split = 1.25;
+    sim.short_range_cutoff = 4.5;
+    sim.short_range_softening = 0.05;
     sim.out_pk = 0;
     sim.out_snapshot = 0;
+    sim.snapshot_deflate = 0;
+    sim.snapshot_single = 0;
+    sim.snapshot_mantissa_bits = 0;
+    sim.halo_linking_length = 0.2;
+    sim.halo_min_particles = 20;
+    sim.output_buffer = 0;
+    sim.checkpoint_interval = 0;
+    sim.checkpoint_base_interval = 8;
+    sim.checkpoint_restart = 0;
+    sim.ic_hibernation = 0;
+    sim.timer_interval = 0;
+    sim.timer_counters = 0;
+    sim.diagnostics_interval = CYCLE_INFO_INTERVAL;
+    sim.time_bins = 1;
+    sim.time_bin_accuracy = 0.05;
+    sim.reorder_interval = 0;
+    sim.balance_interval = 0;
     sim.out_lightcone[0] = 0;
     sim.num_pk = MAX_OUTPUTS;
     sim.numbins = 0;
+    sim.pk_binning_flag = PK_BINNING_LOG;
     sim.num_snapshot = MAX_OUTPUTS;
     sim.num_lightcone = 0;
     sim.num_restart = MAX_OUTPUTS;
@@ -1386,6 +1427,73 @@ int parseMetadata (parameter *&params, const int numparam, metadata &sim,
         }
     }
 
+    if (parseParameter (params, numparam, "interlacing", par_string))
+    {
+        if (par_string[0] == 'y' || par_string[0] == 'Y')
+        {
+            COUT << " density sampled on two " << COLORTEXT_CYAN
+                 << "interlaced" << COLORTEXT_RESET << " grids" << std::endl;
+            sim.interlacing_flag = 1;
+        }
+        else if (par_string[0] != 'n' && par_string[0] != 'N')
+        {
+            COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": interlacing must be yes or no!" << std::endl;
+#ifdef LATFIELD2_HPP
+            parallel.abortForce ();
+#endif
+        }
+    }
+
+    if (parseParameter (params, numparam, "short-range forces", par_string))
+    {
+        if (par_string[0] == 'y' || par_string[0] == 'Y')
+        {
+            COUT << " forces of the close pairs of particles added to the "
+                 << COLORTEXT_CYAN << "long-range" << COLORTEXT_RESET
+                 << " mesh forces" << std::endl;
+            sim.short_range_flag = 1;
+        }
+        else if (par_string[0] != 'n' && par_string[0] != 'N')
+        {
+            COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": short-range forces must be yes or no!" << std::endl;
+#ifdef LATFIELD2_HPP
+            parallel.abortForce ();
+#endif
+        }
+    }
+    if (parseParameter (params, numparam, "short-range split",
+                        sim.short_range_split)
+        && sim.short_range_split <= 0.)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": short-range split must be positive!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+    if (parseParameter (params, numparam, "short-range cutoff",
+                        sim.short_range_cutoff)
+        && sim.short_range_cutoff <= 0.)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": short-range cutoff must be positive!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+    if (parseParameter (params, numparam, "short-range softening",
+                        sim.short_range_softening)
+        && sim.short_range_softening <= 0.)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": short-range softening must be positive!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+
     if (!parseParameter (params, numparam, "generic file base",
                          sim.basename_generic))
         sim.basename_generic[0] = '\0';
@@ -1461,6 +1569,22 @@ int parseMetadata (parameter *&params, const int numparam, metadata &sim,
         }
     }
 
+#ifdef LATFIELD2_HPP
+    // the pairs are only looked up in the neighbouring domains
+    if (sim.short_range_flag
+        && (sim.short_range_cutoff * sim.short_range_split
+                >= sim.numpts / parallel.grid_size ()[0]
+            || sim.short_range_cutoff * sim.short_range_split
+                   >= sim.numpts / parallel.grid_size ()[1]))
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": short-range cutoff times split must be smaller than the "
+                "local domain (Ngrid over the process grid) in y and z!"
+             << std::endl;
+        parallel.abortForce ();
+    }
+#endif
+
     parseParameter (params, numparam, "Courant factor", sim.Cf);
 
     if (ic.Cf < 0.)
@@ -1517,12 +1641,175 @@ int parseMetadata (parameter *&params, const int numparam, metadata &sim,
     parseParameter (params, numparam, "hibernation wallclock limit",
                     sim.wallclocklimit);
 
+    parseParameter (params, numparam, "timer interval", sim.timer_interval);
+    if (parseParameter (params, numparam, "diagnostics interval",
+                        sim.diagnostics_interval)
+        && sim.diagnostics_interval < 1)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": diagnostics interval must be at least 1!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+
+    if (parseParameter (params, numparam, "reorder interval",
+                        sim.reorder_interval)
+        && sim.reorder_interval < 0)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": reorder interval must not be negative!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+
+    if (parseParameter (params, numparam, "particle balance interval",
+                        sim.balance_interval)
+        && sim.balance_interval < 0)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": particle balance interval must not be negative!"
+             << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+
+    if (parseParameter (params, numparam, "time bins", sim.time_bins)
+        && (sim.time_bins < 1 || sim.time_bins > 16))
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": time bins must be between 1 and 16!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+    if (parseParameter (params, numparam, "time bin accuracy",
+                        sim.time_bin_accuracy)
+        && sim.time_bin_accuracy <= 0.)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": time bin accuracy must be positive!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+    if (parseParameter (params, numparam, "timer counters", par_string))
+    {
+        if (par_string[0] == 'y' || par_string[0] == 'Y')
+            sim.timer_counters = 1;
+        else if (par_string[0] != 'n' && par_string[0] != 'N')
+        {
+            COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": timer counters must be yes or no!" << std::endl;
+#ifdef LATFIELD2_HPP
+            parallel.abortForce ();
+#endif
+        }
+    }
+
+    parseParameter (params, numparam, "checkpoint interval",
+                    sim.checkpoint_interval);
+    if (parseParameter (params, numparam, "checkpoint base interval",
+                        sim.checkpoint_base_interval)
+        && sim.checkpoint_base_interval < 1)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": checkpoint base interval must be at least 1!"
+             << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+    if (parseParameter (params, numparam, "checkpoint restart", par_string))
+    {
+        if (par_string[0] == 'y' || par_string[0] == 'Y')
+            sim.checkpoint_restart = 1;
+        else if (par_string[0] != 'n' && par_string[0] != 'N')
+        {
+            COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": checkpoint restart must be yes or no!" << std::endl;
+#ifdef LATFIELD2_HPP
+            parallel.abortForce ();
+#endif
+        }
+    }
+    if (parseParameter (params, numparam, "IC hibernation", par_string))
+    {
+        if (par_string[0] == 'y' || par_string[0] == 'Y')
+            sim.ic_hibernation = 1;
+        else if (par_string[0] != 'n' && par_string[0] != 'N')
+        {
+            COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": IC hibernation must be yes or no!" << std::endl;
+#ifdef LATFIELD2_HPP
+            parallel.abortForce ();
+#endif
+        }
+    }
+
     parseFieldSpecifiers (params, numparam, "lightcone outputs",
                           sim.out_lightcone[0]);
     parseFieldSpecifiers (params, numparam, "snapshot outputs",
                           sim.out_snapshot);
+
+    if (parseParameter (params, numparam, "snapshot compression",
+                        sim.snapshot_deflate)
+        && (sim.snapshot_deflate < 0 || sim.snapshot_deflate > 9))
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": snapshot compression must be a deflate level between 0 "
+                "and 9!"
+             << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+    parseFieldSpecifiers (params, numparam, "snapshot single precision",
+                          sim.snapshot_single);
+    if (parseParameter (params, numparam, "snapshot mantissa bits",
+                        sim.snapshot_mantissa_bits)
+        && sim.snapshot_mantissa_bits < 0)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": snapshot mantissa bits cannot be negative!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+    if (parseParameter (params, numparam, "halo linking length",
+                        sim.halo_linking_length)
+        && sim.halo_linking_length <= 0.)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": halo linking length must be positive!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+    if (parseParameter (params, numparam, "halo min particles",
+                        sim.halo_min_particles)
+        && sim.halo_min_particles < 1)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": halo min particles must be at least 1!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
     parseFieldSpecifiers (params, numparam, "Pk outputs", sim.out_pk);
 
+    if (parseParameter (params, numparam, "output buffer", sim.output_buffer)
+        && sim.output_buffer < 0)
+    {
+        COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+             << ": output buffer cannot be negative!" << std::endl;
+#ifdef LATFIELD2_HPP
+        parallel.abortForce ();
+#endif
+    }
+
     if (!parseParameter (params, numparam, "lightcone pixel factor",
                          sim.pixelfactor[0]))
         sim.pixelfactor[0] = 0.5;
@@ -2046,6 +2333,22 @@ int parseMetadata (parameter *&params, const int numparam, metadata &sim,
         sim.numbins = 64;
     }
 
+    if (parseParameter (params, numparam, "Pk binning", par_string))
+    {
+        if (par_string[0] == 'l' && par_string[1] == 'o')
+            sim.pk_binning_flag = PK_BINNING_LOG;
+        else if (par_string[0] == 'l' && par_string[1] == 'i')
+            sim.pk_binning_flag = PK_BINNING_LINEAR;
+        else
+        {
+            COUT << COLORTEXT_RED << " error" << COLORTEXT_RESET
+                 << ": Pk binning must be log or linear!" << std::endl;
+#ifdef LATFIELD2_HPP
+            parallel.abortForce ();
+#endif
+        }
+    }
+
     if (parseParameter (params, numparam, "gravity theory", par_string))
     {
         if (par_string[0] == 'N' || par_string[0] == 'n')
@@ -10,6 +10,7 @@
 //////////////////////////
 
 #include "gevolution/tools.hpp"
+#include "gevolution/kspace_tables.hpp"
 #include <cmath>
 #include <iostream>
 #include <string>
@@ -57,59 +58,14 @@ void extractCrossSpectrum (Field<Cplx> &fld1FT, Field<Cplx> &fld2FT, Real *kbin,
 {
     int i, weight;
     const int linesize = fld1FT.lattice ().size (1);
-    Real *typek2;
-    Real *sinc;
+    const kspace_axes &axes = kspace_axes::of (linesize);
+    const Real *typek2
+        = (ktype == KTYPE_GRID ? axes.grid_k2 : axes.linear_k2).data ();
+    const Real *sinc = axes.sinc.data ();
     Real k2max, k2, s;
     rKSite k (fld1FT.lattice ());
     Cplx p;
 
-    typek2 = (Real *)malloc (linesize * sizeof (Real));
-    sinc = (Real *)malloc (linesize * sizeof (Real));
-
-    if (ktype == KTYPE_GRID)
-    {
-        for (i = 0; i < linesize; i++)
-        {
-            typek2[i]
-                = 2. * (Real)linesize * sin (M_PI * (Real)i / (Real)linesize);
-            typek2[i] *= typek2[i];
-        }
-    }
-    else
-    {
-        for (i = 0; i <= linesize / 2; i++)
-        {
-            typek2[i] = 2. * M_PI * (Real)i;
-            typek2[i] *= typek2[i];
-        }
-        for (; i < linesize; i++)
-        {
-            typek2[i] = 2. * M_PI * (Real) (linesize - i);
-            typek2[i] *= typek2[i];
-        }
-    }
-
-    sinc[0] = 1.;
-    if (deconvolve)
-    {
-        for (i = 1; i <= linesize / 2; i++)
-        {
-            sinc[i] = sin (M_PI * (float)i / (float)linesize) * (float)linesize
-                      / (M_PI * (float)i);
-        }
-    }
-    else
-    {
-        for (i = 1; i <= linesize / 2; i++)
-        {
-            sinc[i] = 1.;
-        }
-    }
-    for (; i < linesize; i++)
-    {
-        sinc[i] = sinc[linesize - i];
-    }
-
     k2max = 3. * typek2[linesize / 2];
 
     for (i = 0; i < numbins; i++)
@@ -133,8 +89,13 @@ void extractCrossSpectrum (Field<Cplx> &fld1FT, Field<Cplx> &fld2FT, Real *kbin,
             weight = 2;
 
         k2 = typek2[k.coord (0)] + typek2[k.coord (1)] + typek2[k.coord (2)];
-        s = sinc[k.coord (0)] * sinc[k.coord (1)] * sinc[k.coord (2)];
-        s *= s;
+        if (deconvolve)
+        {
+            s = sinc[k.coord (0)] * sinc[k.coord (1)] * sinc[k.coord (2)];
+            s *= s;
+        }
+        else
+            s = 1.;
 
         if (comp1 >= 0 && comp2 >= 0 && comp1 < fld1FT.components ()
             && comp2 < fld2FT.components ())
@@ -170,9 +131,6 @@ void extractCrossSpectrum (Field<Cplx> &fld1FT, Field<Cplx> &fld2FT, Real *kbin,
         }
     }
 
-    free (typek2);
-    free (sinc);
-
     if (parallel.isRoot ())
     {
 #ifdef SINGLE